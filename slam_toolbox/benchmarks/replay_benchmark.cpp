@@ -0,0 +1,318 @@
+/*
+ * Offline replay benchmark of the mapping pipeline
+ */
+
+/**
+ * Replays recorded scans through karto::Mapper::Process with the Ceres solver
+ * plugin, without a ROS master, and reports the wall time of every pipeline
+ * stage, the scan rate and the peak resident memory. The optimized trajectory
+ * is written in the TUM format (time x y z qx qy qz qw) for trajectory error
+ * tools.
+ *
+ * usage: replay_benchmark <scans> [trajectory output] [solver] [grid resolution] [grid interval]
+ *
+ *   scans            a serialized karto::Dataset (the .data file of a saved
+ *                    pose graph) or a scan log, see below
+ *   solver           ceres (default), incremental or none
+ *   grid resolution  meters per cell of the occupancy grid, 0.05 by default
+ *   grid interval    update the occupancy grid every this many processed
+ *                    scans, 0 (default) to build it once at the end
+ *
+ * A scan log is little endian: the magic "KSCN" and a uint32 version (1),
+ * then records each starting with a uint8 type.
+ *   'L' laser: uint32 name length, name, float64 minimum range, maximum range,
+ *       range threshold, minimum angle, maximum angle, angular resolution,
+ *       offset x, offset y, offset heading
+ *   'S' scan: uint32 name length, laser name, float64 time, odometric x, y,
+ *       heading, uint32 number of readings, float64 readings
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <karto_sdk/Karto.h>
+#include <karto_sdk/Mapper.h>
+
+#include "stage_timer.hpp"
+#include "../solvers/ceres_solver.hpp"
+#include "../solvers/incremental_ceres_solver.hpp"
+
+namespace
+{
+
+template<class T>
+bool readValue(std::ifstream& in, T& value)
+{
+  return static_cast<bool>(
+    in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+}
+
+bool readString(std::ifstream& in, std::string& value)
+{
+  uint32_t length;
+  if (!readValue(in, length))
+  {
+    return false;
+  }
+  value.resize(length);
+  return length == 0 || static_cast<bool>(in.read(&value[0], length));
+}
+
+// a scan to replay, with the laser it was taken with
+struct RecordedScan
+{
+  karto::LaserRangeFinder* laser;
+  double time;
+  karto::Pose2 odometric_pose;
+  std::vector<kt_double> readings;
+};
+
+bool loadScanLog(const std::string& filename,
+  std::vector<std::unique_ptr<karto::LaserRangeFinder> >& lasers,
+  std::vector<RecordedScan>& scans)
+{
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  char magic[4];
+  uint32_t version;
+  if (!in.read(magic, 4) || std::memcmp(magic, "KSCN", 4) != 0 ||
+      !readValue(in, version) || version != 1)
+  {
+    return false;
+  }
+
+  uint8_t type;
+  while (readValue(in, type))
+  {
+    std::string name;
+    if (!readString(in, name))
+    {
+      return false;
+    }
+
+    if (type == 'L')
+    {
+      double values[9];
+      if (!in.read(reinterpret_cast<char*>(values), sizeof(values)))
+      {
+        return false;
+      }
+
+      karto::LaserRangeFinder* laser =
+        karto::LaserRangeFinder::CreateLaserRangeFinder(
+        karto::LaserRangeFinder_Custom, karto::Name(name.c_str()));
+      laser->SetMinimumRange(values[0]);
+      laser->SetMaximumRange(values[1]);
+      laser->SetRangeThreshold(values[2]);
+      laser->SetMinimumAngle(values[3]);
+      laser->SetMaximumAngle(values[4]);
+      laser->SetAngularResolution(values[5]);
+      laser->SetOffsetPose(karto::Pose2(values[6], values[7], values[8]));
+      lasers.push_back(std::unique_ptr<karto::LaserRangeFinder>(laser));
+      karto::SensorManager::GetInstance()->RegisterSensor(laser, true);
+    }
+    else if (type == 'S')
+    {
+      RecordedScan scan;
+      scan.laser = NULL;
+      for (size_t i = 0; i != lasers.size(); i++)
+      {
+        if (lasers[i]->GetName().GetName() == name)
+        {
+          scan.laser = lasers[i].get();
+        }
+      }
+
+      double values[4];
+      uint32_t n;
+      if (scan.laser == NULL ||
+          !in.read(reinterpret_cast<char*>(values), sizeof(values)) ||
+          !readValue(in, n))
+      {
+        return false;
+      }
+      scan.time = values[0];
+      scan.odometric_pose = karto::Pose2(values[1], values[2], values[3]);
+      scan.readings.resize(n);
+      if (n != 0 && !in.read(reinterpret_cast<char*>(&scan.readings[0]),
+        n * sizeof(double)))
+      {
+        return false;
+      }
+      scans.push_back(scan);
+    }
+    else
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool loadDataset(const std::string& filename,
+  std::vector<RecordedScan>& scans, karto::Dataset& dataset)
+{
+  try
+  {
+    dataset.LoadFromFile(filename);
+  }
+  catch (const std::exception& e)
+  {
+    return false;
+  }
+
+  // the lasers of a dataset are not registered by its serialization
+  const karto::ObjectVector& lasers = dataset.GetLasers();
+  for (size_t i = 0; i != lasers.size(); i++)
+  {
+    karto::Sensor* sensor = dynamic_cast<karto::Sensor*>(lasers[i]);
+    if (sensor)
+    {
+      karto::SensorManager::GetInstance()->RegisterSensor(sensor, true);
+    }
+  }
+
+  // the recorded scans keep the lasers of the dataset, which stays loaded
+  const karto::DataMap& data = dataset.GetData();
+  karto::DataMap::const_iterator it = data.begin();
+  for (it; it != data.end(); ++it)
+  {
+    karto::LocalizedRangeScan* recorded =
+      dynamic_cast<karto::LocalizedRangeScan*>(it->second);
+    if (recorded == NULL || recorded->GetLaserRangeFinder() == NULL)
+    {
+      continue;
+    }
+
+    RecordedScan scan;
+    scan.laser = recorded->GetLaserRangeFinder();
+    scan.time = recorded->GetTime();
+    scan.odometric_pose = recorded->GetOdometricPose();
+    scan.readings = recorded->GetRangeReadingsVector();
+    scans.push_back(scan);
+  }
+
+  return true;
+}
+
+}  // end namespace
+
+int main(int argc, char** argv)
+{
+  if (argc < 2)
+  {
+    printf("usage: replay_benchmark <scans> [trajectory output] [solver] "
+      "[grid resolution] [grid interval]\n");
+    return 1;
+  }
+
+  const std::string input = argv[1];
+  const std::string trajectory = argc > 2 ? argv[2] : "";
+  const std::string solver_name = argc > 3 ? argv[3] : "ceres";
+  const double resolution = argc > 4 ? atof(argv[4]) : 0.05;
+  const int grid_interval = argc > 5 ? atoi(argv[5]) : 0;
+
+  std::vector<std::unique_ptr<karto::LaserRangeFinder> > lasers;
+  std::vector<RecordedScan> scans;
+  karto::Dataset recorded;
+  if (!loadScanLog(input, lasers, scans))
+  {
+    scans.clear();
+    if (!loadDataset(input, scans, recorded))
+    {
+      printf("could not read %s as a scan log or a dataset\n", input.c_str());
+      return 1;
+    }
+  }
+
+  std::unique_ptr<karto::ScanSolver> solver;
+  if (solver_name == "ceres")
+  {
+    solver.reset(new solver_plugins::CeresSolver());
+  }
+  else if (solver_name == "incremental")
+  {
+    solver.reset(new solver_plugins::IncrementalCeresSolver());
+  }
+  else if (solver_name != "none")
+  {
+    printf("unknown solver %s\n", solver_name.c_str());
+    return 1;
+  }
+
+  // the processed scans are owned by a dataset, as in the ROS nodes
+  karto::Dataset processed;
+  benchmarks::StageTimer timer;
+  std::unique_ptr<karto::Mapper> mapper(new karto::Mapper());
+  mapper->SetScanSolver(solver.get());
+  mapper->AddListener(&timer);
+
+  const std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  int n_processed = 0;
+  for (size_t i = 0; i != scans.size(); i++)
+  {
+    karto::LocalizedRangeScan* scan = new karto::LocalizedRangeScan(
+      scans[i].laser->GetName(), scans[i].readings);
+    scan->SetTime(scans[i].time);
+    scan->SetOdometricPose(scans[i].odometric_pose);
+    scan->SetCorrectedPose(scans[i].odometric_pose);
+
+    if (!mapper->Process(scan))
+    {
+      delete scan;
+      continue;
+    }
+
+    processed.Add(scan);
+    n_processed++;
+    if (grid_interval > 0 && n_processed % grid_interval == 0)
+    {
+      mapper->GetOccupancyGrid(resolution);
+    }
+  }
+  mapper->FinishBackgroundOptimization();
+  mapper->GetOccupancyGrid(resolution);
+  const double elapsed = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  printf("scans: %zu, processed: %d, solver: %s\n",
+    scans.size(), n_processed, solver_name.c_str());
+  printf("wall time: %.3f s, %.1f scans/s, %.1f processed scans/s\n",
+    elapsed, scans.size() / elapsed, n_processed / elapsed);
+  printf("peak resident memory: %.1f MB\n",
+    benchmarks::peakResidentKilobytes() / 1024.0);
+  timer.print();
+
+  if (!trajectory.empty())
+  {
+    FILE* out = fopen(trajectory.c_str(), "w");
+    if (out == NULL)
+    {
+      printf("could not write %s\n", trajectory.c_str());
+      return 1;
+    }
+
+    const karto::LocalizedRangeScanVector poses =
+      mapper->GetAllProcessedScans();
+    karto::LocalizedRangeScanVector::const_iterator it = poses.begin();
+    for (it; it != poses.end(); ++it)
+    {
+      const karto::Pose2& pose = (*it)->GetCorrectedPose();
+      fprintf(out, "%.9f %.9f %.9f 0 0 0 %.9f %.9f\n", (*it)->GetTime(),
+        pose.GetX(), pose.GetY(), sin(0.5 * pose.GetHeading()),
+        cos(0.5 * pose.GetHeading()));
+    }
+    fclose(out);
+  }
+
+  mapper.reset();
+  return 0;
+}
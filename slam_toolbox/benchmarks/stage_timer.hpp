@@ -0,0 +1,75 @@
+/*
+ * Timing helpers shared by the offline benchmarks
+ */
+
+#ifndef SLAM_TOOLBOX_BENCHMARKS_STAGE_TIMER_H_
+#define SLAM_TOOLBOX_BENCHMARKS_STAGE_TIMER_H_
+
+#include <sys/resource.h>
+
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#include <karto_sdk/Mapper.h>
+
+namespace benchmarks
+{
+
+// accumulates the time spent in every pipeline stage, stages may be timed
+// from several threads
+class StageTimer : public karto::MapperStageListener
+{
+public:
+  StageTimer() : counts_(karto::MapperStage_Count, 0),
+    totals_(karto::MapperStage_Count, 0.0),
+    maxima_(karto::MapperStage_Count, 0.0)
+  {
+  }
+
+  virtual void StageTimed(karto::MapperStage stage,
+    const std::chrono::steady_clock::time_point& start,
+    const std::chrono::steady_clock::time_point& end)
+  {
+    const double duration =
+      std::chrono::duration<double>(end - start).count();
+    std::lock_guard<std::mutex> lock(mutex_);
+    counts_[stage]++;
+    totals_[stage] += duration;
+    if (duration > maxima_[stage])
+    {
+      maxima_[stage] = duration;
+    }
+  }
+
+  void print() const
+  {
+    printf("%-18s %8s %12s %12s %12s\n",
+      "stage", "count", "total (s)", "mean (ms)", "max (ms)");
+    for (unsigned int i = 0; i != karto::MapperStage_Count; i++)
+    {
+      printf("%-18s %8u %12.3f %12.3f %12.3f\n",
+        karto::GetMapperStageName(static_cast<karto::MapperStage>(i)),
+        counts_[i], totals_[i],
+        counts_[i] ? 1e3 * totals_[i] / counts_[i] : 0.0, 1e3 * maxima_[i]);
+    }
+  }
+
+private:
+  std::mutex mutex_;
+  std::vector<unsigned int> counts_;
+  std::vector<double> totals_, maxima_;
+};
+
+// peak resident memory of this process
+inline long peakResidentKilobytes()
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+}  // end namespace
+
+#endif  // SLAM_TOOLBOX_BENCHMARKS_STAGE_TIMER_H_
@@ -0,0 +1,376 @@
+/*
+ * Synthetic multi-agent stress test of the mapping pipeline
+ */
+
+/**
+ * Simulates agents wandering a procedurally generated or PGM world with noisy
+ * odometry and simulated lidars, feeds their scans to karto::Mapper as they
+ * are taken, and reports the wall time of every pipeline stage, the scan
+ * rate, the peak resident memory and the absolute trajectory error against
+ * the ground truth. Runs without a ROS master; sweeping --rooms and --agents
+ * shows how processing, loop closure and solving scale with map size and
+ * agent count.
+ *
+ * usage: synthetic_benchmark [--option value]...
+ *
+ *   --agents N             number of agents, 1 by default
+ *   --steps N              scans taken by every agent, 1000 by default
+ *   --rooms N              N x N rooms of --room-size meters (4, 5.0)
+ *   --pgm file             use a PGM map of --pgm-resolution meters per cell
+ *                          (0.05) instead of rooms
+ *   --laser model          360 (default), lms100, lms200, utm30lx or urg04lx
+ *   --max-range m          range threshold of the lasers, 12.0 by default
+ *   --translation-noise f  odometry translation error, m per m (0.02)
+ *   --rotation-noise f     odometry heading error, rad per rad (0.02)
+ *   --drift-noise f        odometry heading error, rad per m (0.005)
+ *   --range-noise m        lidar range error, 0.01 by default
+ *   --solver name          ceres (default), incremental or none
+ *   --background 0|1       run loop closure solves in the background
+ *   --front-ends 0|1       match the scans of the agents concurrently with
+ *                          Mapper::MatchScan, then insert them in turn
+ *   --compact N            keep the scans in compact storage with the points of
+ *                          at most N of them, 0 (default) keeps them in full
+ *   --grid-interval N      update the occupancy grid every N time steps
+ *   --seed N               seed of the world and the agents
+ *   --trajectory prefix    write <prefix>_<agent>_{estimate,truth}.txt in the
+ *                          TUM format
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <karto_sdk/Karto.h>
+#include <karto_sdk/Mapper.h>
+#include <tbb/parallel_for.h>
+
+#include "stage_timer.hpp"
+#include "synthetic_world.hpp"
+#include "../solvers/ceres_solver.hpp"
+#include "../solvers/incremental_ceres_solver.hpp"
+
+namespace
+{
+
+karto::LaserRangeFinder* createLaser(const std::string& model,
+  const std::string& name, double max_range)
+{
+  karto::LaserRangeFinder* laser = NULL;
+  if (model == "360")
+  {
+    laser = karto::LaserRangeFinder::CreateLaserRangeFinder(
+      karto::LaserRangeFinder_Custom, karto::Name(name));
+    laser->SetMinimumRange(0.1);
+    laser->SetMaximumRange(30.0);
+    laser->SetAngularResolution(karto::math::DegreesToRadians(1.0));
+    laser->SetMinimumAngle(-karto::KT_PI);
+    laser->SetMaximumAngle(karto::KT_PI - karto::math::DegreesToRadians(1.0));
+    laser->SetIs360Laser(true);
+  }
+  else if (model == "lms100" || model == "lms200" || model == "utm30lx" ||
+    model == "urg04lx")
+  {
+    karto::LaserRangeFinderType type =
+      model == "lms100" ? karto::LaserRangeFinder_Sick_LMS100 :
+      model == "lms200" ? karto::LaserRangeFinder_Sick_LMS200 :
+      model == "utm30lx" ? karto::LaserRangeFinder_Hokuyo_UTM_30LX :
+      karto::LaserRangeFinder_Hokuyo_URG_04LX;
+    laser = karto::LaserRangeFinder::CreateLaserRangeFinder(type,
+      karto::Name(name));
+  }
+  else
+  {
+    return NULL;
+  }
+
+  laser->SetRangeThreshold(std::min(max_range, laser->GetMaximumRange()));
+  return laser;
+}
+
+// position and heading errors of the given poses against the ground truth
+void trajectoryError(const std::vector<karto::Pose2>& poses,
+  const std::vector<karto::Pose2>& truth, double& position_rmse,
+  double& heading_mean)
+{
+  double squared = 0.0, heading = 0.0;
+  for (size_t i = 0; i != poses.size(); i++)
+  {
+    squared += poses[i].SquaredDistance(truth[i]);
+    heading += std::fabs(karto::math::NormalizeAngle(
+      poses[i].GetHeading() - truth[i].GetHeading()));
+  }
+  position_rmse = poses.empty() ? 0.0 : std::sqrt(squared / poses.size());
+  heading_mean = poses.empty() ? 0.0 : heading / poses.size();
+}
+
+void writeTrajectory(const std::string& filename,
+  const std::vector<double>& times, const std::vector<karto::Pose2>& poses)
+{
+  FILE* out = fopen(filename.c_str(), "w");
+  if (out == NULL)
+  {
+    printf("could not write %s\n", filename.c_str());
+    return;
+  }
+
+  for (size_t i = 0; i != poses.size(); i++)
+  {
+    fprintf(out, "%.9f %.9f %.9f 0 0 0 %.9f %.9f\n", times[i],
+      poses[i].GetX(), poses[i].GetY(), sin(0.5 * poses[i].GetHeading()),
+      cos(0.5 * poses[i].GetHeading()));
+  }
+  fclose(out);
+}
+
+// the scans of an agent the mapper kept, with their true poses
+struct AgentTrajectory
+{
+  std::vector<karto::LocalizedRangeScan*> scans;
+  std::vector<karto::Pose2> truth;
+};
+
+}  // end namespace
+
+int main(int argc, char** argv)
+{
+  std::map<std::string, std::string> options;
+  options["agents"] = "1";
+  options["steps"] = "1000";
+  options["rooms"] = "4";
+  options["room-size"] = "5.0";
+  options["pgm"] = "";
+  options["pgm-resolution"] = "0.05";
+  options["laser"] = "360";
+  options["max-range"] = "12.0";
+  options["translation-noise"] = "0.02";
+  options["rotation-noise"] = "0.02";
+  options["drift-noise"] = "0.005";
+  options["range-noise"] = "0.01";
+  options["solver"] = "ceres";
+  options["background"] = "0";
+  options["front-ends"] = "0";
+  options["compact"] = "0";
+  options["grid-interval"] = "0";
+  options["seed"] = "1";
+  options["trajectory"] = "";
+  for (int i = 1; i < argc; i++)
+  {
+    const std::string key = argv[i];
+    if (key.compare(0, 2, "--") != 0 || i + 1 == argc ||
+      options.find(key.substr(2)) == options.end())
+    {
+      printf("usage: synthetic_benchmark [--option value]..., "
+        "see synthetic_benchmark.cpp for the options\n");
+      return 1;
+    }
+    options[key.substr(2)] = argv[++i];
+  }
+
+  const int n_agents = atoi(options["agents"].c_str());
+  const int steps = atoi(options["steps"].c_str());
+  const int grid_interval = atoi(options["grid-interval"].c_str());
+  const bool front_ends = options["front-ends"] == "1";
+  const int compact = atoi(options["compact"].c_str());
+  const unsigned int seed = atoi(options["seed"].c_str());
+
+  benchmarks::SyntheticWorld world;
+  if (!options["pgm"].empty())
+  {
+    if (!world.loadPgm(options["pgm"], atof(options["pgm-resolution"].c_str())))
+    {
+      printf("could not read %s\n", options["pgm"].c_str());
+      return 1;
+    }
+  }
+  else
+  {
+    const int rooms = atoi(options["rooms"].c_str());
+    world.generateRooms(rooms, rooms, atof(options["room-size"].c_str()),
+      0.05, seed);
+  }
+
+  const benchmarks::Roadmap roadmap(world, 1.0, 0.3);
+  if (roadmap.size() == 0 || n_agents <= 0)
+  {
+    printf("no room for the agents to move\n");
+    return 1;
+  }
+
+  std::unique_ptr<karto::ScanSolver> solver;
+  if (options["solver"] == "ceres")
+  {
+    solver.reset(new solver_plugins::CeresSolver());
+  }
+  else if (options["solver"] == "incremental")
+  {
+    solver.reset(new solver_plugins::IncrementalCeresSolver());
+  }
+  else if (options["solver"] != "none")
+  {
+    printf("unknown solver %s\n", options["solver"].c_str());
+    return 1;
+  }
+
+  // the lasers and the processed scans are owned by a dataset, as in the
+  // ROS nodes
+  karto::Dataset dataset;
+  benchmarks::AgentOptions agent_options;
+  agent_options.translation_noise = atof(options["translation-noise"].c_str());
+  agent_options.rotation_noise = atof(options["rotation-noise"].c_str());
+  agent_options.drift_noise = atof(options["drift-noise"].c_str());
+  agent_options.range_noise = atof(options["range-noise"].c_str());
+
+  std::mt19937 generator(seed);
+  std::vector<std::unique_ptr<benchmarks::SimulatedAgent> > agents;
+  std::vector<karto::LaserRangeFinder*> lasers;
+  for (int i = 0; i != n_agents; i++)
+  {
+    karto::LaserRangeFinder* laser = createLaser(options["laser"],
+      "agent_" + std::to_string(i), atof(options["max-range"].c_str()));
+    if (laser == NULL)
+    {
+      printf("unknown laser %s\n", options["laser"].c_str());
+      return 1;
+    }
+    dataset.Add(laser, true);
+    lasers.push_back(laser);
+
+    agents.push_back(std::unique_ptr<benchmarks::SimulatedAgent>(
+      new benchmarks::SimulatedAgent(world, roadmap, laser, agent_options,
+      generator() % roadmap.size(), seed + i + 1)));
+  }
+
+  benchmarks::StageTimer timer;
+  std::unique_ptr<karto::Mapper> mapper(new karto::Mapper());
+  mapper->SetScanSolver(solver.get());
+  mapper->AddListener(&timer);
+  mapper->setParamLoopCloseAcrossAgents(n_agents > 1);
+  mapper->setParamUseBackgroundOptimization(options["background"] == "1");
+  mapper->setParamUseCompactScans(compact > 0);
+  if (compact > 0)
+  {
+    mapper->setParamMaximumMaterializedScans(compact);
+  }
+  if (front_ends)
+  {
+    for (karto::LaserRangeFinder* laser : lasers)
+    {
+      mapper->RegisterFrontEnd(laser);
+    }
+  }
+
+  // the agents scan in turn, as their messages would arrive
+  std::vector<AgentTrajectory> trajectories(n_agents);
+  int n_processed = 0;
+  const std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  for (int step = 0; step != steps; step++)
+  {
+    const double time = step * agent_options.scan_period;
+    std::vector<karto::LocalizedRangeScan*> scans(n_agents);
+    for (int i = 0; i != n_agents; i++)
+    {
+      scans[i] = agents[i]->step(time);
+    }
+
+    // as the per agent front ends of the synchronous node: each agent matches
+    // against its own running scans, the graph takes the scans one at a time
+    std::vector<karto::Matrix3> covariances(n_agents);
+    std::vector<char> matched(n_agents, 0);
+    if (front_ends)
+    {
+      tbb::parallel_for(0, n_agents, [&](int i)
+      {
+        matched[i] = mapper->MatchScan(scans[i], covariances[i]);
+      });
+    }
+
+    for (int i = 0; i != n_agents; i++)
+    {
+      karto::LocalizedRangeScan* scan = scans[i];
+      const bool processed = front_ends ?
+        matched[i] && mapper->InsertScan(scan, covariances[i]) :
+        mapper->Process(scan);
+      if (!processed)
+      {
+        delete scan;
+        continue;
+      }
+
+      dataset.Add(scan);
+      trajectories[i].scans.push_back(scan);
+      trajectories[i].truth.push_back(agents[i]->truePose());
+      n_processed++;
+    }
+
+    if (grid_interval > 0 && (step + 1) % grid_interval == 0)
+    {
+      mapper->GetOccupancyGrid(0.05);
+    }
+  }
+  mapper->FinishBackgroundOptimization();
+  mapper->GetOccupancyGrid(0.05);
+  const double elapsed = std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start).count();
+
+  printf("world: %.1f x %.1f m, roadmap: %zu nodes, agents: %d, solver: %s\n",
+    world.width(), world.height(), roadmap.size(), n_agents,
+    options["solver"].c_str());
+  printf("scans: %d, processed: %d\n", steps * n_agents, n_processed);
+  printf("wall time: %.3f s, %.1f scans/s, %.1f processed scans/s\n",
+    elapsed, steps * n_agents / elapsed, n_processed / elapsed);
+  printf("peak resident memory: %.1f MB\n",
+    benchmarks::peakResidentKilobytes() / 1024.0);
+  timer.print();
+
+  printf("%-10s %8s %14s %14s %14s %14s\n", "agent", "scans",
+    "ate (m)", "heading (rad)", "odom ate (m)", "odom heading");
+  std::vector<karto::Pose2> all_estimates, all_odometry, all_truth;
+  for (int i = 0; i != n_agents; i++)
+  {
+    std::vector<karto::Pose2> estimates, odometry;
+    std::vector<double> times;
+    const AgentTrajectory& trajectory = trajectories[i];
+    for (size_t k = 0; k != trajectory.scans.size(); k++)
+    {
+      estimates.push_back(trajectory.scans[k]->GetCorrectedPose());
+      odometry.push_back(trajectory.scans[k]->GetOdometricPose());
+      times.push_back(trajectory.scans[k]->GetTime());
+    }
+
+    double ate, heading, odometry_ate, odometry_heading;
+    trajectoryError(estimates, trajectory.truth, ate, heading);
+    trajectoryError(odometry, trajectory.truth, odometry_ate,
+      odometry_heading);
+    printf("%-10d %8zu %14.4f %14.4f %14.4f %14.4f\n", i, estimates.size(),
+      ate, heading, odometry_ate, odometry_heading);
+
+    all_estimates.insert(all_estimates.end(), estimates.begin(),
+      estimates.end());
+    all_odometry.insert(all_odometry.end(), odometry.begin(), odometry.end());
+    all_truth.insert(all_truth.end(), trajectory.truth.begin(),
+      trajectory.truth.end());
+
+    if (!options["trajectory"].empty())
+    {
+      const std::string prefix =
+        options["trajectory"] + "_" + std::to_string(i);
+      writeTrajectory(prefix + "_estimate.txt", times, estimates);
+      writeTrajectory(prefix + "_truth.txt", times, trajectory.truth);
+    }
+  }
+
+  double ate, heading, odometry_ate, odometry_heading;
+  trajectoryError(all_estimates, all_truth, ate, heading);
+  trajectoryError(all_odometry, all_truth, odometry_ate, odometry_heading);
+  printf("%-10s %8zu %14.4f %14.4f %14.4f %14.4f\n", "all",
+    all_estimates.size(), ate, heading, odometry_ate, odometry_heading);
+
+  mapper.reset();
+  return 0;
+}
@@ -0,0 +1,622 @@
+/*
+ * Synthetic 2D worlds and simulated lidar agents for the offline benchmarks
+ */
+
+#include "synthetic_world.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <deque>
+#include <fstream>
+#include <limits>
+#include <sstream>
+
+namespace benchmarks
+{
+
+/*****************************************************************************/
+SyntheticWorld::SyntheticWorld() : width_(0), height_(0), resolution_(0.05)
+/*****************************************************************************/
+{
+}
+
+/*****************************************************************************/
+void SyntheticWorld::generateRooms(int rooms_x, int rooms_y,
+  double room_size, double resolution, unsigned int seed)
+/*****************************************************************************/
+{
+  std::mt19937 generator(seed);
+  std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+  const double wall = std::max(2.0 * resolution, 0.1);
+  const double door = 1.2;
+  resolution_ = resolution;
+  width_ = static_cast<int>(std::ceil((rooms_x * room_size + wall) / resolution));
+  height_ = static_cast<int>(std::ceil((rooms_y * room_size + wall) / resolution));
+  cells_.assign(width_ * height_, 0);
+
+  // every wall, the doorways are cut out of them below
+  for (int i = 0; i <= rooms_x; i++)
+  {
+    fill(i * room_size, 0.0, i * room_size + wall, height(), true);
+  }
+  for (int j = 0; j <= rooms_y; j++)
+  {
+    fill(0.0, j * room_size, width(), j * room_size + wall, true);
+  }
+
+  // a random spanning tree of doorways connects all rooms, a few more make
+  // loops to close
+  std::vector<bool> visited(rooms_x * rooms_y, false);
+  std::vector<int> stack(1, 0);
+  visited[0] = true;
+  std::vector<std::pair<int, int> > doors;
+  while (!stack.empty())
+  {
+    const int room = stack.back();
+    const int x = room % rooms_x, y = room / rooms_x;
+    std::vector<int> next;
+    if (x > 0 && !visited[room - 1]) next.push_back(room - 1);
+    if (x + 1 < rooms_x && !visited[room + 1]) next.push_back(room + 1);
+    if (y > 0 && !visited[room - rooms_x]) next.push_back(room - rooms_x);
+    if (y + 1 < rooms_y && !visited[room + rooms_x]) next.push_back(room + rooms_x);
+    if (next.empty())
+    {
+      stack.pop_back();
+      continue;
+    }
+
+    const int chosen = next[generator() % next.size()];
+    visited[chosen] = true;
+    doors.push_back(std::make_pair(std::min(room, chosen), std::max(room, chosen)));
+    stack.push_back(chosen);
+  }
+  for (int room = 0; room != rooms_x * rooms_y; room++)
+  {
+    const int x = room % rooms_x, y = room / rooms_x;
+    if (x + 1 < rooms_x && unit(generator) < 0.3)
+    {
+      doors.push_back(std::make_pair(room, room + 1));
+    }
+    if (y + 1 < rooms_y && unit(generator) < 0.3)
+    {
+      doors.push_back(std::make_pair(room, room + rooms_x));
+    }
+  }
+
+  for (size_t i = 0; i != doors.size(); i++)
+  {
+    const int x = doors[i].first % rooms_x, y = doors[i].first / rooms_x;
+    const double center_x = (x + 0.5) * room_size + 0.5 * wall;
+    const double center_y = (y + 0.5) * room_size + 0.5 * wall;
+    if (doors[i].second == doors[i].first + 1)
+    {
+      const double wall_x = (x + 1) * room_size;
+      fill(wall_x, center_y - 0.5 * door, wall_x + wall,
+        center_y + 0.5 * door, false);
+    }
+    else
+    {
+      const double wall_y = (y + 1) * room_size;
+      fill(center_x - 0.5 * door, wall_y, center_x + 0.5 * door,
+        wall_y + wall, false);
+    }
+  }
+
+  // pillars give the scan matcher features, kept off the lines between
+  // doorways so every room stays crossable
+  const double margin = 0.3, lane = 1.0;
+  for (int room = 0; room != rooms_x * rooms_y; room++)
+  {
+    const double x0 = (room % rooms_x) * room_size + wall;
+    const double y0 = (room / rooms_x) * room_size + wall;
+    const double center_x = x0 + 0.5 * (room_size - wall);
+    const double center_y = y0 + 0.5 * (room_size - wall);
+    const int pillars = 1 + generator() % 3;
+    for (int p = 0; p != pillars; p++)
+    {
+      for (int attempt = 0; attempt != 10; attempt++)
+      {
+        const double size = 0.2 + 0.4 * unit(generator);
+        const double px = x0 + margin +
+          unit(generator) * (room_size - wall - 2.0 * margin - size);
+        const double py = y0 + margin +
+          unit(generator) * (room_size - wall - 2.0 * margin - size);
+        if (px + size > center_x - lane && px < center_x + lane)
+        {
+          continue;
+        }
+        if (py + size > center_y - lane && py < center_y + lane)
+        {
+          continue;
+        }
+        fill(px, py, px + size, py + size, true);
+        break;
+      }
+    }
+  }
+}
+
+/*****************************************************************************/
+bool SyntheticWorld::loadPgm(const std::string& filename, double resolution,
+  double occupied_threshold)
+/*****************************************************************************/
+{
+  std::ifstream in(filename.c_str(), std::ios::binary);
+  if (!in)
+  {
+    return false;
+  }
+
+  // header tokens, skipping comments
+  std::vector<std::string> header;
+  std::string token;
+  while (header.size() != 4 && in >> token)
+  {
+    if (token[0] == '#')
+    {
+      std::getline(in, token);
+      continue;
+    }
+    header.push_back(token);
+  }
+  if (header.size() != 4 || (header[0] != "P5" && header[0] != "P2"))
+  {
+    return false;
+  }
+
+  const int width = atoi(header[1].c_str());
+  const int height = atoi(header[2].c_str());
+  const int max_value = atoi(header[3].c_str());
+  if (width <= 0 || height <= 0 || max_value <= 0 || max_value > 255)
+  {
+    return false;
+  }
+
+  std::vector<int> values(width * height);
+  if (header[0] == "P5")
+  {
+    in.get();
+    std::vector<char> bytes(values.size());
+    if (!in.read(&bytes[0], bytes.size()))
+    {
+      return false;
+    }
+    for (size_t i = 0; i != values.size(); i++)
+    {
+      values[i] = static_cast<unsigned char>(bytes[i]);
+    }
+  }
+  else
+  {
+    for (size_t i = 0; i != values.size(); i++)
+    {
+      if (!(in >> values[i]))
+      {
+        return false;
+      }
+    }
+  }
+
+  // rows are stored from the top, unknown cells are free
+  width_ = width;
+  height_ = height;
+  resolution_ = resolution;
+  cells_.assign(width_ * height_, 0);
+  for (int row = 0; row != height; row++)
+  {
+    for (int x = 0; x != width; x++)
+    {
+      const double occupancy =
+        static_cast<double>(max_value - values[row * width + x]) / max_value;
+      cells_[(height - 1 - row) * width_ + x] = occupancy > occupied_threshold;
+    }
+  }
+
+  return true;
+}
+
+/*****************************************************************************/
+bool SyntheticWorld::isOccupied(int x, int y) const
+/*****************************************************************************/
+{
+  return cells_[y * width_ + x] != 0;
+}
+
+/*****************************************************************************/
+void SyntheticWorld::fill(double x0, double y0, double x1, double y1,
+  bool occupied)
+/*****************************************************************************/
+{
+  const int begin_x = std::max(0, static_cast<int>(std::floor(x0 / resolution_)));
+  const int begin_y = std::max(0, static_cast<int>(std::floor(y0 / resolution_)));
+  const int end_x = std::min(width_, static_cast<int>(std::ceil(x1 / resolution_)));
+  const int end_y = std::min(height_, static_cast<int>(std::ceil(y1 / resolution_)));
+  for (int y = begin_y; y < end_y; y++)
+  {
+    for (int x = begin_x; x < end_x; x++)
+    {
+      cells_[y * width_ + x] = occupied;
+    }
+  }
+}
+
+/*****************************************************************************/
+double SyntheticWorld::raycast(double x, double y, double angle,
+  double max_range) const
+/*****************************************************************************/
+{
+  // walks the cells along the ray, in cell units
+  const double gx = x / resolution_, gy = y / resolution_;
+  int cell_x = static_cast<int>(std::floor(gx));
+  int cell_y = static_cast<int>(std::floor(gy));
+  if (cell_x < 0 || cell_y < 0 || cell_x >= width_ || cell_y >= height_)
+  {
+    return max_range;
+  }
+  if (isOccupied(cell_x, cell_y))
+  {
+    return 0.0;
+  }
+
+  const double infinity = std::numeric_limits<double>::infinity();
+  const double dx = std::cos(angle), dy = std::sin(angle);
+  const int step_x = dx > 0.0 ? 1 : -1, step_y = dy > 0.0 ? 1 : -1;
+  const double delta_x = dx != 0.0 ? 1.0 / std::fabs(dx) : infinity;
+  const double delta_y = dy != 0.0 ? 1.0 / std::fabs(dy) : infinity;
+  double next_x = dx != 0.0 ?
+    (dx > 0.0 ? cell_x + 1 - gx : gx - cell_x) * delta_x : infinity;
+  double next_y = dy != 0.0 ?
+    (dy > 0.0 ? cell_y + 1 - gy : gy - cell_y) * delta_y : infinity;
+  const double max_distance = max_range / resolution_;
+
+  while (true)
+  {
+    double distance;
+    if (next_x < next_y)
+    {
+      distance = next_x;
+      next_x += delta_x;
+      cell_x += step_x;
+    }
+    else
+    {
+      distance = next_y;
+      next_y += delta_y;
+      cell_y += step_y;
+    }
+
+    if (distance > max_distance ||
+        cell_x < 0 || cell_y < 0 || cell_x >= width_ || cell_y >= height_)
+    {
+      return max_range;
+    }
+    if (isOccupied(cell_x, cell_y))
+    {
+      return distance * resolution_;
+    }
+  }
+}
+
+/*****************************************************************************/
+bool SyntheticWorld::isFree(double x, double y, double radius) const
+/*****************************************************************************/
+{
+  const int begin_x = static_cast<int>(std::floor((x - radius) / resolution_));
+  const int begin_y = static_cast<int>(std::floor((y - radius) / resolution_));
+  const int end_x = static_cast<int>(std::floor((x + radius) / resolution_));
+  const int end_y = static_cast<int>(std::floor((y + radius) / resolution_));
+  if (begin_x < 0 || begin_y < 0 || end_x >= width_ || end_y >= height_)
+  {
+    return false;
+  }
+
+  for (int cell_y = begin_y; cell_y <= end_y; cell_y++)
+  {
+    for (int cell_x = begin_x; cell_x <= end_x; cell_x++)
+    {
+      const double cx = (cell_x + 0.5) * resolution_ - x;
+      const double cy = (cell_y + 0.5) * resolution_ - y;
+      if (cx * cx + cy * cy <= radius * radius && isOccupied(cell_x, cell_y))
+      {
+        return false;
+      }
+    }
+  }
+
+  return true;
+}
+
+/*****************************************************************************/
+bool SyntheticWorld::isSegmentFree(double x0, double y0, double x1,
+  double y1, double radius) const
+/*****************************************************************************/
+{
+  const double length = std::hypot(x1 - x0, y1 - y0);
+  const int samples = static_cast<int>(std::ceil(length / resolution_)) + 1;
+  for (int i = 0; i <= samples; i++)
+  {
+    const double t = static_cast<double>(i) / samples;
+    if (!isFree(x0 + t * (x1 - x0), y0 + t * (y1 - y0), radius))
+    {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+/*****************************************************************************/
+Roadmap::Roadmap(const SyntheticWorld& world, double spacing,
+  double clearance)
+/*****************************************************************************/
+{
+  const int nx = static_cast<int>(world.width() / spacing);
+  const int ny = static_cast<int>(world.height() / spacing);
+
+  std::vector<int> lattice(nx * ny, -1);
+  std::vector<karto::Vector2<kt_double> > nodes;
+  for (int j = 0; j != ny; j++)
+  {
+    for (int i = 0; i != nx; i++)
+    {
+      const double x = (i + 0.5) * spacing, y = (j + 0.5) * spacing;
+      if (world.isFree(x, y, clearance))
+      {
+        lattice[j * nx + i] = nodes.size();
+        nodes.push_back(karto::Vector2<kt_double>(x, y));
+      }
+    }
+  }
+
+  std::vector<std::vector<int> > neighbors(nodes.size());
+  for (int j = 0; j != ny; j++)
+  {
+    for (int i = 0; i != nx; i++)
+    {
+      const int node = lattice[j * nx + i];
+      if (node < 0)
+      {
+        continue;
+      }
+
+      const int next[2] = {i + 1 < nx ? lattice[j * nx + i + 1] : -1,
+        j + 1 < ny ? lattice[(j + 1) * nx + i] : -1};
+      for (int k = 0; k != 2; k++)
+      {
+        if (next[k] >= 0 && world.isSegmentFree(nodes[node].GetX(),
+          nodes[node].GetY(), nodes[next[k]].GetX(), nodes[next[k]].GetY(),
+          clearance))
+        {
+          neighbors[node].push_back(next[k]);
+          neighbors[next[k]].push_back(node);
+        }
+      }
+    }
+  }
+
+  // keep only the largest connected component
+  std::vector<int> component(nodes.size(), -1);
+  int largest = -1;
+  size_t largest_size = 0;
+  for (size_t seed = 0; seed != nodes.size(); seed++)
+  {
+    if (component[seed] >= 0)
+    {
+      continue;
+    }
+
+    size_t count = 0;
+    std::deque<int> queue(1, seed);
+    component[seed] = seed;
+    while (!queue.empty())
+    {
+      const int node = queue.front();
+      queue.pop_front();
+      count++;
+      for (size_t k = 0; k != neighbors[node].size(); k++)
+      {
+        if (component[neighbors[node][k]] < 0)
+        {
+          component[neighbors[node][k]] = seed;
+          queue.push_back(neighbors[node][k]);
+        }
+      }
+    }
+
+    if (count > largest_size)
+    {
+      largest = seed;
+      largest_size = count;
+    }
+  }
+
+  std::vector<int> index(nodes.size(), -1);
+  for (size_t node = 0; node != nodes.size(); node++)
+  {
+    if (component[node] == largest)
+    {
+      index[node] = nodes_.size();
+      nodes_.push_back(nodes[node]);
+    }
+  }
+  neighbors_.resize(nodes_.size());
+  for (size_t node = 0; node != nodes.size(); node++)
+  {
+    if (index[node] < 0)
+    {
+      continue;
+    }
+    for (size_t k = 0; k != neighbors[node].size(); k++)
+    {
+      neighbors_[index[node]].push_back(index[neighbors[node][k]]);
+    }
+  }
+}
+
+/*****************************************************************************/
+SimulatedAgent::SimulatedAgent(const SyntheticWorld& world,
+  const Roadmap& roadmap, karto::LaserRangeFinder* laser,
+  const AgentOptions& options, int start_node, unsigned int seed) :
+  world_(world), roadmap_(roadmap), laser_(laser), options_(options),
+  generator_(seed), normal_(0.0, 1.0), unit_(0.0, 1.0),
+  previous_node_(-1), target_node_(start_node)
+/*****************************************************************************/
+{
+  const karto::Vector2<kt_double>& start = roadmap_.node(start_node);
+  true_pose_ = karto::Pose2(start.GetX(), start.GetY(), 0.0);
+  chooseTarget();
+
+  // start facing the first target so the first motion is not a turn
+  const karto::Vector2<kt_double>& target = roadmap_.node(target_node_);
+  true_pose_.SetHeading(std::atan2(target.GetY() - start.GetY(),
+    target.GetX() - start.GetX()));
+  odometric_pose_ = true_pose_;
+}
+
+/*****************************************************************************/
+karto::LocalizedRangeScan* SimulatedAgent::step(double time)
+/*****************************************************************************/
+{
+  move(options_.scan_period);
+  return scan(time);
+}
+
+/*****************************************************************************/
+void SimulatedAgent::chooseTarget()
+/*****************************************************************************/
+{
+  const std::vector<int>& neighbors = roadmap_.neighbors(target_node_);
+  if (neighbors.empty())
+  {
+    return;
+  }
+
+  // never turn back unless at a dead end
+  std::vector<int> candidates;
+  for (size_t i = 0; i != neighbors.size(); i++)
+  {
+    if (neighbors[i] != previous_node_ || neighbors.size() == 1)
+    {
+      candidates.push_back(neighbors[i]);
+    }
+  }
+
+  const karto::Vector2<kt_double>& here = roadmap_.node(target_node_);
+  int next = candidates[generator_() % candidates.size()];
+  if (previous_node_ >= 0 && unit_(generator_) < options_.straight_bias)
+  {
+    const karto::Vector2<kt_double>& from = roadmap_.node(previous_node_);
+    for (size_t i = 0; i != candidates.size(); i++)
+    {
+      const karto::Vector2<kt_double>& to = roadmap_.node(candidates[i]);
+      if (std::fabs((here - from).GetX() - (to - here).GetX()) < 1e-6 &&
+          std::fabs((here - from).GetY() - (to - here).GetY()) < 1e-6)
+      {
+        next = candidates[i];
+      }
+    }
+  }
+
+  previous_node_ = target_node_;
+  target_node_ = next;
+}
+
+/*****************************************************************************/
+void SimulatedAgent::move(double duration)
+/*****************************************************************************/
+{
+  double remaining = duration;
+  while (remaining > 1e-9)
+  {
+    const karto::Vector2<kt_double>& target = roadmap_.node(target_node_);
+    const double dx = target.GetX() - true_pose_.GetX();
+    const double dy = target.GetY() - true_pose_.GetY();
+    const double distance = std::hypot(dx, dy);
+    if (distance < 1e-6)
+    {
+      if (roadmap_.neighbors(target_node_).empty())
+      {
+        return;
+      }
+      chooseTarget();
+      continue;
+    }
+
+    // turn in place toward the target, then drive to it
+    double translation = 0.0, rotation = 0.0;
+    const double error = karto::math::NormalizeAngle(
+      std::atan2(dy, dx) - true_pose_.GetHeading());
+    if (std::fabs(error) > 1e-9)
+    {
+      const double time = std::min(remaining,
+        std::fabs(error) / options_.angular_speed);
+      rotation = error > 0.0 ? options_.angular_speed * time :
+        -options_.angular_speed * time;
+      if (time < remaining)
+      {
+        rotation = error;
+      }
+      remaining -= time;
+    }
+    else
+    {
+      const double time = std::min(remaining, distance / options_.speed);
+      translation = time < remaining ? distance : options_.speed * time;
+      remaining -= time;
+    }
+
+    true_pose_ = karto::Pose2(
+      true_pose_.GetX() + translation * std::cos(true_pose_.GetHeading()),
+      true_pose_.GetY() + translation * std::sin(true_pose_.GetHeading()),
+      karto::math::NormalizeAngle(true_pose_.GetHeading() + rotation));
+
+    // odometry errors grow with the motion
+    const double noisy_translation = translation +
+      normal_(generator_) * options_.translation_noise * translation;
+    const double noisy_rotation = rotation + normal_(generator_) *
+      (options_.rotation_noise * std::fabs(rotation) +
+      options_.drift_noise * translation);
+    odometric_pose_ = karto::Pose2(
+      odometric_pose_.GetX() +
+      noisy_translation * std::cos(odometric_pose_.GetHeading()),
+      odometric_pose_.GetY() +
+      noisy_translation * std::sin(odometric_pose_.GetHeading()),
+      karto::math::NormalizeAngle(odometric_pose_.GetHeading() +
+      noisy_rotation));
+  }
+}
+
+/*****************************************************************************/
+karto::LocalizedRangeScan* SimulatedAgent::scan(double time)
+/*****************************************************************************/
+{
+  const karto::Pose2 sensor_pose =
+    karto::Transform(true_pose_).TransformPose(laser_->GetOffsetPose());
+  const kt_int32u n = laser_->GetNumberOfRangeReadings();
+  const double max_range = laser_->GetMaximumRange();
+
+  std::vector<kt_double> readings(n);
+  for (kt_int32u i = 0; i != n; i++)
+  {
+    const double angle = sensor_pose.GetHeading() +
+      laser_->GetMinimumAngle() + i * laser_->GetAngularResolution();
+    double range = world_.raycast(sensor_pose.GetX(), sensor_pose.GetY(),
+      angle, max_range);
+    if (range < max_range)
+    {
+      range = std::max(laser_->GetMinimumRange(),
+        range + normal_(generator_) * options_.range_noise);
+    }
+    readings[i] = range;
+  }
+
+  karto::LocalizedRangeScan* range_scan =
+    new karto::LocalizedRangeScan(laser_->GetName(), readings);
+  range_scan->SetTime(time);
+  range_scan->SetOdometricPose(odometric_pose_);
+  range_scan->SetCorrectedPose(odometric_pose_);
+  return range_scan;
+}
+
+}  // end namespace
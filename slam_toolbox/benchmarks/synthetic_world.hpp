@@ -0,0 +1,124 @@
+/*
+ * Synthetic 2D worlds and simulated lidar agents for the offline benchmarks
+ */
+
+#ifndef SLAM_TOOLBOX_BENCHMARKS_SYNTHETIC_WORLD_H_
+#define SLAM_TOOLBOX_BENCHMARKS_SYNTHETIC_WORLD_H_
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include <karto_sdk/Karto.h>
+
+namespace benchmarks
+{
+
+// 2D occupancy world seen by the simulated lidars, with its origin at the
+// lower left corner of the lower left cell
+class SyntheticWorld
+{
+public:
+  SyntheticWorld();
+
+  // rooms of room_size meters laid out on a grid, joined by doorways that
+  // connect all of them with a few extra loops, each holding random pillars
+  void generateRooms(int rooms_x, int rooms_y, double room_size,
+    double resolution, unsigned int seed);
+
+  // a map_server style PGM (P2 or P5), cells darker than the threshold are
+  // walls
+  bool loadPgm(const std::string& filename, double resolution,
+    double occupied_threshold = 0.65);
+
+  // distance from (x, y) along angle to the first wall, max_range if none
+  double raycast(double x, double y, double angle, double max_range) const;
+
+  // no wall within radius of (x, y)
+  bool isFree(double x, double y, double radius) const;
+
+  // no wall within radius of the segment from (x0, y0) to (x1, y1)
+  bool isSegmentFree(double x0, double y0, double x1, double y1,
+    double radius) const;
+
+  double width() const { return width_ * resolution_; }
+  double height() const { return height_ * resolution_; }
+  double resolution() const { return resolution_; }
+
+private:
+  bool isOccupied(int x, int y) const;
+  void fill(double x0, double y0, double x1, double y1, bool occupied);
+
+  int width_, height_;
+  double resolution_;
+  std::vector<unsigned char> cells_;
+};
+
+// lattice of free points the agents travel between
+class Roadmap
+{
+public:
+  // keeps the largest connected set of lattice points with the clearance
+  Roadmap(const SyntheticWorld& world, double spacing, double clearance);
+
+  size_t size() const { return nodes_.size(); }
+  const karto::Vector2<kt_double>& node(int i) const { return nodes_[i]; }
+  const std::vector<int>& neighbors(int i) const { return neighbors_[i]; }
+
+private:
+  std::vector<karto::Vector2<kt_double> > nodes_;
+  std::vector<std::vector<int> > neighbors_;
+};
+
+struct AgentOptions
+{
+  AgentOptions() : speed(0.5), angular_speed(0.8), scan_period(0.1),
+    translation_noise(0.02), rotation_noise(0.02), drift_noise(0.005),
+    range_noise(0.01), straight_bias(0.6)
+  {
+  }
+
+  double speed;              // m/s
+  double angular_speed;      // rad/s, turns happen in place
+  double scan_period;        // s between scans
+  double translation_noise;  // odometry translation error, m per m
+  double rotation_noise;     // odometry heading error, rad per rad
+  double drift_noise;        // odometry heading error, rad per m
+  double range_noise;        // standard deviation of the ranges, m
+  double straight_bias;      // chance to keep going straight at a node
+};
+
+// a robot wandering the roadmap with noisy odometry and a simulated lidar
+class SimulatedAgent
+{
+public:
+  SimulatedAgent(const SyntheticWorld& world, const Roadmap& roadmap,
+    karto::LaserRangeFinder* laser, const AgentOptions& options,
+    int start_node, unsigned int seed);
+
+  // moves for one scan period and scans at the new pose, the scan holds the
+  // odometric pose and is owned by the caller
+  karto::LocalizedRangeScan* step(double time);
+
+  const karto::Pose2& truePose() const { return true_pose_; }
+  const karto::Pose2& odometricPose() const { return odometric_pose_; }
+
+private:
+  void move(double duration);
+  void chooseTarget();
+  karto::LocalizedRangeScan* scan(double time);
+
+  const SyntheticWorld& world_;
+  const Roadmap& roadmap_;
+  karto::LaserRangeFinder* laser_;
+  AgentOptions options_;
+  std::mt19937 generator_;
+  std::normal_distribution<double> normal_;
+  std::uniform_real_distribution<double> unit_;
+  int previous_node_, target_node_;
+  karto::Pose2 true_pose_, odometric_pose_;
+};
+
+}  // end namespace
+
+#endif  // SLAM_TOOLBOX_BENCHMARKS_SYNTHETIC_WORLD_H_
@@ -20,6 +20,7 @@
 #define SLAM_TOOLBOX_LASER_UTILS_H_
 
 #include <string>
+#include <memory>
 
 #include "ros/ros.h"
 #include "slam_toolbox/toolbox_types.hpp"
@@ -29,27 +30,17 @@
 namespace laser_utils
 {
 
-// Convert a laser scan to a vector of readings
-inline std::vector<double> scanToReadings(const sensor_msgs::LaserScan& scan, const bool& inverted)
+// Create a karto scan reading the ranges of a laser scan in place instead of
+// copying them, back to front if the laser is inverted. The karto scan keeps
+// the message alive
+inline karto::LocalizedRangeScan* scanToLocalizedRangeScan(
+  const karto::Name& sensor_name, const sensor_msgs::LaserScan::ConstPtr& scan,
+  const bool& inverted)
 {
-  std::vector<double> readings;
-
-  if (inverted)
-  {
-    for(std::vector<float>::const_reverse_iterator it = scan.ranges.rbegin(); it != scan.ranges.rend(); ++it)
-    {
-      readings.push_back(*it);
-    }
-  }
-  else 
-  {
-    for(std::vector<float>::const_iterator it = scan.ranges.begin(); it != scan.ranges.end(); ++it)
-    {
-      readings.push_back(*it);
-    }
-  }
-
-  return readings;
+  std::shared_ptr<const void> owner(scan.get(),
+    [scan](const void*) {});
+  return new karto::LocalizedRangeScan(sensor_name, scan->ranges.data(),
+    scan->ranges.size(), owner, inverted);
 };
 
 // Store laser scanner information
@@ -94,10 +85,10 @@ public:
   ScanHolder(std::map<std::string, laser_utils::LaserMetadata>& lasers);
   ~ScanHolder();
   sensor_msgs::LaserScan getCorrectedScan(const int& id);
-  void addScan(const sensor_msgs::LaserScan scan);
+  void addScan(const sensor_msgs::LaserScan::ConstPtr& scan);
 
 private:
-  std::unique_ptr<std::vector<sensor_msgs::LaserScan> > current_scans_;
+  std::unique_ptr<std::vector<sensor_msgs::LaserScan::ConstPtr> > current_scans_;
   std::map<std::string, laser_utils::LaserMetadata>& lasers_;
 };
 
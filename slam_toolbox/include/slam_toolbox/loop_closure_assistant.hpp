@@ -33,6 +33,7 @@
 #include "slam_toolbox/toolbox_types.hpp"
 #include "slam_toolbox/laser_utils.hpp"
 #include "slam_toolbox/visualization_utils.hpp"
+#include "slam_toolbox/slam_mapper.hpp"
 
 namespace loop_closure_assistant
 {
@@ -42,7 +43,7 @@ using namespace ::toolbox_types;
 class LoopClosureAssistant
 {
 public:
-  LoopClosureAssistant(ros::NodeHandle& node, karto::Mapper* mapper, laser_utils::ScanHolder* scan_holder, PausedState& state, ProcessType& processor_type);
+  LoopClosureAssistant(ros::NodeHandle& node, mapper_utils::SMapper* smapper, boost::shared_mutex& smapper_mutex, laser_utils::ScanHolder* scan_holder, PausedState& state, ProcessType& processor_type);
 
   void clearMovedNodes();
   void processInteractiveFeedback(const visualization_msgs::InteractiveMarkerFeedbackConstPtr& feedback);
@@ -62,6 +63,8 @@ private:
   ros::ServiceServer ssClear_manual_, ssLoopClosure_, ssInteractive_;
   boost::mutex moved_nodes_mutex_;
   std::map<int, Eigen::Vector3d> moved_nodes_;
+  mapper_utils::SMapper* smapper_;
+  boost::shared_mutex& smapper_mutex_; // exclusive to modify the mapper
   karto::Mapper* mapper_;
   karto::ScanSolver* solver_;
   std::unique_ptr<interactive_markers::InteractiveMarkerServer> interactive_server_;
@@ -24,19 +24,133 @@
 #include "karto_sdk/Karto.h"
 #include "tf2/utils.h"
 
+#include <memory>
+#include <vector>
+
 namespace mapper_utils
 {
 
 using namespace ::karto;
 
+// append-only sequence whose copies share its storage in fixed size chunks.
+// A copy only reads the elements it was taken with, so the original may keep
+// appending while copies are read from other threads
+template<typename T>
+class SharedSequence
+{
+public:
+  class const_iterator
+  {
+  public:
+    const_iterator(const SharedSequence* sequence, const size_t& index)
+    : sequence_(sequence), index_(index)
+    {
+    }
+
+    const T& operator*() const {return (*sequence_)[index_];}
+    const T* operator->() const {return &(*sequence_)[index_];}
+    const_iterator& operator++() {++index_; return *this;}
+    bool operator==(const const_iterator& other) const {return index_ == other.index_;}
+    bool operator!=(const const_iterator& other) const {return index_ != other.index_;}
+
+  private:
+    const SharedSequence* sequence_;
+    size_t index_;
+  };
+
+  SharedSequence()
+  : size_(0)
+  {
+  }
+
+  size_t size() const {return size_;}
+  bool empty() const {return size_ == 0;}
+  const_iterator begin() const {return const_iterator(this, 0);}
+  const_iterator end() const {return const_iterator(this, size_);}
+  const T& back() const {return (*this)[size_ - 1];}
+
+  const T& operator[](const size_t& index) const
+  {
+    return (*chunks_[index / CHUNK_SIZE])[index % CHUNK_SIZE];
+  }
+
+  // writes past the size of every copy, so never to an element they read
+  void push_back(const T& value)
+  {
+    if (size_ % CHUNK_SIZE == 0)
+    {
+      chunks_.push_back(std::make_shared<std::vector<T> >(CHUNK_SIZE));
+    }
+    (*chunks_.back())[size_ % CHUNK_SIZE] = value;
+    size_++;
+  }
+
+  // starts over in new chunks, leaving the copies theirs
+  void clear()
+  {
+    chunks_.clear();
+    size_ = 0;
+  }
+
+private:
+  static constexpr size_t CHUNK_SIZE = 1024;
+  std::vector<std::shared_ptr<std::vector<T> > > chunks_;
+  size_t size_;
+};
+
+// immutable copy of the graph handed to the threads publishing it, so they
+// never need the lock the mapper processes scans under
+struct GraphSnapshot
+{
+  struct Node
+  {
+    int id;
+    int state_id;
+    karto::Name sensor_name;
+    karto::Pose2 pose; // corrected pose when the snapshot was taken
+    // copy of the scan sharing its readings, reused by the snapshots that
+    // follow
+    std::shared_ptr<karto::LocalizedRangeScan> scan;
+  };
+
+  struct Edge
+  {
+    int source, target; // unique ids
+  };
+
+  // the node with the given unique id, or null
+  const Node* find(const int& id) const;
+
+  typedef SharedSequence<Node> Nodes;
+  typedef SharedSequence<Edge> Edges;
+
+  uint64_t version;
+  uint64_t generation; // changes with the mapper, whose unique ids restart
+  double raytrace_pose_change_threshold; // the mapper's, for the grid
+  Nodes nodes; // ascending unique ids
+  Edges edges;
+};
+
+typedef std::shared_ptr<const GraphSnapshot> GraphSnapshotPtr;
+
 class SMapper
 {
 public:
   SMapper();
   ~SMapper();
 
-  // get occupancy grid from scans
-  karto::OccupancyGrid* getOccupancyGrid(const double& resolution);
+  // publish the current graph to readers, with the mapper locked after it
+  // changed
+  void publishSnapshot();
+
+  // latest published graph, from any thread without locking the mapper
+  GraphSnapshotPtr getSnapshot() const;
+
+  // get occupancy grid of a snapshot, incrementally updated from the last
+  // one. Calls must not overlap, but may run while the mapper processes scans
+  // or is replaced, as they only read the snapshot
+  karto::IncrementalOccupancyGrid* getOccupancyGrid(const GraphSnapshot& snapshot,
+    const double& resolution);
 
   // convert Karto pose to TF pose
   tf2::Transform toTfPose(const karto::Pose2& pose) const;
@@ -60,6 +174,14 @@ public:
 
 protected:
   std::unique_ptr<karto::Mapper> mapper_;
+
+  // snapshot state, the nodes and edges published last, which the next
+  // snapshot appends to until the mapper's graph revision changes
+  GraphSnapshotPtr snapshot_;
+  GraphSnapshot::Nodes nodes_;
+  GraphSnapshot::Edges edges_;
+  std::unique_ptr<karto::IncrementalOccupancyGrid> grid_;
+  uint64_t generation_, grid_generation_, graph_revision_;
 };
 
 } // end namespace
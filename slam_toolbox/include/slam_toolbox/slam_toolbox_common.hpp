@@ -37,12 +37,15 @@
 #include "slam_toolbox/get_pose_helper.hpp"
 #include "slam_toolbox/map_saver.hpp"
 #include "slam_toolbox/loop_closure_assistant.hpp"
+#include "slam_toolbox/stage_statistics.hpp"
+#include "slam_toolbox/trace_recorder.hpp"
 #include "mtg_messages/agent_status.h"
 
 #include <string>
 #include <map>
 #include <vector>
 #include <queue>
+#include <atomic>
 #include <cstdlib>
 #include <fstream>
 #include <boost/thread.hpp>
@@ -65,6 +68,7 @@ protected:
   // threads
   void publishVisualizations();
   void publishTransformLoop(const double &transform_publish_period, const double &tag_publish_period);
+  void publishDiagnostics(const double& diagnostics_publish_period);
 
   // setup
   void setParams(ros::NodeHandle& nh);
@@ -81,6 +85,8 @@ protected:
   virtual bool deserializePoseGraphCallback(slam_toolbox_msgs::DeserializePoseGraph::Request& req,
     slam_toolbox_msgs::DeserializePoseGraph::Response& resp);
   void loadSerializedPoseGraph(std::unique_ptr<karto::Mapper>&, std::unique_ptr<karto::Dataset>&);
+  bool dumpTraceCallback(slam_toolbox_msgs::DumpTrace::Request& req,
+    slam_toolbox_msgs::DumpTrace::Response& resp);
   void loadPoseGraphByParams(ros::NodeHandle& nh);
 
   // functional bits
@@ -88,8 +94,13 @@ protected:
   virtual karto::LocalizedRangeScan* addScan(karto::LaserRangeFinder* laser, const sensor_msgs::LaserScan::ConstPtr& scan,
     karto::Pose2& karto_pose);
   karto::LocalizedRangeScan* addScan(karto::LaserRangeFinder* laser, PosedScan& scanWPose);
+  bool matchScan(MatchedScan& matched);
+  karto::LocalizedRangeScan* insertScan(MatchedScan& matched);
+  void addProcessedScan(karto::LocalizedRangeScan* range_scan, const sensor_msgs::LaserScan::ConstPtr& scan,
+    karto::Pose2& karto_pose, const bool& update_reprocessing_transform);
   void addTag(apriltag_ros::AprilTagDetectionArray::ConstPtr& apriltag, karto::LocalizedRangeScan* scan);
   bool updateMap();
+  void mapSubscriberCallback(const ros::SingleSubscriberPublisher& pub);
   tf2::Stamped<tf2::Transform> setTransformFromPoses(const karto::Pose2& pose,
     const karto::Pose2& karto_pose, const std_msgs::Header& header, const bool& update_reprocessing_transform);
   tf2::Stamped<tf2::Transform> publishTagTransform(int tag_id, const karto::Name& sensor_name);
@@ -114,8 +125,8 @@ protected:
   std::vector<std::unique_ptr<tf2_ros::MessageFilter<sensor_msgs::LaserScan> > > scan_filters_;
   std::vector<std::unique_ptr<message_filters::Subscriber<apriltag_ros::AprilTagDetectionArray> > > apriltag_subs_;
   std::vector<std::unique_ptr<apriltag_ros::AprilTagDetectionArray> > apriltags_;
-  ros::Publisher sst_, sstm_, tag_pub_;
-  ros::ServiceServer ssMap_, ssPauseMeasurements_, ssSerialize_, ssDesserialize_;
+  ros::Publisher sst_, sstm_, sstu_, tag_pub_, diagnostics_pub_;
+  ros::ServiceServer ssMap_, ssPauseMeasurements_, ssSerialize_, ssDesserialize_, ssDumpTrace_;
   ros::ServiceClient status_client_;
 
   // Storage for ROS parameters
@@ -141,18 +152,26 @@ protected:
   std::unique_ptr<map_saver::MapSaver> map_saver_;
   std::unique_ptr<loop_closure_assistant::LoopClosureAssistant> closure_assistant_;
   std::unique_ptr<laser_utils::ScanHolder> scan_holder_;
+  std::unique_ptr<stage_statistics::StageStatistics> stage_statistics_;
+  std::unique_ptr<trace_recorder::TraceRecorder> trace_recorder_; // null unless tracing
 
   // Internal state
   std::vector<std::unique_ptr<boost::thread> > threads_;
   tf2::Transform map_to_odom_;
   std::string map_to_odom_child_frame_id_;
-  boost::mutex map_to_odom_mutex_, smapper_mutex_, pose_mutex_, apriltag_mutex_, map_to_tags_mutex_;
+  boost::mutex map_to_odom_mutex_, pose_mutex_, apriltag_mutex_, map_to_tags_mutex_;
+  boost::shared_mutex smapper_mutex_; // shared by the scan front ends, exclusive to modify the mapper
+  boost::mutex map_mutex_; // map_ and the grid it is built from, not the graph
+  boost::mutex lasers_mutex_; // lasers_, read by the scan front ends
   PausedState state_;
   nav_msgs::GetMap::Response map_;
   ProcessType processor_type_;
   std::unique_ptr<karto::Pose2> process_near_pose_;
   tf2::Transform reprocessing_transform_;
   std::set<std::string> fleet_info_;
+  std::atomic<size_t> queue_depth_; // scans waiting to be processed
+  std::atomic<bool> publish_full_map_; // a map subscriber joined since the last update
+  kt_int64u published_map_generation_; // grid generation the published map is from
 
   // pluginlib
   pluginlib::ClassLoader<karto::ScanSolver> solver_loader_;
@@ -31,6 +31,7 @@ public:
   SynchronousSlamToolbox(ros::NodeHandle& nh);
   ~SynchronousSlamToolbox() {};
   void run();
+  void runFrontEnd(const std::string& frame_id, karto::LaserRangeFinder* laser);
 
 protected:
   virtual void laserCallback(const sensor_msgs::LaserScan::ConstPtr& scan) override final;
@@ -39,10 +40,15 @@ protected:
   virtual bool deserializePoseGraphCallback(slam_toolbox_msgs::DeserializePoseGraph::Request& req,
     slam_toolbox_msgs::DeserializePoseGraph::Response& resp) override final;
 
-  std::queue<PosedScan> q_;
+  // scans of each laser waiting for its front end, and the matched scans
+  // waiting for the back end in the order they were matched
+  std::map<std::string, std::queue<PosedScan> > agent_qs_;
+  std::queue<MatchedScan> matched_q_;
+  std::set<std::string> matching_; // lasers with a scan in matched_q_ or being inserted
   std::map<std::string, std::queue<apriltag_ros::AprilTagDetectionArray::ConstPtr> > agent_apriltags_q_m_;
   ros::ServiceServer ssClear_;
-  boost::mutex q_mutex_, apriltag_q_mutex_;
+  boost::mutex q_mutex_, matched_q_mutex_, apriltag_q_mutex_;
+  boost::condition_variable q_condition_, matched_q_condition_;
 };
 
 }
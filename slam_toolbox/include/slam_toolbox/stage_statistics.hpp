@@ -0,0 +1,97 @@
+/*
+ * stage_statistics
+ * Latency histograms of the mapping pipeline stages
+ */
+
+#ifndef SLAM_TOOLBOX_STAGE_STATISTICS_H_
+#define SLAM_TOOLBOX_STAGE_STATISTICS_H_
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "diagnostic_msgs/DiagnosticArray.h"
+#include "karto_sdk/Mapper.h"
+
+namespace stage_statistics
+{
+
+// log-linear histogram of latencies in microseconds, 16 buckets per power of
+// two for about 6% precision, that a thread records into without locks while
+// another one reads it
+class LatencyHistogram
+{
+public:
+  static const int SUB_BUCKETS = 16;
+  static const int SUB_BUCKET_BITS = 4;
+  static const int MAX_EXPONENT = 40;
+  static const int BUCKETS =
+    SUB_BUCKETS + (MAX_EXPONENT - SUB_BUCKET_BITS + 1) * SUB_BUCKETS;
+
+  LatencyHistogram();
+
+  void record(uint64_t micros);
+
+  // adds the counts to the given ones and returns the largest latency since
+  // the last call
+  uint64_t collect(std::vector<uint64_t>& counts);
+
+  static int bucketIndex(uint64_t micros);
+  static double bucketValue(int index); // middle of the bucket
+
+private:
+  std::array<std::atomic<uint64_t>, BUCKETS> counts_;
+  std::atomic<uint64_t> max_;
+};
+
+// latencies of a stage over a window, in milliseconds
+struct StageSummary
+{
+  uint64_t count;
+  double p50, p95, p99, max;
+};
+
+// always on timing of the mapper stages, and of the ROS side stages, each
+// thread recording into its own shard of histograms
+class StageStatistics : public karto::MapperStageListener
+{
+public:
+  // stages timed outside of karto follow the mapper's
+  enum
+  {
+    NAV_MAP_STAGE = karto::MapperStage_Count, // vis_utils::toNavMap
+    STAGE_COUNT
+  };
+
+  StageStatistics();
+
+  virtual void StageTimed(karto::MapperStage stage,
+    const std::chrono::steady_clock::time_point& start,
+    const std::chrono::steady_clock::time_point& end);
+
+  void record(int stage, const std::chrono::steady_clock::duration& duration);
+
+  // latencies of every stage since the last call, not thread safe against
+  // other calls
+  std::vector<StageSummary> summarize();
+
+  // one status per stage with its percentiles
+  void toDiagnostics(const std::vector<StageSummary>& summaries,
+    diagnostic_msgs::DiagnosticArray& msg) const;
+
+  static const char* stageName(int stage);
+
+private:
+  static const int SHARDS = 8;
+  typedef std::array<LatencyHistogram, STAGE_COUNT> Shard;
+
+  std::vector<Shard> shards_;
+  std::vector<std::vector<uint64_t> > last_counts_;
+};
+
+} // end namespace
+
+#endif //SLAM_TOOLBOX_STAGE_STATISTICS_H_
@@ -22,6 +22,7 @@
 #include <nav_msgs/MapMetaData.h>
 #include <sensor_msgs/LaserScan.h>
 #include <nav_msgs/GetMap.h>
+#include <map_msgs/OccupancyGridUpdate.h>
 #include <geometry_msgs/PoseWithCovarianceStamped.h>
 
 #include <visualization_msgs/MarkerArray.h>
@@ -40,5 +41,6 @@
 #include "slam_toolbox_msgs/DeserializePoseGraph.h"
 #include "slam_toolbox_msgs/MergeMaps.h"
 #include "slam_toolbox_msgs/AddSubmap.h"
+#include "slam_toolbox_msgs/DumpTrace.h"
 
 #endif //SLAM_TOOLBOX_TOOLBOX_MSGS_H_
\ No newline at end of file
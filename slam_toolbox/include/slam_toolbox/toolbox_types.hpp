@@ -48,6 +48,20 @@ struct PosedScan
   karto::Pose2 pose;
 };
 
+// object containing a posed scan and its match by the front end, waiting to
+// be inserted by the back end
+struct MatchedScan
+{
+  MatchedScan(const PosedScan& scan_w_pose_in, karto::LaserRangeFinder* laser_in) :
+              scan_w_pose(scan_w_pose_in), laser(laser_in), range_scan(nullptr)
+  {
+  }
+  PosedScan scan_w_pose;
+  karto::LaserRangeFinder* laser;
+  karto::LocalizedRangeScan* range_scan; // null to process with addScan
+  karto::Matrix3 covariance;
+};
+
 // object containing a vertex pointer and an updated score
 struct ScoredVertex
 {
@@ -0,0 +1,98 @@
+/*
+ * trace_recorder
+ * Chrome trace events of the mapping pipeline stages
+ */
+
+#ifndef SLAM_TOOLBOX_TRACE_RECORDER_H_
+#define SLAM_TOOLBOX_TRACE_RECORDER_H_
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "karto_sdk/Mapper.h"
+
+namespace trace_recorder
+{
+
+// keeps the last events of every stage in a ring buffer that any thread
+// writes to without locking, and dumps them as a Chrome trace-event file
+// readable in chrome://tracing or ui.perfetto.dev
+class TraceRecorder : public karto::MapperStageListener
+{
+public:
+  // events recorded outside of karto follow the mapper's stages
+  enum
+  {
+    UPDATE_MAP_EVENT = karto::MapperStage_Count,
+    PUBLISH_GRAPH_EVENT,
+    EVENT_COUNT
+  };
+
+  explicit TraceRecorder(size_t capacity);
+
+  virtual void StageTraced(karto::MapperStage stage,
+    const std::chrono::steady_clock::time_point& start,
+    const std::chrono::steady_clock::time_point& end,
+    const karto::LocalizedRangeScan* scan);
+
+  void record(int event, const std::chrono::steady_clock::time_point& start,
+    const std::chrono::steady_clock::time_point& end,
+    const karto::LocalizedRangeScan* scan = nullptr);
+
+  // writes the events in the buffer, oldest first, may run while recording
+  bool dump(const std::string& filename) const;
+
+  static const char* eventName(int event);
+
+private:
+  struct Event
+  {
+    // odd while the slot is written, 2 * (position + 1) once it is done
+    std::atomic<uint64_t> sequence;
+    int event;
+    int scan_id;
+    uint32_t thread;
+    int64_t start_ns, duration_ns;
+    char sensor[48];
+  };
+
+  bool read(uint64_t position, Event& event) const;
+
+  std::vector<Event> events_;
+  std::atomic<uint64_t> head_;
+};
+
+// records the time from its construction to its destruction, does nothing
+// when tracing is off and the recorder is null
+class ScopedTrace
+{
+public:
+  ScopedTrace(TraceRecorder* recorder, int event)
+  : recorder_(recorder), event_(event)
+  {
+    if (recorder_)
+    {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+
+  ~ScopedTrace()
+  {
+    if (recorder_)
+    {
+      recorder_->record(event_, start_, std::chrono::steady_clock::now());
+    }
+  }
+
+private:
+  TraceRecorder* recorder_;
+  int event_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+} // end namespace
+
+#endif //SLAM_TOOLBOX_TRACE_RECORDER_H_
@@ -92,6 +92,39 @@ inline visualization_msgs::InteractiveMarker toInteractiveMarker(
   return int_marker;
 }
 
+// Convert the cells of a region of the grid, from (min_x, min_y) up to but
+// not including (max_x, max_y), into a map of the same size
+inline void toNavMapRegion(
+  const karto::OccupancyGrid* occ_grid,
+  nav_msgs::OccupancyGrid& map,
+  const kt_int32s& min_x, const kt_int32s& min_y,
+  const kt_int32s& max_x, const kt_int32s& max_y)
+{
+  for (kt_int32s y = min_y; y < max_y; y++)
+  {
+    for (kt_int32s x = min_x; x < max_x; x++) 
+    {
+      kt_int8u value = occ_grid->GetValue(karto::Vector2<kt_int32s>(x, y));
+      switch (value)
+      {
+        case karto::GridStates_Unknown:
+          map.data[MAP_IDX(map.info.width, x, y)] = -1;
+          break;
+        case karto::GridStates_Occupied:
+          map.data[MAP_IDX(map.info.width, x, y)] = 100;
+          break;
+        case karto::GridStates_Free:
+          map.data[MAP_IDX(map.info.width, x, y)] = 0;
+          break;
+        default:
+          ROS_WARN("Encountered unknown cell value at %d, %d", x, y);
+          break;
+      }
+    }
+  }
+  return;
+}
+
 inline void toNavMap(
   const karto::OccupancyGrid* occ_grid,
   nav_msgs::OccupancyGrid& map)
@@ -114,27 +147,28 @@ inline void toNavMap(
     map.data.resize(map.info.width * map.info.height);
   }
 
-  for (kt_int32s y = 0; y < height; y++)
+  toNavMapRegion(occ_grid, map, 0, 0, width, height);
+  return;
+}
+
+// Copy a region of a map, converted by toNavMapRegion, into a partial update
+inline void toNavMapUpdate(
+  const nav_msgs::OccupancyGrid& map,
+  const kt_int32s& min_x, const kt_int32s& min_y,
+  const kt_int32s& max_x, const kt_int32s& max_y,
+  map_msgs::OccupancyGridUpdate& update)
+{
+  update.header = map.header;
+  update.x = min_x;
+  update.y = min_y;
+  update.width = max_x - min_x;
+  update.height = max_y - min_y;
+  update.data.resize(update.width * update.height);
+  for (kt_int32s y = min_y; y < max_y; y++)
   {
-    for (kt_int32s x = 0; x < width; x++) 
-    {
-      kt_int8u value = occ_grid->GetValue(karto::Vector2<kt_int32s>(x, y));
-      switch (value)
-      {
-        case karto::GridStates_Unknown:
-          map.data[MAP_IDX(map.info.width, x, y)] = -1;
-          break;
-        case karto::GridStates_Occupied:
-          map.data[MAP_IDX(map.info.width, x, y)] = 100;
-          break;
-        case karto::GridStates_Free:
-          map.data[MAP_IDX(map.info.width, x, y)] = 0;
-          break;
-        default:
-          ROS_WARN("Encountered unknown cell value at %d, %d", x, y);
-          break;
-      }
-    }
+    std::copy(map.data.begin() + MAP_IDX(map.info.width, min_x, y),
+      map.data.begin() + MAP_IDX(map.info.width, max_x, y),
+      update.data.begin() + (y - min_y) * update.width);
   }
   return;
 }
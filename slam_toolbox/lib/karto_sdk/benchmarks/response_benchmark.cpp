@@ -0,0 +1,145 @@
+/*
+ * Copyright 2010 SRI International
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/**
+ * Micro-benchmark of the scan matcher response kernel: compares ScanMatcher::SumResponses on
+ * compacted offsets against the per point, bounds checked loop it replaced, checking that both
+ * give bit-identical responses.
+ *
+ * usage: response_benchmark [number of points] [number of repetitions]
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+#include "karto_sdk/Mapper.h"
+
+using namespace karto;
+
+// the response loop as it was before SumResponses
+static kt_double ReferenceResponse(const std::vector<kt_int8u>& rGrid, kt_int32s gridPositionIndex,
+                                   const LookupArray& rOffsets)
+{
+  kt_double response = 0.0;
+  const kt_int8u* pByte = &rGrid[0] + gridPositionIndex;
+  kt_int32s* pAngleIndexPointer = rOffsets.GetArrayPointer();
+  kt_int32u nPoints = rOffsets.GetSize();
+  for (kt_int32u i = 0; i < nPoints; i++)
+  {
+    kt_int32s pointGridIndex = gridPositionIndex + pAngleIndexPointer[i];
+    if (!math::IsUpTo(pointGridIndex, static_cast<kt_int32s>(rGrid.size())) || pAngleIndexPointer[i] == INVALID_SCAN)
+    {
+      continue;
+    }
+
+    response += pByte[pAngleIndexPointer[i]];
+  }
+
+  return response / (nPoints * GridStates_Occupied);
+}
+
+int main(int argc, char** argv)
+{
+  kt_int32u nPoints = argc > 1 ? atoi(argv[1]) : 720;
+  kt_int32u nRepetitions = argc > 2 ? atoi(argv[2]) : 200;
+
+  // a 20m x 20m correlation grid at 5cm, of which the central 4m x 4m is searched
+  const kt_int32s width = 400;
+  const kt_int32s height = 400;
+  const kt_int32s searchSize = 80;
+  const kt_int32s pointRange = (width - searchSize) / 2 - 1;
+
+  std::mt19937 generator(42);
+  std::uniform_int_distribution<kt_int32s> cellValue(0, GridStates_Occupied);
+  std::uniform_int_distribution<kt_int32s> pointOffset(-pointRange, pointRange);
+  std::uniform_real_distribution<kt_double> unit(0.0, 1.0);
+
+  std::vector<kt_int8u> grid(width * height);
+  for (size_t i = 0; i < grid.size(); i++)
+  {
+    grid[i] = unit(generator) < 0.1 ? static_cast<kt_int8u>(cellValue(generator)) : 0;
+  }
+
+  // offsets of a scan with a few invalid readings
+  LookupArray offsets;
+  offsets.SetSize(nPoints);
+  for (kt_int32u i = 0; i < nPoints; i++)
+  {
+    offsets[i] = unit(generator) < 0.05 ? INVALID_SCAN : pointOffset(generator) * width + pointOffset(generator);
+  }
+  offsets.Compact();
+
+  // positions of one search row
+  std::vector<kt_int32s> positions;
+  kt_int32s rowStart = (height / 2) * width + (width - searchSize) / 2;
+  for (kt_int32s x = 0; x < searchSize; x++)
+  {
+    positions.push_back(rowStart + x);
+  }
+
+  std::vector<kt_double> referenceResponses(positions.size());
+  std::vector<kt_double> responses(positions.size());
+  std::vector<kt_int32u> sums(positions.size());
+
+  auto start = std::chrono::steady_clock::now();
+  for (kt_int32u r = 0; r < nRepetitions; r++)
+  {
+    for (size_t p = 0; p < positions.size(); p++)
+    {
+      referenceResponses[p] = ReferenceResponse(grid, positions[p], offsets);
+    }
+  }
+  auto middle = std::chrono::steady_clock::now();
+  for (kt_int32u r = 0; r < nRepetitions; r++)
+  {
+    ScanMatcher::SumResponses(&grid[0], &positions[0], static_cast<kt_int32u>(positions.size()),
+                              offsets.GetValidArrayPointer(), offsets.GetValidSize(), &sums[0]);
+    for (size_t p = 0; p < positions.size(); p++)
+    {
+      responses[p] = static_cast<kt_double>(sums[p]) / (nPoints * GridStates_Occupied);
+    }
+  }
+  auto end = std::chrono::steady_clock::now();
+
+  kt_int32u nMismatches = 0;
+  for (size_t p = 0; p < positions.size(); p++)
+  {
+    if (responses[p] != referenceResponses[p])
+    {
+      nMismatches++;
+    }
+  }
+
+  kt_double nResponses = static_cast<kt_double>(nRepetitions) * positions.size();
+  kt_double referenceTime = std::chrono::duration<kt_double>(middle - start).count();
+  kt_double kernelTime = std::chrono::duration<kt_double>(end - middle).count();
+
+#ifdef __AVX2__
+  const char* kernel = "avx2";
+#else
+  const char* kernel = "scalar";
+#endif
+  printf("points: %u, responses: %.0f, kernel: %s\n", nPoints, nResponses, kernel);
+  printf("reference: %.1f ns/response\n", 1e9 * referenceTime / nResponses);
+  printf("kernel:    %.1f ns/response (%.2fx)\n", 1e9 * kernelTime / nResponses, referenceTime / kernelTime);
+  printf("mismatches: %u\n", nMismatches);
+
+  return nMismatches == 0 ? 0 : 1;
+}
@@ -23,6 +23,7 @@
 #include <limits>
 #include <algorithm>
 #include <map>
+#include <set>
 #include <vector>
 #include <iostream>
 #include <iomanip>
@@ -30,6 +31,10 @@
 #include <stdexcept>
 #include <shared_mutex>
 #include <queue>
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_set>
 
 #include <math.h>
 #include <float.h>
@@ -4947,6 +4952,38 @@ namespace karto
      * @param f
      */
     void TraceLine(kt_int32s x0, kt_int32s y0, kt_int32s x1, kt_int32s y1, Functor* f = NULL)
+    {
+      T* pGridPointer = GetDataPointer();
+      if (f == NULL)
+      {
+        TraceClippedLine(x0, y0, x1, y1, [pGridPointer](kt_int32s index, kt_int32s, kt_int32s)
+        {
+          pGridPointer[index]++;
+        });
+      }
+      else
+      {
+        TraceClippedLine(x0, y0, x1, y1, [pGridPointer, f](kt_int32s index, kt_int32s, kt_int32s)
+        {
+          pGridPointer[index]++;
+          (*f)(index);
+        });
+      }
+    }
+
+    /**
+     * Calls cellFunctor(index, x, y) for the cells of the Bresenham line from (x0, y0) to
+     * (x1, y1) that lie in the grid, in the order TraceLine visits them. The line is clipped
+     * to the grid once up front, so cells are neither bounds checked nor indexed one by one.
+     * @param x0
+     * @param y0
+     * @param x1
+     * @param y1
+     * @param cellFunctor
+     */
+    template<class CellFunctor>
+    inline void TraceClippedLine(kt_int32s x0, kt_int32s y0, kt_int32s x1, kt_int32s y1,
+                                 CellFunctor cellFunctor) const
     {
       kt_bool steep = abs(y1 - y0) > abs(x1 - x0);
       if (steep)
@@ -4960,56 +4997,72 @@ namespace karto
         std::swap(y0, y1);
       }
 
-      kt_int32s deltaX = x1 - x0;
-      kt_int32s deltaY = abs(y1 - y0);
-      kt_int32s error = 0;
-      kt_int32s ystep;
-      kt_int32s y = y0;
+      kt_int64s deltaX = x1 - x0;
+      kt_int64s deltaY = abs(y1 - y0);
+      kt_int32s ystep = (y0 < y1) ? 1 : -1;
+      kt_int32s majorSize = steep ? m_Height : m_Width;
+      kt_int32s minorSize = steep ? m_Width : m_Height;
+
+      // the k-th cell is (x0 + k, y0 + ystep * n(k)) with n(k) = (2 k deltaY + deltaX) / (2 deltaX)
+      // minor steps, both monotonic, so the cells in the grid are a single run of k
+      kt_int64s kBegin = math::Maximum<kt_int64s>(0, -x0);
+      kt_int64s kEnd = math::Minimum<kt_int64s>(deltaX, majorSize - 1 - static_cast<kt_int64s>(x0));
+      if (deltaY > 0)
+      {
+        // minor steps to enter the grid and the last one staying inside of it
+        kt_int64s nEnter = ystep > 0 ? -y0 : y0 - (minorSize - 1);
+        kt_int64s nLeave = ystep > 0 ? minorSize - 1 - y0 : y0;
+        if (nLeave < 0)
+        {
+          return;
+        }
+
+        // n(k) >= nEnter <=> k >= (2 nEnter - 1) deltaX / (2 deltaY)
+        if (nEnter > 0)
+        {
+          kBegin = math::Maximum(kBegin, ((2 * nEnter - 1) * deltaX + 2 * deltaY - 1) / (2 * deltaY));
+        }
 
-      if (y0 < y1)
+        // n(k) <= nLeave <=> k < (2 nLeave + 1) deltaX / (2 deltaY)
+        kEnd = math::Minimum(kEnd, ((2 * nLeave + 1) * deltaX + 2 * deltaY - 1) / (2 * deltaY) - 1);
+      }
+      else if (!math::IsUpTo(y0, minorSize))
       {
-        ystep = 1;
+        return;
       }
-      else
+
+      if (kBegin > kEnd)
       {
-        ystep = -1;
+        return;
       }
 
-      kt_int32s pointX;
-      kt_int32s pointY;
-      for (kt_int32s x = x0; x <= x1; x++)
+      kt_int64s nSteps = deltaX > 0 ? (2 * kBegin * deltaY + deltaX) / (2 * deltaX) : 0;
+      kt_int32s x = x0 + static_cast<kt_int32s>(kBegin);
+      kt_int32s y = y0 + ystep * static_cast<kt_int32s>(nSteps);
+      kt_int64s error = kBegin * deltaY - nSteps * deltaX;
+
+      kt_int32s majorStride = steep ? m_WidthStep : 1;
+      kt_int32s minorStride = steep ? ystep : ystep * m_WidthStep;
+      kt_int32s index = steep ? y + x * m_WidthStep : x + y * m_WidthStep;
+      for (kt_int64s k = kBegin; k <= kEnd; k++, x++)
       {
         if (steep)
         {
-          pointX = y;
-          pointY = x;
+          cellFunctor(index, y, x);
         }
         else
         {
-          pointX = x;
-          pointY = y;
+          cellFunctor(index, x, y);
         }
 
         error += deltaY;
-
         if (2 * error >= deltaX)
         {
           y += ystep;
+          index += minorStride;
           error -= deltaX;
         }
-
-        Vector2<kt_int32s> gridIndex(pointX, pointY);
-        if (IsValidGridIndex(gridIndex))
-        {
-          kt_int32s index = GridIndex(gridIndex, false);
-          T* pGridPointer = GetDataPointer();
-          pGridPointer[index]++;
-
-          if (f != NULL)
-          {
-            (*f)(index);
-          }
-        }
+        index += majorStride;
       }
     }
 
@@ -5300,11 +5353,21 @@ namespace karto
     LaserRangeScan(const Name& rSensorName)
       : SensorData(rSensorName)
       , m_pRangeReadings(NULL)
+      , m_RangeReadingsStride(1)
+      , m_pCompactRangeReadings(NULL)
+      , m_CompactRangeStep(0.0)
       , m_NumberOfRangeReadings(0)
+      , m_ReadingsRevision(NextReadingsRevision())
     {
     }
 
     LaserRangeScan()
+      : m_pRangeReadings(NULL)
+      , m_RangeReadingsStride(1)
+      , m_pCompactRangeReadings(NULL)
+      , m_CompactRangeStep(0.0)
+      , m_NumberOfRangeReadings(0)
+      , m_ReadingsRevision(NextReadingsRevision())
     {
     }
 
@@ -5316,35 +5379,72 @@ namespace karto
     LaserRangeScan(const Name& rSensorName, const RangeReadingsVector& rRangeReadings)
       : SensorData(rSensorName)
       , m_pRangeReadings(NULL)
+      , m_RangeReadingsStride(1)
+      , m_pCompactRangeReadings(NULL)
+      , m_CompactRangeStep(0.0)
       , m_NumberOfRangeReadings(0)
+      , m_ReadingsRevision(NextReadingsRevision())
     {
       assert(rSensorName.ToString() != "");
 
       SetRangeReadings(rRangeReadings);
     }
 
+    /**
+     * Constructs a scan from the given sensor with readings borrowed from a buffer, see
+     * SetRangeReadings
+     * @param rSensorName
+     * @param pRangeReadings
+     * @param numberOfRangeReadings
+     * @param rOwner keeps the buffer alive
+     * @param reversed whether to read the buffer back to front
+     */
+    LaserRangeScan(const Name& rSensorName, const kt_float* pRangeReadings, kt_int32u numberOfRangeReadings,
+                   const std::shared_ptr<const void>& rOwner, kt_bool reversed = false)
+      : SensorData(rSensorName)
+      , m_pRangeReadings(NULL)
+      , m_RangeReadingsStride(1)
+      , m_pCompactRangeReadings(NULL)
+      , m_CompactRangeStep(0.0)
+      , m_NumberOfRangeReadings(0)
+      , m_ReadingsRevision(NextReadingsRevision())
+    {
+      assert(rSensorName.ToString() != "");
+
+      SetRangeReadings(pRangeReadings, numberOfRangeReadings, rOwner, reversed);
+    }
+
     /**
      * Destructor
      */
     virtual ~LaserRangeScan()
     {
-      delete [] m_pRangeReadings;
-      m_pRangeReadings = nullptr;
     }
 
   public:
     /**
-     * Gets the range readings of this scan
-     * @return range readings of this scan
+     * Gets a range reading of this scan
+     * @param index beam index, from the minimum angle of the sensor
+     * @return range reading
      */
-    inline kt_double* GetRangeReadings() const
+    inline kt_double GetRangeReading(kt_int32u index) const
     {
-      return m_pRangeReadings;
+      if (m_pCompactRangeReadings != NULL)
+      {
+        return DecodeRangeReading(m_pCompactRangeReadings[index]);
+      }
+
+      return m_pRangeReadings[static_cast<kt_int32s>(index) * m_RangeReadingsStride];
     }
 
     inline RangeReadingsVector GetRangeReadingsVector() const
     {
-      return RangeReadingsVector(m_pRangeReadings, m_pRangeReadings + m_NumberOfRangeReadings);
+      RangeReadingsVector readings(m_NumberOfRangeReadings);
+      for (kt_int32u i = 0; i < m_NumberOfRangeReadings; i++)
+      {
+        readings[i] = GetRangeReading(i);
+      }
+      return readings;
     }
 
     /**
@@ -5362,32 +5462,123 @@ namespace karto
       //   throw Exception(error.str());
       // }
 
-      if (!rRangeReadings.empty())
+      // copy readings, ranges of a laser fit in single precision
+      std::shared_ptr<std::vector<kt_float> > pReadings =
+        std::make_shared<std::vector<kt_float> >(rRangeReadings.begin(), rRangeReadings.end());
+      SetRangeReadings(pReadings->data(), static_cast<kt_int32u>(pReadings->size()), pReadings);
+    }
+
+    /**
+     * Sets the range readings for this scan without copying them: the scan reads them from the given
+     * buffer, e.g. the ranges of the message they arrived in, and keeps its owner alive
+     * @param pRangeReadings
+     * @param numberOfRangeReadings
+     * @param rOwner keeps the buffer alive
+     * @param reversed whether to read the buffer back to front, for a sensor mounted upside down
+     */
+    inline void SetRangeReadings(const kt_float* pRangeReadings, kt_int32u numberOfRangeReadings,
+                                 const std::shared_ptr<const void>& rOwner, kt_bool reversed = false)
+    {
+      if (numberOfRangeReadings != 0)
       {
-        if (rRangeReadings.size() != m_NumberOfRangeReadings)
-        {
-          // delete old readings
-          delete [] m_pRangeReadings;
+        m_pRangeReadings = reversed ? pRangeReadings + numberOfRangeReadings - 1 : pRangeReadings;
+        m_RangeReadingsStride = reversed ? -1 : 1;
+        m_pRangeReadingsOwner = rOwner;
+      }
+      else
+      {
+        m_pRangeReadings = NULL;
+        m_RangeReadingsStride = 1;
+        m_pRangeReadingsOwner.reset();
+      }
+      m_pCompactRangeReadings = NULL;
+      m_NumberOfRangeReadings = numberOfRangeReadings;
 
-          // store size of array!
-          m_NumberOfRangeReadings = static_cast<kt_int32u>(rRangeReadings.size());
+      MarkReadingsChanged();
+    }
 
-          // allocate range readings
-          m_pRangeReadings = new kt_double[m_NumberOfRangeReadings];
-        }
+    /**
+     * Reads the range readings of the given scan, without copying them
+     * @param rScan
+     */
+    inline void ShareRangeReadings(const LaserRangeScan& rScan)
+    {
+      m_pRangeReadings = rScan.m_pRangeReadings;
+      m_RangeReadingsStride = rScan.m_RangeReadingsStride;
+      m_pRangeReadingsOwner = rScan.m_pRangeReadingsOwner;
+      m_pCompactRangeReadings = rScan.m_pCompactRangeReadings;
+      m_CompactRangeStep = rScan.m_CompactRangeStep;
+      m_NumberOfRangeReadings = rScan.m_NumberOfRangeReadings;
 
-        // copy readings
-        kt_int32u index = 0;
-        const_forEach(RangeReadingsVector, &rRangeReadings)
-        {
-          m_pRangeReadings[index++] = *iter;
-        }
+      MarkReadingsChanged();
+    }
+
+    /**
+     * Stores the range readings quantized to 16 bits between zero and the given maximum range, half
+     * the size of single precision, and lets go of the buffer they were read from. A reading moves by
+     * at most half a step of maximumRange / 65531; NaN, infinite and beyond maximum range readings
+     * stay so and negative ones become zero.
+     * @param maximumRange maximum range of the sensor
+     */
+    inline void CompactRangeReadings(kt_double maximumRange)
+    {
+      if (m_pCompactRangeReadings != NULL || m_NumberOfRangeReadings == 0)
+      {
+        return;
       }
-      else
+
+      kt_double step = maximumRange / CompactRangeMaximum;
+      std::shared_ptr<std::vector<kt_int16u> > pReadings =
+        std::make_shared<std::vector<kt_int16u> >(m_NumberOfRangeReadings);
+      for (kt_int32u i = 0; i < m_NumberOfRangeReadings; i++)
       {
-        delete [] m_pRangeReadings;
-        m_pRangeReadings = NULL;
+        kt_double rangeReading = GetRangeReading(i);
+        kt_int16u code;
+        if (std::isnan(rangeReading))
+        {
+          code = CompactRangeNaN;
+        }
+        else if (std::isinf(rangeReading))
+        {
+          code = rangeReading > 0.0 ? CompactRangeInfinity : CompactRangeNegativeInfinity;
+        }
+        else if (rangeReading > maximumRange)
+        {
+          code = CompactRangeBeyondMaximum;
+        }
+        else
+        {
+          code = static_cast<kt_int16u>(math::Round(math::Maximum(rangeReading, 0.0) / step));
+        }
+        (*pReadings)[i] = code;
       }
+
+      m_pRangeReadings = NULL;
+      m_RangeReadingsStride = 1;
+      m_pRangeReadingsOwner = pReadings;
+      m_pCompactRangeReadings = pReadings->data();
+      m_CompactRangeStep = step;
+
+      MarkReadingsChanged();
+    }
+
+    /**
+     * Whether the range readings are stored quantized, see CompactRangeReadings
+     * @return true if the range readings are compact
+     */
+    inline kt_bool IsCompact() const
+    {
+      return m_pCompactRangeReadings != NULL;
+    }
+
+    /**
+     * Gets the revision of the readings of this scan. It changes, to a value never used by any
+     * scan before, whenever the range readings or the point readings computed from them change.
+     * @return readings revision
+     */
+    inline kt_int64u GetReadingsRevision() const
+    {
+      return m_ReadingsRevision;
     }
 
     /**
@@ -5408,13 +5599,63 @@ namespace karto
       return m_NumberOfRangeReadings;
     }
 
+  protected:
+    /**
+     * Gives the readings a new revision, see GetReadingsRevision
+     */
+    inline void MarkReadingsChanged()
+    {
+      m_ReadingsRevision = NextReadingsRevision();
+    }
+
   private:
+    // codes of compact range readings: steps of m_CompactRangeStep from zero up to the maximum range,
+    // one more step for readings beyond it, then non finite readings
+    enum
+    {
+      CompactRangeMaximum = 0xFFFB,
+      CompactRangeBeyondMaximum = 0xFFFC,
+      CompactRangeNegativeInfinity = 0xFFFD,
+      CompactRangeInfinity = 0xFFFE,
+      CompactRangeNaN = 0xFFFF
+    };
+
+    inline kt_double DecodeRangeReading(kt_int16u code) const
+    {
+      if (code <= CompactRangeBeyondMaximum)
+      {
+        return code * m_CompactRangeStep;
+      }
+      else if (code == CompactRangeNaN)
+      {
+        return std::numeric_limits<kt_double>::quiet_NaN();
+      }
+
+      return code == CompactRangeInfinity ? std::numeric_limits<kt_double>::infinity() :
+                                            -std::numeric_limits<kt_double>::infinity();
+    }
+
+    static kt_int64u NextReadingsRevision()
+    {
+      static std::atomic<kt_int64u> revision(0);
+      return ++revision;
+    }
+
     LaserRangeScan(const LaserRangeScan&);
     const LaserRangeScan& operator=(const LaserRangeScan&);
 
   private:
-    kt_double* m_pRangeReadings;
+    // reading i is m_pRangeReadings[i * m_RangeReadingsStride], in a buffer kept alive by
+    // m_pRangeReadingsOwner that may be shared with other scans or the message the readings came in.
+    // Compact readings are m_pCompactRangeReadings[i] instead, in a buffer of the same owner
+    const kt_float* m_pRangeReadings;
+    kt_int32s m_RangeReadingsStride;
+    const kt_int16u* m_pCompactRangeReadings;
+    kt_double m_CompactRangeStep;
+    std::shared_ptr<const void> m_pRangeReadingsOwner;
     kt_int32u m_NumberOfRangeReadings;
+    // not serialized, revisions are only meaningful within a process
+    kt_int64u m_ReadingsRevision;
 
   friend class boost::serialization::access;
   template<class Archive>
@@ -5423,11 +5664,21 @@ namespace karto
     ar & BOOST_SERIALIZATION_NVP(m_NumberOfRangeReadings);
     ar & BOOST_SERIALIZATION_BASE_OBJECT_NVP(SensorData);
 
+   // archived as doubles, as before the readings were stored in single precision
+   RangeReadingsVector readings;
+   if (Archive::is_loading::value)
+   {
+     readings.resize(m_NumberOfRangeReadings);
+   }
+   else
+   {
+     readings = GetRangeReadingsVector();
+   }
+   ar & boost::serialization::make_array<kt_double>(readings.data(), m_NumberOfRangeReadings);
    if (Archive::is_loading::value)
    {
-     m_pRangeReadings = new kt_double[m_NumberOfRangeReadings];
+     SetRangeReadings(readings);
    }
-   ar & boost::serialization::make_array<kt_double>(m_pRangeReadings, m_NumberOfRangeReadings);
   }
   };  // LaserRangeScan
 
@@ -5496,6 +5747,95 @@ namespace karto
   ////////////////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////////////////
 
+  /**
+   * Bounds how many scans keep their point readings. The scans given a cache report which of its
+   * epochs they last used their points in, and Trim releases the points of the scans used longest ago
+   * beyond the capacity, to be recomputed from their range readings when next needed.
+   */
+  class KARTO_EXPORT PointReadingsCache
+  {
+  public:
+    /**
+     * Constructs a cache
+     * @param capacity number of scans that keep their point readings after a trim
+     */
+    PointReadingsCache(kt_int32u capacity)
+      : m_Capacity(capacity)
+      , m_Epoch(1)
+    {
+    }
+
+  public:
+    /**
+     * Gets the number of scans that keep their point readings after a trim
+     * @return capacity
+     */
+    inline kt_int32u GetCapacity() const
+    {
+      return m_Capacity;
+    }
+
+    /**
+     * Gets the number of scans currently holding point readings
+     * @return number of scans
+     */
+    inline kt_int32u GetSize()
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      return static_cast<kt_int32u>(m_Scans.size());
+    }
+
+    /**
+     * Gets the current epoch, which every trim advances
+     * @return epoch
+     */
+    inline kt_int64u GetEpoch() const
+    {
+      return m_Epoch.load(std::memory_order_relaxed);
+    }
+
+    /**
+     * Adds a scan that computed its point readings
+     * @param pScan
+     */
+    inline void Add(LocalizedRangeScan* pScan)
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Scans.insert(pScan);
+    }
+
+    /**
+     * Removes a scan, e.g. when it is deleted
+     * @param pScan
+     */
+    inline void Remove(LocalizedRangeScan* pScan)
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Scans.erase(pScan);
+    }
+
+    /**
+     * Releases the point readings of the scans used longest ago until at most capacity scans hold
+     * them, and starts a new epoch. Must not overlap any use of the point readings of the scans of
+     * the cache, which are handed out by reference.
+     */
+    void Trim();
+
+  private:
+    PointReadingsCache(const PointReadingsCache&);
+    const PointReadingsCache& operator=(const PointReadingsCache&);
+
+  private:
+    kt_int32u m_Capacity;
+    std::atomic<kt_int64u> m_Epoch;
+    std::mutex m_Mutex;
+    std::unordered_set<LocalizedRangeScan*> m_Scans;
+  };  // PointReadingsCache
+
+  ////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////
+
   /**
    * The LocalizedRangeScan contains range data from a single sweep of a laser range finder sensor
    * in a two-dimensional space and position information. The odometer position is the position
@@ -5516,10 +5856,28 @@ namespace karto
     LocalizedRangeScan(const Name& rSensorName, const RangeReadingsVector& rReadings)
       : LaserRangeScan(rSensorName, rReadings)
       , m_IsDirty(true)
+      , m_HasPointReadings(false)
+      , m_PointReadingsUse(0)
+    {
+    }
+
+    /**
+     * Constructs a range scan from the given range finder with readings borrowed from a buffer, see
+     * LaserRangeScan::SetRangeReadings
+     */
+    LocalizedRangeScan(const Name& rSensorName, const kt_float* pRangeReadings,
+                       kt_int32u numberOfRangeReadings, const std::shared_ptr<const void>& rOwner,
+                       kt_bool reversed = false)
+      : LaserRangeScan(rSensorName, pRangeReadings, numberOfRangeReadings, rOwner, reversed)
+      , m_IsDirty(true)
+      , m_HasPointReadings(false)
+      , m_PointReadingsUse(0)
     {
     }
 
 	  LocalizedRangeScan()
+      : m_HasPointReadings(false)
+      , m_PointReadingsUse(0)
 	  {}
 
     /**
@@ -5527,6 +5885,10 @@ namespace karto
      */
     virtual ~LocalizedRangeScan()
     {
+      if (m_pPointReadingsCache)
+      {
+        m_pPointReadingsCache->Remove(this);
+      }
     }
 
   private:
@@ -5648,6 +6010,7 @@ namespace karto
     void SetSensorPose(const Pose2& rScanPose)
     {
       m_CorrectedPose = GetCorrectedAt(rScanPose);
+      m_IsDirty = true;
 
       Update();
     }
@@ -5710,7 +6073,7 @@ namespace karto
     inline const PointVectorDouble& GetPointReadings(kt_bool wantFiltered = false) const
     {
       std::shared_lock<std::shared_mutex> lock(m_Lock);
-      if (m_IsDirty)
+      if (m_IsDirty || !m_HasPointReadings)
       {
         // throw away constness and do an update!
         lock.unlock();
@@ -5718,6 +6081,11 @@ namespace karto
         const_cast<LocalizedRangeScan*>(this)->Update();
       }
 
+      if (m_pPointReadingsCache)
+      {
+        m_PointReadingsUse.store(m_pPointReadingsCache->GetEpoch(), std::memory_order_relaxed);
+      }
+
       if (wantFiltered == true)
       {
         return m_PointReadings;
@@ -5740,6 +6108,79 @@ namespace karto
       }
     }
 
+    /**
+     * Lets the given cache release the point readings of this scan, see PointReadingsCache
+     * @param rCache
+     */
+    void SetPointReadingsCache(const std::shared_ptr<PointReadingsCache>& rCache)
+    {
+      std::unique_lock<std::shared_mutex> lock(m_Lock);
+      if (m_pPointReadingsCache)
+      {
+        m_pPointReadingsCache->Remove(this);
+      }
+
+      m_pPointReadingsCache = rCache;
+      if (m_pPointReadingsCache && m_HasPointReadings)
+      {
+        m_pPointReadingsCache->Add(this);
+      }
+    }
+
+    /**
+     * Switches the scan to compact storage: range readings quantized to 16 bits, see
+     * LaserRangeScan::CompactRangeReadings, and point readings kept only while the given cache
+     * holds them. Everything computed from the readings is recomputed from the quantized ones.
+     * @param rCache
+     */
+    void UseCompactStorage(const std::shared_ptr<PointReadingsCache>& rCache)
+    {
+      LaserRangeFinder* pLaserRangeFinder = GetLaserRangeFinder();
+      if (pLaserRangeFinder != NULL)
+      {
+        std::unique_lock<std::shared_mutex> lock(m_Lock);
+        CompactRangeReadings(pLaserRangeFinder->GetMaximumRange());
+        ReleasePointReadings();
+        m_IsDirty = true;
+      }
+
+      SetPointReadingsCache(rCache);
+    }
+
+  private:
+    /**
+     * Frees the point readings, kept in the cache's epoch they were last used in
+     */
+    inline void ReleasePointReadings()
+    {
+      PointVectorDouble().swap(m_PointReadings);
+      PointVectorDouble().swap(m_UnfilteredPointReadings);
+      m_HasPointReadings = false;
+    }
+
+  protected:
+    /**
+     * Marks the point readings, barycenter and bounding box computed by Update() as current. Their
+     * revision only changes if the pose moved, not if released points were computed again.
+     */
+    inline void FinishUpdate()
+    {
+      if (m_IsDirty)
+      {
+        MarkReadingsChanged();
+      }
+      m_IsDirty = false;
+
+      if (!m_HasPointReadings)
+      {
+        m_HasPointReadings = true;
+        if (m_pPointReadingsCache)
+        {
+          m_pPointReadingsCache->Add(this);
+        }
+      }
+    }
+
   private:
     /**
      * Compute point readings based on range readings
@@ -5764,7 +6205,7 @@ namespace karto
         kt_int32u beamNum = 0;
         for (kt_int32u i = 0; i < pLaserRangeFinder->GetNumberOfRangeReadings(); i++, beamNum++)
         {
-          kt_double rangeReading = GetRangeReadings()[i];
+          kt_double rangeReading = GetRangeReading(i);
           if (!math::InRange(rangeReading, pLaserRangeFinder->GetMinimumRange(), rangeThreshold))
           {
             kt_double angle = scanPose.GetHeading() + minimumAngle + beamNum * angularResolution;
@@ -5810,7 +6251,7 @@ namespace karto
         }
       }
 
-      m_IsDirty = false;
+      FinishUpdate();
     }
 
     /**
@@ -5826,7 +6267,14 @@ namespace karto
       ar & BOOST_SERIALIZATION_NVP(m_PointReadings);
       ar & BOOST_SERIALIZATION_NVP(m_UnfilteredPointReadings);
       ar & BOOST_SERIALIZATION_NVP(m_BoundingBox);
-      ar & BOOST_SERIALIZATION_NVP(m_IsDirty);
+      // released point readings are archived as to be recomputed
+      kt_bool isDirty = m_IsDirty || !m_HasPointReadings;
+      ar & boost::serialization::make_nvp("m_IsDirty", isDirty);
+      if (Archive::is_loading::value)
+      {
+        m_IsDirty = isDirty;
+        m_HasPointReadings = !isDirty;
+      }
       ar & BOOST_SERIALIZATION_BASE_OBJECT_NVP(LaserRangeScan);
     }
 
@@ -5871,6 +6319,20 @@ namespace karto
      * Internal flag used to update point readings, barycenter and bounding box
      */
     kt_bool m_IsDirty;
+
+  private:
+    friend class PointReadingsCache;
+
+    /**
+     * Whether the point readings are computed, false once released to the cache
+     */
+    kt_bool m_HasPointReadings;
+
+    /**
+     * Cache that may release the point readings, and the cache epoch they were last used in
+     */
+    std::shared_ptr<PointReadingsCache> m_pPointReadingsCache;
+    mutable std::atomic<kt_int64u> m_PointReadingsUse;
   };  // LocalizedRangeScan
 
   /**
@@ -5967,7 +6429,7 @@ namespace karto
         m_BoundingBox.Add(*iter);
       }
 
-      m_IsDirty = false;
+      FinishUpdate();
     }
 
   private:
@@ -6230,30 +6692,19 @@ namespace karto
     }
 
     /**
-     * Create grid using scans
+     * Create grid using scans. Large sets of scans are raytraced in parallel, each worker
+     * thread into counters of its own that are summed up afterwards. The counters are
+     * integer sums, so the grid is identical to adding the scans one by one.
      * @param rScans
      */
-    virtual void CreateFromScans(const LocalizedRangeScanVector& rScans)
-    {
-      m_pCellPassCnt->Resize(GetWidth(), GetHeight());
-      m_pCellPassCnt->GetCoordinateConverter()->SetOffset(GetCoordinateConverter()->GetOffset());
-
-      m_pCellHitsCnt->Resize(GetWidth(), GetHeight());
-      m_pCellHitsCnt->GetCoordinateConverter()->SetOffset(GetCoordinateConverter()->GetOffset());
+    virtual void CreateFromScans(const LocalizedRangeScanVector& rScans);
 
-      const_forEach(LocalizedRangeScanVector, &rScans)
-      {
-        if (*iter == nullptr)
-        {
-          continue;
-        }
-
-        LocalizedRangeScan* pScan = *iter;
-        AddScan(pScan);
-      }
-
-      Update();
-    }
+    /**
+     * Gets how many threads may raytrace into counters of their own of this grid's size at once,
+     * so that the counters of all of them stay within a fixed memory budget
+     * @return number of threads, 1 if no second set of counters fits
+     */
+    kt_int32s GetMaximumRaytraceConcurrency() const;
 
     /**
      * @brief Get the regions of invalid readings
@@ -6265,7 +6716,6 @@ namespace karto
     {
       std::queue<std::pair<int,int>> invalid_regions;
       // Extract range readings and length
-      kt_double* rangeReadings = pScan->GetRangeReadings();
       kt_int32u numReadings = pScan->GetNumberOfRangeReadings();
       bool was_valid = true;
       bool in_region = false;
@@ -6273,7 +6723,7 @@ namespace karto
       for (kt_int32u i = 0; i < numReadings; i++)
       {
         // Get current range reading
-        kt_double rangeReading = rangeReadings[i];
+        kt_double rangeReading = pScan->GetRangeReading(i);
         // See if range reading is valid
         bool is_valid = math::InRange(rangeReading, pScan->GetLaserRangeFinder()->GetMinimumRange(), pScan->GetLaserRangeFinder()->GetMaximumRange());
         // Compare is_valid vs was_valid
@@ -6340,35 +6790,36 @@ namespace karto
     }
 
     /**
-     * @brief Determines if point is trustworthy
+     * @brief Determines which readings are trustworthy, readings below the minimum range
+     * only are within a trust region
      * 
-     * @param trust_regions regions of trust
-     * @param minRange minimum range of laser scanner
-     * @param range range measurement of current point
-     * @param index index of current point
-     * @return true if point should be used for raytracing
-     * @return false if point should not be used for raytracing
+     * @param pScan localized range scan which contains scan of interest
+     * @param trust_mask set for every reading that should be used for raytracing
      */
-    bool isTrustworthy(std::queue<std::pair<int,int>> trust_regions, kt_double minRange, kt_double range, int index)
+    void getTrustMask(LocalizedRangeScan* pScan, std::vector<kt_bool>& trust_mask)
     {
-      // Only worry about readings below minimum
-      if(range > minRange)
-        return true;
-      // If below min, see if in trust region
+      kt_int32u numReadings = pScan->GetNumberOfRangeReadings();
+      kt_double minRange = pScan->GetLaserRangeFinder()->GetMinimumRange();
+      trust_mask.assign(numReadings, false);
+      std::queue<std::pair<int,int>> trust_regions = getTrustRegions(getInvalidRegions(pScan), 20);
       while(!trust_regions.empty())
       {
-        std::pair<int,int> cur_region = trust_regions.front();
+        for (int i = trust_regions.front().first; i <= trust_regions.front().second; i++)
+        {
+          trust_mask[i] = true;
+        }
         trust_regions.pop();
-        if(index >= cur_region.first && index <= cur_region.second)
+      }
+      for (kt_int32u i = 0; i < numReadings; i++)
+      {
+        // Only worry about readings below minimum
+        if (pScan->GetRangeReading(i) > minRange)
         {
-          // Point resides in trust region
-          return true;
+          trust_mask[i] = true;
         }
       }
-      // Point was not in trust region
-      return false;
-      
     }
+
     /**
      * Adds the scan's information to this grid's counters (optionally
      * update the grid's cells' occupancy status)
@@ -6389,21 +6840,21 @@ namespace karto
 
       kt_bool isAllInMap = true;
 
-      // Get trust regions
-      std::queue<std::pair<int,int>> inval_regions = getInvalidRegions(pScan);
-      std::queue<std::pair<int,int>> trust_regions = getTrustRegions(inval_regions, 20);
+      // Get trusted readings
+      std::vector<kt_bool> trust_mask;
+      getTrustMask(pScan, trust_mask);
       // draw lines from scan position to all point readings
       int pointIndex = 0;
       const_forEachAs(PointVectorDouble, &rPointReadings, pointsIter)
       {
         Vector2<kt_double> point = *pointsIter;
-        kt_double rangeReading = pScan->GetRangeReadings()[pointIndex];
+        kt_double rangeReading = pScan->GetRangeReading(pointIndex);
 
         // lidar was giving range reading as 0 instead of infinity for points out of range
         // thus condition of end point validity needed to be changed from having only a upper bound to being in a range
         kt_bool isEndPointValid = math::InRange(rangeReading, minRange, rangeThreshold - KT_TOLERANCE);
 
-        if (!isTrustworthy(trust_regions, minRange, rangeReading, pointIndex))
+        if (!trust_mask[pointIndex])
         {
           // Measurement is not trustworthy, most likely shallow incident angle
           // and there is an obstacle that wasn't detected
@@ -6460,8 +6911,19 @@ namespace karto
       Vector2<kt_int32s> gridFrom = m_pCellPassCnt->WorldToGrid(rWorldFrom);
       Vector2<kt_int32s> gridTo = m_pCellPassCnt->WorldToGrid(rWorldTo);
 
-      CellUpdater* pCellUpdater = doUpdate ? m_pCellUpdater : NULL;
-      m_pCellPassCnt->TraceLine(gridFrom.GetX(), gridFrom.GetY(), gridTo.GetX(), gridTo.GetY(), pCellUpdater);
+      if (doUpdate)
+      {
+        m_pCellPassCnt->TraceLine(gridFrom.GetX(), gridFrom.GetY(), gridTo.GetX(), gridTo.GetY(), m_pCellUpdater);
+      }
+      else
+      {
+        kt_int32u* pCellPassCntPtr = m_pCellPassCnt->GetDataPointer();
+        m_pCellPassCnt->TraceClippedLine(gridFrom.GetX(), gridFrom.GetY(), gridTo.GetX(), gridTo.GetY(),
+                                         [pCellPassCntPtr](kt_int32s index, kt_int32s, kt_int32s)
+        {
+          pCellPassCntPtr[index]++;
+        });
+      }
 
       // for the end point
       if (isEndPointValid)
@@ -6585,6 +7047,665 @@ namespace karto
   ////////////////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////////////////
 
+  /**
+   * Occupancy grid that is kept up to date incrementally from a growing set of scans.
+   * Each scan is raytraced into the pass and hit counters once; the grid grows in place
+   * when a scan falls outside of it, and scans whose corrected pose moved their beams by more
+   * than the pose change threshold since they were raytraced are subtracted at their old pose
+   * and added again at their new one.
+   * Cells are indexed relative to a fixed anchor so that growing the grid never changes
+   * which cells a beam touches, keeping additions and subtractions exactly symmetric.
+   * The grid is split into square tiles, marked dirty by the raytracer, that each carry the
+   * generation their occupancy last changed in, so that only changed tiles need publishing.
+   */
+  class IncrementalOccupancyGrid : public OccupancyGrid
+  {
+  public:
+    /**
+     * Constructs an empty incremental occupancy grid
+     * @param resolution
+     * @param tileSizeShift tiles are 2^tileSizeShift cells wide, 128 by default
+     */
+    IncrementalOccupancyGrid(kt_double resolution, kt_int32u tileSizeShift = 7)
+      : OccupancyGrid(0, 0, Vector2<kt_double>(0.0, 0.0), resolution)
+      , m_Resolution(resolution)
+      , m_IsAnchored(false)
+      , m_PoseChangeThreshold(0.0)
+      , m_TileSizeShift(tileSizeShift)
+      , m_NumberOfTilesX(0)
+      , m_Generation(NextGeneration())
+      , m_BoundsGeneration(m_Generation)
+    {
+    }
+
+    /**
+     * Destructor
+     */
+    virtual ~IncrementalOccupancyGrid()
+    {
+    }
+
+  public:
+    /**
+     * Gets the resolution of the grid
+     * @return resolution
+     */
+    inline kt_double GetResolution() const
+    {
+      return m_Resolution;
+    }
+
+    /**
+     * Gets the width and height of the tiles
+     * @return tile size in cells
+     */
+    inline kt_int32s GetTileSize() const
+    {
+      return 1 << m_TileSizeShift;
+    }
+
+    /**
+     * Gets the number of tiles along x, the last ones may be cut off by the grid
+     * @return number of tiles
+     */
+    inline kt_int32s GetNumberOfTilesX() const
+    {
+      return m_NumberOfTilesX;
+    }
+
+    /**
+     * Gets the number of tiles along y, the last ones may be cut off by the grid
+     * @return number of tiles
+     */
+    inline kt_int32s GetNumberOfTilesY() const
+    {
+      return m_NumberOfTilesX > 0 ? static_cast<kt_int32s>(m_TileGenerations.size()) / m_NumberOfTilesX : 0;
+    }
+
+    /**
+     * Gets the generation of the grid the occupancy of a cell of the given tile last changed in
+     * @param tileX
+     * @param tileY
+     * @return tile generation
+     */
+    inline kt_int64u GetTileGeneration(kt_int32s tileX, kt_int32s tileY) const
+    {
+      return m_TileGenerations[tileY * m_NumberOfTilesX + tileX];
+    }
+
+    /**
+     * Gets the generation of the grid, which advances whenever an occupancy changes. Generations
+     * are unique across grids, a newer grid only has newer generations.
+     * @return generation
+     */
+    inline kt_int64u GetGeneration() const
+    {
+      return m_Generation;
+    }
+
+    /**
+     * Gets the generation the grid last moved or changed size in, which changes every tile
+     * @return bounds generation
+     */
+    inline kt_int64u GetBoundsGeneration() const
+    {
+      return m_BoundsGeneration;
+    }
+
+    /**
+     * Sets how far, as a fraction of a cell, the beams of a raytraced scan must move before the
+     * scan is raytraced again at its new pose. Beams move by the translation of the laser plus
+     * its rotation times the range threshold. Scans that stay within it remain at the pose they
+     * were raytraced at, so the grid never drifts further than this from the corrected poses.
+     * 0 raytraces any scan whose pose changed again.
+     * @param cellFraction
+     */
+    void SetPoseChangeThreshold(kt_double cellFraction)
+    {
+      m_PoseChangeThreshold = cellFraction;
+    }
+
+    /**
+     * Gets how far the beams of a scan must move before it is raytraced again
+     * @return fraction of a cell
+     */
+    inline kt_double GetPoseChangeThreshold() const
+    {
+      return m_PoseChangeThreshold;
+    }
+
+    /**
+     * Brings the grid in line with the given scans: new scans are raytraced, scans whose
+     * corrected pose changed beyond the pose change threshold are moved and the occupancy
+     * of all touched cells is updated.
+     * The grid is rebuilt from scratch if any previously added scan is no longer present.
+     * @param rScans all scans that should be in the grid
+     * @return true if the grid changed
+     */
+    kt_bool Synchronize(const LocalizedRangeScanVector& rScans)
+    {
+      std::vector<Pose2> poses;
+      poses.reserve(rScans.size());
+      const_forEach(LocalizedRangeScanVector, &rScans)
+      {
+        poses.push_back(*iter != nullptr ? (*iter)->GetCorrectedPose() : Pose2());
+      }
+
+      return Synchronize(rScans, poses);
+    }
+
+    /**
+     * Brings the grid in line with the given scans raytraced at the given robot poses
+     * instead of their corrected poses, for scans that must not be modified
+     * @param rScans all scans that should be in the grid
+     * @param rPoses robot pose of each scan
+     * @return true if the grid changed
+     */
+    kt_bool Synchronize(const LocalizedRangeScanVector& rScans, const std::vector<Pose2>& rPoses)
+    {
+      assert(rScans.size() == rPoses.size());
+      kt_bool needsRebuild = false;
+      kt_int32u nPresent = 0;
+
+      const_forEach(LocalizedRangeScanVector, &rScans)
+      {
+        LocalizedRangeScan* pScan = *iter;
+        if (pScan == nullptr)
+        {
+          continue;
+        }
+
+        std::map<kt_int32s, RasterizedScan>::const_iterator rasterized =
+          m_RasterizedScans.find(pScan->GetUniqueId());
+        if (rasterized == m_RasterizedScans.end())
+        {
+          continue;
+        }
+
+        if (rasterized->second.pScan != pScan)
+        {
+          needsRebuild = true;
+          break;
+        }
+        nPresent++;
+      }
+
+      if (needsRebuild || nPresent != m_RasterizedScans.size())
+      {
+        Reset();
+      }
+
+      std::vector<Rasterization> rasterizations;
+      for (size_t i = 0; i < rScans.size(); i++)
+      {
+        LocalizedRangeScan* pScan = rScans[i];
+        if (pScan == nullptr)
+        {
+          continue;
+        }
+
+        const Pose2& rPose = rPoses[i];
+        std::map<kt_int32s, RasterizedScan>::iterator rasterized =
+          m_RasterizedScans.find(pScan->GetUniqueId());
+        if (rasterized == m_RasterizedScans.end())
+        {
+          rasterizations.push_back(Rasterization(pScan, rPose, 1));
+          m_RasterizedScans[pScan->GetUniqueId()] = RasterizedScan(pScan, rPose);
+        }
+        else if (rasterized->second.pose != rPose &&
+          IsBeyondPoseChangeThreshold(pScan, rasterized->second.pose, rPose))
+        {
+          rasterizations.push_back(Rasterization(pScan, rasterized->second.pose, -1));
+          rasterizations.push_back(Rasterization(pScan, rPose, 1));
+          rasterized->second.pose = rPose;
+        }
+      }
+
+      RasterizeScans(rasterizations);
+      UpdateDirtyTiles();
+      return !rasterizations.empty();
+    }
+
+    /**
+     * Removes all scans from the grid and releases its cells
+     */
+    void Reset()
+    {
+      m_RasterizedScans.clear();
+      m_IsAnchored = false;
+      m_Origin = Vector2<kt_int32s>(0, 0);
+      Resize(0, 0);
+      ResizeTiles();
+    }
+
+    /**
+     * Gets the number of scans currently raytraced into the grid
+     * @return number of scans
+     */
+    inline kt_int32u GetNumberOfScans() const
+    {
+      return static_cast<kt_int32u>(m_RasterizedScans.size());
+    }
+
+  private:
+    /**
+     * Scan to add to or subtract from the counters as seen from the given robot pose
+     */
+    struct Rasterization
+    {
+      Rasterization(LocalizedRangeScan* pRasterizedScan, const Pose2& rPose, kt_int32s rasterizedDelta)
+        : pScan(pRasterizedScan)
+        , pose(rPose)
+        , delta(rasterizedDelta)
+      {
+      }
+
+      LocalizedRangeScan* pScan;
+      Pose2 pose;
+      kt_int32s delta;
+    };
+
+    /**
+     * Anchor cells of the beams of a scan, and the bounds of all of them
+     */
+    struct ScanBeams
+    {
+      Vector2<kt_int32s> fromCell;
+      std::vector<Vector2<kt_int32s> > toCells;
+      std::vector<kt_bool> endPointValid;
+      std::vector<kt_bool> trustMask;
+      Vector2<kt_int32s> minCell;
+      Vector2<kt_int32s> maxCell;
+    };
+
+    /**
+     * Checks whether moving the scan from one robot pose to another moves any of its beam end
+     * points by more than the pose change threshold
+     * @param pScan
+     * @param rFromPose robot pose the scan was raytraced at
+     * @param rToPose
+     * @return true if the scan needs raytracing again
+     */
+    kt_bool IsBeyondPoseChangeThreshold(LocalizedRangeScan* pScan, const Pose2& rFromPose,
+                                        const Pose2& rToPose) const
+    {
+      if (m_PoseChangeThreshold <= 0.0)
+      {
+        return true;
+      }
+
+      Pose2 fromSensorPose = pScan->GetSensorAt(rFromPose);
+      Pose2 toSensorPose = pScan->GetSensorAt(rToPose);
+      kt_double rotation = fabs(math::NormalizeAngle(toSensorPose.GetHeading() - fromSensorPose.GetHeading()));
+      kt_double leverArm = pScan->GetLaserRangeFinder()->GetRangeThreshold();
+      kt_double beamChange = fromSensorPose.GetPosition().Distance(toSensorPose.GetPosition()) +
+        rotation * leverArm;
+
+      return beamChange > m_PoseChangeThreshold * m_Resolution;
+    }
+
+    /**
+     * Adds (delta = 1) or subtracts (delta = -1) the beams of the given scans as seen from the
+     * given robot poses to the counters. Large batches, like a first synchronization or a large
+     * loop closure, are raytraced in parallel, each thread into counters of its own that are
+     * summed up afterwards; the counters are integer sums, so the result is the same.
+     * @param rRasterizations
+     */
+    void RasterizeScans(const std::vector<Rasterization>& rRasterizations);
+
+    /**
+     * Adds (delta = 1) or subtracts (delta = -1) the beams of the scan as seen from the
+     * given robot pose to the counters. Applies the same rules to each beam as
+     * OccupancyGrid::AddScan, but the cells are laid out relative to the grid's anchor rather
+     * than the bounds of the scans, so the grid need not line up with one built by
+     * OccupancyGrid::CreateFromScans.
+     * @param pScan
+     * @param rPose robot pose to raytrace the scan at
+     * @param delta
+     */
+    void RasterizeScan(LocalizedRangeScan* pScan, const Pose2& rPose, kt_int32s delta)
+    {
+      ScanBeams beams;
+      ComputeBeams(pScan, rPose, beams);
+
+      if (delta > 0)
+      {
+        GrowToContain(beams.minCell, beams.maxCell);
+      }
+
+      TraceBeams(beams, delta, m_pCellPassCnt->GetDataPointer(), m_pCellHitsCnt->GetDataPointer(), true);
+    }
+
+    /**
+     * Computes the anchor cells of the beams of the scan as seen from the given robot pose. Only
+     * reads the grid once it is anchored.
+     * @param pScan
+     * @param rPose robot pose to raytrace the scan at
+     * @param rBeams
+     */
+    void ComputeBeams(LocalizedRangeScan* pScan, const Pose2& rPose, ScanBeams& rBeams)
+    {
+      LaserRangeFinder* pLaserRangeFinder = pScan->GetLaserRangeFinder();
+      kt_double rangeThreshold = pLaserRangeFinder->GetRangeThreshold();
+      kt_double maxRange = pLaserRangeFinder->GetMaximumRange();
+      kt_double minRange = pLaserRangeFinder->GetMinimumRange();
+      kt_double minimumAngle = pLaserRangeFinder->GetMinimumAngle();
+      kt_double angularResolution = pLaserRangeFinder->GetAngularResolution();
+      kt_int32u nReadings = pLaserRangeFinder->GetNumberOfRangeReadings();
+
+      // same computation as LocalizedRangeScan::Update() for the unfiltered readings
+      Pose2 scanPose = pScan->GetSensorAt(rPose);
+      Vector2<kt_double> scanPosition = scanPose.GetPosition();
+      rBeams.fromCell = ToAnchorCell(scanPosition);
+      rBeams.toCells.clear();
+      rBeams.endPointValid.clear();
+      rBeams.toCells.reserve(nReadings);
+      rBeams.endPointValid.reserve(nReadings);
+      rBeams.minCell = rBeams.fromCell;
+      rBeams.maxCell = rBeams.fromCell;
+
+      getTrustMask(pScan, rBeams.trustMask);
+      for (kt_int32u i = 0; i < nReadings; i++)
+      {
+        kt_double rangeReading = pScan->GetRangeReading(i);
+        kt_double angle = scanPose.GetHeading() + minimumAngle + i * angularResolution;
+        kt_double pointRange = math::InRange(rangeReading, minRange, rangeThreshold) ?
+          rangeReading : rangeThreshold;
+
+        Vector2<kt_double> point;
+        point.SetX(scanPosition.GetX() + (pointRange * cos(angle)));
+        point.SetY(scanPosition.GetY() + (pointRange * sin(angle)));
+
+        if (!rBeams.trustMask[i] || std::isnan(rangeReading))
+        {
+          continue;
+        }
+        else if (rangeReading >= rangeThreshold && rangeReading < maxRange)
+        {
+          kt_double ratio = rangeThreshold / rangeReading;
+          kt_double dx = point.GetX() - scanPosition.GetX();
+          kt_double dy = point.GetY() - scanPosition.GetY();
+          point.SetX(scanPosition.GetX() + ratio * dx);
+          point.SetY(scanPosition.GetY() + ratio * dy);
+        }
+
+        Vector2<kt_int32s> toCell = ToAnchorCell(point);
+        rBeams.minCell.MakeFloor(toCell);
+        rBeams.maxCell.MakeCeil(toCell);
+
+        rBeams.toCells.push_back(toCell);
+        rBeams.endPointValid.push_back(math::InRange(rangeReading, minRange, rangeThreshold - KT_TOLERANCE));
+      }
+    }
+
+    /**
+     * Adds delta to the given pass counters along the beams and to the given hit counters of
+     * their end points, which must have the layout of the grid. Visits exactly the cells of
+     * Grid::TraceLine.
+     * @param rBeams
+     * @param delta
+     * @param pCellPassCntPtr
+     * @param pCellHitCntPtr
+     * @param markDirty whether to mark the touched tiles, only for the grid's own counters
+     */
+    void TraceBeams(const ScanBeams& rBeams, kt_int32s delta, kt_int32u* pCellPassCntPtr,
+                    kt_int32u* pCellHitCntPtr, kt_bool markDirty)
+    {
+      Vector2<kt_int32s> from = rBeams.fromCell - m_Origin;
+      for (size_t i = 0; i < rBeams.toCells.size(); i++)
+      {
+        Vector2<kt_int32s> to = rBeams.toCells[i] - m_Origin;
+        TraceClippedLine(from.GetX(), from.GetY(), to.GetX(), to.GetY(),
+                         [this, pCellPassCntPtr, delta, markDirty](kt_int32s index, kt_int32s x, kt_int32s y)
+        {
+          pCellPassCntPtr[index] += delta;
+          if (markDirty)
+          {
+            MarkDirty(Vector2<kt_int32s>(x, y));
+          }
+        });
+
+        if (rBeams.endPointValid[i] && IsValidGridIndex(to))
+        {
+          kt_int32s index = GridIndex(to, false);
+          pCellPassCntPtr[index] += delta;
+          pCellHitCntPtr[index] += delta;
+        }
+      }
+    }
+
+    /**
+     * Converts a world coordinate to a cell relative to the anchor of the grid, anchoring
+     * the grid at the first converted coordinate
+     * @param rWorld
+     * @return cell relative to the anchor
+     */
+    Vector2<kt_int32s> ToAnchorCell(const Vector2<kt_double>& rWorld)
+    {
+      if (!m_IsAnchored)
+      {
+        m_Anchor = rWorld;
+        m_IsAnchored = true;
+      }
+
+      kt_double scale = 1.0 / m_Resolution;
+      return Vector2<kt_int32s>(
+        static_cast<kt_int32s>(math::Round((rWorld.GetX() - m_Anchor.GetX()) * scale)),
+        static_cast<kt_int32s>(math::Round((rWorld.GetY() - m_Anchor.GetY()) * scale)));
+    }
+
+    /**
+     * Grows the grid, keeping its counters, until it contains the given anchor cells.
+     * Growth is padded so that a slowly expanding map does not reallocate on every scan.
+     * @param rMinCell
+     * @param rMaxCell
+     */
+    void GrowToContain(const Vector2<kt_int32s>& rMinCell, const Vector2<kt_int32s>& rMaxCell)
+    {
+      kt_int32s width = GetWidth();
+      kt_int32s height = GetHeight();
+      Vector2<kt_int32s> minCell = m_Origin;
+      Vector2<kt_int32s> maxCell = m_Origin + Vector2<kt_int32s>(width - 1, height - 1);
+
+      if (width > 0 && height > 0 &&
+          rMinCell.GetX() >= minCell.GetX() && rMinCell.GetY() >= minCell.GetY() &&
+          rMaxCell.GetX() <= maxCell.GetX() && rMaxCell.GetY() <= maxCell.GetY())
+      {
+        return;
+      }
+
+      kt_int32s padding = math::Maximum(64, math::Maximum(width, height) / 4);
+      Vector2<kt_int32s> newMinCell = rMinCell;
+      Vector2<kt_int32s> newMaxCell = rMaxCell;
+      if (width > 0 && height > 0)
+      {
+        newMinCell.MakeFloor(minCell);
+        newMaxCell.MakeCeil(maxCell);
+      }
+      newMinCell -= Vector2<kt_int32s>(padding, padding);
+      newMaxCell += Vector2<kt_int32s>(padding, padding);
+
+      kt_int32s newWidth = newMaxCell.GetX() - newMinCell.GetX() + 1;
+      kt_int32s newHeight = newMaxCell.GetY() - newMinCell.GetY() + 1;
+      Vector2<kt_double> newOffset(m_Anchor.GetX() + newMinCell.GetX() * m_Resolution,
+                                   m_Anchor.GetY() + newMinCell.GetY() * m_Resolution);
+
+      Grid<kt_int32u>* pCellPassCnt = Grid<kt_int32u>::CreateGrid(newWidth, newHeight, m_Resolution);
+      Grid<kt_int32u>* pCellHitsCnt = Grid<kt_int32u>::CreateGrid(newWidth, newHeight, m_Resolution);
+      pCellPassCnt->GetCoordinateConverter()->SetOffset(newOffset);
+      pCellHitsCnt->GetCoordinateConverter()->SetOffset(newOffset);
+
+      // copy the old counters row by row into their new location
+      Vector2<kt_int32s> shift = m_Origin - newMinCell;
+      for (kt_int32s y = 0; y < height; y++)
+      {
+        kt_int32s oldIndex = m_pCellPassCnt->GridIndex(Vector2<kt_int32s>(0, y), false);
+        kt_int32s newIndex = pCellPassCnt->GridIndex(Vector2<kt_int32s>(shift.GetX(), y + shift.GetY()), false);
+        memcpy(pCellPassCnt->GetDataPointer() + newIndex, m_pCellPassCnt->GetDataPointer() + oldIndex,
+               width * sizeof(kt_int32u));
+        memcpy(pCellHitsCnt->GetDataPointer() + newIndex, m_pCellHitsCnt->GetDataPointer() + oldIndex,
+               width * sizeof(kt_int32u));
+      }
+
+      delete m_pCellPassCnt;
+      delete m_pCellHitsCnt;
+      m_pCellPassCnt = pCellPassCnt;
+      m_pCellHitsCnt = pCellHitsCnt;
+
+      Grid<kt_int8u>::Resize(newWidth, newHeight);
+      GetCoordinateConverter()->SetOffset(newOffset);
+      m_Origin = newMinCell;
+
+      // cell values were cleared by the resize, so all of them need to be recomputed
+      ResizeTiles();
+    }
+
+    /**
+     * Lays the tiles out over the grid after it moved or changed size, all of them dirty and of a
+     * new bounds generation
+     */
+    void ResizeTiles()
+    {
+      kt_int32s tileSize = GetTileSize();
+      m_NumberOfTilesX = (GetWidth() + tileSize - 1) >> m_TileSizeShift;
+      kt_int32s nTilesY = (GetHeight() + tileSize - 1) >> m_TileSizeShift;
+
+      m_Generation = NextGeneration();
+      m_BoundsGeneration = m_Generation;
+      m_TileGenerations.assign(m_NumberOfTilesX * nTilesY, m_Generation);
+      m_IsTileDirty.assign(m_NumberOfTilesX * nTilesY, true);
+      m_DirtyTiles.clear();
+      for (kt_int32s i = 0; i < m_NumberOfTilesX * nTilesY; i++)
+      {
+        m_DirtyTiles.push_back(i);
+      }
+    }
+
+    /**
+     * Marks the tile of a cell whose counters changed as needing its occupancy recomputed
+     * @param rGrid
+     */
+    inline void MarkDirty(const Vector2<kt_int32s>& rGrid)
+    {
+      kt_int32s tile = (rGrid.GetY() >> m_TileSizeShift) * m_NumberOfTilesX + (rGrid.GetX() >> m_TileSizeShift);
+      if (!m_IsTileDirty[tile])
+      {
+        m_IsTileDirty[tile] = true;
+        m_DirtyTiles.push_back(tile);
+      }
+    }
+
+    /**
+     * Recomputes the occupancy of the cells of the dirty tiles, moving the tiles in which any
+     * changed to a new generation
+     */
+    void UpdateDirtyTiles()
+    {
+      if (m_DirtyTiles.empty())
+      {
+        return;
+      }
+
+      kt_int64u generation = NextGeneration();
+      kt_bool isChanged = false;
+      kt_int32s tileSize = GetTileSize();
+      kt_int8u* pDataPtr = GetDataPointer();
+      kt_int32u* pCellPassCntPtr = m_pCellPassCnt->GetDataPointer();
+      kt_int32u* pCellHitCntPtr = m_pCellHitsCnt->GetDataPointer();
+      const_forEach(std::vector<kt_int32s>, &m_DirtyTiles)
+      {
+        kt_int32s tile = *iter;
+        kt_int32s minX = (tile % m_NumberOfTilesX) * tileSize;
+        kt_int32s minY = (tile / m_NumberOfTilesX) * tileSize;
+        kt_int32s maxX = math::Minimum(minX + tileSize, GetWidth()) - 1;
+        kt_int32s maxY = math::Minimum(minY + tileSize, GetHeight()) - 1;
+
+        kt_bool isTileChanged = false;
+        for (kt_int32s y = minY; y <= maxY; y++)
+        {
+          for (kt_int32s x = minX; x <= maxX; x++)
+          {
+            kt_int32s index = GridIndex(Vector2<kt_int32s>(x, y), false);
+            kt_int8u value = pDataPtr[index];
+            pDataPtr[index] = GridStates_Unknown;
+            UpdateCell(pDataPtr + index, pCellPassCntPtr[index], pCellHitCntPtr[index]);
+            isTileChanged = isTileChanged || pDataPtr[index] != value;
+          }
+        }
+
+        if (isTileChanged)
+        {
+          m_TileGenerations[tile] = generation;
+          isChanged = true;
+        }
+        m_IsTileDirty[tile] = false;
+      }
+      m_DirtyTiles.clear();
+
+      if (isChanged)
+      {
+        m_Generation = generation;
+      }
+    }
+
+    static kt_int64u NextGeneration()
+    {
+      static std::atomic<kt_int64u> generation(0);
+      return ++generation;
+    }
+
+  private:
+    /**
+     * Scan that has been raytraced into the grid and the robot pose it was raytraced at
+     */
+    struct RasterizedScan
+    {
+      RasterizedScan()
+        : pScan(NULL)
+      {
+      }
+
+      RasterizedScan(LocalizedRangeScan* pRasterizedScan, const Pose2& rPose)
+        : pScan(pRasterizedScan)
+        , pose(rPose)
+      {
+      }
+
+      LocalizedRangeScan* pScan;
+      Pose2 pose;
+    };
+
+    IncrementalOccupancyGrid(const IncrementalOccupancyGrid&);
+    const IncrementalOccupancyGrid& operator=(const IncrementalOccupancyGrid&);
+
+  private:
+    kt_double m_Resolution;
+
+    // world coordinate of anchor cell (0, 0) and anchor cell of grid cell (0, 0)
+    kt_bool m_IsAnchored;
+    Vector2<kt_double> m_Anchor;
+    Vector2<kt_int32s> m_Origin;
+
+    // fraction of a cell beams must move by before their scan is raytraced again
+    kt_double m_PoseChangeThreshold;
+
+    // tiles of 2^m_TileSizeShift cells in rows of m_NumberOfTilesX, the generation each last
+    // changed in and the ones whose cells were touched since the last update
+    kt_int32u m_TileSizeShift;
+    kt_int32s m_NumberOfTilesX;
+    std::vector<kt_int64u> m_TileGenerations;
+    std::vector<kt_bool> m_IsTileDirty;
+    std::vector<kt_int32s> m_DirtyTiles;
+    kt_int64u m_Generation;
+    kt_int64u m_BoundsGeneration;
+
+    std::map<kt_int32s, RasterizedScan> m_RasterizedScans;
+  };  // IncrementalOccupancyGrid
+
+  ////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////
+
   /**
    * Dataset info
    * Contains title, author and other information about the dataset
@@ -6884,6 +8005,8 @@ namespace karto
 			  : m_pArray(NULL)
 				, m_Capacity(0)
 				   , m_Size(0)
+				   , m_MinimumOffset(0)
+				   , m_MaximumOffset(0)
 	  {
 	  }
 
@@ -6979,10 +8102,83 @@ namespace karto
 			  return m_pArray;
 		  }
 
+		  /**
+		   * Collects the valid (non INVALID_SCAN) entries into a compacted array and
+		   * records their range; must be called after the array has been filled
+		   */
+		  void Compact()
+		  {
+			  m_ValidArray.clear();
+			  m_ValidArray.reserve(m_Size);
+			  m_MinimumOffset = 0;
+			  m_MaximumOffset = 0;
+
+			  for (kt_int32u i = 0; i < m_Size; i++)
+			  {
+				  if (m_pArray[i] == INVALID_SCAN)
+				  {
+					  continue;
+				  }
+
+				  if (m_ValidArray.empty())
+				  {
+					  m_MinimumOffset = m_pArray[i];
+					  m_MaximumOffset = m_pArray[i];
+				  }
+				  else
+				  {
+					  m_MinimumOffset = math::Minimum(m_MinimumOffset, m_pArray[i]);
+					  m_MaximumOffset = math::Maximum(m_MaximumOffset, m_pArray[i]);
+				  }
+				  m_ValidArray.push_back(m_pArray[i]);
+			  }
+		  }
+
+		  /**
+		   * Gets number of valid entries in the compacted array
+		   * @return number of valid entries
+		   */
+		  inline kt_int32u GetValidSize() const
+		  {
+			  return static_cast<kt_int32u>(m_ValidArray.size());
+		  }
+
+		  /**
+		   * Gets compacted array pointer (only valid entries, see Compact)
+		   * @return compacted array pointer
+		   */
+		  inline const kt_int32s* GetValidArrayPointer() const
+		  {
+			  return m_ValidArray.empty() ? NULL : &m_ValidArray[0];
+		  }
+
+		  /**
+		   * Gets smallest valid entry
+		   * @return smallest valid entry
+		   */
+		  inline kt_int32s GetMinimumOffset() const
+		  {
+			  return m_MinimumOffset;
+		  }
+
+		  /**
+		   * Gets largest valid entry
+		   * @return largest valid entry
+		   */
+		  inline kt_int32s GetMaximumOffset() const
+		  {
+			  return m_MaximumOffset;
+		  }
+
 	  private:
 		  kt_int32s* m_pArray;
 		  kt_int32u m_Capacity;
 		  kt_int32u m_Size;
+
+		  // derived from m_pArray by Compact, not serialized
+		  std::vector<kt_int32s> m_ValidArray;
+		  kt_int32s m_MinimumOffset;
+		  kt_int32s m_MaximumOffset;
       friend class boost::serialization::access;
       template<class Archive>
       void serialize(Archive &ar, const unsigned int version)
@@ -6994,8 +8190,10 @@ namespace karto
           m_pArray = new kt_int32s[m_Capacity];
         }
         ar & boost::serialization::make_array<kt_int32s >(m_pArray, m_Capacity);
-
-
+        if (Archive::is_loading::value)
+        {
+          Compact();
+        }
       }
   };  // LookupArray
 
@@ -7025,6 +8223,12 @@ namespace karto
 			   * @param pGrid
 			   */
        GridIndexLookup()
+        : m_pGrid(NULL)
+        , m_Capacity(0)
+        , m_Size(0)
+        , m_ppLookupArray(NULL)
+        , m_pCachedScan(NULL)
+        , m_CachedRevision(0)
         {
         }
 			  GridIndexLookup(Grid<T>* pGrid)
@@ -7032,6 +8236,8 @@ namespace karto
 					, m_Capacity(0)
 					   , m_Size(0)
 					   , m_ppLookupArray(NULL)
+             , m_pCachedScan(NULL)
+             , m_CachedRevision(0)
 		  {
 		  }
 
@@ -7066,7 +8272,11 @@ namespace karto
 			  }
 
 			  /**
-			   * Compute lookup table of the points of the given scan for the given angular space
+			   * Compute lookup table of the points of the given scan for the given angular space. Angle
+			   * angleIndex is angleCenter + (angleIndex - (nAngles - 1) / 2) * angleResolution, so searches
+			   * around the same center share their angles. The local points of the scan and the lookup
+			   * arrays of every angle computed since the scan, its readings or the grid offset last changed
+			   * are kept, and reused by later calls (e.g. the coarse, expanded and fine searches of a match).
 			   * @param pScan the scan
 			   * @param angleCenter
 			   * @param angleOffset computes lookup arrays for the angles within this offset around angleStart
@@ -7088,40 +8298,75 @@ namespace karto
 
 				  const PointVectorDouble& rPointReadings = pScan->GetPointReadings();
 
-				  // compute transform to scan pose
-				  Transform transform(pScan->GetSensorPose());
+				  if (pScan != m_pCachedScan || pScan->GetReadingsRevision() != m_CachedRevision)
+				  {
+					  ClearCachedArrays();
+
+					  // compute transform to scan pose
+					  Transform transform(pScan->GetSensorPose());
 
-				  Pose2Vector localPoints;
-				  const_forEach(PointVectorDouble, &rPointReadings)
+					  m_LocalPoints.clear();
+					  const_forEach(PointVectorDouble, &rPointReadings)
+					  {
+						  // do inverse transform to get points in local coordinates
+						  Pose2 vec = transform.InverseTransformPose(Pose2(*iter, 0.0));
+						  m_LocalPoints.push_back(vec);
+					  }
+
+					  m_pCachedScan = pScan;
+					  m_CachedRevision = pScan->GetReadingsRevision();
+				  }
+
+				  // lookup indices are relative to the grid offset
+				  const Vector2<kt_double>& rGridOffset = m_pGrid->GetCoordinateConverter()->GetOffset();
+				  if (rGridOffset != m_CachedGridOffset)
 				  {
-					  // do inverse transform to get points in local coordinates
-					  Pose2 vec = transform.InverseTransformPose(Pose2(*iter, 0.0));
-					  localPoints.push_back(vec);
+					  ClearCachedArrays();
+					  m_CachedGridOffset = rGridOffset;
 				  }
 
 				  //////////////////////////////////////////////////////
 				  // create lookup array for different angles
-				  kt_double angle = 0.0;
-				  kt_double startAngle = angleCenter - angleOffset;
+				  kt_double centerIndex = 0.5 * (nAngles - 1);
 				  for (kt_int32u angleIndex = 0; angleIndex < nAngles; angleIndex++)
 				  {
-					  angle = startAngle + angleIndex * angleResolution;
-					  ComputeOffsets(angleIndex, angle, localPoints, pScan);
+					  kt_double angle = angleCenter + (angleIndex - centerIndex) * angleResolution;
+					  m_Angles.at(angleIndex) = angle;
+
+					  typename std::map<kt_double, LookupArray*>::iterator iter = m_CachedArrays.find(angle);
+					  if (iter != m_CachedArrays.end())
+					  {
+						  m_ppLookupArray[angleIndex] = iter->second;
+						  continue;
+					  }
+
+					  LookupArray* pLookupArray = NULL;
+					  if (m_FreeArrays.empty())
+					  {
+						  pLookupArray = new LookupArray();
+					  }
+					  else
+					  {
+						  pLookupArray = m_FreeArrays.back();
+						  m_FreeArrays.pop_back();
+					  }
+
+					  ComputeOffsets(pLookupArray, angle, m_LocalPoints, pScan);
+					  m_CachedArrays[angle] = pLookupArray;
+					  m_ppLookupArray[angleIndex] = pLookupArray;
 				  }
-				  // assert(math::DoubleEqual(angle, angleCenter + angleOffset));
 			  }
 
 		  private:
 			  /**
 			   * Compute lookup value of points for given angle
-			   * @param angleIndex
+			   * @param pLookupArray
 			   * @param angle
 			   * @param rLocalPoints
 			   */
-			  void ComputeOffsets(kt_int32u angleIndex, kt_double angle, const Pose2Vector& rLocalPoints, LocalizedRangeScan* pScan)
+			  void ComputeOffsets(LookupArray* pLookupArray, kt_double angle, const Pose2Vector& rLocalPoints, LocalizedRangeScan* pScan)
 			  {
-				  m_ppLookupArray[angleIndex]->SetSize(static_cast<kt_int32u>(rLocalPoints.size()));
-				  m_Angles.at(angleIndex) = angle;
+				  pLookupArray->SetSize(static_cast<kt_int32u>(rLocalPoints.size()));
 
 				  // set up point array by computing relative offsets to points readings
 				  // when rotated by given angle
@@ -7133,15 +8378,13 @@ namespace karto
 
 				  kt_int32u readingIndex = 0;
 
-				  kt_int32s* pAngleIndexPointer = m_ppLookupArray[angleIndex]->GetArrayPointer();
-
-				  kt_double maxRange = pScan->GetLaserRangeFinder()->GetMaximumRange();
+				  kt_int32s* pAngleIndexPointer = pLookupArray->GetArrayPointer();
 
 				  const_forEach(Pose2Vector, &rLocalPoints)
 				  {
 					  const Vector2<kt_double>& rPosition = iter->GetPosition();
 
-					  if (std::isnan(pScan->GetRangeReadings()[readingIndex]) || std::isinf(pScan->GetRangeReadings()[readingIndex]))
+					  if (std::isnan(pScan->GetRangeReading(readingIndex)) || std::isinf(pScan->GetRangeReading(readingIndex)))
 					  {
 						  pAngleIndexPointer[readingIndex] = INVALID_SCAN;
 						  readingIndex++;
@@ -7165,6 +8408,8 @@ namespace karto
 					  readingIndex++;
 				  }
 				  assert(readingIndex == rLocalPoints.size());
+
+				  pLookupArray->Compact();
 			  }
 
 			  /**
@@ -7177,17 +8422,12 @@ namespace karto
 
 				  if (size > m_Capacity)
 				  {
-					  if (m_ppLookupArray != NULL)
-					  {
-						  DestroyArrays();
-					  }
+					  // the slots only point into the cached arrays
+					  delete[] m_ppLookupArray;
 
 					  m_Capacity = size;
 					  m_ppLookupArray = new LookupArray*[m_Capacity];
-					  for (kt_int32u i = 0; i < m_Capacity; i++)
-					  {
-						  m_ppLookupArray[i] = new LookupArray();
-					  }
+					  std::fill(m_ppLookupArray, m_ppLookupArray + m_Capacity, static_cast<LookupArray*>(NULL));
 				  }
 
 				  m_Size = size;
@@ -7195,18 +8435,31 @@ namespace karto
 				  m_Angles.resize(size);
 			  }
 
+			  /**
+			   * Moves the cached lookup arrays to the free arrays
+			   */
+			  void ClearCachedArrays()
+			  {
+				  for (typename std::map<kt_double, LookupArray*>::iterator iter = m_CachedArrays.begin();
+				       iter != m_CachedArrays.end(); ++iter)
+				  {
+					  m_FreeArrays.push_back(iter->second);
+				  }
+				  m_CachedArrays.clear();
+			  }
+
 			  /**
 			   * Delete the arrays
 			   */
 			  void DestroyArrays()
 			  {
-          if (m_ppLookupArray)
+          ClearCachedArrays();
+          for (size_t i = 0; i < m_FreeArrays.size(); i++)
           {
-            for (kt_int32u i = 0; i < m_Capacity; i++)
-            {
-              delete m_ppLookupArray[i];
-            }
+            delete m_FreeArrays[i];
           }
+          m_FreeArrays.clear();
+
           if (m_ppLookupArray)
           {
               delete[] m_ppLookupArray;
@@ -7220,10 +8473,20 @@ namespace karto
 			  kt_int32u m_Capacity;
 			  kt_int32u m_Size;
 
+			  // lookup array of each angle, pointing into m_CachedArrays
 			  LookupArray **m_ppLookupArray;
 
 			  // for sanity check
 			  std::vector<kt_double> m_Angles;
+
+			  // local points of m_pCachedScan and lookup arrays by angle, not serialized
+			  LocalizedRangeScan* m_pCachedScan;
+			  kt_int64u m_CachedRevision;
+			  Vector2<kt_double> m_CachedGridOffset;
+			  Pose2Vector m_LocalPoints;
+			  std::map<kt_double, LookupArray*> m_CachedArrays;
+			  std::vector<LookupArray*> m_FreeArrays;
+
         friend class boost::serialization::access;
         template<class Archive>
         void serialize(Archive &ar, const unsigned int version)
@@ -7235,12 +8498,16 @@ namespace karto
           if (Archive::is_loading::value)
           {
             m_ppLookupArray = new LookupArray*[m_Capacity];
-            for (kt_int32u i = 0; i < m_Capacity; i++)
-            {
-              m_ppLookupArray[i] = new LookupArray();
-            }
+            std::fill(m_ppLookupArray, m_ppLookupArray + m_Capacity, static_cast<LookupArray*>(NULL));
           }
           ar & boost::serialization::make_array<LookupArray*>(m_ppLookupArray, m_Capacity);
+          if (Archive::is_loading::value)
+          {
+            // the loaded arrays are kept until the next ComputeOffsets, which recomputes every slot
+            std::set<LookupArray*> loadedArrays(m_ppLookupArray, m_ppLookupArray + m_Capacity);
+            loadedArrays.erase(static_cast<LookupArray*>(NULL));
+            m_FreeArrays.assign(loadedArrays.begin(), loadedArrays.end());
+          }
         }
 	  };  // class GridIndexLookup
 
@@ -21,6 +21,7 @@
 #include <map>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <queue>
 
 #include <Eigen/Core>
@@ -30,6 +31,10 @@
 #include "tbb/blocked_range.h"
 #include <algorithm>
 #include <chrono>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 
 #include <karto_sdk/Karto.h>
 
@@ -101,6 +106,98 @@ namespace karto
     }
   };  // MapperLoopClosureListener
   BOOST_SERIALIZATION_ASSUME_ABSTRACT(MapperLoopClosureListener)
+
+  /**
+   * Stages of the mapping pipeline reported to MapperStageListener
+   */
+  typedef enum
+  {
+    MapperStage_Process = 0,          // a whole call to Mapper::Process
+    MapperStage_SequentialMatch,      // matching a scan against the running scans
+    MapperStage_AddEdges,             // linking a scan into the graph
+    MapperStage_LoopClosure,          // searching for and closing loops, including the solve
+    MapperStage_Solve,                // a single ScanSolver::Compute
+    MapperStage_OccupancyGrid,        // bringing the occupancy grid up to date
+    MapperStage_MatchScan,            // any single scan match, sequential or loop closure
+    MapperStage_LinkNearChains,       // matching a scan against the chains near it
+    MapperStage_CorrelateScan,        // a single correlation of a scan against a grid
+    MapperStage_TryCloseLoop          // searching for and closing loops with one sensor's scans
+  } MapperStage;
+
+  /**
+   * Number of MapperStage values
+   */
+  const kt_int32u MapperStage_Count = MapperStage_TryCloseLoop + 1;
+
+  /**
+   * Gets a printable name for the given stage
+   * @param stage
+   * @return name of stage
+   */
+  inline const char* GetMapperStageName(MapperStage stage)
+  {
+    switch (stage)
+    {
+      case MapperStage_Process:
+        return "process";
+      case MapperStage_SequentialMatch:
+        return "sequential_match";
+      case MapperStage_AddEdges:
+        return "add_edges";
+      case MapperStage_LoopClosure:
+        return "loop_closure";
+      case MapperStage_Solve:
+        return "solve";
+      case MapperStage_OccupancyGrid:
+        return "occupancy_grid";
+      case MapperStage_MatchScan:
+        return "match_scan";
+      case MapperStage_LinkNearChains:
+        return "link_near_chains";
+      case MapperStage_CorrelateScan:
+        return "correlate_scan";
+      case MapperStage_TryCloseLoop:
+        return "try_close_loop";
+    }
+
+    return "unknown";
+  }
+
+  /**
+   * Abstract class to listen to the timing of the mapping pipeline stages
+   */
+  class MapperStageListener : public MapperListener
+  {
+  public:
+    /**
+     * Called when a stage is over, on the thread that ran it (solves may run on the background
+     * optimizer thread)
+     * @param stage
+     * @param start start of the stage
+     * @param end end of the stage
+     */
+    virtual void StageTimed(MapperStage /*stage*/,
+                            const std::chrono::steady_clock::time_point& /*start*/,
+                            const std::chrono::steady_clock::time_point& /*end*/) {};
+
+    /**
+     * Called along with StageTimed with the scan the stage worked on, if any
+     * @param stage
+     * @param start start of the stage
+     * @param end end of the stage
+     * @param pScan scan being processed, NULL for stages not tied to a scan
+     */
+    virtual void StageTraced(MapperStage /*stage*/,
+                             const std::chrono::steady_clock::time_point& /*start*/,
+                             const std::chrono::steady_clock::time_point& /*end*/,
+                             const LocalizedRangeScan* /*pScan*/) {};
+    friend class boost::serialization::access;
+    template<class Archive>
+    void serialize(Archive &ar, const unsigned int version)
+    {
+    }
+  };  // MapperStageListener
+  BOOST_SERIALIZATION_ASSUME_ABSTRACT(MapperStageListener)
   ////////////////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////////////////
@@ -246,6 +343,9 @@ namespace karto
   template<typename T>
   class Edge;
 
+  template<typename T>
+  class Graph;
+
   /**
    * Represents an object in a graph
    */
@@ -294,6 +394,23 @@ namespace karto
       return;
     }
 
+    /**
+     * Removes the given edge, in time linear in the number of edges of this vertex
+     * @param pEdge
+     * @return false if the edge is not adjacent to this vertex
+     */
+    inline kt_bool RemoveEdge(Edge<T>* pEdge)
+    {
+      typename std::vector<Edge<T>*>::iterator iter = std::find(m_Edges.begin(), m_Edges.end(), pEdge);
+      if (iter == m_Edges.end())
+      {
+        return false;
+      }
+
+      m_Edges.erase(iter);
+      return true;
+    }
+
     /**
      * Gets score for vertex
      * @return score
@@ -395,6 +512,8 @@ namespace karto
   template<typename T>
   class Edge
   {
+    friend class Graph<T>;
+
   public:
     /**
      * Constructs an edge from the source to target vertex
@@ -405,12 +524,14 @@ namespace karto
       : m_pSource(NULL)
       , m_pTarget(NULL)
       , m_pLabel(NULL)
+      , m_GraphIndex(0)
     {
     }
     Edge(Vertex<T>* pSource, Vertex<T>* pTarget)
       : m_pSource(pSource)
       , m_pTarget(pTarget)
       , m_pLabel(NULL)
+      , m_GraphIndex(0)
     {
       m_pSource->AddEdge(this);
       m_pTarget->AddEdge(this);
@@ -473,6 +594,9 @@ namespace karto
     Vertex<T>* m_pTarget;
     EdgeLabel* m_pLabel;
 
+    // position in the edges of the graph it was added to, not serialized
+    kt_int32u m_GraphIndex;
+
     friend class boost::serialization::access;
     template<class Archive>
     void serialize(Archive &ar, const unsigned int version)
@@ -619,17 +743,38 @@ namespace karto
      */
     inline void AddEdge(Edge<T>* pEdge)
     {
+      pEdge->m_GraphIndex = static_cast<kt_int32u>(m_Edges.size());
       m_Edges.push_back(pEdge);
     }
 
     /**
-     * Removes an edge to the graph
-     * @param pEdge
+     * Removes an edge to the graph, moving the last edge into its place
+     * @param idx
      */
     inline void RemoveEdge(const int& idx)
     {
-      m_Edges[idx] = NULL;
-      m_Edges.erase(m_Edges.begin() + idx);
+      m_Edges[idx] = m_Edges.back();
+      if (m_Edges[idx] != NULL)
+      {
+        m_Edges[idx]->m_GraphIndex = idx;
+      }
+      m_Edges.pop_back();
+    }
+
+    /**
+     * Removes the given edge from the graph in constant time, moving the last edge into its place
+     * @param pEdge
+     * @return false if the edge is not in the graph
+     */
+    inline kt_bool RemoveEdge(Edge<T>* pEdge)
+    {
+      if (pEdge->m_GraphIndex >= m_Edges.size() || m_Edges[pEdge->m_GraphIndex] != pEdge)
+      {
+        return false;
+      }
+
+      RemoveEdge(pEdge->m_GraphIndex);
+      return true;
     }
 
 
@@ -695,6 +840,13 @@ namespace karto
     {
       std::cout << "Graph <- m_Edges; ";
       ar & BOOST_SERIALIZATION_NVP(m_Edges);
+      for (size_t i = 0; i < m_Edges.size(); i++)
+      {
+        if (m_Edges[i] != NULL)
+        {
+          m_Edges[i]->m_GraphIndex = static_cast<kt_int32u>(i);
+        }
+      }
       std::cout << "Graph <- m_Vertices\n";
       ar & BOOST_SERIALIZATION_NVP(m_Vertices);
     }
@@ -720,6 +872,7 @@ namespace karto
      */
     MapperGraph(Mapper* pMapper, kt_double rangeThreshold);
     MapperGraph()
+      : m_RangeThreshold(0.0)
     {
     }
     /**
@@ -754,7 +907,9 @@ namespace karto
     void AddEdges(LocalizedRangeScan* pScan, const Matrix3& rCovariance);
 
     /**
-     * Tries to close a loop using the given scan with the scans from the given device
+     * Tries to close a loop using the given scan with the scans from the given device. With
+     * UseBatchedLoopClosure, all candidate chains are matched concurrently and every accepted
+     * closure is added before a single optimization.
      * @param pScan
      * @param rSensorName
      */
@@ -765,6 +920,18 @@ namespace karto
      */
     void CorrectPoses();
 
+    /**
+     * Optimizes scan poses after a loop closure, on the mapper's background thread with
+     * UseBackgroundOptimization
+     */
+    void CorrectPosesAfterLoopClosure();
+
+    /**
+     * Moves the scans to the given corrected poses
+     * @param rCorrections corrected poses by scan unique id
+     */
+    void ApplyCorrections(const std::vector<std::pair<kt_int32s, Pose2> >& rCorrections);
+
     /**
      * Find "nearby" (no further than given distance away) scans through graph links
      * @param pScan
@@ -791,13 +958,28 @@ namespace karto
      * @param pScan
      * @param maxDistance
      */
-    std::vector<Vertex<LocalizedRangeScan>*> FindNearByVertices(Name name, const Pose2 refPose, kt_double maxDistance);
+    std::vector<Vertex<LocalizedRangeScan>*> FindNearByVertices(const Name& name, const Pose2& refPose, kt_double maxDistance);
 
     /**
      * Find closest scan to pose
      * @param pScan
      */
-    Vertex<LocalizedRangeScan>* FindNearByScan(Name name, const Pose2 refPose);
+    Vertex<LocalizedRangeScan>* FindNearByScan(const Name& name, const Pose2& refPose);
+
+    /**
+     * Removes the vertex of the given state id from the graph and from the nearby vertex and loop
+     * closure indices
+     * @param rName
+     * @param idx
+     */
+    void RemoveVertex(const Name& rName, const int& idx);
+
+    /**
+     * Gets the number of scans in the loop closure index of the given sensor
+     * @param rSensorName
+     * @return number of indexed scans, 0 if the sensor was not indexed yet
+     */
+    kt_int32u GetLoopClosureIndexSize(const Name& rSensorName) const;
 
     /**
      * Gets the graph's scan matcher
@@ -902,6 +1084,159 @@ namespace karto
                                                      const Name& rSensorName,
                                                      kt_int32u& rStartNum);
 
+    /**
+     * Uniform hash grid of the reference positions of the scans of one sensor, by state id
+     */
+    struct LoopClosureIndex
+    {
+      kt_double cellSize;
+      kt_bool useBarycenter;
+      std::unordered_map<kt_int64s, std::vector<kt_int32s> > cells;
+      std::unordered_map<kt_int32s, kt_int64s> scanCells;
+    };
+
+    /**
+     * Gets the loop closure index of the given sensor, (re)building it if it does not exist yet or
+     * was built for other parameters
+     * @param rSensorName
+     * @return loop closure index
+     */
+    LoopClosureIndex& GetLoopClosureIndex(const Name& rSensorName);
+
+    /**
+     * Gets the key of the index cell containing the given position
+     * @param rIndex
+     * @param rPosition
+     * @return cell key
+     */
+    kt_int64s GetLoopClosureIndexCell(const LoopClosureIndex& rIndex, const Vector2<kt_double>& rPosition) const;
+
+    /**
+     * Moves the given scan to the index cell of its current reference pose
+     * @param rIndex
+     * @param pScan
+     */
+    void IndexScan(LoopClosureIndex& rIndex, LocalizedRangeScan* pScan);
+
+    /**
+     * Moves the given scan to the index cell of its current reference pose, if its sensor is indexed
+     * @param pScan
+     */
+    void UpdateLoopClosureIndex(LocalizedRangeScan* pScan);
+
+    /**
+     * Removes the given scan (by state id) from the index
+     * @param rIndex
+     * @param stateId
+     */
+    void UnindexScan(LoopClosureIndex& rIndex, kt_int32s stateId);
+
+    typedef PointVectorNanoFlannAdaptor<std::vector<Vector2<kt_double> > > NearByVertexAdaptor;
+    typedef nanoflann::KDTreeSingleIndexAdaptor<nanoflann::L2_Simple_Adaptor<kt_double, NearByVertexAdaptor>,
+                                                NearByVertexAdaptor, 2> NearByVertexTree;
+
+    /**
+     * KD-tree of the corrected positions of the vertices of one sensor. Vertices added since the
+     * tree was built are searched linearly and removed ones are left in the tree as NULL slots,
+     * until there are enough of either to rebuild it; pose corrections rebuild it on the next query.
+     */
+    struct NearByVertexIndex
+    {
+      NearByVertexIndex()
+        : removedCount(0)
+        , dirty(true)
+        , pAdaptor(NULL)
+        , pTree(NULL)
+      {
+      }
+
+      std::vector<Vertex<LocalizedRangeScan>*> vertices;
+      std::vector<Vector2<kt_double> > positions;
+      std::unordered_map<kt_int32s, size_t> slots;
+      std::vector<Vertex<LocalizedRangeScan>*> pending;
+      kt_int32u removedCount;
+      kt_bool dirty;
+      NearByVertexAdaptor* pAdaptor;
+      NearByVertexTree* pTree;
+    };
+
+    /**
+     * Gets the nearby vertex index of the given sensor, rebuilding it if it is out of date
+     * @param rSensorName
+     * @return nearby vertex index, or NULL if the sensor has no vertices
+     */
+    NearByVertexIndex* GetNearByVertexIndex(const Name& rSensorName);
+
+    /**
+     * Rebuilds the KD-tree of the given index from the given vertices
+     * @param rIndex
+     * @param rVertices
+     */
+    void BuildNearByVertexIndex(NearByVertexIndex& rIndex, const std::map<int, Vertex<LocalizedRangeScan>*>& rVertices);
+
+    /**
+     * Deletes the KD-trees of the nearby vertex indices
+     */
+    void DestroyNearByVertexIndices();
+
+    /**
+     * Result of matching a scan against a possible loop closure chain
+     */
+    struct LoopClosureMatch
+    {
+      kt_double coarseResponse;
+      Matrix3 coarseCovariance;
+      kt_bool passedCoarse;
+      kt_double fineResponse;
+      Pose2 bestPose;
+      Matrix3 covariance;
+    };
+
+    /**
+     * Coarse and, if the coarse match is good enough, fine match of the given scan against a chain
+     * @param pScan
+     * @param rChain
+     * @param pLoopScanMatcher matcher for the coarse match
+     * @param pFineScanMatcher matcher for the fine match
+     * @param rMatch output parameter of the match
+     */
+    void MatchLoopClosure(LocalizedRangeScan* pScan, const LocalizedRangeScanVector& rChain,
+                          ScanMatcher* pLoopScanMatcher, ScanMatcher* pFineScanMatcher,
+                          LoopClosureMatch& rMatch) const;
+
+    /**
+     * Reports a loop closure match to the listeners
+     * @param rMatch
+     * @return whether the match closes the loop
+     */
+    kt_bool ReportLoopClosureMatch(const LoopClosureMatch& rMatch) const;
+
+    /**
+     * Matches the given scan against all possible loop closure chains concurrently, then adds
+     * every accepted closure and optimizes once
+     * @param pScan
+     * @param rSensorName
+     */
+    kt_bool TryCloseLoopBatch(LocalizedRangeScan* pScan, const Name& rSensorName);
+
+    /**
+     * Takes a coarse (loop) and fine (sequential) scan matcher for one worker of the batch,
+     * creating them if none is free
+     * @return coarse and fine scan matchers
+     */
+    std::pair<ScanMatcher*, ScanMatcher*> AcquireLoopClosureMatchers();
+
+    /**
+     * Gives back scan matchers taken with AcquireLoopClosureMatchers
+     * @param rMatchers
+     */
+    void ReleaseLoopClosureMatchers(const std::pair<ScanMatcher*, ScanMatcher*>& rMatchers);
+
+    /**
+     * Deletes the scan matchers of the batch workers
+     */
+    void DestroyLoopClosureMatchers();
+
   private:
     /**
      * Mapper of this graph
@@ -918,6 +1253,23 @@ namespace karto
      */
     GraphTraversal<LocalizedRangeScan>* m_pTraversal;
 
+    /**
+     * Range threshold of the scan matchers, and idle scan matchers of the batch workers (not serialized)
+     */
+    kt_double m_RangeThreshold;
+    std::vector<std::pair<ScanMatcher*, ScanMatcher*> > m_LoopClosureMatchers;
+    std::mutex m_LoopClosureMatchersMutex;
+
+    /**
+     * Loop closure candidate index of each sensor (not serialized, rebuilt on demand)
+     */
+    std::map<Name, LoopClosureIndex> m_LoopClosureIndices;
+
+    /**
+     * Nearby vertex index of each sensor (not serialized, rebuilt on demand)
+     */
+    std::map<Name, NearByVertexIndex> m_NearByVertexIndices;
+
     /**
      * Serialization: class MapperGraph
      */
@@ -1020,6 +1372,14 @@ namespace karto
     {
     }
 
+    /**
+     * Get the number of iterations the last solve took
+     */
+    virtual kt_int32s GetIterations() const
+    {
+      return 0;
+    }
+
     /**
      * Get graph stored
      */
@@ -1172,6 +1532,67 @@ namespace karto
       }
     }
 
+    /**
+     * Smears the kernel centered at the given cell, keeping the larger value of each cell. Unlike
+     * SmearPoint, the cell is in data coordinates (border included) and does not have to be marked
+     * as "occupied" first; the kernel sets it to occupied.
+     * @param rDataPoint
+     */
+    inline void SmearKernel(const Vector2<kt_int32s>& rDataPoint)
+    {
+      assert(m_pKernel != NULL);
+
+      kt_int32s halfKernel = m_KernelSize / 2;
+
+      kt_int32s minX = math::Maximum(rDataPoint.GetX() - halfKernel, 0);
+      kt_int32s minY = math::Maximum(rDataPoint.GetY() - halfKernel, 0);
+      kt_int32s maxX = math::Minimum(rDataPoint.GetX() + halfKernel, GetWidth() - 1);
+      kt_int32s maxY = math::Minimum(rDataPoint.GetY() + halfKernel, GetHeight() - 1);
+
+      for (kt_int32s y = minY; y <= maxY; y++)
+      {
+        kt_int8u* pGridAdr = GetDataPointer() + y * GetWidthStep();
+        const kt_int8u* pKernelAdr = m_pKernel + m_KernelSize * (y - rDataPoint.GetY() + halfKernel) +
+                                     halfKernel - rDataPoint.GetX();
+
+        for (kt_int32s x = minX; x <= maxX; x++)
+        {
+          if (pKernelAdr[x] > pGridAdr[x])
+          {
+            pGridAdr[x] = pKernelAdr[x];
+          }
+        }
+      }
+    }
+
+    /**
+     * Gets the smearing kernel, GetKernelSize() x GetKernelSize() values indexed by
+     * (x offset + half size) + (y offset + half size) * size
+     * @return kernel
+     */
+    inline const kt_int8u* GetKernel() const
+    {
+      return m_pKernel;
+    }
+
+    /**
+     * Gets the size of the smearing kernel (odd, in cells)
+     * @return kernel size
+     */
+    inline kt_int32s GetKernelSize() const
+    {
+      return m_KernelSize;
+    }
+
+    /**
+     * Gets the smear deviation
+     * @return smear deviation
+     */
+    inline kt_double GetSmearDeviation() const
+    {
+      return m_SmearDeviation;
+    }
+
   protected:
     /**
      * Constructs a correlation grid of given size and parameters
@@ -1315,6 +1736,8 @@ namespace karto
   {
   public:
     ScanMatcher()
+      : m_useBranchAndBound(false)
+      , m_useGridCache(false)
     {
     }
     /**
@@ -1323,19 +1746,32 @@ namespace karto
     virtual ~ScanMatcher();
 
   public:
-    /**
-     * Parallelize scan matching
-     */
-    void operator() (const kt_double& y) const;
-
     /**
      * Create a scan matcher with the given parameters
+     * @param useBranchAndBound whether coarse searches use branch and bound instead of brute force
+     * @param useGridCache whether MatchScanToRunningScans keeps a correlation grid per sensor
      */
     static ScanMatcher* Create(Mapper* pMapper,
                                kt_double searchSize,
                                kt_double resolution,
                                kt_double smearDeviation,
-                               kt_double rangeThreshold);
+                               kt_double rangeThreshold,
+                               kt_bool useBranchAndBound = false,
+                               kt_bool useGridCache = false);
+
+    /**
+     * Sums the grid cells found at every offset from each of the given positions; the kernel behind
+     * GetResponse. No bounds checks are done: position + offset must lie on the grid and, since
+     * AVX2 builds gather 4 bytes per cell, so must the 3 bytes that follow it.
+     * @param pGrid grid data
+     * @param pPositions grid indices of the positions
+     * @param nPositions number of positions
+     * @param pOffsets index offsets of the points (see LookupArray::GetValidArrayPointer)
+     * @param nOffsets number of offsets
+     * @param pSums output sum per position
+     */
+    static void SumResponses(const kt_int8u* pGrid, const kt_int32s* pPositions, kt_int32u nPositions,
+                             const kt_int32s* pOffsets, kt_int32u nOffsets, kt_int32u* pSums);
 
     /**
      * Match given scan against set of scans
@@ -1354,6 +1790,27 @@ namespace karto
                         kt_bool doPenalize = true,
                         kt_bool doRefineMatch = true);
 
+    /**
+     * Match given scan against the running scans of its sensor. Same as MatchScan, but when the
+     * matcher was created with a grid cache the correlation grid of each sensor is kept between
+     * calls: it is anchored to a fixed world lattice, follows the scan by whole cells and is only
+     * updated for the scans that entered or left the running buffer. It is rebuilt when the
+     * buffered scans move (e.g. after a loop closure). Points of cached scans are filtered against
+     * the view point of the scan they were first matched with.
+     * @param pScan scan being scan-matched
+     * @param rRunningScans running scans of the scan's sensor
+     * @param rMean output parameter of mean (best pose) of match
+     * @param rCovariance output parameter of covariance of match
+     * @param doPenalize whether to penalize matches further from the search center
+     * @param doRefineMatch whether to do finer-grained matching if coarse match is good (default is true)
+     * @return strength of response
+     */
+    kt_double MatchScanToRunningScans(LocalizedRangeScan* pScan,
+                                      const LocalizedRangeScanVector& rRunningScans,
+                                      Pose2& rMean, Matrix3& rCovariance,
+                                      kt_bool doPenalize = true,
+                                      kt_bool doRefineMatch = true);
+
     /**
      * Finds the best pose for the scan centering the search in the correlation grid
      * at the given pose and search in the space by the vector and angular offsets
@@ -1449,6 +1906,101 @@ namespace karto
      */
     PointVectorDouble FindValidPoints(LocalizedRangeScan* pScan, const Vector2<kt_double>& rViewPoint) const;
 
+    /**
+     * Searches the correlation grid, already set up with the base scans, for the best pose of the scan
+     * @param pScan scan being scan-matched
+     * @param rScanPose pose of the scan, center of the search
+     * @param rMean output parameter of mean (best pose) of match
+     * @param rCovariance output parameter of covariance of match
+     * @param doPenalize whether to penalize matches further from the search center
+     * @param doRefineMatch whether to do finer-grained matching if coarse match is good
+     * @return strength of response
+     */
+    kt_double SearchCorrelationGrid(LocalizedRangeScan* pScan, const Pose2& rScanPose,
+                                    Pose2& rMean, Matrix3& rCovariance,
+                                    kt_bool doPenalize, kt_bool doRefineMatch);
+
+    /**
+     * Points of a running scan as cells of the grid cache lattice
+     */
+    struct CachedScan
+    {
+      kt_int32s uniqueId;
+      Pose2 pose;
+      std::vector<Vector2<kt_int32s> > cells;
+    };
+
+    /**
+     * Correlation grid of the running scans of one sensor, see MatchScanToRunningScans
+     */
+    struct GridCache
+    {
+      CorrelationGrid* pGrid;
+      GridIndexLookup<kt_int8u>* pGridLookup;
+      kt_bool isAnchored;
+      // world position of lattice cell (0, 0)
+      Vector2<kt_double> anchor;
+      // lattice cell of the grid's region of interest origin
+      Vector2<kt_int32s> origin;
+      std::map<LocalizedRangeScan*, CachedScan> scans;
+      // number of cached points in each cell of the grid data (width, not width step, per row)
+      std::vector<kt_int16u> hitCounts;
+      // tiles of the grid data that have to be recomputed from the hit counts
+      std::vector<kt_bool> dirtyTiles;
+      kt_int32s nTilesX;
+      kt_int32s nTilesY;
+    };
+
+    /**
+     * Gets the grid cache of the given sensor, creating it if needed
+     * @param rSensorName
+     * @return grid cache
+     */
+    GridCache* GetGridCache(const Name& rSensorName);
+
+    /**
+     * Brings the cached grid up to date for matching the given scan against the given scans
+     * @param pCache
+     * @param pScan scan being scan-matched
+     * @param rScans running scans
+     */
+    void UpdateGridCache(GridCache* pCache, LocalizedRangeScan* pScan, const LocalizedRangeScanVector& rScans);
+
+    /**
+     * Adds a scan to the cache and smears its points into the grid
+     * @param pCache
+     * @param pScan scan to add
+     * @param rViewPoint do not add points that belong to scans "opposite" the view point
+     */
+    void AddToGridCache(GridCache* pCache, LocalizedRangeScan* pScan, const Vector2<kt_double>& rViewPoint);
+
+    /**
+     * Moves the cached grid so that its region of interest starts at the given lattice cell
+     * @param pCache
+     * @param rOrigin
+     */
+    void ShiftGridCache(GridCache* pCache, const Vector2<kt_int32s>& rOrigin);
+
+    /**
+     * Removes a scan from the cache and marks the grid around its points as dirty
+     * @param pCache
+     * @param pScan scan to remove
+     */
+    void RemoveFromGridCache(GridCache* pCache, LocalizedRangeScan* pScan);
+
+    /**
+     * Marks the tiles of the cached grid overlapping the given rectangle (data coordinates) as dirty
+     * @param pCache
+     * @param rRegion
+     */
+    void MarkGridCacheDirty(GridCache* pCache, const Rectangle2<kt_int32s>& rRegion);
+
+    /**
+     * Recomputes the dirty tiles of the cached grid from the hit counts
+     * @param pCache
+     */
+    void RepairGridCache(GridCache* pCache);
+
     /**
      * Get response at given position for given rotation (only look up valid points)
      * @param angleIndex
@@ -1457,6 +2009,113 @@ namespace karto
      */
     kt_double GetResponse(kt_int32u angleIndex, kt_int32s gridPositionIndex) const;
 
+    /**
+     * Get responses at several positions for given rotation, same values as GetResponse
+     * @param angleIndex
+     * @param pGridPositionIndices
+     * @param nPositions
+     * @param pResponses output response per position
+     */
+    void GetResponses(kt_int32u angleIndex, const kt_int32s* pGridPositionIndices, kt_int32u nPositions,
+                      kt_double* pResponses) const;
+
+    /**
+     * Scores every pose of one row of the search space into the pose response arena and
+     * records the row's best response and the poses that may tie with the overall best
+     * @param yIndex index of the row in m_yPoses
+     * @param updateSearchSpaceProbs whether to also update the search space probabilities
+     */
+    void CorrelateRow(kt_int32u yIndex, kt_bool updateSearchSpaceProbs);
+
+    /**
+     * Raises the search space probability of the cell of the given pose to its response
+     * @param rPoseResponse
+     */
+    void UpdateSearchSpaceProbs(const std::pair<kt_double, Pose2>& rPoseResponse);
+
+    /**
+     * Best response of a row of the search space
+     */
+    struct RowBest
+    {
+      kt_double response;
+      // indices of the row's poses whose response is within KT_TOLERANCE of the row's best
+      std::vector<kt_int32u> candidates;
+    };
+
+    /**
+     * Computes the penalty multiplier for a pose deviating from the search center
+     * @param squaredDistance squared distance from the search center
+     * @param angle heading of the pose
+     * @return penalty multiplier
+     */
+    kt_double ComputePenalty(kt_double squaredDistance, kt_double angle) const;
+
+    /**
+     * Block of 2^level x 2^level search positions at a single search angle
+     */
+    struct SearchCandidate
+    {
+      kt_int32u xIndex;
+      kt_int32u yIndex;
+      kt_int32u angleIndex;
+      kt_int32u level;
+      kt_double score;
+    };
+
+    /**
+     * Same contract as CorrelateScan for a coarse search, but found by a branch and bound
+     * search over a max-pooled pyramid of the correlation grid instead of scoring every pose.
+     * All poses whose response is within 0.1 of the best are still evaluated exactly, so the
+     * best pose, tie averaging and positional covariance are identical to the brute force search.
+     * @param pScan scan to match against correlation grid
+     * @param rSearchCenter the center of the search space
+     * @param rSearchSpaceOffset searches poses in the area offset by this vector around search center
+     * @param rSearchSpaceResolution how fine a granularity to search in the search space
+     * @param searchAngleOffset searches poses in the angles offset by this angle around search center
+     * @param searchAngleResolution how fine a granularity to search in the angular search space
+     * @param doPenalize whether to penalize matches further from the search center
+     * @param rMean output parameter of mean (best pose) of match
+     * @param rCovariance output parameter of covariance of match
+     * @return strength of response
+     */
+    kt_double CorrelateScanBranchAndBound(LocalizedRangeScan* pScan,
+                                          const Pose2& rSearchCenter,
+                                          const Vector2<kt_double>& rSearchSpaceOffset,
+                                          const Vector2<kt_double>& rSearchSpaceResolution,
+                                          kt_double searchAngleOffset,
+                                          kt_double searchAngleResolution,
+                                          kt_bool doPenalize,
+                                          Pose2& rMean,
+                                          Matrix3& rCovariance);
+
+    /**
+     * Depth first branch and bound below the given candidate. Keeps every leaf whose response
+     * is at least rBestResponse - margin.
+     * @param rCandidate
+     * @param margin
+     * @param rBestResponse best response found so far, shared between searches
+     * @param rLeaves output leaves
+     */
+    void SearchBranchAndBound(const SearchCandidate& rCandidate, kt_double margin,
+                              std::atomic<kt_double>& rBestResponse,
+                              std::vector<SearchCandidate>& rLeaves) const;
+
+    /**
+     * Scores a candidate: the exact response for a leaf, an upper bound of the responses
+     * of all its positions otherwise
+     * @param rCandidate
+     * @return score
+     */
+    kt_double ScoreCandidate(const SearchCandidate& rCandidate) const;
+
+    /**
+     * Computes the max-pooled correlation grids for the given window sizes, reusing
+     * pooled grids that are still valid
+     * @param rWindows window size of each pyramid level above the correlation grid
+     */
+    void ComputePooledGrids(const std::vector<kt_int32s>& rWindows);
+
   protected:
     /**
      * Default constructor
@@ -1466,8 +2125,9 @@ namespace karto
       , m_pCorrelationGrid(NULL)
       , m_pSearchSpaceProbs(NULL)
       , m_pGridLookup(NULL)
-      , m_pPoseResponse(NULL)
       , m_doPenalize(false)
+      , m_useBranchAndBound(false)
+      , m_useGridCache(false)
     {
     }
 
@@ -1476,7 +2136,6 @@ namespace karto
     CorrelationGrid* m_pCorrelationGrid;
     Grid<kt_double>* m_pSearchSpaceProbs;
     GridIndexLookup<kt_int8u>* m_pGridLookup;
-    std::pair<kt_double, Pose2>* m_pPoseResponse;
     std::vector<kt_double> m_xPoses;
     std::vector<kt_double> m_yPoses;
     Pose2 m_rSearchCenter;
@@ -1485,6 +2144,24 @@ namespace karto
     kt_double m_searchAngleResolution;
     kt_bool m_doPenalize;
 
+    // brute force search arena, grown to the largest search seen and reused between searches
+    std::vector<std::pair<kt_double, Pose2> > m_PoseResponses;
+    std::vector<kt_int32s> m_RowGridIndices;
+    std::vector<kt_double> m_RowResponses;
+    std::vector<RowBest> m_RowBests;
+    std::vector<kt_int32u> m_TieIndices;
+
+    // branch and bound search state; pooled grids are invalidated whenever scans are added
+    kt_bool m_useBranchAndBound;
+    std::vector<std::vector<kt_int8u> > m_PooledGrids;
+    std::vector<kt_int32s> m_PooledWindows;
+    std::vector<kt_int32s> m_xGridPoses;
+    std::vector<kt_int32s> m_yGridPoses;
+
+    // correlation grids of the running scans of each sensor, not serialized
+    kt_bool m_useGridCache;
+    std::map<Name, GridCache*> m_GridCaches;
+
     /**
      * Serialization: class ScanMatcher
      */
@@ -1504,25 +2181,15 @@ namespace karto
       ar & BOOST_SERIALIZATION_NVP(m_searchAngleResolution);;
       ar & BOOST_SERIALIZATION_NVP(m_doPenalize);
       
-      // Note - m_pPoseResponse is generally only ever defined within the
-      // execution of ScanMatcher::CorrelateScan and used as a temporary
-      // accumulator for multithreaded matching results. It would normally
-      // not make sense to serialize, but we don't want to break compatibility
-      // with previously serialized data. Gen some dummy data that we free
-      // immediately after so that we don't alloc here and leak.
+      // Note - the pose responses used to be a temporary array that was serialized
+      // along with the matcher. They are only scratch space for CorrelateScan and
+      // are not restored, but dummy data is still written and read so that we don't
+      // break compatibility with previously serialized data.
       kt_int32u poseResponseSize =
         static_cast<kt_int32u>(m_xPoses.size() * m_yPoses.size() * m_nAngles);
-
-      // We could check first if m_pPoseResponse == nullptr for good measure, but
-      // based on the codepaths it should always be freed and set to null outside of
-      // any execution of ScanMatcher::CorrelateScan, so go ahead and alloc here.
-      m_pPoseResponse = new std::pair<kt_double, Pose2>[poseResponseSize];
-      ar & boost::serialization::make_array<std::pair<kt_double, Pose2>>(m_pPoseResponse,
+      std::vector<std::pair<kt_double, Pose2> > poseResponses(poseResponseSize);
+      ar & boost::serialization::make_array<std::pair<kt_double, Pose2>>(poseResponses.data(),
         poseResponseSize);
-
-      // Aaaand now, clean up the dummy data
-      delete[] m_pPoseResponse;
-      m_pPoseResponse = nullptr;
     }
 
   };  // ScanMatcher
@@ -1551,7 +2218,9 @@ namespace karto
     {
     }
 
-    MapperSensorManager(){
+    MapperSensorManager()
+      : m_NextScanId(0)
+    {
 	}
 
     /**
@@ -1638,6 +2307,15 @@ namespace karto
       }
     }
 
+    /**
+     * Gets the scans of all devices by unique id
+     * @return scans in ascending unique id
+     */
+    inline const std::map<int, LocalizedRangeScan*>& GetScansById() const
+    {
+      return m_Scans;
+    }
+
     /**
      * Adds scan to scan vector of device that recorded scan
      * @param pScan
@@ -1698,6 +2376,14 @@ namespace karto
      */
     LocalizedRangeScanVector GetAllScans();
 
+    /**
+     * Keeps added scans in compact storage with their point readings bounded by the given cache,
+     * see LocalizedRangeScan::UseCompactStorage, or in full if null. Scans already added, e.g.
+     * deserialized ones, only have their point readings bounded.
+     * @param rCache
+     */
+    void SetPointReadingsCache(const std::shared_ptr<PointReadingsCache>& rCache);
+
     /**
      * Deletes all scan managers of all devices
      */
@@ -1751,6 +2437,9 @@ namespace karto
     kt_int32s m_NextScanId;
 
     std::map<int, LocalizedRangeScan*> m_Scans;
+
+    // set by the mapper in compact mode, not serialized
+    std::shared_ptr<PointReadingsCache> m_pPointReadingsCache;
   };  // MapperSensorManager
 
   ////////////////////////////////////////////////////////////////////////////////////////
@@ -1990,6 +2679,44 @@ namespace karto
      */
     virtual kt_bool Process(Object* pObject);
 
+    /**
+     * Prepares the mapper for MatchScan calls on scans of the given sensor: initializes the mapper if
+     * needed, registers the sensor and gives it a sequential scan matcher of its own. Must not run
+     * concurrently with any other call
+     * @param pLaserRangeFinder sensor
+     */
+    void RegisterFrontEnd(LaserRangeFinder* pLaserRangeFinder);
+
+    /**
+     * Whether RegisterFrontEnd was called for the given sensor
+     * @param rSensorName
+     * @return true if the sensor has a front end
+     */
+    kt_bool HasFrontEnd(const Name& rSensorName) const;
+
+    /**
+     * Front end of Process: validates the scan, predicts its pose from the last scan of its sensor
+     * and matches it against the sensor's running scans. It only reads the state of the scan's own
+     * sensor and writes none of the mapper's, so the front ends of different registered sensors may
+     * run concurrently as long as nothing modifies the mapper meanwhile (listeners must be thread
+     * safe). A sensor can have one matched scan waiting for InsertScan at a time
+     * @param pScan scan of a sensor registered with RegisterFrontEnd
+     * @param rCovariance output parameter of covariance of the match
+     * @return true if the scan should be passed to InsertScan, false if it was rejected
+     */
+    kt_bool MatchScan(LocalizedRangeScan* pScan, Matrix3& rCovariance);
+
+    /**
+     * Back end of Process: adds a scan matched by MatchScan to the graph, links it to the other
+     * scans and tries to close loops. If the last scan of its sensor was moved since the match,
+     * e.g. by a loop closure, the scan moves along with it
+     * @param pScan scan matched by MatchScan
+     * @param rCovariance covariance of the match
+     * @return true if the scan was added, false if it is not the pending match of its sensor or
+     * the last scan it was matched against is gone
+     */
+    kt_bool InsertScan(LocalizedRangeScan* pScan, const Matrix3& rCovariance);
+
     // processors
     kt_bool ProcessAtDock(LocalizedRangeScan* pScan);
     kt_bool ProcessAgainstNode(LocalizedRangeScan* pScan,  const int& nodeId);
@@ -2007,6 +2734,15 @@ namespace karto
      */
     virtual const LocalizedRangeScanVector GetAllProcessedScans() const;
 
+    /**
+     * Gets an occupancy grid of all processed scans. The grid is kept by the mapper and
+     * updated incrementally: only new scans and scans moved by an optimization are raytraced.
+     * NOTE: The returned grid is owned by the mapper and must not be deleted.
+     * @param resolution
+     * @return occupancy grid, or NULL if no scans have been processed
+     */
+    OccupancyGrid* GetOccupancyGrid(kt_double resolution);
+
     /**
      * Add a listener to mapper
      * @param pListener
@@ -2058,6 +2794,16 @@ namespace karto
       return m_pMapperSensorManager;
     }
 
+    /**
+     * Gets the revision of the scans in the graph, which advances whenever scans are corrected or
+     * removed but not when they are added
+     * @return graph revision
+     */
+    inline kt_int64u GetGraphRevision() const
+    {
+      return m_GraphRevision;
+    }
+
     /**
      * Tries to close a loop using the given scan with the scans from the given sensor
      * @param pScan
@@ -2070,12 +2816,52 @@ namespace karto
 
     inline void CorrectPoses()
     {
+      FinishBackgroundOptimization();
       m_pGraph->CorrectPoses();
     }
 
+    /**
+     * Applies the corrections of a finished background optimization, if any. Called at the start
+     * of every processed scan
+     * @param startRequested whether to start the optimization requested while the last one ran
+     */
+    void ApplyBackgroundOptimization(kt_bool startRequested = true);
+
+    /**
+     * Waits for a running background optimization and applies its corrections
+     */
+    void FinishBackgroundOptimization();
+
   protected:
     void InitializeParameters();
 
+    /**
+     * Adds the vertex to the scan solver, or defers it while a background optimization runs
+     * @param pVertex
+     */
+    void AddScanOptimizerNode(Vertex<LocalizedRangeScan>* pVertex);
+
+    /**
+     * Adds the edge to the scan solver, or defers it while a background optimization runs
+     * @param pEdge
+     */
+    void AddScanOptimizerConstraint(Edge<LocalizedRangeScan>* pEdge);
+
+    /**
+     * Hands an optimization to the background thread, starting it if needed
+     */
+    void StartBackgroundOptimization();
+
+    /**
+     * Body of the background optimization thread
+     */
+    void RunBackgroundOptimizer();
+
+    /**
+     * Stops the background optimization thread and drops its pending work
+     */
+    void StopBackgroundOptimizer();
+
     /**
      * Test if the scan is "sufficiently far" from the last scan added.
      * @param pScan scan to be checked
@@ -2085,6 +2871,32 @@ namespace karto
      */
     kt_bool HasMovedEnough(LocalizedRangeScan* pScan, LocalizedRangeScan* pLastScan) const;
 
+    /**
+     * Creates a scan matcher with the sequential matcher parameters
+     * @param rangeThreshold
+     * @return scan matcher, owned by the caller
+     */
+    ScanMatcher* CreateSequentialScanMatcher(kt_double rangeThreshold);
+
+    /**
+     * Predicts the pose of the scan from the last scan of its sensor and, unless it has not moved
+     * enough, matches it against the running scans of its sensor
+     * @param pScan
+     * @param pLastScan last scan of the sensor, or NULL
+     * @param pScanMatcher matcher to use
+     * @param rCovariance output parameter of covariance of the match
+     * @return true if the scan should be added
+     */
+    kt_bool MatchToRunningScans(LocalizedRangeScan* pScan, LocalizedRangeScan* pLastScan,
+                                ScanMatcher* pScanMatcher, Matrix3& rCovariance);
+
+    /**
+     * Adds a matched scan to its sensor, the graph and the running scans, and tries to close loops
+     * @param pScan
+     * @param rCovariance covariance of the match
+     */
+    void AddMatchedScan(LocalizedRangeScan* pScan, const Matrix3& rCovariance);
+
   public:
     /////////////////////////////////////////////
     // fire information for listeners!!
@@ -2119,6 +2931,15 @@ namespace karto
      */
     void FireEndLoopClosure(const std::string& rInfo) const;
 
+    /**
+     * Fire the timing of a pipeline stage to listeners
+     * @param stage
+     * @param rStart start of the stage, it ends now
+     * @param pScan scan the stage worked on
+     */
+    void FireStageTimed(MapperStage stage, const std::chrono::steady_clock::time_point& rStart,
+                        const LocalizedRangeScan* pScan = NULL) const;
+
     // FireRunningScansUpdated
 
     // FireCovarianceCalculated
@@ -2153,6 +2974,38 @@ namespace karto
     ScanSolver* m_pScanOptimizer;
     LocalizationScanVertices m_LocalizationScanVertices;
 
+    // Occupancy grid of all processed scans, not serialized
+    IncrementalOccupancyGrid* m_pOccupancyGrid;
+
+    // Front end of each sensor registered for MatchScan and its match waiting for InsertScan, not
+    // serialized
+    struct SensorFrontEnd
+    {
+      ScanMatcher* pScanMatcher;
+      LocalizedRangeScan* pPendingScan;
+      LocalizedRangeScan* pReferenceScan; // last scan of the sensor when pPendingScan was matched
+      Pose2 referencePose;
+      std::chrono::steady_clock::time_point matchStart;
+    };
+    typedef std::map<Name, SensorFrontEnd> SensorFrontEnds;
+    SensorFrontEnds m_FrontEnds;
+
+    // Background optimization thread and the solver updates deferred while it runs, not serialized
+    typedef std::vector<std::pair<Vertex<LocalizedRangeScan>*, Edge<LocalizedRangeScan>*> > DeferredSolverUpdates;
+    std::thread m_OptimizerThread;
+    std::mutex m_OptimizerMutex;
+    std::condition_variable m_OptimizerCondition;
+    kt_bool m_OptimizerStop;
+    kt_bool m_OptimizationRunning;
+    kt_bool m_OptimizationSolving;
+    kt_bool m_OptimizationRequested;
+    ScanSolver::IdPoseVector m_BackgroundCorrections;
+    DeferredSolverUpdates m_DeferredSolverUpdates;
+    kt_int32s m_LastSolverScanId;
+
+    // advanced by corrections and removals, not serialized
+    kt_int64u m_GraphRevision;
+
 
     std::vector<MapperListener*> m_Listeners;
 
@@ -2356,6 +3209,25 @@ namespace karto
     // Threshold for ignoring scan if response is too low
     Parameter<kt_double>* m_pMinimumScanMatchResponse;
 
+    // whether loop closure and initialization matching use branch and bound
+    Parameter<kt_bool>* m_pUseBranchAndBoundMatching;
+
+    // whether sequential matching keeps a correlation grid per sensor between scans
+    Parameter<kt_bool>* m_pUseSequentialGridCache;
+
+    // whether loop closure candidates are matched concurrently and closed with a single optimization
+    Parameter<kt_bool>* m_pUseBatchedLoopClosure;
+
+    // whether the optimization after a loop closure runs on a background thread
+    Parameter<kt_bool>* m_pUseBackgroundOptimization;
+
+    // whether scans are kept with quantized ranges, and how many of them keep their point readings
+    Parameter<kt_bool>* m_pUseCompactScans;
+    Parameter<kt_int32u>* m_pMaximumMaterializedScans;
+
+    // fraction of a cell the beams of a scan must move by before the map raytraces it again
+    Parameter<kt_double>* m_pRaytracePoseChangeThreshold;
+
     friend class boost::serialization::access;
     template<class Archive>
     void serialize(Archive &ar, const unsigned int version)
@@ -2370,7 +3242,10 @@ namespace karto
       std::cout << "Mapper <- m_pMapperSensorManager\n";
       ar & BOOST_SERIALIZATION_NVP(m_pMapperSensorManager);
       std::cout << "Mapper <- m_Listeners\n";
-      ar & BOOST_SERIALIZATION_NVP(m_Listeners);
+      // listeners are hooks of the running process, such as the stage timers, and are never
+      // persisted; an empty list keeps the archive layout of older pose graphs
+      std::vector<MapperListener*> listeners;
+      ar & boost::serialization::make_nvp("m_Listeners", listeners);
       ar & BOOST_SERIALIZATION_NVP(m_pUseScanMatching);
       ar & BOOST_SERIALIZATION_NVP(m_pUseScanBarycenter);
       ar & BOOST_SERIALIZATION_NVP(m_pMinimumTimeInterval);
@@ -2447,6 +3322,13 @@ namespace karto
     double getParamMinimumDistancePenalty();
     bool getParamUseResponseExpansion();
     double getParamMinimumScanMatchResponse();
+    bool getParamUseBranchAndBoundMatching();
+    bool getParamUseSequentialGridCache();
+    bool getParamUseBatchedLoopClosure();
+    bool getParamUseBackgroundOptimization();
+    bool getParamUseCompactScans();
+    int getParamMaximumMaterializedScans();
+    double getParamRaytracePoseChangeThreshold();
 
     /* Setters */
     // General Parameters
@@ -2490,6 +3372,13 @@ namespace karto
     void setParamMinimumDistancePenalty(double d);
     void setParamUseResponseExpansion(bool b);
     void setParamMinimumScanMatchResponse(double d);
+    void setParamUseBranchAndBoundMatching(bool b);
+    void setParamUseSequentialGridCache(bool b);
+    void setParamUseBatchedLoopClosure(bool b);
+    void setParamUseBackgroundOptimization(bool b);
+    void setParamUseCompactScans(bool b);
+    void setParamMaximumMaterializedScans(int i);
+    void setParamRaytracePoseChangeThreshold(double d);
   };
   BOOST_SERIALIZATION_ASSUME_ABSTRACT(Mapper)
 }  // namespace karto
@@ -73,3 +73,26 @@ struct VertexVectorScanCenterNanoFlannAdaptor
   bool kdtree_get_bbox(BBOX& /*bb*/) const { return false; }
 
 }; // end of VertexVectorScanCenterNanoFlannAdaptor
+
+// And this is the "dataset to kd-tree" adaptor class for positions copied out of the vertices:
+template <typename Derived>
+struct PointVectorNanoFlannAdaptor
+{
+  const Derived &obj;
+
+  PointVectorNanoFlannAdaptor(const Derived &obj_) : obj(obj_) { }
+
+  inline const Derived& derived() const { return obj; }
+
+  inline size_t kdtree_get_point_count() const { return derived().size(); }
+
+  inline double kdtree_get_pt(const size_t idx, const size_t dim) const
+  {
+    if (dim == 0) return derived()[idx].GetX();
+    else return derived()[idx].GetY();
+  }
+
+  template <class BBOX>
+  bool kdtree_get_bbox(BBOX& /*bb*/) const { return false; }
+
+}; // end of PointVectorNanoFlannAdaptor
@@ -23,6 +23,11 @@
 #include <string.h>
 #include <stdio.h>
 #include "karto_sdk/Karto.h"
+#include "tbb/parallel_for.h"
+#include "tbb/parallel_reduce.h"
+#include "tbb/blocked_range.h"
+#include "tbb/enumerable_thread_specific.h"
+#include "tbb/task_arena.h"
 #include <boost/serialization/export.hpp>
 BOOST_CLASS_EXPORT_IMPLEMENT(karto::NonCopyable);
 BOOST_CLASS_EXPORT_IMPLEMENT(karto::Object);
@@ -135,6 +140,298 @@ namespace karto
   ////////////////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////////////////
 
+  void PointReadingsCache::Trim()
+  {
+    std::vector<LocalizedRangeScan*> released;
+    {
+      std::lock_guard<std::mutex> lock(m_Mutex);
+      m_Epoch++;
+      if (m_Scans.size() <= m_Capacity)
+      {
+        return;
+      }
+
+      // oldest uses first
+      released.assign(m_Scans.begin(), m_Scans.end());
+      size_t nReleased = released.size() - m_Capacity;
+      std::nth_element(released.begin(), released.begin() + nReleased, released.end(),
+        [](const LocalizedRangeScan* pScan1, const LocalizedRangeScan* pScan2)
+        {
+          return pScan1->m_PointReadingsUse.load(std::memory_order_relaxed) <
+                 pScan2->m_PointReadingsUse.load(std::memory_order_relaxed);
+        });
+      released.resize(nReleased);
+
+      forEach(std::vector<LocalizedRangeScan*>, &released)
+      {
+        m_Scans.erase(*iter);
+      }
+    }
+
+    // outside of the cache lock, scans lock themselves before adding to it
+    forEach(std::vector<LocalizedRangeScan*>, &released)
+    {
+      std::unique_lock<std::shared_mutex> lock((*iter)->m_Lock);
+      (*iter)->ReleasePointReadings();
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////
+
+  void OccupancyGrid::CreateFromScans(const LocalizedRangeScanVector& rScans)
+  {
+    // scans per task, a worker's own counters cost about as much to clear and sum up as
+    // raytracing a few dozen scans
+    const size_t grainSize = 64;
+
+    m_pCellPassCnt->Resize(GetWidth(), GetHeight());
+    m_pCellPassCnt->GetCoordinateConverter()->SetOffset(GetCoordinateConverter()->GetOffset());
+
+    m_pCellHitsCnt->Resize(GetWidth(), GetHeight());
+    m_pCellHitsCnt->GetCoordinateConverter()->SetOffset(GetCoordinateConverter()->GetOffset());
+
+    kt_int32s concurrency = GetMaximumRaytraceConcurrency();
+    if (rScans.size() < 2 * grainSize || concurrency < 2)
+    {
+      const_forEach(LocalizedRangeScanVector, &rScans)
+      {
+        if (*iter == nullptr)
+        {
+          continue;
+        }
+
+        LocalizedRangeScan* pScan = *iter;
+        AddScan(pScan);
+      }
+
+      Update();
+      return;
+    }
+
+    // grids with only counters, of the same size and placement as this one's, one per thread of
+    // the arena
+    tbb::enumerable_thread_specific<std::unique_ptr<OccupancyGrid> > partialGrids;
+    tbb::task_arena arena(concurrency);
+    arena.execute([&]()
+    {
+      tbb::parallel_for(tbb::blocked_range<size_t>(0, rScans.size(), grainSize),
+                        [&](const tbb::blocked_range<size_t>& rRange)
+      {
+        std::unique_ptr<OccupancyGrid>& rpPartialGrid = partialGrids.local();
+        if (!rpPartialGrid)
+        {
+          rpPartialGrid.reset(new OccupancyGrid(0, 0, GetCoordinateConverter()->GetOffset(),
+                                                1.0 / GetCoordinateConverter()->GetScale()));
+          delete rpPartialGrid->m_pCellPassCnt;
+          delete rpPartialGrid->m_pCellHitsCnt;
+          rpPartialGrid->m_pCellPassCnt = m_pCellPassCnt->Clone();
+          rpPartialGrid->m_pCellHitsCnt = m_pCellHitsCnt->Clone();
+        }
+
+        for (size_t i = rRange.begin(); i != rRange.end(); i++)
+        {
+          if (rScans[i] != nullptr)
+          {
+            rpPartialGrid->AddScan(rScans[i]);
+          }
+        }
+      });
+    });
+
+    std::vector<const kt_int32u*> partialPassCnts;
+    std::vector<const kt_int32u*> partialHitsCnts;
+    for (std::unique_ptr<OccupancyGrid>& rpPartialGrid : partialGrids)
+    {
+      partialPassCnts.push_back(rpPartialGrid->m_pCellPassCnt->GetDataPointer());
+      partialHitsCnts.push_back(rpPartialGrid->m_pCellHitsCnt->GetDataPointer());
+    }
+
+    kt_int32u* pCellPassCntPtr = m_pCellPassCnt->GetDataPointer();
+    kt_int32u* pCellHitCntPtr = m_pCellHitsCnt->GetDataPointer();
+    tbb::parallel_for(tbb::blocked_range<kt_int32s>(0, m_pCellPassCnt->GetDataSize(), 4096),
+                      [&](const tbb::blocked_range<kt_int32s>& rRange)
+    {
+      for (size_t j = 0; j < partialPassCnts.size(); j++)
+      {
+        const kt_int32u* pPartialPassCnt = partialPassCnts[j];
+        const kt_int32u* pPartialHitsCnt = partialHitsCnts[j];
+        for (kt_int32s i = rRange.begin(); i != rRange.end(); i++)
+        {
+          pCellPassCntPtr[i] += pPartialPassCnt[i];
+          pCellHitCntPtr[i] += pPartialHitsCnt[i];
+        }
+      }
+    });
+
+    Update();
+  }
+
+  kt_int32s OccupancyGrid::GetMaximumRaytraceConcurrency() const
+  {
+    // pass and hit counters of all threads together
+    const size_t maximumCounterBytes = 256 * 1024 * 1024;
+
+    size_t counterBytes = 2 * sizeof(kt_int32u) * math::Maximum(GetDataSize(), 1);
+    size_t maximumThreads = math::Maximum<size_t>(maximumCounterBytes / counterBytes, 1);
+    return static_cast<kt_int32s>(math::Minimum<size_t>(maximumThreads,
+                                                        tbb::this_task_arena::max_concurrency()));
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////
+
+  void IncrementalOccupancyGrid::RasterizeScans(const std::vector<Rasterization>& rRasterizations)
+  {
+    // scans per task, as for OccupancyGrid::CreateFromScans
+    const size_t grainSize = 64;
+
+    if (rRasterizations.size() < 2 * grainSize)
+    {
+      const_forEach(std::vector<Rasterization>, &rRasterizations)
+      {
+        RasterizeScan(iter->pScan, iter->pose, iter->delta);
+      }
+      return;
+    }
+
+    // anchored at the first scan as if raytraced one by one, after which computing beams only
+    // reads the grid
+    const Rasterization& rFirst = rRasterizations.front();
+    ToAnchorCell(rFirst.pScan->GetSensorAt(rFirst.pose).GetPosition());
+
+    // grow once to contain all added beams, subtracted ones were in the grid already
+    typedef std::pair<Vector2<kt_int32s>, Vector2<kt_int32s> > CellBounds;
+    const CellBounds emptyBounds(Vector2<kt_int32s>(INT_MAX, INT_MAX), Vector2<kt_int32s>(INT_MIN, INT_MIN));
+    tbb::enumerable_thread_specific<ScanBeams> scanBeams;
+    CellBounds bounds = tbb::parallel_reduce(tbb::blocked_range<size_t>(0, rRasterizations.size(), grainSize),
+                                             emptyBounds,
+                                             [&](const tbb::blocked_range<size_t>& rRange, CellBounds rangeBounds)
+    {
+      ScanBeams& rBeams = scanBeams.local();
+      for (size_t i = rRange.begin(); i != rRange.end(); i++)
+      {
+        if (rRasterizations[i].delta > 0)
+        {
+          ComputeBeams(rRasterizations[i].pScan, rRasterizations[i].pose, rBeams);
+          rangeBounds.first.MakeFloor(rBeams.minCell);
+          rangeBounds.second.MakeCeil(rBeams.maxCell);
+        }
+      }
+      return rangeBounds;
+    },
+    [](CellBounds a, const CellBounds& b)
+    {
+      a.first.MakeFloor(b.first);
+      a.second.MakeCeil(b.second);
+      return a;
+    });
+
+    if (bounds.first.GetX() <= bounds.second.GetX())
+    {
+      GrowToContain(bounds.first, bounds.second);
+    }
+
+    kt_int32s concurrency = GetMaximumRaytraceConcurrency();
+    if (concurrency < 2)
+    {
+      const_forEach(std::vector<Rasterization>, &rRasterizations)
+      {
+        RasterizeScan(iter->pScan, iter->pose, iter->delta);
+      }
+      return;
+    }
+
+    // counters of the same layout as the grid's, one pair per thread of the arena
+    struct PartialCounters
+    {
+      std::unique_ptr<Grid<kt_int32u> > pCellPassCnt;
+      std::unique_ptr<Grid<kt_int32u> > pCellHitsCnt;
+    };
+    tbb::enumerable_thread_specific<PartialCounters> partialCounters;
+    tbb::task_arena arena(concurrency);
+    arena.execute([&]()
+    {
+      tbb::parallel_for(tbb::blocked_range<size_t>(0, rRasterizations.size(), grainSize),
+                        [&](const tbb::blocked_range<size_t>& rRange)
+      {
+        PartialCounters& rCounters = partialCounters.local();
+        if (!rCounters.pCellPassCnt)
+        {
+          rCounters.pCellPassCnt.reset(Grid<kt_int32u>::CreateGrid(GetWidth(), GetHeight(), m_Resolution));
+          rCounters.pCellHitsCnt.reset(Grid<kt_int32u>::CreateGrid(GetWidth(), GetHeight(), m_Resolution));
+        }
+
+        ScanBeams& rBeams = scanBeams.local();
+        for (size_t i = rRange.begin(); i != rRange.end(); i++)
+        {
+          ComputeBeams(rRasterizations[i].pScan, rRasterizations[i].pose, rBeams);
+          TraceBeams(rBeams, rRasterizations[i].delta, rCounters.pCellPassCnt->GetDataPointer(),
+                     rCounters.pCellHitsCnt->GetDataPointer(), false);
+        }
+      });
+    });
+
+    std::vector<const kt_int32u*> partialPassCnts;
+    std::vector<const kt_int32u*> partialHitsCnts;
+    for (PartialCounters& rCounters : partialCounters)
+    {
+      partialPassCnts.push_back(rCounters.pCellPassCnt->GetDataPointer());
+      partialHitsCnts.push_back(rCounters.pCellHitsCnt->GetDataPointer());
+    }
+
+    // summed up tile by tile, so that each tile knows whether any of its cells were touched, in
+    // byte flags as neighbouring tiles are summed up concurrently
+    kt_int32u* pCellPassCntPtr = m_pCellPassCnt->GetDataPointer();
+    kt_int32u* pCellHitCntPtr = m_pCellHitsCnt->GetDataPointer();
+    kt_int32s tileSize = GetTileSize();
+    std::vector<kt_int8u> isTileTouched(m_IsTileDirty.size(), 0);
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, isTileTouched.size()),
+                      [&](const tbb::blocked_range<size_t>& rRange)
+    {
+      for (size_t tile = rRange.begin(); tile != rRange.end(); tile++)
+      {
+        kt_int32s minX = (static_cast<kt_int32s>(tile) % m_NumberOfTilesX) * tileSize;
+        kt_int32s minY = (static_cast<kt_int32s>(tile) / m_NumberOfTilesX) * tileSize;
+        kt_int32s maxX = math::Minimum(minX + tileSize, GetWidth());
+        kt_int32s maxY = math::Minimum(minY + tileSize, GetHeight());
+
+        kt_bool isTouched = false;
+        for (size_t j = 0; j < partialPassCnts.size(); j++)
+        {
+          const kt_int32u* pPartialPassCnt = partialPassCnts[j];
+          const kt_int32u* pPartialHitsCnt = partialHitsCnts[j];
+          for (kt_int32s y = minY; y < maxY; y++)
+          {
+            kt_int32s rowIndex = GridIndex(Vector2<kt_int32s>(0, y), false);
+            for (kt_int32s i = rowIndex + minX; i != rowIndex + maxX; i++)
+            {
+              isTouched = isTouched || pPartialPassCnt[i] != 0 || pPartialHitsCnt[i] != 0;
+              pCellPassCntPtr[i] += pPartialPassCnt[i];
+              pCellHitCntPtr[i] += pPartialHitsCnt[i];
+            }
+          }
+        }
+        isTileTouched[tile] = isTouched;
+      }
+    });
+
+    for (size_t tile = 0; tile < isTileTouched.size(); tile++)
+    {
+      if (isTileTouched[tile] && !m_IsTileDirty[tile])
+      {
+        m_IsTileDirty[tile] = true;
+        m_DirtyTiles.push_back(static_cast<kt_int32s>(tile));
+      }
+    }
+  }
+
+  ////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////
+
   void CellUpdater::operator() (kt_int32u index)
   {
     kt_int8u* pDataPtr = m_pOccupancyGrid->GetDataPointer();
@@ -172,10 +469,9 @@ namespace karto
 
     // compute point readings
     kt_int32u beamNum = 0;
-    kt_double* pRangeReadings = pLocalizedRangeScan->GetRangeReadings();
     for (kt_int32u i = 0; i < m_NumberOfRangeReadings; i++, beamNum++)
     {
-      kt_double rangeReading = pRangeReadings[i];
+      kt_double rangeReading = pLocalizedRangeScan->GetRangeReading(i);
 
       if (ignoreThresholdPoints)
       {
@@ -26,6 +26,9 @@
 #include <math.h>
 #include <assert.h>
 #include <boost/serialization/vector.hpp>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 #include "karto_sdk/Mapper.h"
 
@@ -47,6 +50,32 @@ namespace karto
   #define DISTANCE_PENALTY_GAIN   0.2
   #define ANGLE_PENALTY_GAIN      0.2
 
+  /**
+   * Fires the time from its construction to its destruction to the mapper's stage listeners
+   */
+  class ScopedStageTimer
+  {
+  public:
+    ScopedStageTimer(const Mapper* pMapper, MapperStage stage, const LocalizedRangeScan* pScan = NULL)
+      : m_pMapper(pMapper)
+      , m_Stage(stage)
+      , m_pScan(pScan)
+      , m_Start(std::chrono::steady_clock::now())
+    {
+    }
+
+    ~ScopedStageTimer()
+    {
+      m_pMapper->FireStageTimed(m_Stage, m_Start, m_pScan);
+    }
+
+  private:
+    const Mapper* m_pMapper;
+    MapperStage m_Stage;
+    const LocalizedRangeScan* m_pScan;
+    std::chrono::steady_clock::time_point m_Start;
+  };  // ScopedStageTimer
+
   ////////////////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////////////////
   ////////////////////////////////////////////////////////////////////////////////////////
@@ -338,6 +367,13 @@ namespace karto
    */
   void MapperSensorManager::AddScan(LocalizedRangeScan* pScan)
   {
+    if (m_pPointReadingsCache)
+    {
+      // nothing holds on to point readings between scans
+      m_pPointReadingsCache->Trim();
+      pScan->UseCompactStorage(m_pPointReadingsCache);
+    }
+
     GetScanManager(pScan)->AddScan(pScan, m_NextScanId);
     m_Scans.insert({m_NextScanId, pScan});
     m_NextScanId++;
@@ -445,6 +481,19 @@ namespace karto
     return scans;
   }
 
+  void MapperSensorManager::SetPointReadingsCache(const std::shared_ptr<PointReadingsCache>& rCache)
+  {
+    m_pPointReadingsCache = rCache;
+
+    forEach(LocalizedRangeScanMap, &m_Scans)
+    {
+      if (iter->second != NULL)
+      {
+        iter->second->SetPointReadingsCache(rCache);
+      }
+    }
+  }
+
   /**
    * Deletes all scan managers of all devices
    */
@@ -479,11 +528,17 @@ namespace karto
     {
       delete m_pGridLookup;
     }
-
+    for (std::map<Name, GridCache*>::iterator iter = m_GridCaches.begin(); iter != m_GridCaches.end(); ++iter)
+    {
+      delete iter->second->pGrid;
+      delete iter->second->pGridLookup;
+      delete iter->second;
+    }
   }
 
   ScanMatcher* ScanMatcher::Create(Mapper* pMapper, kt_double searchSize, kt_double resolution,
-                                   kt_double smearDeviation, kt_double rangeThreshold)
+                                   kt_double smearDeviation, kt_double rangeThreshold,
+                                   kt_bool useBranchAndBound, kt_bool useGridCache)
   {
     // invalid parameters
     if (resolution <= 0)
@@ -526,6 +581,8 @@ namespace karto
     pScanMatcher->m_pCorrelationGrid = pCorrelationGrid;
     pScanMatcher->m_pSearchSpaceProbs = pSearchSpaceProbs;
     pScanMatcher->m_pGridLookup = new GridIndexLookup<kt_int8u>(pCorrelationGrid);
+    pScanMatcher->m_useBranchAndBound = useBranchAndBound;
+    pScanMatcher->m_useGridCache = useGridCache;
 
     return pScanMatcher;
   }
@@ -544,6 +601,8 @@ namespace karto
   kt_double ScanMatcher::MatchScan(LocalizedRangeScan* pScan, const T& rBaseScans, Pose2& rMean,
                                    Matrix3& rCovariance, kt_bool doPenalize, kt_bool doRefineMatch)
   {
+    ScopedStageTimer timer(m_pMapper, MapperStage_MatchScan, pScan);
+
     ///////////////////////////////////////
     // set scan pose to be center of grid
 
@@ -580,6 +639,75 @@ namespace karto
     // set up correlation grid
     AddScans(rBaseScans, scanPose.GetPosition());
 
+    return SearchCorrelationGrid(pScan, scanPose, rMean, rCovariance, doPenalize, doRefineMatch);
+  }
+
+  /**
+   * Match given scan against the running scans of its sensor, keeping a correlation grid per sensor
+   * @param pScan scan being scan-matched
+   * @param rRunningScans running scans of the scan's sensor
+   * @param rMean output parameter of mean (best pose) of match
+   * @param rCovariance output parameter of covariance of match
+   * @param doPenalize whether to penalize matches further from the search center
+   * @param doRefineMatch whether to do finer-grained matching if coarse match is good (default is true)
+   * @return strength of response
+   */
+  kt_double ScanMatcher::MatchScanToRunningScans(LocalizedRangeScan* pScan,
+                                                 const LocalizedRangeScanVector& rRunningScans,
+                                                 Pose2& rMean, Matrix3& rCovariance,
+                                                 kt_bool doPenalize, kt_bool doRefineMatch)
+  {
+    if (m_useGridCache == false || pScan->GetNumberOfRangeReadings() == 0)
+    {
+      return MatchScan(pScan, rRunningScans, rMean, rCovariance, doPenalize, doRefineMatch);
+    }
+
+    ScopedStageTimer timer(m_pMapper, MapperStage_MatchScan, pScan);
+    GridCache* pCache = GetGridCache(pScan->GetSensorName());
+
+    // search the sensor's cached grid instead of the matcher's own
+    CorrelationGrid* pCorrelationGrid = m_pCorrelationGrid;
+    GridIndexLookup<kt_int8u>* pGridLookup = m_pGridLookup;
+    m_pCorrelationGrid = pCache->pGrid;
+    m_pGridLookup = pCache->pGridLookup;
+    m_PooledWindows.clear();
+
+    kt_double bestResponse = 0.0;
+    try
+    {
+      UpdateGridCache(pCache, pScan, rRunningScans);
+      bestResponse = SearchCorrelationGrid(pScan, pScan->GetSensorPose(), rMean, rCovariance,
+                                           doPenalize, doRefineMatch);
+    }
+    catch(...)
+    {
+      m_pCorrelationGrid = pCorrelationGrid;
+      m_pGridLookup = pGridLookup;
+      m_PooledWindows.clear();
+      throw;
+    }
+
+    m_pCorrelationGrid = pCorrelationGrid;
+    m_pGridLookup = pGridLookup;
+    m_PooledWindows.clear();
+
+    return bestResponse;
+  }
+
+  /**
+   * Searches the correlation grid, already set up with the base scans, for the best pose of the scan
+   * @param pScan scan being scan-matched
+   * @param rScanPose pose of the scan, center of the search
+   * @param rMean output parameter of mean (best pose) of match
+   * @param rCovariance output parameter of covariance of match
+   * @param doPenalize whether to penalize matches further from the search center
+   * @param doRefineMatch whether to do finer-grained matching if coarse match is good
+   * @return strength of response
+   */
+  kt_double ScanMatcher::SearchCorrelationGrid(LocalizedRangeScan* pScan, const Pose2& rScanPose,
+                                               Pose2& rMean, Matrix3& rCovariance,
+                                               kt_bool doPenalize, kt_bool doRefineMatch)
+  {
     // compute how far to search in each direction
     Vector2<kt_double> searchDimensions(m_pSearchSpaceProbs->GetWidth(), m_pSearchSpaceProbs->GetHeight());
     Vector2<kt_double> coarseSearchOffset(0.5 * (searchDimensions.GetX() - 1) * m_pCorrelationGrid->GetResolution(),
@@ -590,7 +718,7 @@ namespace karto
                                               2 * m_pCorrelationGrid->GetResolution());
 
     // actual scan-matching
-    kt_double bestResponse = CorrelateScan(pScan, scanPose, coarseSearchOffset, coarseSearchResolution,
+    kt_double bestResponse = CorrelateScan(pScan, rScanPose, coarseSearchOffset, coarseSearchResolution,
                                            m_pMapper->m_pCoarseSearchAngleOffset->GetValue(),
                                            m_pMapper->m_pCoarseAngleResolution->GetValue(),
                                            doPenalize, rMean, rCovariance, false);
@@ -608,7 +736,7 @@ namespace karto
         {
           newSearchAngleOffset += math::DegreesToRadians(20);
 
-          bestResponse = CorrelateScan(pScan, scanPose, coarseSearchOffset, coarseSearchResolution,
+          bestResponse = CorrelateScan(pScan, rScanPose, coarseSearchOffset, coarseSearchResolution,
                                        newSearchAngleOffset, m_pMapper->m_pCoarseAngleResolution->GetValue(),
                                        doPenalize, rMean, rCovariance, false);
 
@@ -646,58 +774,114 @@ namespace karto
     return bestResponse;
   }
 
-  void ScanMatcher::operator() (const kt_double& y) const
+  /**
+   * Scores every pose of one row of the search space into the pose response arena and
+   * records the row's best response and the poses that may tie with the overall best
+   * @param yIndex index of the row in m_yPoses
+   * @param updateSearchSpaceProbs whether to also update the search space probabilities
+   */
+  void ScanMatcher::CorrelateRow(kt_int32u yIndex, kt_bool updateSearchSpaceProbs)
   {
-    kt_int32u poseResponseCounter;
-    kt_int32u x_pose;
-    kt_int32u y_pose = std::find(m_yPoses.begin(), m_yPoses.end(), y) - m_yPoses.begin();
-
     const kt_int32u size_x = m_xPoses.size();
 
+    kt_double y = m_yPoses[yIndex];
     kt_double newPositionY = m_rSearchCenter.GetY() + y;
     kt_double squareY = math::Square(y);
 
-    for ( std::vector<kt_double>::const_iterator xIter = m_xPoses.begin(); xIter != m_xPoses.end(); ++xIter )
+    // grid index of every position in the row so responses can be computed several at a time
+    kt_int32s* pGridIndices = &m_RowGridIndices[yIndex * size_x];
+    for (kt_int32u x_pose = 0; x_pose < size_x; x_pose++)
     {
-      x_pose = std::distance(m_xPoses.begin(), xIter);
-      kt_double x = *xIter;
-      kt_double newPositionX = m_rSearchCenter.GetX() + x;
-      kt_double squareX = math::Square(x);
+      kt_double newPositionX = m_rSearchCenter.GetX() + m_xPoses[x_pose];
 
       Vector2<kt_int32s> gridPoint = m_pCorrelationGrid->WorldToGrid(Vector2<kt_double>(newPositionX, newPositionY));
-      kt_int32s gridIndex = m_pCorrelationGrid->GridIndex(gridPoint);
-      assert(gridIndex >= 0);
+      pGridIndices[x_pose] = m_pCorrelationGrid->GridIndex(gridPoint);
+      assert(pGridIndices[x_pose] >= 0);
+    }
 
-      kt_double angle = 0.0;
-      kt_double startAngle = m_rSearchCenter.GetHeading() - m_searchAngleOffset;
-      for (kt_int32u angleIndex = 0; angleIndex < m_nAngles; angleIndex++)
-      {
-        angle = startAngle + angleIndex * m_searchAngleResolution;
+    RowBest& rRowBest = m_RowBests[yIndex];
+    rRowBest.response = -1;
+    rRowBest.candidates.clear();
+
+    kt_double* pResponses = &m_RowResponses[yIndex * size_x];
+    const std::vector<kt_double>& rAngles = m_pGridLookup->GetAngles();
+    for (kt_int32u angleIndex = 0; angleIndex < m_nAngles; angleIndex++)
+    {
+      kt_double angle = rAngles[angleIndex];
+
+      GetResponses(angleIndex, pGridIndices, size_x, pResponses);
 
-        kt_double response = GetResponse(angleIndex, gridIndex);
+      for (kt_int32u x_pose = 0; x_pose < size_x; x_pose++)
+      {
+        kt_double x = m_xPoses[x_pose];
+        kt_double response = pResponses[x_pose];
         if (m_doPenalize && (math::DoubleEqual(response, 0.0) == false))
         {
-          // simple model (approximate Gaussian) to take odometry into account
-          kt_double squaredDistance = squareX + squareY;
-          kt_double distancePenalty = 1.0 - (DISTANCE_PENALTY_GAIN *
-                                             squaredDistance / m_pMapper->m_pDistanceVariancePenalty->GetValue());
-          distancePenalty = math::Maximum(distancePenalty, m_pMapper->m_pMinimumDistancePenalty->GetValue());
-
-          kt_double squaredAngleDistance = math::Square(angle - m_rSearchCenter.GetHeading());
-          kt_double anglePenalty = 1.0 - (ANGLE_PENALTY_GAIN *
-                                          squaredAngleDistance / m_pMapper->m_pAngleVariancePenalty->GetValue());
-          anglePenalty = math::Maximum(anglePenalty, m_pMapper->m_pMinimumAnglePenalty->GetValue());
-
-          response *= (distancePenalty * anglePenalty);
+          response *= ComputePenalty(math::Square(x) + squareY, angle);
         }
 
         // store response and pose
-        poseResponseCounter = (y_pose*size_x + x_pose)*(m_nAngles) + angleIndex;
-        m_pPoseResponse[poseResponseCounter] = std::pair<kt_double, Pose2>(response, Pose2(newPositionX, newPositionY,
-                                                                         math::NormalizeAngle(angle)));
+        kt_int32u poseResponseCounter = (yIndex * size_x + x_pose) * m_nAngles + angleIndex;
+        std::pair<kt_double, Pose2>& rPoseResponse = m_PoseResponses[poseResponseCounter];
+        rPoseResponse = std::pair<kt_double, Pose2>(response, Pose2(m_rSearchCenter.GetX() + x, newPositionY,
+                                                                    math::NormalizeAngle(angle)));
+
+        if (updateSearchSpaceProbs)
+        {
+          UpdateSearchSpaceProbs(rPoseResponse);
+        }
+
+        // keep every pose that could still equal the best response of the whole search,
+        // which is at least the best response of this row
+        if (response > rRowBest.response)
+        {
+          rRowBest.response = response;
+
+          std::vector<kt_int32u>& rCandidates = rRowBest.candidates;
+          kt_int32u nCandidates = 0;
+          for (kt_int32u i = 0; i < rCandidates.size(); i++)
+          {
+            if (m_PoseResponses[rCandidates[i]].first - response >= -KT_TOLERANCE)
+            {
+              rCandidates[nCandidates++] = rCandidates[i];
+            }
+          }
+          rCandidates.resize(nCandidates);
+        }
+
+        if (response - rRowBest.response >= -KT_TOLERANCE)
+        {
+          rRowBest.candidates.push_back(poseResponseCounter);
+        }
       }
     }
-    return;
+  }
+
+  /**
+   * Raises the search space probability of the cell of the given pose to its response
+   * @param rPoseResponse
+   */
+  void ScanMatcher::UpdateSearchSpaceProbs(const std::pair<kt_double, Pose2>& rPoseResponse)
+  {
+    const Pose2& rPose = rPoseResponse.second;
+    Vector2<kt_int32s> grid = m_pSearchSpaceProbs->WorldToGrid(rPose.GetPosition());
+    kt_double* ptr;
+
+    try
+    {
+      ptr = (kt_double*)(m_pSearchSpaceProbs->GetDataPointer(grid));
+    }
+    catch(...)
+    {
+      throw std::runtime_error("Mapper FATAL ERROR - unable to get pointer in probability search!");
+    }
+
+    if (ptr == NULL)
+    {
+      throw std::runtime_error("Mapper FATAL ERROR - Index out of range in probability search!");
+    }
+
+    *ptr = math::Maximum(rPoseResponse.first, *ptr);
   }
 
   /**
@@ -723,6 +907,13 @@ namespace karto
                                        kt_bool doPenalize, Pose2& rMean, Matrix3& rCovariance, kt_bool doingFineMatch)
   {
     assert(searchAngleResolution != 0.0);
+    ScopedStageTimer timer(m_pMapper, MapperStage_CorrelateScan, pScan);
+
+    if (m_useBranchAndBound && !doingFineMatch)
+    {
+      return CorrelateScanBranchAndBound(pScan, rSearchCenter, rSearchSpaceOffset, rSearchSpaceResolution,
+                                         searchAngleOffset, searchAngleResolution, doPenalize, rMean, rCovariance);
+    }
 
     // setup lookup arrays
     m_pGridLookup->ComputeOffsets(pScan, rSearchCenter.GetHeading(), searchAngleOffset, searchAngleResolution);
@@ -764,11 +955,32 @@ namespace karto
 
     kt_int32u poseResponseSize = static_cast<kt_int32u>(m_xPoses.size() * m_yPoses.size() * nAngles);
 
-    // allocate array
-    m_pPoseResponse = new std::pair<kt_double, Pose2>[poseResponseSize];
+    // grow the arena if this search is larger than any before
+    if (m_PoseResponses.size() < poseResponseSize)
+    {
+      m_PoseResponses.resize(poseResponseSize);
+    }
+    if (m_RowGridIndices.size() < nX * nY)
+    {
+      m_RowGridIndices.resize(nX * nY);
+      m_RowResponses.resize(nX * nY);
+    }
+    if (m_RowBests.size() < nY)
+    {
+      m_RowBests.resize(nY);
+    }
 
-    Vector2<kt_int32s> startGridPoint = m_pCorrelationGrid->WorldToGrid(Vector2<kt_double>(rSearchCenter.GetX()
-                                                                        + startX, rSearchCenter.GetY() + startY));
+    // rows can update the search space probabilities themselves as long as no two rows share
+    // a row of the probability grid, which holds unless the search is finer than the grid
+    kt_bool updateSearchSpaceProbsInRows = !doingFineMatch;
+    for (kt_int32u yIndex = 1; yIndex < nY && updateSearchSpaceProbsInRows; yIndex++)
+    {
+      kt_int32s previousRow = m_pSearchSpaceProbs->WorldToGrid(
+        Vector2<kt_double>(rSearchCenter.GetX(), rSearchCenter.GetY() + m_yPoses[yIndex - 1])).GetY();
+      kt_int32s row = m_pSearchSpaceProbs->WorldToGrid(
+        Vector2<kt_double>(rSearchCenter.GetX(), rSearchCenter.GetY() + m_yPoses[yIndex])).GetY();
+      updateSearchSpaceProbsInRows = (row != previousRow);
+    }
 
     // this isn't good but its the fastest way to iterate. Should clean up later.
     m_rSearchCenter = rSearchCenter;
@@ -776,56 +988,60 @@ namespace karto
     m_nAngles = nAngles;
     m_searchAngleResolution = searchAngleResolution;
     m_doPenalize = doPenalize;
-    tbb::parallel_do(m_yPoses, (*this) );
+    tbb::parallel_for(tbb::blocked_range<kt_int32u>(0, nY),
+                      [&](const tbb::blocked_range<kt_int32u>& rRange)
+    {
+      for (kt_int32u yIndex = rRange.begin(); yIndex != rRange.end(); yIndex++)
+      {
+        CorrelateRow(yIndex, updateSearchSpaceProbsInRows);
+      }
+    });
+
+    if (!doingFineMatch && !updateSearchSpaceProbsInRows)
+    {
+      for (kt_int32u i = 0; i < poseResponseSize; i++)
+      {
+        UpdateSearchSpaceProbs(m_PoseResponses[i]);
+      }
+    }
 
     // find value of best response (in [0; 1])
     kt_double bestResponse = -1;
-    for (kt_int32u i = 0; i < poseResponseSize; i++)
+    for (kt_int32u yIndex = 0; yIndex < nY; yIndex++)
     {
-      bestResponse = math::Maximum(bestResponse, m_pPoseResponse[i].first);
+      bestResponse = math::Maximum(bestResponse, m_RowBests[yIndex].response);
+    }
 
-      // will compute positional covariance, save best relative probability for each cell
-      if (!doingFineMatch)
+    // poses with same highest response are all among the rows' candidates; average them
+    // in pose order
+    m_TieIndices.clear();
+    for (kt_int32u yIndex = 0; yIndex < nY; yIndex++)
+    {
+      const std::vector<kt_int32u>& rCandidates = m_RowBests[yIndex].candidates;
+      for (kt_int32u i = 0; i < rCandidates.size(); i++)
       {
-        const Pose2& rPose = m_pPoseResponse[i].second;
-        Vector2<kt_int32s> grid = m_pSearchSpaceProbs->WorldToGrid(rPose.GetPosition());
-        kt_double* ptr;
-
-        try
-        {
-          ptr = (kt_double*)(m_pSearchSpaceProbs->GetDataPointer(grid));
-        }
-        catch(...)
-        {
-          throw std::runtime_error("Mapper FATAL ERROR - unable to get pointer in probability search!");
-        }
-
-        if (ptr == NULL)
+        if (math::DoubleEqual(m_PoseResponses[rCandidates[i]].first, bestResponse))
         {
-          throw std::runtime_error("Mapper FATAL ERROR - Index out of range in probability search!");
+          m_TieIndices.push_back(rCandidates[i]);
         }
-
-        *ptr = math::Maximum(m_pPoseResponse[i].first, *ptr);
       }
     }
+    std::sort(m_TieIndices.begin(), m_TieIndices.end());
 
-    // average all poses with same highest response
     Vector2<kt_double> averagePosition;
     kt_double thetaX = 0.0;
     kt_double thetaY = 0.0;
     kt_int32s averagePoseCount = 0;
-    for (kt_int32u i = 0; i < poseResponseSize; i++)
+    for (kt_int32u i = 0; i < m_TieIndices.size(); i++)
     {
-      if (math::DoubleEqual(m_pPoseResponse[i].first, bestResponse))
-      {
-        averagePosition += m_pPoseResponse[i].second.GetPosition();
+      const std::pair<kt_double, Pose2>& rPoseResponse = m_PoseResponses[m_TieIndices[i]];
+      averagePosition += rPoseResponse.second.GetPosition();
 
-        kt_double heading = m_pPoseResponse[i].second.GetHeading();
-        thetaX += cos(heading);
-        thetaY += sin(heading);
+      kt_double heading = rPoseResponse.second.GetHeading();
+      thetaX += cos(heading);
+      thetaY += sin(heading);
 
-        averagePoseCount++;
-      }
+      averagePoseCount++;
     }
 
     Pose2 averagePose;
@@ -843,10 +1059,6 @@ namespace karto
       throw std::runtime_error("Mapper FATAL ERROR - Unable to find best position");
     }
 
-    // delete pose response array
-    delete [] m_pPoseResponse;
-    m_pPoseResponse = nullptr;
-
 #ifdef KARTO_DEBUG
     std::cout << "bestPose: " << averagePose << std::endl;
     std::cout << "bestResponse: " << bestResponse << std::endl;
@@ -1013,14 +1225,16 @@ namespace karto
 
     kt_int32u nAngles = static_cast<kt_int32u>(math::Round(searchAngleOffset * 2 / searchAngleResolution) + 1);
 
-    kt_double angle = 0.0;
-    kt_double startAngle = rSearchCenter.GetHeading() - searchAngleOffset;
+    // same angles as the lookup arrays of the search
+    const std::vector<kt_double>& rAngles = m_pGridLookup->GetAngles();
+    assert(rAngles.size() == nAngles);
 
+    kt_double angle = 0.0;
     kt_double norm = 0.0;
     kt_double accumulatedVarianceThTh = 0.0;
     for (kt_int32u angleIndex = 0; angleIndex < nAngles; angleIndex++)
     {
-      angle = startAngle + angleIndex * searchAngleResolution;
+      angle = rAngles[angleIndex];
       kt_double response = GetResponse(angleIndex, gridIndex);
 
       // response is not a low response
@@ -1057,6 +1271,7 @@ namespace karto
   void ScanMatcher::AddScans(const LocalizedRangeScanVector& rScans, Vector2<kt_double> viewPoint)
   {
     m_pCorrelationGrid->Clear();
+    m_PooledWindows.clear();
 
     // add all scans to grid
     const_forEach(LocalizedRangeScanVector, &rScans)
@@ -1078,6 +1293,7 @@ namespace karto
   void ScanMatcher::AddScans(const LocalizedRangeScanMap& rScans, Vector2<kt_double> viewPoint)
   {
     m_pCorrelationGrid->Clear();
+    m_PooledWindows.clear();
 
     // add all scans to grid
     const_forEach(LocalizedRangeScanMap, &rScans)
@@ -1194,122 +1410,1115 @@ namespace karto
     return validPoints;
   }
 
+  // grid cache tiles are 2^GRID_CACHE_TILE_SHIFT cells on a side
+  const kt_int32s GRID_CACHE_TILE_SHIFT = 5;
+
   /**
-   * Get response at given position for given rotation (only look up valid points)
-   * @param angleIndex
-   * @param gridPositionIndex
-   * @return response
+   * Gets the grid cache of the given sensor, creating it if needed
+   * @param rSensorName
+   * @return grid cache
    */
-  kt_double ScanMatcher::GetResponse(kt_int32u angleIndex, kt_int32s gridPositionIndex) const
+  ScanMatcher::GridCache* ScanMatcher::GetGridCache(const Name& rSensorName)
   {
-    kt_double response = 0.0;
+    std::map<Name, GridCache*>::iterator iter = m_GridCaches.find(rSensorName);
+    if (iter != m_GridCaches.end())
+    {
+      return iter->second;
+    }
 
-    // add up value for each point
-    kt_int8u* pByte = m_pCorrelationGrid->GetDataPointer() + gridPositionIndex;
+    // same geometry as the matcher's own correlation grid
+    const Rectangle2<kt_int32s>& rRoi = m_pCorrelationGrid->GetROI();
 
-    const LookupArray* pOffsets = m_pGridLookup->GetLookupArray(angleIndex);
-    assert(pOffsets != NULL);
+    GridCache* pCache = new GridCache();
+    pCache->pGrid = CorrelationGrid::CreateGrid(rRoi.GetWidth(), rRoi.GetHeight(),
+                                                m_pCorrelationGrid->GetResolution(),
+                                                m_pCorrelationGrid->GetSmearDeviation());
+    pCache->pGridLookup = new GridIndexLookup<kt_int8u>(pCache->pGrid);
+    pCache->isAnchored = false;
+    pCache->hitCounts.assign(pCache->pGrid->GetWidth() * pCache->pGrid->GetHeight(), 0);
+    pCache->nTilesX = ((pCache->pGrid->GetWidth() - 1) >> GRID_CACHE_TILE_SHIFT) + 1;
+    pCache->nTilesY = ((pCache->pGrid->GetHeight() - 1) >> GRID_CACHE_TILE_SHIFT) + 1;
+    pCache->dirtyTiles.assign(pCache->nTilesX * pCache->nTilesY, false);
 
-    // get number of points in offset list
-    kt_int32u nPoints = pOffsets->GetSize();
-    if (nPoints == 0)
+    m_GridCaches[rSensorName] = pCache;
+
+    return pCache;
+  }
+
+  /**
+   * Brings the cached grid up to date for matching the given scan against the given scans
+   * @param pCache
+   * @param pScan scan being scan-matched
+   * @param rScans running scans
+   */
+  void ScanMatcher::UpdateGridCache(GridCache* pCache, LocalizedRangeScan* pScan,
+                                    const LocalizedRangeScanVector& rScans)
+  {
+    CorrelationGrid* pGrid = pCache->pGrid;
+    const Rectangle2<kt_int32s>& rRoi = pGrid->GetROI();
+    kt_double resolution = pGrid->GetResolution();
+    Pose2 scanPose = pScan->GetSensorPose();
+
+    if (pCache->isAnchored == false)
     {
-      return response;
+      pCache->anchor = scanPose.GetPosition();
+      pCache->isAnchored = true;
     }
 
-    // calculate response
-    kt_int32s* pAngleIndexPointer = pOffsets->GetArrayPointer();
-    for (kt_int32u i = 0; i < nPoints; i++)
+    // center the region of interest on the lattice cell of the scan, like MatchScan centers it on the scan
+    Vector2<kt_double> scanCell = (scanPose.GetPosition() - pCache->anchor) * (1.0 / resolution);
+    Vector2<kt_int32s> origin(static_cast<kt_int32s>(math::Round(scanCell.GetX())) - (rRoi.GetWidth() - 1) / 2,
+                              static_cast<kt_int32s>(math::Round(scanCell.GetY())) - (rRoi.GetHeight() - 1) / 2);
+
+    // find the scans that left the buffer, and whether any buffered scan moved since it was cached
+    std::set<LocalizedRangeScan*> scans;
+    const_forEach(LocalizedRangeScanVector, &rScans)
     {
-      // ignore points that fall off the grid
-      kt_int32s pointGridIndex = gridPositionIndex + pAngleIndexPointer[i];
-      if (!math::IsUpTo(pointGridIndex, m_pCorrelationGrid->GetDataSize()) || pAngleIndexPointer[i] == INVALID_SCAN)
+      if (*iter != NULL)
       {
-        continue;
+        scans.insert(*iter);
       }
+    }
 
-      // uses index offsets to efficiently find location of point in the grid
-      response += pByte[pAngleIndexPointer[i]];
+    kt_bool doRebuild = pCache->scans.empty();
+    std::vector<LocalizedRangeScan*> removedScans;
+    for (std::map<LocalizedRangeScan*, CachedScan>::iterator iter = pCache->scans.begin();
+         iter != pCache->scans.end(); ++iter)
+    {
+      if (scans.find(iter->first) == scans.end() || iter->first->GetUniqueId() != iter->second.uniqueId)
+      {
+        removedScans.push_back(iter->first);
+      }
+      else if (iter->first->GetSensorPose() != iter->second.pose)
+      {
+        doRebuild = true;
+      }
     }
 
-    // normalize response
-    response /= (nPoints * GridStates_Occupied);
-    assert(fabs(response) <= 1.0);
+    if (doRebuild)
+    {
+      pCache->scans.clear();
+      pCache->origin = origin;
+      pGrid->Clear();
+      std::fill(pCache->hitCounts.begin(), pCache->hitCounts.end(), 0);
+      std::fill(pCache->dirtyTiles.begin(), pCache->dirtyTiles.end(), false);
+    }
+    else
+    {
+      ShiftGridCache(pCache, origin);
 
-    return response;
-  }
+      for (size_t i = 0; i < removedScans.size(); i++)
+      {
+        RemoveFromGridCache(pCache, removedScans[i]);
+      }
+    }
 
+    pGrid->GetCoordinateConverter()->SetOffset(pCache->anchor +
+      Vector2<kt_double>(pCache->origin.GetX(), pCache->origin.GetY()) * resolution);
 
-  ////////////////////////////////////////////////////////////////////////////////////////
-  ////////////////////////////////////////////////////////////////////////////////////////
-  ////////////////////////////////////////////////////////////////////////////////////////
+    // new scans are filtered against the view point of the scan being matched now
+    const_forEach(LocalizedRangeScanVector, &rScans)
+    {
+      if (*iter != NULL && pCache->scans.find(*iter) == pCache->scans.end())
+      {
+        AddToGridCache(pCache, *iter, scanPose.GetPosition());
+      }
+    }
 
-  template<typename T>
-  class BreadthFirstTraversal : public GraphTraversal<T>
-  {
-  public:
-  /**
-   * Constructs a breadth-first traverser for the given graph
-   */
-  BreadthFirstTraversal()
-  {
-  }
-  BreadthFirstTraversal(Graph<T>* pGraph)
-  : GraphTraversal<T>(pGraph)
-  {
+    RepairGridCache(pCache);
   }
 
   /**
-   * Destructor
+   * Adds a scan to the cache and smears its points into the grid
+   * @param pCache
+   * @param pScan scan to add
+   * @param rViewPoint do not add points that belong to scans "opposite" the view point
    */
-  virtual ~BreadthFirstTraversal()
+  void ScanMatcher::AddToGridCache(GridCache* pCache, LocalizedRangeScan* pScan, const Vector2<kt_double>& rViewPoint)
   {
+    CorrelationGrid* pGrid = pCache->pGrid;
+    const Rectangle2<kt_int32s>& rRoi = pGrid->GetROI();
+    kt_double scale = 1.0 / pGrid->GetResolution();
+
+    CachedScan& rCachedScan = pCache->scans[pScan];
+    rCachedScan.uniqueId = pScan->GetUniqueId();
+    rCachedScan.pose = pScan->GetSensorPose();
+    rCachedScan.cells.clear();
+
+    PointVectorDouble validPoints = FindValidPoints(pScan, rViewPoint);
+    const_forEach(PointVectorDouble, &validPoints)
+    {
+      Vector2<kt_double> cell = (*iter - pCache->anchor) * scale;
+      Vector2<kt_int32s> latticeCell(static_cast<kt_int32s>(math::Round(cell.GetX())),
+                                     static_cast<kt_int32s>(math::Round(cell.GetY())));
+
+      if (rCachedScan.cells.empty() == false && rCachedScan.cells.back() == latticeCell)
+      {
+        continue;
+      }
+      rCachedScan.cells.push_back(latticeCell);
+
+      // points outside the region of interest are kept for when the grid moves over them
+      Vector2<kt_int32s> roiCell = latticeCell - pCache->origin;
+      if (math::IsUpTo(roiCell.GetX(), rRoi.GetWidth()) && math::IsUpTo(roiCell.GetY(), rRoi.GetHeight()))
+      {
+        Vector2<kt_int32s> dataCell(roiCell.GetX() + rRoi.GetX(), roiCell.GetY() + rRoi.GetY());
+        if (pCache->hitCounts[dataCell.GetX() + dataCell.GetY() * pGrid->GetWidth()]++ == 0)
+        {
+          pGrid->SmearKernel(dataCell);
+        }
+      }
+    }
   }
 
-  public:
   /**
-   * Traverse the graph starting with the given vertex; applies the visitor to visited nodes
-   * @param pStartVertex
-   * @param pVisitor
-   * @return visited vertice scans
+   * Removes a scan from the cache and marks the grid around its points as dirty
+   * @param pCache
+   * @param pScan scan to remove
    */
-  virtual std::vector<T*> TraverseForScans(Vertex<T>* pStartVertex, Visitor<T>* pVisitor)
+  void ScanMatcher::RemoveFromGridCache(GridCache* pCache, LocalizedRangeScan* pScan)
   {
-    std::vector<Vertex<T>*> validVertices = TraverseForVertices(pStartVertex, pVisitor);
+    CorrelationGrid* pGrid = pCache->pGrid;
+    const Rectangle2<kt_int32s>& rRoi = pGrid->GetROI();
+    kt_int32s halfKernel = pGrid->GetKernelSize() / 2;
 
-    std::vector<T*> objects;
-    forEach(typename std::vector<Vertex<T>*>, &validVertices)
+    // the point may have been smeared anywhere within a kernel of it, unless another point shares its cell
+    const std::vector<Vector2<kt_int32s> >& rCells = pCache->scans[pScan].cells;
+    for (size_t i = 0; i < rCells.size(); i++)
     {
-      objects.push_back((*iter)->GetObject());
+      Vector2<kt_int32s> roiCell = rCells[i] - pCache->origin;
+      if (math::IsUpTo(roiCell.GetX(), rRoi.GetWidth()) && math::IsUpTo(roiCell.GetY(), rRoi.GetHeight()))
+      {
+        Vector2<kt_int32s> dataCell(roiCell.GetX() + rRoi.GetX(), roiCell.GetY() + rRoi.GetY());
+        if (--pCache->hitCounts[dataCell.GetX() + dataCell.GetY() * pGrid->GetWidth()] == 0)
+        {
+          MarkGridCacheDirty(pCache, Rectangle2<kt_int32s>(dataCell.GetX() - halfKernel, dataCell.GetY() - halfKernel,
+                                                           2 * halfKernel + 1, 2 * halfKernel + 1));
+        }
+      }
     }
 
-    return objects;
+    pCache->scans.erase(pScan);
   }
 
   /**
-   * Traverse the graph starting with the given vertex; applies the visitor to visited nodes
-   * @param pStartVertex
-   * @param pVisitor
-   * @return visited vertices
+   * Moves the values of a width x height array so that cell (x, y) takes the value of cell (x + dx, y + dy),
+   * zeroing cells whose source is outside the array
    */
-  virtual std::vector<Vertex<T>*> TraverseForVertices(Vertex<T>* pStartVertex, Visitor<T>* pVisitor)
+  template<typename T>
+  static void ShiftArray(T* pArray, kt_int32s width, kt_int32s height, kt_int32s rowStep, kt_int32s dx, kt_int32s dy)
   {
-    std::queue<Vertex<T>*> toVisit;
-    std::set<Vertex<T>*> seenVertices;
-    std::vector<Vertex<T>*> validVertices;
-
-    toVisit.push(pStartVertex);
-    seenVertices.insert(pStartVertex);
+    kt_int32s minX = math::Maximum(0, -dx);
+    kt_int32s maxX = math::Maximum(minX, math::Minimum(width, width - dx));
 
-    do
+    // rows are visited so that no source row is overwritten before it is read
+    for (kt_int32s i = 0; i < height; i++)
     {
-      Vertex<T>* pNext = toVisit.front();
-      toVisit.pop();
+      kt_int32s y = (dy > 0) ? i : height - 1 - i;
+      T* pRow = pArray + y * rowStep;
 
-      if (pNext != NULL && pVisitor->Visit(pNext))
+      if (math::IsUpTo(y + dy, height) == false)
       {
-        // vertex is valid, explore neighbors
-        validVertices.push_back(pNext);
+        std::fill(pRow, pRow + width, 0);
+        continue;
+      }
+
+      memmove(pRow + minX, pArray + (y + dy) * rowStep + minX + dx, (maxX - minX) * sizeof(T));
+      std::fill(pRow, pRow + minX, 0);
+      std::fill(pRow + maxX, pRow + width, 0);
+    }
+  }
+
+  /**
+   * Moves the cached grid so that its region of interest starts at the given lattice cell
+   * @param pCache
+   * @param rOrigin
+   */
+  void ScanMatcher::ShiftGridCache(GridCache* pCache, const Vector2<kt_int32s>& rOrigin)
+  {
+    CorrelationGrid* pGrid = pCache->pGrid;
+    const Rectangle2<kt_int32s>& rRoi = pGrid->GetROI();
+    kt_int32s width = pGrid->GetWidth();
+    kt_int32s height = pGrid->GetHeight();
+    kt_int32s dx = rOrigin.GetX() - pCache->origin.GetX();
+    kt_int32s dy = rOrigin.GetY() - pCache->origin.GetY();
+
+    if (dx == 0 && dy == 0)
+    {
+      return;
+    }
+
+    Vector2<kt_int32s> previousOrigin = pCache->origin;
+    pCache->origin = rOrigin;
+
+    ShiftArray(pGrid->GetDataPointer(), width, height, pGrid->GetWidthStep(), dx, dy);
+    ShiftArray(&pCache->hitCounts[0], width, height, width, dx, dy);
+
+    // the cells uncovered by the move are recomputed
+    if (dx != 0)
+    {
+      MarkGridCacheDirty(pCache, (dx > 0) ? Rectangle2<kt_int32s>(width - dx, 0, dx, height) :
+                                            Rectangle2<kt_int32s>(0, 0, -dx, height));
+    }
+    if (dy != 0)
+    {
+      MarkGridCacheDirty(pCache, (dy > 0) ? Rectangle2<kt_int32s>(0, height - dy, width, dy) :
+                                            Rectangle2<kt_int32s>(0, 0, width, -dy));
+    }
+
+    // points that left the region of interest are uncounted and their surroundings recomputed, points
+    // that entered it are counted and smeared
+    kt_int32s halfKernel = pGrid->GetKernelSize() / 2;
+    for (std::map<LocalizedRangeScan*, CachedScan>::const_iterator iter = pCache->scans.begin();
+         iter != pCache->scans.end(); ++iter)
+    {
+      const std::vector<Vector2<kt_int32s> >& rCells = iter->second.cells;
+      for (size_t i = 0; i < rCells.size(); i++)
+      {
+        Vector2<kt_int32s> roiCell = rCells[i] - pCache->origin;
+        Vector2<kt_int32s> previousRoiCell = rCells[i] - previousOrigin;
+        kt_bool isInRoi = math::IsUpTo(roiCell.GetX(), rRoi.GetWidth()) &&
+                          math::IsUpTo(roiCell.GetY(), rRoi.GetHeight());
+        kt_bool wasInRoi = math::IsUpTo(previousRoiCell.GetX(), rRoi.GetWidth()) &&
+                           math::IsUpTo(previousRoiCell.GetY(), rRoi.GetHeight());
+        if (isInRoi == wasInRoi)
+        {
+          continue;
+        }
+
+        Vector2<kt_int32s> dataCell(roiCell.GetX() + rRoi.GetX(), roiCell.GetY() + rRoi.GetY());
+        if (isInRoi)
+        {
+          if (pCache->hitCounts[dataCell.GetX() + dataCell.GetY() * width]++ == 0)
+          {
+            pGrid->SmearKernel(dataCell);
+          }
+        }
+        else
+        {
+          if (math::IsUpTo(dataCell.GetX(), width) && math::IsUpTo(dataCell.GetY(), height))
+          {
+            pCache->hitCounts[dataCell.GetX() + dataCell.GetY() * width] = 0;
+          }
+          MarkGridCacheDirty(pCache, Rectangle2<kt_int32s>(dataCell.GetX() - halfKernel, dataCell.GetY() - halfKernel,
+                                                           2 * halfKernel + 1, 2 * halfKernel + 1));
+        }
+      }
+    }
+  }
+
+  /**
+   * Marks the tiles of the cached grid overlapping the given rectangle (data coordinates) as dirty
+   * @param pCache
+   * @param rRegion
+   */
+  void ScanMatcher::MarkGridCacheDirty(GridCache* pCache, const Rectangle2<kt_int32s>& rRegion)
+  {
+    kt_int32s minTileX = math::Maximum(rRegion.GetX(), 0) >> GRID_CACHE_TILE_SHIFT;
+    kt_int32s minTileY = math::Maximum(rRegion.GetY(), 0) >> GRID_CACHE_TILE_SHIFT;
+    kt_int32s maxTileX = math::Minimum((rRegion.GetX() + rRegion.GetWidth() - 1) >> GRID_CACHE_TILE_SHIFT,
+                                       pCache->nTilesX - 1);
+    kt_int32s maxTileY = math::Minimum((rRegion.GetY() + rRegion.GetHeight() - 1) >> GRID_CACHE_TILE_SHIFT,
+                                       pCache->nTilesY - 1);
+
+    for (kt_int32s tileY = minTileY; tileY <= maxTileY; tileY++)
+    {
+      for (kt_int32s tileX = minTileX; tileX <= maxTileX; tileX++)
+      {
+        pCache->dirtyTiles[tileY * pCache->nTilesX + tileX] = true;
+      }
+    }
+  }
+
+  /**
+   * Recomputes the dirty tiles of the cached grid from the hit counts
+   * @param pCache
+   */
+  void ScanMatcher::RepairGridCache(GridCache* pCache)
+  {
+    CorrelationGrid* pGrid = pCache->pGrid;
+    kt_int32s width = pGrid->GetWidth();
+    kt_int32s height = pGrid->GetHeight();
+    kt_int32s tileSize = 1 << GRID_CACHE_TILE_SHIFT;
+    kt_int32s kernelSize = pGrid->GetKernelSize();
+    kt_int32s halfKernel = kernelSize / 2;
+    const kt_int8u* pKernel = pGrid->GetKernel();
+    const kt_int16u* pHitCounts = &pCache->hitCounts[0];
+
+    // for each row around the tile, distance to the closest hit of the row (halfKernel + 1 if none in reach)
+    kt_int32s nRows = tileSize + 2 * halfKernel;
+    std::vector<kt_int32s> rowDistances(nRows * tileSize);
+    std::vector<kt_int32s> hitRows;
+    hitRows.reserve(nRows);
+
+    for (kt_int32s tileY = 0; tileY < pCache->nTilesY; tileY++)
+    {
+      for (kt_int32s tileX = 0; tileX < pCache->nTilesX; tileX++)
+      {
+        if (pCache->dirtyTiles[tileY * pCache->nTilesX + tileX] == false)
+        {
+          continue;
+        }
+
+        kt_int32s x0 = tileX * tileSize;
+        kt_int32s y0 = tileY * tileSize;
+        kt_int32s nX = math::Minimum(tileSize, width - x0);
+        kt_int32s nY = math::Minimum(tileSize, height - y0);
+
+        hitRows.clear();
+        for (kt_int32s row = 0; row < nRows; row++)
+        {
+          kt_int32s y = y0 - halfKernel + row;
+          kt_int32s* pDistances = &rowDistances[row * tileSize];
+          if (math::IsUpTo(y, height) == false)
+          {
+            continue;
+          }
+          std::fill(pDistances, pDistances + nX, halfKernel + 1);
+
+          const kt_int16u* pRow = pHitCounts + y * width;
+          kt_int32s minX = math::Maximum(x0 - halfKernel, 0);
+          kt_int32s maxX = math::Minimum(x0 + nX + halfKernel, width);
+
+          // closest hit on the left, then on the right
+          kt_int32s lastHit = -2 * kernelSize;
+          for (kt_int32s x = minX; x < x0 + nX; x++)
+          {
+            if (pRow[x] != 0)
+            {
+              lastHit = x;
+            }
+            if (x >= x0)
+            {
+              pDistances[x - x0] = math::Minimum(pDistances[x - x0], x - lastHit);
+            }
+          }
+          lastHit = width + 2 * kernelSize;
+          for (kt_int32s x = maxX - 1; x >= x0; x--)
+          {
+            if (pRow[x] != 0)
+            {
+              lastHit = x;
+            }
+            if (x < x0 + nX)
+            {
+              pDistances[x - x0] = math::Minimum(pDistances[x - x0], lastHit - x);
+            }
+          }
+
+          if (*std::min_element(pDistances, pDistances + nX) <= halfKernel)
+          {
+            hitRows.push_back(row);
+          }
+        }
+
+        for (kt_int32s j = 0; j < nY; j++)
+        {
+          memset(pGrid->GetDataPointer() + (y0 + j) * pGrid->GetWidthStep() + x0, 0, nX);
+        }
+
+        // the kernel only decreases away from its center along a row, so the closest hit of each
+        // row gives that row's largest kernel value
+        for (size_t k = 0; k < hitRows.size(); k++)
+        {
+          kt_int32s row = hitRows[k];
+          const kt_int32s* pDistances = &rowDistances[row * tileSize];
+
+          // the kernel row of the hit row as seen from tile row j is row - j
+          kt_int32s minJ = math::Maximum(row - 2 * halfKernel, 0);
+          kt_int32s maxJ = math::Minimum(row, nY - 1);
+          for (kt_int32s j = minJ; j <= maxJ; j++)
+          {
+            kt_int8u* pGridAdr = pGrid->GetDataPointer() + (y0 + j) * pGrid->GetWidthStep() + x0;
+            const kt_int8u* pKernelAdr = pKernel + halfKernel + (row - j) * kernelSize;
+            for (kt_int32s i = 0; i < nX; i++)
+            {
+              if (pDistances[i] <= halfKernel && pKernelAdr[pDistances[i]] > pGridAdr[i])
+              {
+                pGridAdr[i] = pKernelAdr[pDistances[i]];
+              }
+            }
+          }
+        }
+
+        pCache->dirtyTiles[tileY * pCache->nTilesX + tileX] = false;
+      }
+    }
+  }
+
+  // number of positions evaluated per pass over the offsets
+  const kt_int32u RESPONSE_BATCH_SIZE = 4;
+
+  // bytes past the last cell that SumResponses may read
+  const kt_int32s RESPONSE_READ_PADDING = 3;
+
+#ifdef __AVX2__
+  static inline kt_int32u HorizontalSum(__m256i values)
+  {
+    __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(values), _mm256_extracti128_si256(values, 1));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+    sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+    return static_cast<kt_int32u>(_mm_cvtsi128_si32(sum));
+  }
+#endif
+
+  void ScanMatcher::SumResponses(const kt_int8u* pGrid, const kt_int32s* pPositions, kt_int32u nPositions,
+                                 const kt_int32s* pOffsets, kt_int32u nOffsets, kt_int32u* pSums)
+  {
+    kt_int32u p = 0;
+
+    // full batches share every offset load between the positions
+    for (; p + RESPONSE_BATCH_SIZE <= nPositions; p += RESPONSE_BATCH_SIZE)
+    {
+      const kt_int8u* pByte0 = pGrid + pPositions[p];
+      const kt_int8u* pByte1 = pGrid + pPositions[p + 1];
+      const kt_int8u* pByte2 = pGrid + pPositions[p + 2];
+      const kt_int8u* pByte3 = pGrid + pPositions[p + 3];
+
+      kt_int32u sum0 = 0, sum1 = 0, sum2 = 0, sum3 = 0;
+      kt_int32u i = 0;
+
+#ifdef __AVX2__
+      const __m256i byteMask = _mm256_set1_epi32(0xFF);
+      __m256i acc0 = _mm256_setzero_si256();
+      __m256i acc1 = _mm256_setzero_si256();
+      __m256i acc2 = _mm256_setzero_si256();
+      __m256i acc3 = _mm256_setzero_si256();
+      for (; i + 8 <= nOffsets; i += 8)
+      {
+        // gather 4 bytes per point and keep the first, the grid is stored one byte per cell
+        __m256i offsets = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pOffsets + i));
+        acc0 = _mm256_add_epi32(acc0, _mm256_and_si256(byteMask,
+          _mm256_i32gather_epi32(reinterpret_cast<const int*>(pByte0), offsets, 1)));
+        acc1 = _mm256_add_epi32(acc1, _mm256_and_si256(byteMask,
+          _mm256_i32gather_epi32(reinterpret_cast<const int*>(pByte1), offsets, 1)));
+        acc2 = _mm256_add_epi32(acc2, _mm256_and_si256(byteMask,
+          _mm256_i32gather_epi32(reinterpret_cast<const int*>(pByte2), offsets, 1)));
+        acc3 = _mm256_add_epi32(acc3, _mm256_and_si256(byteMask,
+          _mm256_i32gather_epi32(reinterpret_cast<const int*>(pByte3), offsets, 1)));
+      }
+      sum0 = HorizontalSum(acc0);
+      sum1 = HorizontalSum(acc1);
+      sum2 = HorizontalSum(acc2);
+      sum3 = HorizontalSum(acc3);
+#endif
+
+      for (; i < nOffsets; i++)
+      {
+        kt_int32s offset = pOffsets[i];
+        sum0 += pByte0[offset];
+        sum1 += pByte1[offset];
+        sum2 += pByte2[offset];
+        sum3 += pByte3[offset];
+      }
+
+      pSums[p] = sum0;
+      pSums[p + 1] = sum1;
+      pSums[p + 2] = sum2;
+      pSums[p + 3] = sum3;
+    }
+
+    // remaining positions one at a time
+    for (; p < nPositions; p++)
+    {
+      const kt_int8u* pByte = pGrid + pPositions[p];
+      kt_int32u sum = 0;
+      for (kt_int32u i = 0; i < nOffsets; i++)
+      {
+        sum += pByte[pOffsets[i]];
+      }
+      pSums[p] = sum;
+    }
+  }
+
+  /**
+   * Get response at given position for given rotation (only look up valid points)
+   * @param angleIndex
+   * @param gridPositionIndex
+   * @return response
+   */
+  kt_double ScanMatcher::GetResponse(kt_int32u angleIndex, kt_int32s gridPositionIndex) const
+  {
+    kt_double response = 0.0;
+    GetResponses(angleIndex, &gridPositionIndex, 1, &response);
+
+    return response;
+  }
+
+  /**
+   * Get responses at several positions for given rotation, same values as GetResponse
+   * @param angleIndex
+   * @param pGridPositionIndices
+   * @param nPositions
+   * @param pResponses output response per position
+   */
+  void ScanMatcher::GetResponses(kt_int32u angleIndex, const kt_int32s* pGridPositionIndices, kt_int32u nPositions,
+                                 kt_double* pResponses) const
+  {
+    const LookupArray* pOffsets = m_pGridLookup->GetLookupArray(angleIndex);
+    assert(pOffsets != NULL);
+
+    // get number of points in offset list
+    kt_int32u nPoints = pOffsets->GetSize();
+    if (nPoints == 0)
+    {
+      std::fill(pResponses, pResponses + nPositions, 0.0);
+      return;
+    }
+
+    // invalid readings never add to the response but still count in the normalization
+    const kt_int32s* pValidOffsets = pOffsets->GetValidArrayPointer();
+    kt_int32u nValidPoints = pOffsets->GetValidSize();
+    kt_int32s minimumOffset = pOffsets->GetMinimumOffset();
+    kt_int32s maximumOffset = pOffsets->GetMaximumOffset();
+
+    const kt_int8u* pGrid = m_pCorrelationGrid->GetDataPointer();
+    kt_int32s dataSize = m_pCorrelationGrid->GetDataSize();
+
+    kt_int32u sums[RESPONSE_BATCH_SIZE];
+    for (kt_int32u i = 0; i < nPositions; i += RESPONSE_BATCH_SIZE)
+    {
+      kt_int32u nBatch = math::Minimum(RESPONSE_BATCH_SIZE, nPositions - i);
+      const kt_int32s* pBatch = pGridPositionIndices + i;
+
+      // the correlation grid is padded by the range threshold, so points normally all land on
+      // the grid and the bounds test is done once for the batch instead of once per point
+      kt_bool isOnGrid = true;
+      for (kt_int32u k = 0; k < nBatch; k++)
+      {
+        if (pBatch[k] + minimumOffset < 0 || pBatch[k] + maximumOffset + RESPONSE_READ_PADDING >= dataSize)
+        {
+          isOnGrid = false;
+        }
+      }
+
+      if (isOnGrid)
+      {
+        SumResponses(pGrid, pBatch, nBatch, pValidOffsets, nValidPoints, sums);
+      }
+      else
+      {
+        for (kt_int32u k = 0; k < nBatch; k++)
+        {
+          sums[k] = 0;
+          for (kt_int32u j = 0; j < nValidPoints; j++)
+          {
+            // ignore points that fall off the grid
+            kt_int32s pointGridIndex = pBatch[k] + pValidOffsets[j];
+            if (math::IsUpTo(pointGridIndex, dataSize))
+            {
+              sums[k] += pGrid[pointGridIndex];
+            }
+          }
+        }
+      }
+
+      // normalize response; integer sums are exact so this matches summing in double
+      for (kt_int32u k = 0; k < nBatch; k++)
+      {
+        pResponses[i + k] = static_cast<kt_double>(sums[k]) / (nPoints * GridStates_Occupied);
+        assert(fabs(pResponses[i + k]) <= 1.0);
+      }
+    }
+  }
+
+
+  /**
+   * Computes the penalty multiplier for a pose deviating from the search center
+   * @param squaredDistance squared distance from the search center
+   * @param angle heading of the pose
+   * @return penalty multiplier
+   */
+  kt_double ScanMatcher::ComputePenalty(kt_double squaredDistance, kt_double angle) const
+  {
+    // simple model (approximate Gaussian) to take odometry into account
+    kt_double distancePenalty = 1.0 - (DISTANCE_PENALTY_GAIN *
+                                       squaredDistance / m_pMapper->m_pDistanceVariancePenalty->GetValue());
+    distancePenalty = math::Maximum(distancePenalty, m_pMapper->m_pMinimumDistancePenalty->GetValue());
+
+    kt_double squaredAngleDistance = math::Square(angle - m_rSearchCenter.GetHeading());
+    kt_double anglePenalty = 1.0 - (ANGLE_PENALTY_GAIN *
+                                    squaredAngleDistance / m_pMapper->m_pAngleVariancePenalty->GetValue());
+    anglePenalty = math::Maximum(anglePenalty, m_pMapper->m_pMinimumAnglePenalty->GetValue());
+
+    return distancePenalty * anglePenalty;
+  }
+
+  /**
+   * Computes pDestination[k] = max(pSource[k + i * stride]) for 0 <= i < window, treating
+   * cells past the end of the data as empty. Uses the van Herk/Gil-Werman algorithm so the
+   * cost per cell does not depend on the window size.
+   * @param pSource
+   * @param pDestination
+   * @param size number of cells
+   * @param stride distance between consecutive cells of the window
+   * @param window number of cells in the window
+   */
+  static void SlidingMaximum(const kt_int8u* pSource, kt_int8u* pDestination, kt_int32s size,
+                             kt_int32s stride, kt_int32s window)
+  {
+    std::vector<kt_int8u> prefix;
+    std::vector<kt_int8u> suffix;
+    for (kt_int32s start = 0; start < stride && start < size; start++)
+    {
+      kt_int32s n = (size - start + stride - 1) / stride;
+      prefix.resize(n);
+      suffix.resize(n);
+
+      // running maximum from the start and to the end of each block of window cells
+      for (kt_int32s i = 0; i < n; i++)
+      {
+        kt_int8u value = pSource[start + i * stride];
+        prefix[i] = (i % window == 0) ? value : math::Maximum(prefix[i - 1], value);
+      }
+      for (kt_int32s i = n - 1; i >= 0; i--)
+      {
+        kt_int8u value = pSource[start + i * stride];
+        suffix[i] = (i == n - 1 || i % window == window - 1) ? value : math::Maximum(suffix[i + 1], value);
+      }
+
+      for (kt_int32s i = 0; i < n; i++)
+      {
+        kt_int32s last = math::Minimum(i + window - 1, n - 1);
+        pDestination[start + i * stride] = (last / window == i / window) ?
+          suffix[i] : math::Maximum(suffix[i], prefix[last]);
+      }
+    }
+  }
+
+  /**
+   * Computes the max-pooled correlation grids for the given window sizes, reusing
+   * pooled grids that are still valid
+   * @param rWindows window size of each pyramid level above the correlation grid
+   */
+  void ScanMatcher::ComputePooledGrids(const std::vector<kt_int32s>& rWindows)
+  {
+    kt_int32s size = m_pCorrelationGrid->GetDataSize();
+    kt_int32s widthStep = m_pCorrelationGrid->GetWidthStep();
+
+    std::vector<kt_int8u> rowMaximum(size);
+    m_PooledGrids.resize(rWindows.size());
+    for (size_t level = 0; level < rWindows.size(); level++)
+    {
+      if (level < m_PooledWindows.size() && m_PooledWindows[level] == rWindows[level])
+      {
+        continue;
+      }
+
+      // pooled[k] is the maximum over the window x window cells starting at k
+      m_PooledGrids[level].resize(size);
+      SlidingMaximum(m_pCorrelationGrid->GetDataPointer(), &rowMaximum[0], size, 1, rWindows[level]);
+      SlidingMaximum(&rowMaximum[0], &m_PooledGrids[level][0], size, widthStep, rWindows[level]);
+    }
+
+    m_PooledWindows = rWindows;
+  }
+
+  /**
+   * Scores a candidate: the exact response for a leaf, an upper bound of the responses
+   * of all its positions otherwise
+   * @param rCandidate
+   * @return score
+   */
+  kt_double ScanMatcher::ScoreCandidate(const SearchCandidate& rCandidate) const
+  {
+    kt_double angle = m_pGridLookup->GetAngles()[rCandidate.angleIndex];
+
+    kt_int32s gridIndex = m_pCorrelationGrid->GridIndex(Vector2<kt_int32s>(m_xGridPoses[rCandidate.xIndex],
+                                                                           m_yGridPoses[rCandidate.yIndex]));
+
+    // leaves are scored exactly like the brute force search
+    if (rCandidate.level == 0)
+    {
+      kt_double response = GetResponse(rCandidate.angleIndex, gridIndex);
+      if (m_doPenalize && (math::DoubleEqual(response, 0.0) == false))
+      {
+        kt_double x = m_xPoses[rCandidate.xIndex];
+        kt_double y = m_yPoses[rCandidate.yIndex];
+        response *= ComputePenalty(math::Square(x) + math::Square(y), angle);
+      }
+
+      return response;
+    }
+
+    const LookupArray* pOffsets = m_pGridLookup->GetLookupArray(rCandidate.angleIndex);
+    assert(pOffsets != NULL);
+
+    kt_int32u nPoints = pOffsets->GetSize();
+    if (nPoints == 0)
+    {
+      return 0.0;
+    }
+
+    // pooled cells hold the maximum over every position of the block
+    const kt_int8u* pPooled = &m_PooledGrids[rCandidate.level - 1][0];
+    kt_int32s size = m_pCorrelationGrid->GetDataSize();
+    const kt_int32s* pValidOffsets = pOffsets->GetValidArrayPointer();
+    kt_int32u nValidPoints = pOffsets->GetValidSize();
+    kt_int32u sum = 0;
+    for (kt_int32u i = 0; i < nValidPoints; i++)
+    {
+      kt_int32s pointGridIndex = gridIndex + pValidOffsets[i];
+      if (pointGridIndex >= size)
+      {
+        // off the grid for every position of the block
+        continue;
+      }
+
+      // the block may still reach the grid from below, so assume the best
+      sum += (pointGridIndex < 0) ? static_cast<kt_int8u>(GridStates_Occupied) : pPooled[pointGridIndex];
+    }
+
+    kt_double response = static_cast<kt_double>(sum) / (nPoints * GridStates_Occupied);
+    if (m_doPenalize)
+    {
+      // the penalty is largest at the position of the block closest to the search center
+      kt_int32u blockSize = 1u << rCandidate.level;
+      kt_int32u xLast = math::Minimum(rCandidate.xIndex + blockSize, static_cast<kt_int32u>(m_xPoses.size())) - 1;
+      kt_int32u yLast = math::Minimum(rCandidate.yIndex + blockSize, static_cast<kt_int32u>(m_yPoses.size())) - 1;
+
+      kt_double x0 = m_xPoses[rCandidate.xIndex];
+      kt_double x1 = m_xPoses[xLast];
+      kt_double y0 = m_yPoses[rCandidate.yIndex];
+      kt_double y1 = m_yPoses[yLast];
+      kt_double closestX = (x0 <= 0.0 && x1 >= 0.0) ? 0.0 : math::Minimum(fabs(x0), fabs(x1));
+      kt_double closestY = (y0 <= 0.0 && y1 >= 0.0) ? 0.0 : math::Minimum(fabs(y0), fabs(y1));
+
+      response *= ComputePenalty(math::Square(closestX) + math::Square(closestY), angle);
+    }
+
+    return response;
+  }
+
+  /**
+   * Depth first branch and bound below the given candidate. Keeps every leaf whose response
+   * is at least rBestResponse - margin.
+   * @param rCandidate
+   * @param margin
+   * @param rBestResponse best response found so far, shared between searches
+   * @param rLeaves output leaves
+   */
+  void ScanMatcher::SearchBranchAndBound(const SearchCandidate& rCandidate, kt_double margin,
+                                         std::atomic<kt_double>& rBestResponse,
+                                         std::vector<SearchCandidate>& rLeaves) const
+  {
+    if (rCandidate.score < rBestResponse.load() - margin)
+    {
+      return;
+    }
+
+    if (rCandidate.level == 0)
+    {
+      rLeaves.push_back(rCandidate);
+
+      kt_double bestResponse = rBestResponse.load();
+      while (rCandidate.score > bestResponse &&
+             !rBestResponse.compare_exchange_weak(bestResponse, rCandidate.score))
+      {
+      }
+
+      return;
+    }
+
+    // split into the (up to) four blocks of half the size and search the most promising first
+    SearchCandidate children[4];
+    kt_int32u nChildren = 0;
+    kt_int32u childSize = 1u << (rCandidate.level - 1);
+    for (kt_int32u yOffset = 0; yOffset <= childSize; yOffset += childSize)
+    {
+      for (kt_int32u xOffset = 0; xOffset <= childSize; xOffset += childSize)
+      {
+        SearchCandidate child;
+        child.xIndex = rCandidate.xIndex + xOffset;
+        child.yIndex = rCandidate.yIndex + yOffset;
+        if (child.xIndex >= m_xPoses.size() || child.yIndex >= m_yPoses.size())
+        {
+          continue;
+        }
+
+        child.angleIndex = rCandidate.angleIndex;
+        child.level = rCandidate.level - 1;
+        child.score = ScoreCandidate(child);
+        children[nChildren++] = child;
+      }
+    }
+
+    std::sort(children, children + nChildren,
+              [](const SearchCandidate& rA, const SearchCandidate& rB) { return rA.score > rB.score; });
+
+    for (kt_int32u i = 0; i < nChildren; i++)
+    {
+      SearchBranchAndBound(children[i], margin, rBestResponse, rLeaves);
+    }
+  }
+
+  /**
+   * Same contract as CorrelateScan for a coarse search, found by branch and bound
+   * @param pScan scan to match against correlation grid
+   * @param rSearchCenter the center of the search space
+   * @param rSearchSpaceOffset searches poses in the area offset by this vector around search center
+   * @param rSearchSpaceResolution how fine a granularity to search in the search space
+   * @param searchAngleOffset searches poses in the angles offset by this angle around search center
+   * @param searchAngleResolution how fine a granularity to search in the angular search space
+   * @param doPenalize whether to penalize matches further from the search center
+   * @param rMean output parameter of mean (best pose) of match
+   * @param rCovariance output parameter of covariance of match
+   * @return strength of response
+   */
+  kt_double ScanMatcher::CorrelateScanBranchAndBound(LocalizedRangeScan* pScan, const Pose2& rSearchCenter,
+                                                     const Vector2<kt_double>& rSearchSpaceOffset,
+                                                     const Vector2<kt_double>& rSearchSpaceResolution,
+                                                     kt_double searchAngleOffset, kt_double searchAngleResolution,
+                                                     kt_bool doPenalize, Pose2& rMean, Matrix3& rCovariance)
+  {
+    // setup lookup arrays
+    m_pGridLookup->ComputeOffsets(pScan, rSearchCenter.GetHeading(), searchAngleOffset, searchAngleResolution);
+
+    m_pSearchSpaceProbs->Clear();
+
+    // position search grid - finds lower left corner of search grid
+    Vector2<kt_double> offset(rSearchCenter.GetPosition() - rSearchSpaceOffset);
+    m_pSearchSpaceProbs->GetCoordinateConverter()->SetOffset(offset);
+
+    // calculate position arrays, identical to the brute force search
+    m_xPoses.clear();
+    kt_int32u nX = static_cast<kt_int32u>(math::Round(rSearchSpaceOffset.GetX() *
+                                          2.0 / rSearchSpaceResolution.GetX()) + 1);
+    kt_double startX = -rSearchSpaceOffset.GetX();
+    for (kt_int32u xIndex = 0; xIndex < nX; xIndex++)
+    {
+      m_xPoses.push_back(startX + xIndex * rSearchSpaceResolution.GetX());
+    }
+
+    m_yPoses.clear();
+    kt_int32u nY = static_cast<kt_int32u>(math::Round(rSearchSpaceOffset.GetY() *
+                                          2.0 / rSearchSpaceResolution.GetY()) + 1);
+    kt_double startY = -rSearchSpaceOffset.GetY();
+    for (kt_int32u yIndex = 0; yIndex < nY; yIndex++)
+    {
+      m_yPoses.push_back(startY + yIndex * rSearchSpaceResolution.GetY());
+    }
+
+    kt_int32u nAngles = static_cast<kt_int32u>(math::Round(searchAngleOffset * 2.0 / searchAngleResolution) + 1);
+
+    m_rSearchCenter = rSearchCenter;
+    m_searchAngleOffset = searchAngleOffset;
+    m_nAngles = nAngles;
+    m_searchAngleResolution = searchAngleResolution;
+    m_doPenalize = doPenalize;
+
+    // grid coordinates of the search positions (x and y map to the grid independently)
+    m_xGridPoses.resize(nX);
+    for (kt_int32u xIndex = 0; xIndex < nX; xIndex++)
+    {
+      m_xGridPoses[xIndex] = m_pCorrelationGrid->WorldToGrid(Vector2<kt_double>(
+        rSearchCenter.GetX() + m_xPoses[xIndex], rSearchCenter.GetY())).GetX();
+    }
+    m_yGridPoses.resize(nY);
+    for (kt_int32u yIndex = 0; yIndex < nY; yIndex++)
+    {
+      m_yGridPoses[yIndex] = m_pCorrelationGrid->WorldToGrid(Vector2<kt_double>(
+        rSearchCenter.GetX(), rSearchCenter.GetY() + m_yPoses[yIndex])).GetY();
+    }
+
+    // level l of the pyramid bounds blocks of 2^l x 2^l search positions; its window must
+    // cover the cells spanned by any such block
+    kt_int32u nLevels = 0;
+    while ((1u << nLevels) < math::Maximum(nX, nY))
+    {
+      nLevels++;
+    }
+
+    std::vector<kt_int32s> windows;
+    for (kt_int32u level = 1; level <= nLevels; level++)
+    {
+      kt_int32u blockSize = 1u << level;
+      kt_int32s window = 1;
+      for (kt_int32u start = 0; start < nX; start += blockSize)
+      {
+        kt_int32u last = math::Minimum(start + blockSize, nX) - 1;
+        window = math::Maximum(window, m_xGridPoses[last] - m_xGridPoses[start] + 1);
+      }
+      for (kt_int32u start = 0; start < nY; start += blockSize)
+      {
+        kt_int32u last = math::Minimum(start + blockSize, nY) - 1;
+        window = math::Maximum(window, m_yGridPoses[last] - m_yGridPoses[start] + 1);
+      }
+      windows.push_back(window);
+    }
+    ComputePooledGrids(windows);
+
+    // keep every pose within 0.1 of the best response; they are needed for the positional covariance
+    const kt_double margin = 0.1 + KT_TOLERANCE;
+    std::atomic<kt_double> bestResponse(-1.0);
+    std::vector<std::vector<SearchCandidate> > angleLeaves(nAngles);
+    tbb::parallel_for(tbb::blocked_range<kt_int32u>(0, nAngles),
+                      [&](const tbb::blocked_range<kt_int32u>& rRange)
+    {
+      for (kt_int32u angleIndex = rRange.begin(); angleIndex != rRange.end(); angleIndex++)
+      {
+        SearchCandidate root;
+        root.xIndex = 0;
+        root.yIndex = 0;
+        root.angleIndex = angleIndex;
+        root.level = nLevels;
+        root.score = ScoreCandidate(root);
+        SearchBranchAndBound(root, margin, bestResponse, angleLeaves[angleIndex]);
+      }
+    });
+
+    // visit the leaves in the order of the brute force search so ties are averaged identically
+    std::vector<std::pair<kt_int32u, kt_double> > leaves;
+    for (kt_int32u angleIndex = 0; angleIndex < nAngles; angleIndex++)
+    {
+      const_forEach(std::vector<SearchCandidate>, &angleLeaves[angleIndex])
+      {
+        leaves.push_back(std::make_pair((iter->yIndex * nX + iter->xIndex) * nAngles + iter->angleIndex,
+                                        iter->score));
+      }
+    }
+    std::sort(leaves.begin(), leaves.end());
+
+    kt_double bestResponseValue = bestResponse.load();
+    const std::vector<kt_double>& rAngles = m_pGridLookup->GetAngles();
+
+    Vector2<kt_double> averagePosition;
+    kt_double thetaX = 0.0;
+    kt_double thetaY = 0.0;
+    kt_int32s averagePoseCount = 0;
+    for (size_t i = 0; i < leaves.size(); i++)
+    {
+      kt_int32u angleIndex = leaves[i].first % nAngles;
+      kt_int32u xIndex = (leaves[i].first / nAngles) % nX;
+      kt_int32u yIndex = (leaves[i].first / nAngles) / nX;
+      kt_double response = leaves[i].second;
+
+      Vector2<kt_double> position(rSearchCenter.GetX() + m_xPoses[xIndex], rSearchCenter.GetY() + m_yPoses[yIndex]);
+
+      // save best relative probability for each cell; cells below the margin are never
+      // used by the positional covariance
+      Vector2<kt_int32s> grid = m_pSearchSpaceProbs->WorldToGrid(position);
+      kt_double* ptr;
+      try
+      {
+        ptr = (kt_double*)(m_pSearchSpaceProbs->GetDataPointer(grid));
+      }
+      catch(...)
+      {
+        throw std::runtime_error("Mapper FATAL ERROR - unable to get pointer in probability search!");
+      }
+      *ptr = math::Maximum(response, *ptr);
+
+      // average all poses with same highest response
+      if (math::DoubleEqual(response, bestResponseValue))
+      {
+        averagePosition += position;
+
+        kt_double heading = math::NormalizeAngle(rAngles[angleIndex]);
+        thetaX += cos(heading);
+        thetaY += sin(heading);
+
+        averagePoseCount++;
+      }
+    }
+
+    if (averagePoseCount == 0)
+    {
+      throw std::runtime_error("Mapper FATAL ERROR - Unable to find best position");
+    }
+
+    averagePosition /= averagePoseCount;
+    thetaX /= averagePoseCount;
+    thetaY /= averagePoseCount;
+    Pose2 averagePose(averagePosition, atan2(thetaY, thetaX));
+
+    ComputePositionalCovariance(averagePose, bestResponseValue, rSearchCenter, rSearchSpaceOffset,
+                                rSearchSpaceResolution, searchAngleResolution, rCovariance);
+
+    rMean = averagePose;
+
+    if (bestResponseValue > 1.0)
+    {
+      bestResponseValue = 1.0;
+    }
+
+    assert(math::InRange(bestResponseValue, 0.0, 1.0));
+    assert(math::InRange(rMean.GetHeading(), -KT_PI, KT_PI));
+
+    return bestResponseValue;
+  }
+
+
+  ////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////
+  ////////////////////////////////////////////////////////////////////////////////////////
+
+  template<typename T>
+  class BreadthFirstTraversal : public GraphTraversal<T>
+  {
+  public:
+  /**
+   * Constructs a breadth-first traverser for the given graph
+   */
+  BreadthFirstTraversal()
+  {
+  }
+  BreadthFirstTraversal(Graph<T>* pGraph)
+  : GraphTraversal<T>(pGraph)
+  {
+  }
+
+  /**
+   * Destructor
+   */
+  virtual ~BreadthFirstTraversal()
+  {
+  }
+
+  public:
+  /**
+   * Traverse the graph starting with the given vertex; applies the visitor to visited nodes
+   * @param pStartVertex
+   * @param pVisitor
+   * @return visited vertice scans
+   */
+  virtual std::vector<T*> TraverseForScans(Vertex<T>* pStartVertex, Visitor<T>* pVisitor)
+  {
+    std::vector<Vertex<T>*> validVertices = TraverseForVertices(pStartVertex, pVisitor);
+
+    std::vector<T*> objects;
+    forEach(typename std::vector<Vertex<T>*>, &validVertices)
+    {
+      objects.push_back((*iter)->GetObject());
+    }
+
+    return objects;
+  }
+
+  /**
+   * Traverse the graph starting with the given vertex; applies the visitor to visited nodes
+   * @param pStartVertex
+   * @param pVisitor
+   * @return visited vertices
+   */
+  virtual std::vector<Vertex<T>*> TraverseForVertices(Vertex<T>* pStartVertex, Visitor<T>* pVisitor)
+  {
+    std::queue<Vertex<T>*> toVisit;
+    std::set<Vertex<T>*> seenVertices;
+    std::vector<Vertex<T>*> validVertices;
+
+    toVisit.push(pStartVertex);
+    seenVertices.insert(pStartVertex);
+
+    do
+    {
+      Vertex<T>* pNext = toVisit.front();
+      toVisit.pop();
+
+      if (pNext != NULL && pVisitor->Visit(pNext))
+      {
+        // vertex is valid, explore neighbors
+        validVertices.push_back(pNext);
 
         std::vector<Vertex<T>*> adjacentVertices = pNext->GetAdjacentVertices();
         forEach(typename std::vector<Vertex<T>*>, &adjacentVertices)
@@ -1429,10 +2638,12 @@ namespace karto
 
   MapperGraph::MapperGraph(Mapper* pMapper, kt_double rangeThreshold)
     : m_pMapper(pMapper)
+    , m_RangeThreshold(rangeThreshold)
   {
     m_pLoopScanMatcher = ScanMatcher::Create(pMapper, m_pMapper->m_pLoopSearchSpaceDimension->GetValue(),
                                              m_pMapper->m_pLoopSearchSpaceResolution->GetValue(),
-                                             m_pMapper->m_pLoopSearchSpaceSmearDeviation->GetValue(), rangeThreshold);
+                                             m_pMapper->m_pLoopSearchSpaceSmearDeviation->GetValue(), rangeThreshold,
+                                             m_pMapper->m_pUseBranchAndBoundMatching->GetValue());
     assert(m_pLoopScanMatcher);
 
     m_pTraversal = new BreadthFirstTraversal<LocalizedRangeScan>(this);
@@ -1440,6 +2651,9 @@ namespace karto
 
   MapperGraph::~MapperGraph()
   {
+    DestroyLoopClosureMatchers();
+    DestroyNearByVertexIndices();
+
     if (m_pLoopScanMatcher)
     {
       delete m_pLoopScanMatcher;
@@ -1460,9 +2674,13 @@ namespace karto
     {
       Vertex<LocalizedRangeScan>* pVertex = new Vertex<LocalizedRangeScan>(pScan);
       Graph<LocalizedRangeScan>::AddVertex(pScan->GetSensorName(), pVertex);
-      if (m_pMapper->m_pScanOptimizer != NULL)
+      m_pMapper->AddScanOptimizerNode(pVertex);
+      UpdateLoopClosureIndex(pScan);
+
+      std::map<Name, NearByVertexIndex>::iterator indexIter = m_NearByVertexIndices.find(pScan->GetSensorName());
+      if (indexIter != m_NearByVertexIndices.end() && !indexIter->second.dirty)
       {
-        m_pMapper->m_pScanOptimizer->AddNode(pVertex);
+        indexIter->second.pending.push_back(pVertex);
       }
       return pVertex;
     }
@@ -1543,6 +2761,13 @@ namespace karto
 
   kt_bool MapperGraph::TryCloseLoop(LocalizedRangeScan* pScan, const Name& rSensorName)
   {
+    ScopedStageTimer timer(m_pMapper, MapperStage_TryCloseLoop, pScan);
+
+    if (m_pMapper->m_pUseBatchedLoopClosure->GetValue())
+    {
+      return TryCloseLoopBatch(pScan, rSensorName);
+    }
+
     kt_bool loopClosed = false;
 
     kt_int32u scanIndex = 0;
@@ -1551,63 +2776,212 @@ namespace karto
 
     while (!candidateChain.empty())
     {
-      Pose2 bestPose;
-      Matrix3 covariance;
-      kt_double coarseResponse = m_pLoopScanMatcher->MatchScan(pScan, candidateChain,
-                                                               bestPose, covariance, false, false);
-
-      std::stringstream stream;
-      stream << "COARSE RESPONSE: " << coarseResponse
-             << " (> " << m_pMapper->m_pLoopMatchMinimumResponseCoarse->GetValue() << ")"
-             << std::endl;
-      stream << "            var: " << covariance(0, 0) << ",  " << covariance(1, 1)
-             << " (< " << m_pMapper->m_pLoopMatchMaximumVarianceCoarse->GetValue() << ")";
-
-      m_pMapper->FireLoopClosureCheck(stream.str());
-
-      if ((coarseResponse > m_pMapper->m_pLoopMatchMinimumResponseCoarse->GetValue()) &&
-          (covariance(0, 0) < m_pMapper->m_pLoopMatchMaximumVarianceCoarse->GetValue()) &&
-          (covariance(1, 1) < m_pMapper->m_pLoopMatchMaximumVarianceCoarse->GetValue()))
-      {
-        std::cout << "\r\n[mtg:Mapper:TryCloseLoop] Loop closure candidate passed coarse response threshold (response = " << coarseResponse << ")\r\n";
-        LocalizedRangeScan tmpScan(pScan->GetSensorName(), pScan->GetRangeReadingsVector());
-        tmpScan.SetUniqueId(pScan->GetUniqueId());
-        tmpScan.SetTime(pScan->GetTime());
-        tmpScan.SetStateId(pScan->GetStateId());
-        tmpScan.SetCorrectedPose(pScan->GetCorrectedPose());
-        tmpScan.SetSensorPose(bestPose);  // This also updates OdometricPose.
-        kt_double fineResponse = m_pMapper->m_pSequentialScanMatcher->MatchScan(&tmpScan, candidateChain,
-                                                                                bestPose, covariance, false);
-
-        std::stringstream stream1;
-        stream1 << "FINE RESPONSE: " << fineResponse << " (>"
-                << m_pMapper->m_pLoopMatchMinimumResponseFine->GetValue() << ")" << std::endl;
-        m_pMapper->FireLoopClosureCheck(stream1.str());
-
-        if (fineResponse < m_pMapper->m_pLoopMatchMinimumResponseFine->GetValue())
+      LoopClosureMatch match;
+      MatchLoopClosure(pScan, candidateChain, m_pLoopScanMatcher, m_pMapper->m_pSequentialScanMatcher, match);
+
+      if (ReportLoopClosureMatch(match))
+      {
+        m_pMapper->FireBeginLoopClosure("Closing loop...");
+
+        pScan->SetSensorPose(match.bestPose);
+        LinkChainToScan(candidateChain, pScan, match.bestPose, match.covariance);
+        CorrectPosesAfterLoopClosure();
+
+        m_pMapper->FireEndLoopClosure("Loop closed!");
+
+        loopClosed = true;
+      }
+
+      candidateChain = FindPossibleLoopClosure(pScan, rSensorName, scanIndex);
+    }
+
+    return loopClosed;
+  }
+
+  void MapperGraph::MatchLoopClosure(LocalizedRangeScan* pScan, const LocalizedRangeScanVector& rChain,
+                                     ScanMatcher* pLoopScanMatcher, ScanMatcher* pFineScanMatcher,
+                                     LoopClosureMatch& rMatch) const
+  {
+    rMatch.coarseResponse = pLoopScanMatcher->MatchScan(pScan, rChain, rMatch.bestPose, rMatch.covariance,
+                                                        false, false);
+    rMatch.coarseCovariance = rMatch.covariance;
+    rMatch.passedCoarse = (rMatch.coarseResponse > m_pMapper->m_pLoopMatchMinimumResponseCoarse->GetValue()) &&
+                          (rMatch.covariance(0, 0) < m_pMapper->m_pLoopMatchMaximumVarianceCoarse->GetValue()) &&
+                          (rMatch.covariance(1, 1) < m_pMapper->m_pLoopMatchMaximumVarianceCoarse->GetValue());
+    rMatch.fineResponse = 0.0;
+
+    if (rMatch.passedCoarse)
+    {
+      LocalizedRangeScan tmpScan(pScan->GetSensorName(), RangeReadingsVector());
+      tmpScan.ShareRangeReadings(*pScan);
+      tmpScan.SetUniqueId(pScan->GetUniqueId());
+      tmpScan.SetTime(pScan->GetTime());
+      tmpScan.SetStateId(pScan->GetStateId());
+      tmpScan.SetCorrectedPose(pScan->GetCorrectedPose());
+      tmpScan.SetSensorPose(rMatch.bestPose);  // This also updates OdometricPose.
+      rMatch.fineResponse = pFineScanMatcher->MatchScan(&tmpScan, rChain, rMatch.bestPose, rMatch.covariance, false);
+    }
+  }
+
+  kt_bool MapperGraph::ReportLoopClosureMatch(const LoopClosureMatch& rMatch) const
+  {
+    std::stringstream stream;
+    stream << "COARSE RESPONSE: " << rMatch.coarseResponse
+           << " (> " << m_pMapper->m_pLoopMatchMinimumResponseCoarse->GetValue() << ")"
+           << std::endl;
+    stream << "            var: " << rMatch.coarseCovariance(0, 0) << ",  " << rMatch.coarseCovariance(1, 1)
+           << " (< " << m_pMapper->m_pLoopMatchMaximumVarianceCoarse->GetValue() << ")";
+
+    m_pMapper->FireLoopClosureCheck(stream.str());
+
+    if (rMatch.passedCoarse == false)
+    {
+      return false;
+    }
+
+    std::cout << "\r\n[mtg:Mapper:TryCloseLoop] Loop closure candidate passed coarse response threshold (response = " << rMatch.coarseResponse << ")\r\n";
+
+    std::stringstream stream1;
+    stream1 << "FINE RESPONSE: " << rMatch.fineResponse << " (>"
+            << m_pMapper->m_pLoopMatchMinimumResponseFine->GetValue() << ")" << std::endl;
+    m_pMapper->FireLoopClosureCheck(stream1.str());
+
+    if (rMatch.fineResponse < m_pMapper->m_pLoopMatchMinimumResponseFine->GetValue())
+    {
+      std::cout << "[mtg:Mapper:TryCloseLoop] Loop closure candidate FAILED fine response threshold; rejected (response = " << rMatch.fineResponse << ")\r\n";
+      m_pMapper->FireLoopClosureCheck("REJECTED!");
+      return false;
+    }
+
+    std::cout << "[mtg:Mapper:TryCloseLoop] Loop closure candidate PASSED fine response threshold; accepted (response = " << rMatch.fineResponse << ")\r\n";
+    return true;
+  }
+
+  kt_bool MapperGraph::TryCloseLoopBatch(LocalizedRangeScan* pScan, const Name& rSensorName)
+  {
+    // all chains are found against the poses before any of them closes the loop
+    std::vector<LocalizedRangeScanVector> candidateChains;
+
+    kt_int32u scanIndex = 0;
+    LocalizedRangeScanVector candidateChain = FindPossibleLoopClosure(pScan, rSensorName, scanIndex);
+    while (!candidateChain.empty())
+    {
+      candidateChains.push_back(candidateChain);
+      candidateChain = FindPossibleLoopClosure(pScan, rSensorName, scanIndex);
+    }
+
+    if (candidateChains.empty())
+    {
+      return false;
+    }
+
+    // make sure the scan does not update its points while the workers read them
+    pScan->GetPointReadings();
+
+    // each chain takes a pair of matchers for its whole match, since a worker waiting inside a match
+    // (the matchers run parallel loops too) can pick up another chain
+    std::vector<LoopClosureMatch> matches(candidateChains.size());
+    tbb::parallel_for(tbb::blocked_range<size_t>(0, candidateChains.size(), 1),
+                      [&](const tbb::blocked_range<size_t>& rRange)
+    {
+      for (size_t i = rRange.begin(); i != rRange.end(); i++)
+      {
+        std::pair<ScanMatcher*, ScanMatcher*> matchers = AcquireLoopClosureMatchers();
+        try
         {
-          std::cout << "[mtg:Mapper:TryCloseLoop] Loop closure candidate FAILED fine response threshold; rejected (response = " << fineResponse << ")\r\n";
-          m_pMapper->FireLoopClosureCheck("REJECTED!");
+          MatchLoopClosure(pScan, candidateChains[i], matchers.first, matchers.second, matches[i]);
         }
-        else
+        catch(...)
         {
-          std::cout << "[mtg:Mapper:TryCloseLoop] Loop closure candidate PASSED fine response threshold; accepted (response = " << fineResponse << ")\r\n";
-          m_pMapper->FireBeginLoopClosure("Closing loop...");
+          ReleaseLoopClosureMatchers(matchers);
+          throw;
+        }
+        ReleaseLoopClosureMatchers(matchers);
+      }
+    });
+
+    // report in chain order, like the serial search
+    std::vector<size_t> accepted;
+    for (size_t i = 0; i < matches.size(); i++)
+    {
+      if (ReportLoopClosureMatch(matches[i]))
+      {
+        accepted.push_back(i);
+      }
+    }
 
-          pScan->SetSensorPose(bestPose);
-          LinkChainToScan(candidateChain, pScan, bestPose, covariance);
-          CorrectPoses();
+    if (accepted.empty())
+    {
+      return false;
+    }
 
-          m_pMapper->FireEndLoopClosure("Loop closed!");
+    m_pMapper->FireBeginLoopClosure("Closing loop...");
 
-          loopClosed = true;
-        }
+    // start the optimization from the best closure; every closure adds its own constraint
+    size_t best = accepted.front();
+    for (size_t i = 1; i < accepted.size(); i++)
+    {
+      if (matches[accepted[i]].fineResponse > matches[best].fineResponse)
+      {
+        best = accepted[i];
       }
+    }
+    pScan->SetSensorPose(matches[best].bestPose);
 
-      candidateChain = FindPossibleLoopClosure(pScan, rSensorName, scanIndex);
+    for (size_t i = 0; i < accepted.size(); i++)
+    {
+      const LoopClosureMatch& rMatch = matches[accepted[i]];
+      LinkChainToScan(candidateChains[accepted[i]], pScan, rMatch.bestPose, rMatch.covariance);
     }
+    CorrectPosesAfterLoopClosure();
 
-    return loopClosed;
+    m_pMapper->FireEndLoopClosure("Loop closed!");
+
+    return true;
+  }
+
+  std::pair<ScanMatcher*, ScanMatcher*> MapperGraph::AcquireLoopClosureMatchers()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_LoopClosureMatchersMutex);
+      if (!m_LoopClosureMatchers.empty())
+      {
+        std::pair<ScanMatcher*, ScanMatcher*> matchers = m_LoopClosureMatchers.back();
+        m_LoopClosureMatchers.pop_back();
+        return matchers;
+      }
+    }
+
+    // same configurations as the loop and sequential scan matchers
+    ScanMatcher* pLoopScanMatcher = ScanMatcher::Create(m_pMapper,
+      m_pMapper->m_pLoopSearchSpaceDimension->GetValue(),
+      m_pMapper->m_pLoopSearchSpaceResolution->GetValue(),
+      m_pMapper->m_pLoopSearchSpaceSmearDeviation->GetValue(), m_RangeThreshold,
+      m_pMapper->m_pUseBranchAndBoundMatching->GetValue());
+    ScanMatcher* pFineScanMatcher = ScanMatcher::Create(m_pMapper,
+      m_pMapper->m_pCorrelationSearchSpaceDimension->GetValue(),
+      m_pMapper->m_pCorrelationSearchSpaceResolution->GetValue(),
+      m_pMapper->m_pCorrelationSearchSpaceSmearDeviation->GetValue(), m_RangeThreshold);
+    assert(pLoopScanMatcher && pFineScanMatcher);
+
+    return std::make_pair(pLoopScanMatcher, pFineScanMatcher);
+  }
+
+  void MapperGraph::ReleaseLoopClosureMatchers(const std::pair<ScanMatcher*, ScanMatcher*>& rMatchers)
+  {
+    std::lock_guard<std::mutex> lock(m_LoopClosureMatchersMutex);
+    m_LoopClosureMatchers.push_back(rMatchers);
+  }
+
+  void MapperGraph::DestroyLoopClosureMatchers()
+  {
+    std::lock_guard<std::mutex> lock(m_LoopClosureMatchersMutex);
+    for (size_t i = 0; i < m_LoopClosureMatchers.size(); i++)
+    {
+      delete m_LoopClosureMatchers[i].first;
+      delete m_LoopClosureMatchers[i].second;
+    }
+    m_LoopClosureMatchers.clear();
   }
 
   LocalizedRangeScan* MapperGraph::GetClosestScanToPose(const LocalizedRangeScanVector& rScans,
@@ -1677,15 +3051,13 @@ namespace karto
     if (isNewEdge == true)
     {
       pEdge->SetLabel(new LinkInfo(pFromScan->GetCorrectedPose(), pToScan->GetCorrectedAt(rMean), rCovariance));
-      if (m_pMapper->m_pScanOptimizer != NULL)
-      {
-        m_pMapper->m_pScanOptimizer->AddConstraint(pEdge);
-      }
+      m_pMapper->AddScanOptimizerConstraint(pEdge);
     }
   }
 
   void MapperGraph::LinkNearChains(LocalizedRangeScan* pScan, Pose2Vector& rMeans, std::vector<Matrix3>& rCovariances)
   {
+    ScopedStageTimer timer(m_pMapper, MapperStage_LinkNearChains, pScan);
     const std::vector<LocalizedRangeScanVector> nearChains = FindNearChains(pScan);
     const_forEach(std::vector<LocalizedRangeScanVector>, &nearChains)
     {
@@ -1865,84 +3237,228 @@ namespace karto
     return nearLinkedScans;
   }
 
-  std::vector<Vertex<LocalizedRangeScan>*> MapperGraph::FindNearByVertices(Name name, const Pose2 refPose, kt_double maxDistance)
+  std::vector<Vertex<LocalizedRangeScan>*> MapperGraph::FindNearByVertices(const Name& name, const Pose2& refPose, kt_double maxDistance)
   {
-    VertexMap vertexMap = GetVertices();
-    std::map<int, Vertex<LocalizedRangeScan>*>& vertices = vertexMap[name];
+    std::vector<Vertex<LocalizedRangeScan>*> rtn_vertices;
+    NearByVertexIndex* pIndex = GetNearByVertexIndex(name);
+    if (pIndex == NULL)
+    {
+      return rtn_vertices;
+    }
+
+    // maxDistance is compared against squared distances, as the KD-tree always did
+    std::vector<std::pair<size_t, double> > ret_matches;
+    const double query_pt[2] = {refPose.GetX(), refPose.GetY()};
+    if (pIndex->pTree != NULL)
+    {
+      nanoflann::SearchParams params;
+      pIndex->pTree->radiusSearch(&query_pt[0], maxDistance, ret_matches, params);
+    }
 
-    std::vector<Vertex<LocalizedRangeScan>*> vertices_to_search;
-    std::map<int, Vertex<LocalizedRangeScan>*>::iterator it;
-    for (it = vertices.begin(); it != vertices.end(); ++it)
+    std::vector<std::pair<double, Vertex<LocalizedRangeScan>*> > matches;
+    matches.reserve(ret_matches.size());
+    for (size_t i = 0; i != ret_matches.size(); i++)
     {
-      if (it->second)
+      Vertex<LocalizedRangeScan>* pVertex = pIndex->vertices[ret_matches[i].first];
+      if (pVertex != NULL)
       {
-        vertices_to_search.push_back(it->second);
+        matches.push_back(std::make_pair(ret_matches[i].second, pVertex));
       }
     }
 
-    const size_t dim = 2;
+    if (!pIndex->pending.empty())
+    {
+      const_forEach(std::vector<Vertex<LocalizedRangeScan>*>, &pIndex->pending)
+      {
+        const Pose2& rPose = (*iter)->GetObject()->GetCorrectedPose();
+        const double dx = query_pt[0] - rPose.GetX();
+        const double dy = query_pt[1] - rPose.GetY();
+        const double dist = dx * dx + dy * dy;
+        if (dist < maxDistance)
+        {
+          matches.push_back(std::make_pair(dist, *iter));
+        }
+      }
 
-    typedef VertexVectorPoseNanoFlannAdaptor<std::vector<Vertex<LocalizedRangeScan>* > > P2KD;
-    const P2KD p2kd(vertices_to_search);
+      std::stable_sort(matches.begin(), matches.end(),
+        [](const std::pair<double, Vertex<LocalizedRangeScan>*>& rLeft,
+           const std::pair<double, Vertex<LocalizedRangeScan>*>& rRight)
+        {
+          return rLeft.first < rRight.first;
+        });
+    }
 
-    typedef nanoflann::KDTreeSingleIndexAdaptor<nanoflann::L2_Simple_Adaptor<double, P2KD > , P2KD, dim> my_kd_tree_t;
+    rtn_vertices.reserve(matches.size());
+    for (size_t i = 0; i != matches.size(); i++)
+    {
+      rtn_vertices.push_back(matches[i].second);
+    }
+    return rtn_vertices;
+  }
 
-    my_kd_tree_t index(dim, p2kd, nanoflann::KDTreeSingleIndexAdaptorParams(10) );
-    index.buildIndex();
+  Vertex<LocalizedRangeScan>* MapperGraph::FindNearByScan(const Name& name, const Pose2& refPose)
+  {
+    NearByVertexIndex* pIndex = GetNearByVertexIndex(name);
+    if (pIndex == NULL)
+    {
+      return NULL;
+    }
 
-    std::vector<std::pair<size_t,double> > ret_matches;
+    Vertex<LocalizedRangeScan>* pClosest = NULL;
+    double closestDistance = 0.0;
     const double query_pt[2] = {refPose.GetX(), refPose.GetY()};
-    nanoflann::SearchParams params;
-    const size_t num_results = index.radiusSearch(&query_pt[0], maxDistance, ret_matches, params);
 
-    std::vector<Vertex<LocalizedRangeScan>*> rtn_vertices;
-    rtn_vertices.reserve(ret_matches.size());
-    for (uint i = 0; i != ret_matches.size(); i++)
+    if (pIndex->pTree != NULL)
+    {
+      // ask for as many neighbors as there are removed slots, so that one of them is still a vertex
+      size_t num_results = math::Minimum(pIndex->vertices.size(), static_cast<size_t>(pIndex->removedCount + 1));
+      std::vector<size_t> ret_index(num_results);
+      std::vector<double> out_dist_sqr(num_results);
+      num_results = pIndex->pTree->knnSearch(&query_pt[0], num_results, &ret_index[0], &out_dist_sqr[0]);
+
+      for (size_t i = 0; i != num_results; i++)
+      {
+        if (pIndex->vertices[ret_index[i]] != NULL)
+        {
+          pClosest = pIndex->vertices[ret_index[i]];
+          closestDistance = out_dist_sqr[i];
+          break;
+        }
+      }
+    }
+
+    const_forEach(std::vector<Vertex<LocalizedRangeScan>*>, &pIndex->pending)
     {
-      rtn_vertices.push_back(vertices_to_search[ret_matches[i].first]);
+      const Pose2& rPose = (*iter)->GetObject()->GetCorrectedPose();
+      const double dx = query_pt[0] - rPose.GetX();
+      const double dy = query_pt[1] - rPose.GetY();
+      const double dist = dx * dx + dy * dy;
+      if (pClosest == NULL || dist < closestDistance)
+      {
+        pClosest = *iter;
+        closestDistance = dist;
+      }
     }
-    return rtn_vertices;
+
+    return pClosest;
   }
 
-  Vertex<LocalizedRangeScan>* MapperGraph::FindNearByScan(Name name, const Pose2 refPose)
+  void MapperGraph::RemoveVertex(const Name& rName, const int& idx)
   {
-    VertexMap vertexMap = GetVertices();
-    std::map<int, Vertex<LocalizedRangeScan>*>& vertices = vertexMap[name];
-
-    std::vector<Vertex<LocalizedRangeScan>*> vertices_to_search;
-    std::map<int, Vertex<LocalizedRangeScan>*>::iterator it;
-    for (it = vertices.begin(); it != vertices.end(); ++it)
+    std::map<Name, NearByVertexIndex>::iterator indexIter = m_NearByVertexIndices.find(rName);
+    if (indexIter != m_NearByVertexIndices.end() && !indexIter->second.dirty)
     {
-      if (it->second)
+      NearByVertexIndex& rIndex = indexIter->second;
+      std::unordered_map<kt_int32s, size_t>::iterator slotIter = rIndex.slots.find(idx);
+      if (slotIter != rIndex.slots.end())
+      {
+        rIndex.vertices[slotIter->second] = NULL;
+        rIndex.slots.erase(slotIter);
+        rIndex.removedCount++;
+      }
+      else
       {
-        vertices_to_search.push_back(it->second);
+        std::vector<Vertex<LocalizedRangeScan>*>::iterator pendingIter = rIndex.pending.begin();
+        while (pendingIter != rIndex.pending.end() && (*pendingIter)->GetObject()->GetStateId() != idx)
+        {
+          ++pendingIter;
+        }
+        if (pendingIter != rIndex.pending.end())
+        {
+          rIndex.pending.erase(pendingIter);
+        }
       }
     }
 
-    size_t num_results = 1;
-    const size_t dim = 2;
+    std::map<Name, LoopClosureIndex>::iterator loopIter = m_LoopClosureIndices.find(rName);
+    if (loopIter != m_LoopClosureIndices.end())
+    {
+      UnindexScan(loopIter->second, idx);
+    }
 
-    typedef VertexVectorPoseNanoFlannAdaptor<std::vector<Vertex<LocalizedRangeScan>* > > P2KD;
-    const P2KD p2kd(vertices_to_search);
+    Graph<LocalizedRangeScan>::RemoveVertex(rName, idx);
+  }
 
-    typedef nanoflann::KDTreeSingleIndexAdaptor<nanoflann::L2_Simple_Adaptor<double, P2KD > , P2KD, dim> my_kd_tree_t;
+  kt_int32u MapperGraph::GetLoopClosureIndexSize(const Name& rSensorName) const
+  {
+    std::map<Name, LoopClosureIndex>::const_iterator iter = m_LoopClosureIndices.find(rSensorName);
+    if (iter == m_LoopClosureIndices.end())
+    {
+      return 0;
+    }
 
-    my_kd_tree_t index(dim, p2kd, nanoflann::KDTreeSingleIndexAdaptorParams(10) );
-    index.buildIndex();
+    return static_cast<kt_int32u>(iter->second.scanCells.size());
+  }
 
-    std::vector<size_t>   ret_index(num_results);
-    std::vector<double> out_dist_sqr(num_results);
-    const double query_pt[2] = {refPose.GetX(), refPose.GetY()};
-    num_results = index.knnSearch(&query_pt[0], num_results, &ret_index[0], &out_dist_sqr[0]);
+  // vertices added or removed since the nearby vertex KD-tree was built before it is rebuilt
+  const kt_int32u NEAR_BY_VERTEX_INDEX_MAX_CHANGES = 64;
 
-    if (num_results > 0)
+  MapperGraph::NearByVertexIndex* MapperGraph::GetNearByVertexIndex(const Name& rSensorName)
+  {
+    VertexMap::const_iterator verticesIter = m_Vertices.find(rSensorName);
+    if (verticesIter == m_Vertices.end())
     {
-      return vertices_to_search[ret_index[0]];
+      return NULL;
     }
-    else
+
+    NearByVertexIndex& rIndex = m_NearByVertexIndices[rSensorName];
+    if (rIndex.dirty || rIndex.pending.size() + rIndex.removedCount > NEAR_BY_VERTEX_INDEX_MAX_CHANGES)
     {
-      return NULL;
+      BuildNearByVertexIndex(rIndex, verticesIter->second);
+    }
+
+    return &rIndex;
+  }
+
+  void MapperGraph::BuildNearByVertexIndex(NearByVertexIndex& rIndex,
+                                           const std::map<int, Vertex<LocalizedRangeScan>*>& rVertices)
+  {
+    if (rIndex.pTree != NULL)
+    {
+      delete rIndex.pTree;
+      rIndex.pTree = NULL;
+    }
+
+    rIndex.vertices.clear();
+    rIndex.positions.clear();
+    rIndex.slots.clear();
+    rIndex.pending.clear();
+    rIndex.removedCount = 0;
+    rIndex.dirty = false;
+
+    std::map<int, Vertex<LocalizedRangeScan>*>::const_iterator it;
+    for (it = rVertices.begin(); it != rVertices.end(); ++it)
+    {
+      if (it->second)
+      {
+        rIndex.slots[it->first] = rIndex.vertices.size();
+        rIndex.vertices.push_back(it->second);
+        rIndex.positions.push_back(it->second->GetObject()->GetCorrectedPose().GetPosition());
+      }
+    }
+
+    if (rIndex.vertices.empty())
+    {
+      return;
     }
+
+    if (rIndex.pAdaptor == NULL)
+    {
+      rIndex.pAdaptor = new NearByVertexAdaptor(rIndex.positions);
+    }
+    rIndex.pTree = new NearByVertexTree(2, *rIndex.pAdaptor, nanoflann::KDTreeSingleIndexAdaptorParams(10));
+    rIndex.pTree->buildIndex();
+  }
+
+  void MapperGraph::DestroyNearByVertexIndices()
+  {
+    std::map<Name, NearByVertexIndex>::iterator iter;
+    for (iter = m_NearByVertexIndices.begin(); iter != m_NearByVertexIndices.end(); ++iter)
+    {
+      delete iter->second.pTree;
+      delete iter->second.pAdaptor;
+    }
+    m_NearByVertexIndices.clear();
   }
 
   Pose2 MapperGraph::ComputeWeightedMean(const Pose2Vector& rMeans, const std::vector<Matrix3>& rCovariances) const
@@ -1995,53 +3511,200 @@ namespace karto
   {
     LocalizedRangeScanVector chain;  // return value
 
-    Pose2 pose = pScan->GetReferencePose(m_pMapper->m_pUseScanBarycenter->GetValue());
+    kt_bool useBarycenter = m_pMapper->m_pUseScanBarycenter->GetValue();
+    kt_double maximumDistance = m_pMapper->m_pLoopSearchMaximumDistance->GetValue();
+    Pose2 pose = pScan->GetReferencePose(useBarycenter);
 
     // possible loop closure chain should not include close scans that have a
     // path of links to the scan of interest
-    const LocalizedRangeScanVector nearLinkedScans =
-          FindNearLinkedScans(pScan, m_pMapper->m_pLoopSearchMaximumDistance->GetValue());
+    const LocalizedRangeScanVector nearLinkedScanVector = FindNearLinkedScans(pScan, maximumDistance);
+    const std::unordered_set<LocalizedRangeScan*> nearLinkedScans(nearLinkedScanVector.begin(),
+                                                                   nearLinkedScanVector.end());
+
+    LocalizedRangeScanMap& rScans = m_pMapper->m_pMapperSensorManager->GetScans(rSensorName);
+    kt_int32s nScans = static_cast<kt_int32s>(rScans.size());
+
+    // scans in range, in state id order; the index cells are at least as large as the search radius
+    LoopClosureIndex& rIndex = GetLoopClosureIndex(rSensorName);
+    if (pScan->GetSensorName() == rSensorName)
+    {
+      IndexScan(rIndex, pScan);
+    }
+
+    kt_int64s centerCell = GetLoopClosureIndexCell(rIndex, pose.GetPosition());
+    kt_int32s centerX = static_cast<kt_int32s>(centerCell >> 32);
+    kt_int32s centerY = static_cast<kt_int32s>(centerCell & 0xFFFFFFFF);
+
+    std::vector<kt_int32s> inRange;
+    for (kt_int32s dy = -1; dy <= 1; dy++)
+    {
+      for (kt_int32s dx = -1; dx <= 1; dx++)
+      {
+        kt_int64s key = (static_cast<kt_int64s>(centerX + dx) << 32) |
+                        static_cast<kt_int64u>(static_cast<kt_int32u>(centerY + dy));
+        std::unordered_map<kt_int64s, std::vector<kt_int32s> >::const_iterator cell = rIndex.cells.find(key);
+        if (cell == rIndex.cells.end())
+        {
+          continue;
+        }
+
+        for (size_t i = 0; i < cell->second.size(); i++)
+        {
+          kt_int32s stateId = cell->second[i];
+          if (stateId < static_cast<kt_int32s>(rStartNum) || stateId >= nScans)
+          {
+            continue;
+          }
+
+          LocalizedRangeScanMap::const_iterator scan = rScans.find(stateId);
+          if (scan == rScans.end() || scan->second == NULL)
+          {
+            continue;
+          }
+
+          Pose2 candidateScanPose = scan->second->GetReferencePose(useBarycenter);
+          kt_double squaredDistance = candidateScanPose.GetPosition().SquaredDistance(pose.GetPosition());
+          if (squaredDistance < math::Square(maximumDistance) + KT_TOLERANCE)
+          {
+            inRange.push_back(stateId);
+          }
+        }
+      }
+    }
+    std::sort(inRange.begin(), inRange.end());
+
+    // a chain is a run of scans in range; any scan in between that is out of range ends it
+    kt_int32s nextStateId = static_cast<kt_int32s>(rStartNum);
+    for (size_t i = 0; i <= inRange.size(); i++)
+    {
+      kt_int32s stateId = (i < inRange.size()) ? inRange[i] : nScans;
+
+      LocalizedRangeScanMap::const_iterator outOfRange = rScans.lower_bound(nextStateId);
+      if (outOfRange != rScans.end() && outOfRange->first < stateId)
+      {
+        // return chain if it is long "enough"
+        if (chain.size() >= m_pMapper->m_pLoopMatchMinimumChainSize->GetValue())
+        {
+          rStartNum = outOfRange->first;
+          return chain;
+        }
+        else
+        {
+          chain.clear();
+        }
+      }
+
+      if (i == inRange.size())
+      {
+        break;
+      }
+
+      LocalizedRangeScan* pCandidateScan = rScans.find(stateId)->second;
+
+      // a linked scan cannot be in the chain
+      if (nearLinkedScans.find(pCandidateScan) != nearLinkedScans.end())
+      {
+        chain.clear();
+      }
+      else
+      {
+        chain.push_back(pCandidateScan);
+      }
+
+      nextStateId = stateId + 1;
+    }
+
+    rStartNum = math::Maximum(static_cast<kt_int32s>(rStartNum), nScans);
+    return chain;
+  }
+
+  MapperGraph::LoopClosureIndex& MapperGraph::GetLoopClosureIndex(const Name& rSensorName)
+  {
+    // cells as large as the search radius, so that a search only visits the 3 x 3 cells around the scan
+    kt_double cellSize = sqrt(math::Square(m_pMapper->m_pLoopSearchMaximumDistance->GetValue()) + KT_TOLERANCE);
+    kt_bool useBarycenter = m_pMapper->m_pUseScanBarycenter->GetValue();
+
+    std::map<Name, LoopClosureIndex>::iterator iter = m_LoopClosureIndices.find(rSensorName);
+    if (iter != m_LoopClosureIndices.end() &&
+        iter->second.cellSize == cellSize && iter->second.useBarycenter == useBarycenter)
+    {
+      return iter->second;
+    }
+
+    LoopClosureIndex& rIndex = m_LoopClosureIndices[rSensorName];
+    rIndex.cellSize = cellSize;
+    rIndex.useBarycenter = useBarycenter;
+    rIndex.cells.clear();
+    rIndex.scanCells.clear();
+
+    const LocalizedRangeScanMap& rScans = m_pMapper->m_pMapperSensorManager->GetScans(rSensorName);
+    for (LocalizedRangeScanMap::const_iterator scan = rScans.begin(); scan != rScans.end(); ++scan)
+    {
+      if (scan->second != NULL)
+      {
+        IndexScan(rIndex, scan->second);
+      }
+    }
+
+    return rIndex;
+  }
+
+  kt_int64s MapperGraph::GetLoopClosureIndexCell(const LoopClosureIndex& rIndex,
+                                                 const Vector2<kt_double>& rPosition) const
+  {
+    kt_int32s x = static_cast<kt_int32s>(floor(rPosition.GetX() / rIndex.cellSize));
+    kt_int32s y = static_cast<kt_int32s>(floor(rPosition.GetY() / rIndex.cellSize));
+    return (static_cast<kt_int64s>(x) << 32) | static_cast<kt_int64u>(static_cast<kt_int32u>(y));
+  }
 
-    kt_int32u nScans = static_cast<kt_int32u>(m_pMapper->m_pMapperSensorManager->GetScans(rSensorName).size());
-    for (; rStartNum < nScans; rStartNum++)
-    {
-      LocalizedRangeScan* pCandidateScan = m_pMapper->m_pMapperSensorManager->GetScan(rSensorName, rStartNum);
+  void MapperGraph::IndexScan(LoopClosureIndex& rIndex, LocalizedRangeScan* pScan)
+  {
+    kt_int64s key = GetLoopClosureIndexCell(rIndex, pScan->GetReferencePose(rIndex.useBarycenter).GetPosition());
 
-      if (pCandidateScan == NULL)
+    std::unordered_map<kt_int32s, kt_int64s>::iterator iter = rIndex.scanCells.find(pScan->GetStateId());
+    if (iter != rIndex.scanCells.end())
+    {
+      if (iter->second == key)
       {
-        continue;
+        return;
       }
+      UnindexScan(rIndex, pScan->GetStateId());
+    }
 
-      Pose2 candidateScanPose = pCandidateScan->GetReferencePose(m_pMapper->m_pUseScanBarycenter->GetValue());
+    rIndex.cells[key].push_back(pScan->GetStateId());
+    rIndex.scanCells[pScan->GetStateId()] = key;
+  }
 
-      kt_double squaredDistance = candidateScanPose.GetPosition().SquaredDistance(pose.GetPosition());
-      if (squaredDistance < math::Square(m_pMapper->m_pLoopSearchMaximumDistance->GetValue()) + KT_TOLERANCE)
-      {
-        // a linked scan cannot be in the chain
-        if (find(nearLinkedScans.begin(), nearLinkedScans.end(), pCandidateScan) != nearLinkedScans.end())
-        {
-          chain.clear();
-        }
-        else
-        {
-          chain.push_back(pCandidateScan);
-        }
-      }
-      else
-      {
-        // return chain if it is long "enough"
-        if (chain.size() >= m_pMapper->m_pLoopMatchMinimumChainSize->GetValue())
-        {
-          return chain;
-        }
-        else
-        {
-          chain.clear();
-        }
-      }
+  void MapperGraph::UpdateLoopClosureIndex(LocalizedRangeScan* pScan)
+  {
+    std::map<Name, LoopClosureIndex>::iterator iter = m_LoopClosureIndices.find(pScan->GetSensorName());
+    if (iter != m_LoopClosureIndices.end())
+    {
+      IndexScan(iter->second, pScan);
     }
+  }
 
-    return chain;
+  void MapperGraph::UnindexScan(LoopClosureIndex& rIndex, kt_int32s stateId)
+  {
+    std::unordered_map<kt_int32s, kt_int64s>::iterator iter = rIndex.scanCells.find(stateId);
+    if (iter == rIndex.scanCells.end())
+    {
+      return;
+    }
+
+    std::vector<kt_int32s>& rCell = rIndex.cells[iter->second];
+    std::vector<kt_int32s>::iterator scan = std::find(rCell.begin(), rCell.end(), stateId);
+    if (scan != rCell.end())
+    {
+      *scan = rCell.back();
+      rCell.pop_back();
+    }
+    if (rCell.empty())
+    {
+      rIndex.cells.erase(iter->second);
+    }
+
+    rIndex.scanCells.erase(iter);
   }
 
   void MapperGraph::CorrectPoses()
@@ -2050,31 +3713,67 @@ namespace karto
     ScanSolver* pSolver = m_pMapper->m_pScanOptimizer;
     if (pSolver != NULL)
     {
+      std::chrono::steady_clock::time_point solveStart = std::chrono::steady_clock::now();
       pSolver->Compute();
+      m_pMapper->FireStageTimed(MapperStage_Solve, solveStart);
+
+      ApplyCorrections(pSolver->GetCorrections());
+
+      pSolver->Clear();
+    }
+  }
+
+  void MapperGraph::CorrectPosesAfterLoopClosure()
+  {
+    if (m_pMapper->m_pUseBackgroundOptimization->GetValue())
+    {
+      m_pMapper->StartBackgroundOptimization();
+    }
+    else
+    {
+      CorrectPoses();
+    }
+  }
+
+  void MapperGraph::ApplyCorrections(const std::vector<std::pair<kt_int32s, Pose2> >& rCorrections)
+  {
+    if (rCorrections.empty())
+    {
+      return;
+    }
 
-      const_forEach(ScanSolver::IdPoseVector, &pSolver->GetCorrections())
+    const_forEach(ScanSolver::IdPoseVector, &rCorrections)
+    {
+      LocalizedRangeScan* scan = m_pMapper->m_pMapperSensorManager->GetScan(iter->first);
+      if (scan == NULL)
       {
-        LocalizedRangeScan* scan = m_pMapper->m_pMapperSensorManager->GetScan(iter->first);
-        if (scan == NULL)
-        {
-          continue;
-        }
-        scan->SetCorrectedPoseAndUpdate(iter->second);
+        continue;
       }
+      scan->SetCorrectedPoseAndUpdate(iter->second);
+      UpdateLoopClosureIndex(scan);
+    }
+    m_pMapper->m_GraphRevision++;
 
-      pSolver->Clear();
+    std::map<Name, NearByVertexIndex>::iterator indexIter;
+    for (indexIter = m_NearByVertexIndices.begin(); indexIter != m_NearByVertexIndices.end(); ++indexIter)
+    {
+      indexIter->second.dirty = true;
     }
   }
 
   void MapperGraph::UpdateLoopScanMatcher(kt_double rangeThreshold)
   {
+    m_RangeThreshold = rangeThreshold;
+    DestroyLoopClosureMatchers();
+
     if (m_pLoopScanMatcher) {
       delete m_pLoopScanMatcher;
     }
     m_pLoopScanMatcher = ScanMatcher::Create(m_pMapper,
       m_pMapper->m_pLoopSearchSpaceDimension->GetValue(),
       m_pMapper->m_pLoopSearchSpaceResolution->GetValue(),
-      m_pMapper->m_pLoopSearchSpaceSmearDeviation->GetValue(), rangeThreshold);
+      m_pMapper->m_pLoopSearchSpaceSmearDeviation->GetValue(), rangeThreshold,
+      m_pMapper->m_pUseBranchAndBoundMatching->GetValue());
     assert(m_pLoopScanMatcher);
   }
 
@@ -2093,7 +3792,14 @@ namespace karto
     m_pInitialScanMatcher(NULL),
     m_pMapperSensorManager(NULL),
     m_pGraph(NULL),
-    m_pScanOptimizer(NULL)
+    m_pScanOptimizer(NULL),
+    m_pOccupancyGrid(NULL),
+    m_OptimizerStop(false),
+    m_OptimizationRunning(false),
+    m_OptimizationSolving(false),
+    m_OptimizationRequested(false),
+    m_LastSolverScanId(-1),
+    m_GraphRevision(0)
   {
     InitializeParameters();
   }
@@ -2109,7 +3815,14 @@ namespace karto
     m_pInitialScanMatcher(NULL),
     m_pMapperSensorManager(NULL),
     m_pGraph(NULL),
-    m_pScanOptimizer(NULL)
+    m_pScanOptimizer(NULL),
+    m_pOccupancyGrid(NULL),
+    m_OptimizerStop(false),
+    m_OptimizationRunning(false),
+    m_OptimizationSolving(false),
+    m_OptimizationRequested(false),
+    m_LastSolverScanId(-1),
+    m_GraphRevision(0)
   {
     InitializeParameters();
   }
@@ -2360,6 +4073,63 @@ namespace karto
         "Minimum value of the scan match response for it to be considered "
         "for pose correction.",
         0.0, GetParameterManager());
+
+    m_pUseBranchAndBoundMatching = new Parameter<kt_bool>(
+        "UseBranchAndBoundMatching",
+        "Whether the loop closure and initialization scan matchers find the "
+        "coarse match by branch and bound over a max-pooled correlation grid "
+        "pyramid instead of brute force. Same result, faster for large search "
+        "spaces.",
+        false, GetParameterManager());
+
+    m_pUseSequentialGridCache = new Parameter<kt_bool>(
+        "UseSequentialGridCache",
+        "Whether sequential scan matching keeps the correlation grid of each "
+        "sensor's running scans between scans and only updates it for the "
+        "scans entering and leaving the buffer, instead of rebuilding it for "
+        "every scan. The grid is aligned to a fixed world lattice, so matches "
+        "can differ slightly from a rebuilt grid.",
+        false, GetParameterManager());
+
+    m_pUseBatchedLoopClosure = new Parameter<kt_bool>(
+        "UseBatchedLoopClosure",
+        "Whether all loop closure candidate chains of a scan are matched "
+        "concurrently, each worker with its own scan matchers, and every "
+        "accepted closure is added before a single optimization, instead of "
+        "optimizing after each accepted closure.",
+        false, GetParameterManager());
+
+    m_pUseBackgroundOptimization = new Parameter<kt_bool>(
+        "UseBackgroundOptimization",
+        "Whether the optimization after a loop closure runs on a background "
+        "thread. Scans keep being matched against the pre-optimization poses "
+        "and the corrections are applied when the next scan is processed, "
+        "moving the scans added in the meantime along with the last optimized "
+        "scan.",
+        false, GetParameterManager());
+
+    m_pUseCompactScans = new Parameter<kt_bool>(
+        "UseCompactScans",
+        "Whether scans added to the map keep their range readings quantized "
+        "to 16 bits and only the point readings of the most recently used "
+        "\"MaximumMaterializedScans\" scans, recomputing the others when "
+        "needed.",
+        false, GetParameterManager());
+
+    m_pMaximumMaterializedScans = new Parameter<kt_int32u>(
+        "MaximumMaterializedScans",
+        "Number of scans that keep their point readings between processed "
+        "scans with \"UseCompactScans\". Should cover the running buffers "
+        "and the scans near the robots.",
+        1000, GetParameterManager());
+
+    m_pRaytracePoseChangeThreshold = new Parameter<kt_double>(
+        "RaytracePoseChangeThreshold",
+        "Fraction of a cell the beams of a scan in the occupancy grid must "
+        "move by, from the laser translation plus its rotation at the range "
+        "threshold, before the scan is raytraced again at its corrected pose. "
+        "0 raytraces every scan whose pose changed again.",
+        0.0, GetParameterManager());
   }
   /* Adding in getters and setters here for easy parameter access */
 
@@ -2541,6 +4311,41 @@ namespace karto
     return static_cast<double>(m_pMinimumDistancePenalty->GetValue());
   }
 
+  bool Mapper::getParamUseBranchAndBoundMatching()
+  {
+    return static_cast<bool>(m_pUseBranchAndBoundMatching->GetValue());
+  }
+
+  bool Mapper::getParamUseSequentialGridCache()
+  {
+    return static_cast<bool>(m_pUseSequentialGridCache->GetValue());
+  }
+
+  bool Mapper::getParamUseBatchedLoopClosure()
+  {
+    return static_cast<bool>(m_pUseBatchedLoopClosure->GetValue());
+  }
+
+  bool Mapper::getParamUseBackgroundOptimization()
+  {
+    return static_cast<bool>(m_pUseBackgroundOptimization->GetValue());
+  }
+
+  bool Mapper::getParamUseCompactScans()
+  {
+    return static_cast<bool>(m_pUseCompactScans->GetValue());
+  }
+
+  int Mapper::getParamMaximumMaterializedScans()
+  {
+    return static_cast<int>(m_pMaximumMaterializedScans->GetValue());
+  }
+
+  double Mapper::getParamRaytracePoseChangeThreshold()
+  {
+    return static_cast<double>(m_pRaytracePoseChangeThreshold->GetValue());
+  }
+
   /* Setters for parameters */
   // General Parameters
   void Mapper::setParamUseScanMatching(bool b)
@@ -2717,6 +4522,41 @@ namespace karto
     m_pMinimumDistancePenalty->SetValue((kt_double)d);
   }
 
+  void Mapper::setParamUseBranchAndBoundMatching(bool b)
+  {
+    m_pUseBranchAndBoundMatching->SetValue((kt_bool)b);
+  }
+
+  void Mapper::setParamUseSequentialGridCache(bool b)
+  {
+    m_pUseSequentialGridCache->SetValue((kt_bool)b);
+  }
+
+  void Mapper::setParamUseBatchedLoopClosure(bool b)
+  {
+    m_pUseBatchedLoopClosure->SetValue((kt_bool)b);
+  }
+
+  void Mapper::setParamUseBackgroundOptimization(bool b)
+  {
+    m_pUseBackgroundOptimization->SetValue((kt_bool)b);
+  }
+
+  void Mapper::setParamUseCompactScans(bool b)
+  {
+    m_pUseCompactScans->SetValue((kt_bool)b);
+  }
+
+  void Mapper::setParamMaximumMaterializedScans(int i)
+  {
+    m_pMaximumMaterializedScans->SetValue((kt_int32u)i);
+  }
+
+  void Mapper::setParamRaytracePoseChangeThreshold(double d)
+  {
+    m_pRaytracePoseChangeThreshold->SetValue((kt_double)d);
+  }
+
 
 
 
@@ -2730,11 +4570,7 @@ namespace karto
     if (m_pSequentialScanMatcher) {
       delete m_pSequentialScanMatcher;
     }
-    m_pSequentialScanMatcher = ScanMatcher::Create(this,
-      m_pCorrelationSearchSpaceDimension->GetValue(),
-      m_pCorrelationSearchSpaceResolution->GetValue(),
-      m_pCorrelationSearchSpaceSmearDeviation->GetValue(),
-      rangeThreshold);
+    m_pSequentialScanMatcher = CreateSequentialScanMatcher(rangeThreshold);
     assert(m_pSequentialScanMatcher);
     // Set up scan matcher for first scans
     if (m_pInitialScanMatcher) {
@@ -2744,7 +4580,8 @@ namespace karto
       m_pInitializationCorrelationSearchSpaceDimension->GetValue(),
       m_pInitializationCorrelationSearchSpaceResolution->GetValue(),
       m_pInitializationCorrelationSearchSpaceSmearDeviation->GetValue(),
-      rangeThreshold);
+      rangeThreshold,
+      m_pUseBranchAndBoundMatching->GetValue());
     assert(m_pInitialScanMatcher);
 
     if (m_Deserialized) {
@@ -2759,6 +4596,13 @@ namespace karto
       m_pGraph = new MapperGraph(this, rangeThreshold);
     }
 
+    std::shared_ptr<PointReadingsCache> pPointReadingsCache;
+    if (m_pUseCompactScans->GetValue())
+    {
+      pPointReadingsCache = std::make_shared<PointReadingsCache>(m_pMaximumMaterializedScans->GetValue());
+    }
+    m_pMapperSensorManager->SetPointReadingsCache(pPointReadingsCache);
+
     m_Initialized = true;
   }
 
@@ -2770,140 +4614,304 @@ namespace karto
     oa << BOOST_SERIALIZATION_NVP(*this);
   }
 
-  void Mapper::LoadFromFile(const std::string& filename)
+  void Mapper::LoadFromFile(const std::string& filename)
+  {
+    printf("Load From File %s \n", filename.c_str());
+    std::ifstream ifs(filename.c_str());
+    boost::archive::binary_iarchive ia(ifs, boost::archive::no_codecvt);
+    ia >> BOOST_SERIALIZATION_NVP(*this);
+    m_Deserialized = true;
+    m_Initialized = false;
+  }
+
+  void Mapper::Reset()
+  {
+    StopBackgroundOptimizer();
+
+    if (m_pSequentialScanMatcher)
+    {
+      delete m_pSequentialScanMatcher;
+      m_pSequentialScanMatcher = NULL;
+    }
+    if (m_pInitialScanMatcher)
+    {
+      delete m_pInitialScanMatcher;
+      m_pInitialScanMatcher = NULL;
+    }
+    forEach(SensorFrontEnds, &m_FrontEnds)
+    {
+      delete iter->second.pScanMatcher;
+    }
+    m_FrontEnds.clear();
+    if (m_pGraph)
+    {
+      delete m_pGraph;
+      m_pGraph = NULL;
+    }
+    if (m_pMapperSensorManager)
+    {
+      delete m_pMapperSensorManager;
+      m_pMapperSensorManager = NULL;
+    }
+    if (m_pOccupancyGrid)
+    {
+      delete m_pOccupancyGrid;
+      m_pOccupancyGrid = NULL;
+    }
+	  m_Initialized = false;
+    m_Deserialized = false;
+    m_GraphRevision++;
+    while (!m_LocalizationScanVertices.empty())
+    {
+      m_LocalizationScanVertices.pop();
+    }
+  }
+
+  kt_bool Mapper::Process(Object*  /*pObject*/)
+  {
+    return true;
+  }
+
+  kt_bool Mapper::Process(LocalizedRangeScan* pScan)
+  {
+    std::chrono::steady_clock::time_point processStart = std::chrono::steady_clock::now();
+    ApplyBackgroundOptimization();
+
+	  if (pScan != NULL)
+	  {
+		  karto::LaserRangeFinder* pLaserRangeFinder = pScan->GetLaserRangeFinder();
+
+		  // validate scan
+		  if (pLaserRangeFinder == NULL || pScan == NULL || pLaserRangeFinder->Validate(pScan) == false)
+		  {
+			  return false;
+		  }
+
+		  if (m_Initialized == false)
+		  {
+			  // initialize mapper with range threshold from device
+			  Initialize(pLaserRangeFinder->GetRangeThreshold());
+		  }
+
+		  // get last scan
+		  LocalizedRangeScan* pLastScan = m_pMapperSensorManager->GetLastScan(pScan->GetSensorName());
+
+		  // a sensor with a front end of its own keeps using its matcher
+		  ScanMatcher* pScanMatcher = m_pSequentialScanMatcher;
+		  SensorFrontEnds::iterator frontEnd = m_FrontEnds.find(pScan->GetSensorName());
+		  if (frontEnd != m_FrontEnds.end())
+		  {
+			  pScanMatcher = frontEnd->second.pScanMatcher;
+		  }
+
+		  Matrix3 covariance;
+		  if (!MatchToRunningScans(pScan, pLastScan, pScanMatcher, covariance))
+		  {
+			  return false;
+		  }
+
+		  AddMatchedScan(pScan, covariance);
+
+		  FireStageTimed(MapperStage_Process, processStart, pScan);
+		  return true;
+	  }
+
+	  return false;
+  }
+
+  void Mapper::RegisterFrontEnd(LaserRangeFinder* pLaserRangeFinder)
+  {
+    if (pLaserRangeFinder == NULL)
+    {
+      return;
+    }
+
+    if (m_Initialized == false)
+    {
+      Initialize(pLaserRangeFinder->GetRangeThreshold());
+    }
+
+    m_pMapperSensorManager->RegisterSensor(pLaserRangeFinder->GetName());
+    if (m_FrontEnds.find(pLaserRangeFinder->GetName()) == m_FrontEnds.end())
+    {
+      SensorFrontEnd frontEnd;
+      frontEnd.pScanMatcher = CreateSequentialScanMatcher(pLaserRangeFinder->GetRangeThreshold());
+      frontEnd.pPendingScan = NULL;
+      frontEnd.pReferenceScan = NULL;
+      m_FrontEnds[pLaserRangeFinder->GetName()] = frontEnd;
+    }
+  }
+
+  kt_bool Mapper::HasFrontEnd(const Name& rSensorName) const
+  {
+    return m_FrontEnds.find(rSensorName) != m_FrontEnds.end();
+  }
+
+  kt_bool Mapper::MatchScan(LocalizedRangeScan* pScan, Matrix3& rCovariance)
+  {
+    std::chrono::steady_clock::time_point matchStart = std::chrono::steady_clock::now();
+    if (pScan == NULL)
+    {
+      return false;
+    }
+
+    SensorFrontEnds::iterator frontEnd = m_FrontEnds.find(pScan->GetSensorName());
+    if (frontEnd == m_FrontEnds.end())
+    {
+      return false;
+    }
+
+    karto::LaserRangeFinder* pLaserRangeFinder = pScan->GetLaserRangeFinder();
+    if (pLaserRangeFinder == NULL || pLaserRangeFinder->Validate(pScan) == false)
+    {
+      return false;
+    }
+
+    // the sensor is registered, this only reads the sensor manager
+    LocalizedRangeScan* pLastScan = m_pMapperSensorManager->GetLastScan(pScan->GetSensorName());
+    if (!MatchToRunningScans(pScan, pLastScan, frontEnd->second.pScanMatcher, rCovariance))
+    {
+      return false;
+    }
+
+    SensorFrontEnd& rFrontEnd = frontEnd->second;
+    rFrontEnd.pPendingScan = pScan;
+    rFrontEnd.pReferenceScan = pLastScan;
+    if (pLastScan != NULL)
+    {
+      rFrontEnd.referencePose = pLastScan->GetCorrectedPose();
+    }
+    rFrontEnd.matchStart = matchStart;
+    return true;
+  }
+
+  kt_bool Mapper::InsertScan(LocalizedRangeScan* pScan, const Matrix3& rCovariance)
   {
-    printf("Load From File %s \n", filename.c_str());
-    std::ifstream ifs(filename.c_str());
-    boost::archive::binary_iarchive ia(ifs, boost::archive::no_codecvt);
-    ia >> BOOST_SERIALIZATION_NVP(*this);
-    m_Deserialized = true;
-    m_Initialized = false;
-  }
+    ApplyBackgroundOptimization();
 
-  void Mapper::Reset()
-  {
-    if (m_pSequentialScanMatcher)
-    {
-      delete m_pSequentialScanMatcher;
-      m_pSequentialScanMatcher = NULL;
-    }
-    if (m_pInitialScanMatcher)
+    if (pScan == NULL)
     {
-      delete m_pInitialScanMatcher;
-      m_pInitialScanMatcher = NULL;
+      return false;
     }
-    if (m_pGraph)
+
+    SensorFrontEnds::iterator frontEnd = m_FrontEnds.find(pScan->GetSensorName());
+    if (frontEnd == m_FrontEnds.end() || frontEnd->second.pPendingScan != pScan)
     {
-      delete m_pGraph;
-      m_pGraph = NULL;
+      return false;
     }
-    if (m_pMapperSensorManager)
+
+    SensorFrontEnd& rFrontEnd = frontEnd->second;
+    rFrontEnd.pPendingScan = NULL;
+
+    // the last scan was removed or replaced since the match
+    LocalizedRangeScan* pLastScan = m_pMapperSensorManager->GetLastScan(pScan->GetSensorName());
+    if (pLastScan != rFrontEnd.pReferenceScan)
     {
-      delete m_pMapperSensorManager;
-      m_pMapperSensorManager = NULL;
+      return false;
     }
-	  m_Initialized = false;
-    m_Deserialized = false;
-    while (!m_LocalizationScanVertices.empty())
+
+    // the last scan was corrected since the match, the scan keeps its pose relative to it
+    if (pLastScan != NULL && pLastScan->GetCorrectedPose() != rFrontEnd.referencePose)
     {
-      m_LocalizationScanVertices.pop();
+      Transform correction(rFrontEnd.referencePose, pLastScan->GetCorrectedPose());
+      pScan->SetCorrectedPose(correction.TransformPose(pScan->GetCorrectedPose()));
     }
-  }
 
-  kt_bool Mapper::Process(Object*  /*pObject*/)
-  {
+    AddMatchedScan(pScan, rCovariance);
+
+    FireStageTimed(MapperStage_Process, rFrontEnd.matchStart, pScan);
     return true;
   }
 
-  kt_bool Mapper::Process(LocalizedRangeScan* pScan)
+  ScanMatcher* Mapper::CreateSequentialScanMatcher(kt_double rangeThreshold)
   {
-	  if (pScan != NULL)
-	  {
-		  karto::LaserRangeFinder* pLaserRangeFinder = pScan->GetLaserRangeFinder();
-
-		  // validate scan
-		  if (pLaserRangeFinder == NULL || pScan == NULL || pLaserRangeFinder->Validate(pScan) == false)
-		  {
-			  return false;
-		  }
-
-		  if (m_Initialized == false)
-		  {
-			  // initialize mapper with range threshold from device
-			  Initialize(pLaserRangeFinder->GetRangeThreshold());
-		  }
-
-		  // get last scan
-		  LocalizedRangeScan* pLastScan = m_pMapperSensorManager->GetLastScan(pScan->GetSensorName());
+    return ScanMatcher::Create(this,
+      m_pCorrelationSearchSpaceDimension->GetValue(),
+      m_pCorrelationSearchSpaceResolution->GetValue(),
+      m_pCorrelationSearchSpaceSmearDeviation->GetValue(),
+      rangeThreshold,
+      false,
+      m_pUseSequentialGridCache->GetValue());
+  }
 
-		  // update scans corrected pose based on last correction
-		  if (pLastScan != NULL)
-		  {
-			  Transform lastTransform(pLastScan->GetOdometricPose(), pLastScan->GetCorrectedPose());
-			  pScan->SetCorrectedPose(lastTransform.TransformPose(pScan->GetOdometricPose()));
-		  }
+  kt_bool Mapper::MatchToRunningScans(LocalizedRangeScan* pScan, LocalizedRangeScan* pLastScan,
+                                      ScanMatcher* pScanMatcher, Matrix3& rCovariance)
+  {
+    // update scans corrected pose based on last correction
+    if (pLastScan != NULL)
+    {
+      Transform lastTransform(pLastScan->GetOdometricPose(), pLastScan->GetCorrectedPose());
+      pScan->SetCorrectedPose(lastTransform.TransformPose(pScan->GetOdometricPose()));
+    }
 
-		  // test if scan is outside minimum boundary or if heading is larger then minimum heading
-		  if (!HasMovedEnough(pScan, pLastScan))
-		  {
-			  return false;
-		  }
+    // test if scan is outside minimum boundary or if heading is larger then minimum heading
+    if (!HasMovedEnough(pScan, pLastScan))
+    {
+      return false;
+    }
 
-		  Matrix3 covariance;
-		  covariance.SetToIdentity();
+    rCovariance.SetToIdentity();
 
-		  // correct scan (if not first scan)
-		  if (m_pUseScanMatching->GetValue() && pLastScan != NULL)
-		  {
-			  Pose2 bestPose;
-			  kt_double scan_match_response = m_pSequentialScanMatcher->MatchScan(pScan,
-					  m_pMapperSensorManager->GetRunningScans(pScan->GetSensorName()),
-					  bestPose,
-					  covariance);
-        // Only correct pose if scan matching is reasonable
-        if(scan_match_response > getParamMinimumScanMatchResponse())
-			    pScan->SetSensorPose(bestPose);
-		  }
+    // correct scan (if not first scan)
+    if (m_pUseScanMatching->GetValue() && pLastScan != NULL)
+    {
+      std::chrono::steady_clock::time_point matchStart = std::chrono::steady_clock::now();
+      Pose2 bestPose;
+      kt_double scan_match_response = pScanMatcher->MatchScanToRunningScans(pScan,
+          m_pMapperSensorManager->GetRunningScans(pScan->GetSensorName()),
+          bestPose,
+          rCovariance);
+      FireStageTimed(MapperStage_SequentialMatch, matchStart, pScan);
+      // Only correct pose if scan matching is reasonable
+      if(scan_match_response > getParamMinimumScanMatchResponse())
+        pScan->SetSensorPose(bestPose);
+    }
 
-		  // add scan to buffer and assign id
-		  m_pMapperSensorManager->AddScan(pScan);
+    return true;
+  }
 
-		  if (m_pUseScanMatching->GetValue())
-		  {
-			  // add to graph
-			  m_pGraph->AddVertex(pScan);
-			  m_pGraph->AddEdges(pScan, covariance);
+  void Mapper::AddMatchedScan(LocalizedRangeScan* pScan, const Matrix3& rCovariance)
+  {
+    // add scan to buffer and assign id
+    m_pMapperSensorManager->AddScan(pScan);
 
-			  m_pMapperSensorManager->AddRunningScan(pScan);
+    if (m_pUseScanMatching->GetValue())
+    {
+      // add to graph
+      std::chrono::steady_clock::time_point edgesStart = std::chrono::steady_clock::now();
+      m_pGraph->AddVertex(pScan);
+      m_pGraph->AddEdges(pScan, rCovariance);
+      FireStageTimed(MapperStage_AddEdges, edgesStart, pScan);
 
-			  if (m_pDoLoopClosing->GetValue())
-			  {
-			    std::vector<Name> deviceNames;
-			    if(m_pLoopCloseAcrossAgents->GetValue()){
-			      deviceNames = m_pMapperSensorManager->GetSensorNames();
-			    }
-			    else{
-			      karto::Name current_sensor_name = pScan->GetSensorName();
-			      deviceNames.push_back(current_sensor_name);
-			    }
-
-				  const_forEach(std::vector<Name>, &deviceNames)
-				  {
-					  m_pGraph->TryCloseLoop(pScan, *iter);
-				  }
-			  }
-		  }
+      m_pMapperSensorManager->AddRunningScan(pScan);
 
-		  m_pMapperSensorManager->SetLastScan(pScan);
+      if (m_pDoLoopClosing->GetValue())
+      {
+        std::chrono::steady_clock::time_point loopClosureStart = std::chrono::steady_clock::now();
+        std::vector<Name> deviceNames;
+        if(m_pLoopCloseAcrossAgents->GetValue()){
+          deviceNames = m_pMapperSensorManager->GetSensorNames();
+        }
+        else{
+          karto::Name current_sensor_name = pScan->GetSensorName();
+          deviceNames.push_back(current_sensor_name);
+        }
 
-		  return true;
-	  }
+        const_forEach(std::vector<Name>, &deviceNames)
+        {
+          m_pGraph->TryCloseLoop(pScan, *iter);
+        }
+        FireStageTimed(MapperStage_LoopClosure, loopClosureStart, pScan);
+      }
+    }
 
-	  return false;
+    m_pMapperSensorManager->SetLastScan(pScan);
   }
 
   kt_bool Mapper::ProcessAgainstNodesNearBy(LocalizedRangeScan* pScan, kt_bool addScanToLocalizationBuffer)
   {
+    ApplyBackgroundOptimization();
+
     if (pScan != NULL)
     {
       karto::LaserRangeFinder* pLaserRangeFinder = pScan->GetLaserRangeFinder();
@@ -2940,7 +4948,7 @@ namespace karto
       if (m_pUseScanMatching->GetValue() && pLastScan != NULL)
       {
         Pose2 bestPose;
-        m_pSequentialScanMatcher->MatchScan(pScan,
+        m_pSequentialScanMatcher->MatchScanToRunningScans(pScan,
             m_pMapperSensorManager->GetRunningScans(pScan->GetSensorName()),
             bestPose,
             covariance);
@@ -2994,6 +5002,8 @@ namespace karto
 
   kt_bool Mapper::ProcessLocalization(LocalizedRangeScan* pScan)
   {
+    ApplyBackgroundOptimization();
+
     if (pScan == NULL)
     {
       return false;
@@ -3041,7 +5051,7 @@ namespace karto
     if (m_pUseScanMatching->GetValue() && pLastScan != NULL)
     {
       Pose2 bestPose;
-      m_pSequentialScanMatcher->MatchScan(pScan,
+      m_pSequentialScanMatcher->MatchScanToRunningScans(pScan,
           m_pMapperSensorManager->GetRunningScans(pScan->GetSensorName()),
           bestPose,
           covariance);
@@ -3141,60 +5151,48 @@ namespace karto
 
   kt_bool Mapper::RemoveNodeFromGraph(Vertex<LocalizedRangeScan>* vertex_to_remove)
   {
+    // the solver can't lose a node while optimizing or with updates deferred
+    FinishBackgroundOptimization();
+
     // 1) delete edges in adjacent vertices, graph, and optimizer
-    std::vector<Vertex<LocalizedRangeScan>*> adjVerts =
-      vertex_to_remove->GetAdjacentVertices();
-    for (int i = 0; i != adjVerts.size(); i++)
+    std::vector<Edge<LocalizedRangeScan>*> edges = vertex_to_remove->GetEdges();
+    for (size_t i = 0; i != edges.size(); i++)
     {
-      std::vector<Edge<LocalizedRangeScan>*> adjEdges = adjVerts[i]->GetEdges();
-      bool found = false;
-      for (int j=0; j!=adjEdges.size(); j++)
-      {
-        if (adjEdges[j]->GetTarget() == vertex_to_remove ||
-          adjEdges[j]->GetSource() == vertex_to_remove)
-        {
-          adjVerts[i]->RemoveEdge(j);
-          m_pScanOptimizer->RemoveConstraint(
-            adjEdges[j]->GetSource()->GetObject()->GetUniqueId(),
-            adjEdges[j]->GetTarget()->GetObject()->GetUniqueId()); 
-          std::vector<Edge<LocalizedRangeScan>*> edges = m_pGraph->GetEdges();
-          std::vector<Edge<LocalizedRangeScan>*>::iterator edgeGraphIt =
-            std::find(edges.begin(), edges.end(), adjEdges[j]);
-
-          if (edgeGraphIt == edges.end())
-          {
-            std::cout << "Edge not found in graph to remove!" << std::endl;
-            continue;
-          }
-
-          int posEdge = edgeGraphIt - edges.begin();
-          m_pGraph->RemoveEdge(posEdge); // remove from graph
-          delete *edgeGraphIt; // free hat!
-          *edgeGraphIt = NULL;
-          found = true;
-        }
-      }
-      if (!found)
+      Edge<LocalizedRangeScan>* pEdge = edges[i];
+      Vertex<LocalizedRangeScan>* pAdjVertex = pEdge->GetSource() == vertex_to_remove ?
+        pEdge->GetTarget() : pEdge->GetSource();
+      vertex_to_remove->RemoveEdge(pEdge);
+      if (!pAdjVertex->RemoveEdge(pEdge))
       {
         std::cout << "Failed to find any edge in adj. vertex" <<
           " with a matching vertex to current!" << std::endl;
       }
+      m_pScanOptimizer->RemoveConstraint(
+        pEdge->GetSource()->GetObject()->GetUniqueId(),
+        pEdge->GetTarget()->GetObject()->GetUniqueId());
+
+      if (!m_pGraph->RemoveEdge(pEdge)) // remove from graph
+      {
+        std::cout << "Edge not found in graph to remove!" << std::endl;
+        continue;
+      }
+      delete pEdge; // free hat!
     }
 
+    m_GraphRevision++;
+
     // 2) delete vertex from optimizer
     m_pScanOptimizer->RemoveNode(vertex_to_remove->GetObject()->GetUniqueId());
 
     // 3) delete from vertex map
-    std::map<Name, std::map<int, Vertex<LocalizedRangeScan>*> > 
-      vertexMap = m_pGraph->GetVertices();
-    std::map<int, Vertex<LocalizedRangeScan>*> graphVertices =
-      vertexMap[vertex_to_remove->GetObject()->GetSensorName()];
-    std::map<int, Vertex<LocalizedRangeScan>*>::iterator
-      vertexGraphIt = graphVertices.find(vertex_to_remove->GetObject()->GetStateId());
-    if (vertexGraphIt != graphVertices.end())
+    const Graph<LocalizedRangeScan>::VertexMap& vertexMap = m_pGraph->GetVertices();
+    Graph<LocalizedRangeScan>::VertexMap::const_iterator sensorIt =
+      vertexMap.find(vertex_to_remove->GetObject()->GetSensorName());
+    if (sensorIt != vertexMap.end() &&
+      sensorIt->second.find(vertex_to_remove->GetObject()->GetStateId()) != sensorIt->second.end())
     {
       m_pGraph->RemoveVertex(vertex_to_remove->GetObject()->GetSensorName(),
-        vertexGraphIt->second->GetObject()->GetStateId());
+        vertex_to_remove->GetObject()->GetStateId());
     }
     else
     {
@@ -3208,6 +5206,8 @@ namespace karto
   kt_bool Mapper::ProcessAgainstNode(LocalizedRangeScan* pScan, 
     const int& nodeId)
   {
+    ApplyBackgroundOptimization();
+
     if (pScan != NULL)
     {
       karto::LaserRangeFinder* pLaserRangeFinder = pScan->GetLaserRangeFinder();
@@ -3241,7 +5241,7 @@ namespace karto
       if (m_pUseScanMatching->GetValue() && pLastScan != NULL)
       {
         Pose2 bestPose;
-        m_pSequentialScanMatcher->MatchScan(pScan,
+        m_pSequentialScanMatcher->MatchScanToRunningScans(pScan,
             m_pMapperSensorManager->GetRunningScans(pScan->GetSensorName()),
             bestPose,
             covariance);
@@ -3349,6 +5349,32 @@ namespace karto
 	  return allScans;
   }
 
+  OccupancyGrid* Mapper::GetOccupancyGrid(kt_double resolution)
+  {
+    LocalizedRangeScanVector allScans = GetAllProcessedScans();
+    if (allScans.empty())
+    {
+      return NULL;
+    }
+
+    if (m_pOccupancyGrid != NULL &&
+      !math::DoubleEqual(m_pOccupancyGrid->GetResolution(), resolution))
+    {
+      delete m_pOccupancyGrid;
+      m_pOccupancyGrid = NULL;
+    }
+    if (m_pOccupancyGrid == NULL)
+    {
+      m_pOccupancyGrid = new IncrementalOccupancyGrid(resolution);
+    }
+    m_pOccupancyGrid->SetPoseChangeThreshold(m_pRaytracePoseChangeThreshold->GetValue());
+
+    std::chrono::steady_clock::time_point gridStart = std::chrono::steady_clock::now();
+    m_pOccupancyGrid->Synchronize(allScans);
+    FireStageTimed(MapperStage_OccupancyGrid, gridStart);
+    return m_pOccupancyGrid;
+  }
+
   /**
    * Adds a listener
    * @param pListener
@@ -3431,11 +5457,224 @@ namespace karto
 	  }
   }
 
+  void Mapper::FireStageTimed(MapperStage stage, const std::chrono::steady_clock::time_point& rStart,
+                              const LocalizedRangeScan* pScan) const
+  {
+    std::chrono::steady_clock::time_point end;
+    kt_bool timed = false;
+	  const_forEach(std::vector<MapperListener*>, &m_Listeners)
+	  {
+		  MapperStageListener* pListener = dynamic_cast<MapperStageListener*>(*iter);
+
+		  if (pListener != NULL)
+		  {
+			  // every listener sees the same end of the stage
+			  if (!timed)
+			  {
+			    end = std::chrono::steady_clock::now();
+			    timed = true;
+			  }
+			  pListener->StageTimed(stage, rStart, end);
+			  pListener->StageTraced(stage, rStart, end, pScan);
+		  }
+	  }
+  }
+
   void Mapper::SetScanSolver(ScanSolver* pScanOptimizer)
   {
+    FinishBackgroundOptimization();
 	  m_pScanOptimizer = pScanOptimizer;
   }
 
+  void Mapper::AddScanOptimizerNode(Vertex<LocalizedRangeScan>* pVertex)
+  {
+    if (m_pScanOptimizer == NULL)
+    {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_OptimizerMutex);
+    if (m_OptimizationRunning)
+    {
+      m_DeferredSolverUpdates.push_back(std::make_pair(pVertex, (Edge<LocalizedRangeScan>*)NULL));
+      return;
+    }
+
+    m_pScanOptimizer->AddNode(pVertex);
+    m_LastSolverScanId = pVertex->GetObject()->GetUniqueId();
+  }
+
+  void Mapper::AddScanOptimizerConstraint(Edge<LocalizedRangeScan>* pEdge)
+  {
+    if (m_pScanOptimizer == NULL)
+    {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_OptimizerMutex);
+    if (m_OptimizationRunning)
+    {
+      m_DeferredSolverUpdates.push_back(std::make_pair((Vertex<LocalizedRangeScan>*)NULL, pEdge));
+      return;
+    }
+
+    m_pScanOptimizer->AddConstraint(pEdge);
+  }
+
+  void Mapper::StartBackgroundOptimization()
+  {
+    if (m_pScanOptimizer == NULL)
+    {
+      return;
+    }
+
+    std::lock_guard<std::mutex> lock(m_OptimizerMutex);
+    if (m_OptimizationRunning)
+    {
+      m_OptimizationRequested = true;
+      return;
+    }
+
+    if (!m_OptimizerThread.joinable())
+    {
+      m_OptimizerStop = false;
+      m_OptimizerThread = std::thread(&Mapper::RunBackgroundOptimizer, this);
+    }
+
+    m_OptimizationRunning = true;
+    m_OptimizationSolving = true;
+    m_OptimizerCondition.notify_all();
+  }
+
+  void Mapper::RunBackgroundOptimizer()
+  {
+    std::unique_lock<std::mutex> lock(m_OptimizerMutex);
+    while (true)
+    {
+      m_OptimizerCondition.wait(lock, [this] { return m_OptimizerStop || m_OptimizationSolving; });
+      if (m_OptimizerStop)
+      {
+        break;
+      }
+
+      // the front end defers its solver updates until the corrections are applied
+      lock.unlock();
+      std::chrono::steady_clock::time_point solveStart = std::chrono::steady_clock::now();
+      m_pScanOptimizer->Compute();
+      FireStageTimed(MapperStage_Solve, solveStart);
+      ScanSolver::IdPoseVector corrections = m_pScanOptimizer->GetCorrections();
+      m_pScanOptimizer->Clear();
+      lock.lock();
+
+      m_BackgroundCorrections.swap(corrections);
+      m_OptimizationSolving = false;
+      m_OptimizerCondition.notify_all();
+    }
+  }
+
+  void Mapper::ApplyBackgroundOptimization(kt_bool startRequested)
+  {
+    std::lock_guard<std::mutex> lock(m_OptimizerMutex);
+    if (m_OptimizationSolving)
+    {
+      return;
+    }
+
+    if (m_OptimizationRunning)
+    {
+      ScanSolver::IdPoseVector corrections;
+      corrections.swap(m_BackgroundCorrections);
+
+      // scans added during the optimization move with the last scan it optimized
+      Pose2 identity;
+      Transform rebase(identity, identity);
+      LocalizedRangeScan* pReference = NULL;
+      if (m_LastSolverScanId >= 0)
+      {
+        pReference = m_pMapperSensorManager->GetScan(m_LastSolverScanId);
+      }
+      if (pReference != NULL)
+      {
+        const_forEach(ScanSolver::IdPoseVector, &corrections)
+        {
+          if (iter->first == m_LastSolverScanId)
+          {
+            rebase = Transform(pReference->GetCorrectedPose(), iter->second);
+            break;
+          }
+        }
+      }
+
+      m_pGraph->ApplyCorrections(corrections);
+
+      ScanSolver::IdPoseVector rebased;
+      const_forEach(DeferredSolverUpdates, &m_DeferredSolverUpdates)
+      {
+        if (iter->first != NULL)
+        {
+          LocalizedRangeScan* pScan = iter->first->GetObject();
+          rebased.push_back(std::make_pair(pScan->GetUniqueId(), rebase.TransformPose(pScan->GetCorrectedPose())));
+        }
+      }
+      m_pGraph->ApplyCorrections(rebased);
+
+      const_forEach(DeferredSolverUpdates, &m_DeferredSolverUpdates)
+      {
+        if (iter->first != NULL)
+        {
+          m_pScanOptimizer->AddNode(iter->first);
+          m_LastSolverScanId = iter->first->GetObject()->GetUniqueId();
+        }
+        else
+        {
+          m_pScanOptimizer->AddConstraint(iter->second);
+        }
+      }
+      m_DeferredSolverUpdates.clear();
+      m_OptimizationRunning = false;
+    }
+
+    if (startRequested && m_OptimizationRequested)
+    {
+      m_OptimizationRequested = false;
+      m_OptimizationRunning = true;
+      m_OptimizationSolving = true;
+      m_OptimizerCondition.notify_all();
+    }
+  }
+
+  void Mapper::FinishBackgroundOptimization()
+  {
+    {
+      std::unique_lock<std::mutex> lock(m_OptimizerMutex);
+      m_OptimizerCondition.wait(lock, [this] { return !m_OptimizationSolving; });
+    }
+
+    ApplyBackgroundOptimization(false);
+  }
+
+  void Mapper::StopBackgroundOptimizer()
+  {
+    {
+      std::lock_guard<std::mutex> lock(m_OptimizerMutex);
+      m_OptimizerStop = true;
+      m_OptimizerCondition.notify_all();
+    }
+
+    if (m_OptimizerThread.joinable())
+    {
+      m_OptimizerThread.join();
+    }
+
+    m_OptimizerStop = false;
+    m_OptimizationRunning = false;
+    m_OptimizationSolving = false;
+    m_OptimizationRequested = false;
+    m_BackgroundCorrections.clear();
+    m_DeferredSolverUpdates.clear();
+    m_LastSolverScanId = -1;
+  }
+
   ScanSolver* Mapper::getScanSolver()
   {
     return m_pScanOptimizer;
@@ -16,28 +16,32 @@ namespace solver_plugins
 
 /*****************************************************************************/
 CeresSolver::CeresSolver() : 
- nodes_(new std::unordered_map<int, Eigen::Vector3d>()),
+  num_nodes_(0), first_node_(-1),
   blocks_(new std::unordered_map<std::size_t,
     ceres::ResidualBlockId>()),
-  problem_(NULL), was_constant_set_(false)
+  problem_(NULL), was_constant_set_(false), debug_logging_(false),
+  iterations_(0)
 /*****************************************************************************/
 {
-  ros::NodeHandle nh("~");
   std::string solver_type, preconditioner_type, dogleg_type,
     trust_strategy, loss_fn, mode;
-  nh.getParam("ceres_linear_solver", solver_type);
-  nh.getParam("ceres_preconditioner", preconditioner_type);
-  nh.getParam("ceres_dogleg_type", dogleg_type);
-  nh.getParam("ceres_trust_strategy", trust_strategy);
-  nh.getParam("ceres_loss_function", loss_fn);
-  nh.getParam("mode", mode);
-  nh.getParam("debug_logging", debug_logging_);
+  // offline tools run the solver without a ROS node and keep the defaults
+  if (ros::isInitialized())
+  {
+    ros::NodeHandle nh("~");
+    nh.getParam("ceres_linear_solver", solver_type);
+    nh.getParam("ceres_preconditioner", preconditioner_type);
+    nh.getParam("ceres_dogleg_type", dogleg_type);
+    nh.getParam("ceres_trust_strategy", trust_strategy);
+    nh.getParam("ceres_loss_function", loss_fn);
+    nh.getParam("mode", mode);
+    nh.getParam("debug_logging", debug_logging_);
+  }
 
   corrections_.clear();
-  first_node_ = nodes_->end();
 
   // formulate problem
-  angle_local_parameterization_ = AngleLocalParameterization::Create();
+  pose_local_parameterization_ = PoseLocalParameterization::Create();
 
   // choose loss function default squared loss (NULL)
   loss_function_ = NULL;
@@ -156,10 +160,6 @@ CeresSolver::~CeresSolver()
   {
     delete loss_function_;
   }
-  if (nodes_ != NULL)
-  {
-    delete nodes_;
-  }
   if (problem_ != NULL)
   {
     delete problem_;  
@@ -172,7 +172,7 @@ void CeresSolver::Compute()
 {
   boost::mutex::scoped_lock lock(nodes_mutex_);
 
-  if (nodes_->size() == 0)
+  if (num_nodes_ == 0)
   {
     ROS_ERROR("CeresSolver: Ceres was called when there are no nodes."
       " This shouldn't happen.");
@@ -180,20 +180,21 @@ void CeresSolver::Compute()
   }
 
   // populate contraint for static initial pose
-  if (!was_constant_set_ && first_node_ != nodes_->end())
+  Eigen::Vector3d* first_node = GetNode(first_node_);
+  if (!was_constant_set_ && first_node != NULL &&
+      problem_->HasParameterBlock(first_node->data()))
   {
     ROS_DEBUG("CeresSolver: Setting first node as a constant pose:"
-      "%0.2f, %0.2f, %0.2f.", first_node_->second(0),
-      first_node_->second(1), first_node_->second(2));
-    problem_->SetParameterBlockConstant(&first_node_->second(0));
-    problem_->SetParameterBlockConstant(&first_node_->second(1));
-    problem_->SetParameterBlockConstant(&first_node_->second(2));
+      "%0.2f, %0.2f, %0.2f.", (*first_node)(0),
+      (*first_node)(1), (*first_node)(2));
+    problem_->SetParameterBlockConstant(first_node->data());
     was_constant_set_ = !was_constant_set_;
   }
 
   const ros::Time start_time = ros::Time::now();
   ceres::Solver::Summary summary;
   ceres::Solve(options_, problem_, &summary);
+  iterations_ = summary.iterations.size();
   if (debug_logging_)
   {
     std::cout << summary.FullReport() << '\n';
@@ -211,15 +212,18 @@ void CeresSolver::Compute()
   {
     corrections_.clear();
   }
-  corrections_.reserve(nodes_->size());
+  corrections_.reserve(num_nodes_);
   karto::Pose2 pose;
-  ConstGraphIterator iter = nodes_->begin();
-  for ( iter; iter != nodes_->end(); ++iter )
+  for (std::size_t id = 0; id != nodes_.size(); ++id)
   {
-    pose.SetX(iter->second(0));
-    pose.SetY(iter->second(1));
-    pose.SetHeading(iter->second(2));
-    corrections_.push_back(std::make_pair(iter->first, pose));
+    if (!in_graph_[id])
+    {
+      continue;
+    }
+    pose.SetX(nodes_[id](0));
+    pose.SetY(nodes_[id](1));
+    pose.SetHeading(nodes_[id](2));
+    corrections_.push_back(std::make_pair(static_cast<int>(id), pose));
   }
 
   return;
@@ -253,22 +257,20 @@ void CeresSolver::Reset()
     delete problem_;
   }
 
-  if (nodes_)
-  {
-    delete nodes_;
-  }
-
   if (blocks_)
   {
     delete blocks_;
   }
 
-  nodes_ = new std::unordered_map<int, Eigen::Vector3d>();
+  nodes_.clear();
+  in_graph_.clear();
+  num_nodes_ = 0;
+  first_node_ = -1;
+  graph_.clear();
   blocks_ = new std::unordered_map<std::size_t, ceres::ResidualBlockId>();
   problem_ = new ceres::Problem(options_problem_);
-  first_node_ = nodes_->end();
 
-  angle_local_parameterization_ = AngleLocalParameterization::Create();
+  pose_local_parameterization_ = PoseLocalParameterization::Create();
 }
 
 /*****************************************************************************/
@@ -287,11 +289,23 @@ void CeresSolver::AddNode(karto::Vertex<karto::LocalizedRangeScan>* pVertex)
   const int id = pVertex->GetObject()->GetUniqueId();
 
   boost::mutex::scoped_lock lock(nodes_mutex_);
-  nodes_->insert(std::pair<int,Eigen::Vector3d>(id,pose2d));
+  if (id >= static_cast<int>(nodes_.size()))
+  {
+    // a deque keeps the parameter blocks of ceres in place as it grows
+    nodes_.resize(id + 1, Eigen::Vector3d::Zero());
+    in_graph_.resize(id + 1, false);
+  }
+  if (in_graph_[id])
+  {
+    return;
+  }
+  nodes_[id] = pose2d;
+  in_graph_[id] = true;
+  num_nodes_++;
 
-  if (nodes_->size() == 1)
+  if (num_nodes_ == 1)
   {
-    first_node_ = nodes_->find(id);
+    first_node_ = id;
   }
 }
 
@@ -308,12 +322,12 @@ void CeresSolver::AddConstraint(karto::Edge<karto::LocalizedRangeScan>* pEdge)
   }
 
   const int node1 = pEdge->GetSource()->GetObject()->GetUniqueId();
-  GraphIterator node1it = nodes_->find(node1);
+  Eigen::Vector3d* node1pose = GetNode(node1);
   const int node2 = pEdge->GetTarget()->GetObject()->GetUniqueId();
-  GraphIterator node2it = nodes_->find(node2);
+  Eigen::Vector3d* node2pose = GetNode(node2);
 
-  if (node1it == nodes_->end() || 
-      node2it == nodes_->end() || node1it == node2it)
+  if (node1pose == NULL || 
+      node2pose == NULL || node1pose == node2pose)
   {
     ROS_WARN("CeresSolver: Failed to add constraint, could not find nodes.");
     return;
@@ -334,17 +348,22 @@ void CeresSolver::AddConstraint(karto::Edge<karto::LocalizedRangeScan>* pEdge)
   information(2, 2) = precisionMatrix(2, 2);
   Eigen::Matrix3d sqrt_information = information.llt().matrixU();
 
-  // populate residual and parameterization for heading normalization
+  // populate parameterization for heading normalization and residual
+  if (!problem_->HasParameterBlock(node1pose->data()))
+  {
+    problem_->AddParameterBlock(node1pose->data(), 3,
+      pose_local_parameterization_);
+  }
+  if (!problem_->HasParameterBlock(node2pose->data()))
+  {
+    problem_->AddParameterBlock(node2pose->data(), 3,
+      pose_local_parameterization_);
+  }
+
   ceres::CostFunction* cost_function = PoseGraph2dErrorTerm::Create(pose2d(0), 
     pose2d(1), pose2d(2), sqrt_information);
   ceres::ResidualBlockId block = problem_->AddResidualBlock(
-   cost_function, loss_function_, 
-   &node1it->second(0), &node1it->second(1), &node1it->second(2),
-   &node2it->second(0), &node2it->second(1), &node2it->second(2));
-  problem_->SetParameterization(&node1it->second(2),
-    angle_local_parameterization_);
-  problem_->SetParameterization(&node2it->second(2),
-    angle_local_parameterization_);
+   cost_function, loss_function_, node1pose->data(), node2pose->data());
 
   blocks_->insert(std::pair<std::size_t, ceres::ResidualBlockId>(
     GetHash(node1, node2), block));
@@ -356,10 +375,11 @@ void CeresSolver::RemoveNode(kt_int32s id)
 /*****************************************************************************/
 {
   boost::mutex::scoped_lock lock(nodes_mutex_);
-  GraphIterator nodeit = nodes_->find(id);
-  if (nodeit != nodes_->end())
+  if (GetNode(id) != NULL)
   {
-    nodes_->erase(nodeit);
+    // the slot is never reused, so ceres may keep the unused block
+    in_graph_[id] = false;
+    num_nodes_--;
   }
   else
   {
@@ -398,12 +418,12 @@ void CeresSolver::ModifyNode(const int& unique_id, Eigen::Vector3d pose)
 /*****************************************************************************/
 {
   boost::mutex::scoped_lock lock(nodes_mutex_);
-  GraphIterator it = nodes_->find(unique_id);
-  if (it != nodes_->end())
+  Eigen::Vector3d* node = GetNode(unique_id);
+  if (node != NULL)
   {
-    double yaw_init = it->second(2);
-    it->second = pose;
-    it->second(2) += yaw_init;
+    double yaw_init = (*node)(2);
+    *node = pose;
+    (*node)(2) += yaw_init;
   }
 }
 
@@ -412,19 +432,47 @@ void CeresSolver::GetNodeOrientation(const int& unique_id, double& pose)
 /*****************************************************************************/
 {
   boost::mutex::scoped_lock lock(nodes_mutex_);
-  GraphIterator it = nodes_->find(unique_id);
-  if (it != nodes_->end())
+  Eigen::Vector3d* node = GetNode(unique_id);
+  if (node != NULL)
   {
-    pose = it->second(2);
+    pose = (*node)(2);
   }
 }
 
+/*****************************************************************************/
+kt_int32s CeresSolver::GetIterations() const
+/*****************************************************************************/
+{
+  return iterations_;
+}
+
 /*****************************************************************************/
 std::unordered_map<int, Eigen::Vector3d>* CeresSolver::getGraph()
 /*****************************************************************************/
 {
   boost::mutex::scoped_lock lock(nodes_mutex_);
-  return nodes_;
+  graph_.clear();
+  graph_.reserve(num_nodes_);
+  for (std::size_t id = 0; id != nodes_.size(); ++id)
+  {
+    if (in_graph_[id])
+    {
+      graph_.insert(std::pair<int, Eigen::Vector3d>(id, nodes_[id]));
+    }
+  }
+  return &graph_;
+}
+
+/*****************************************************************************/
+Eigen::Vector3d* CeresSolver::GetNode(const int& unique_id)
+/*****************************************************************************/
+{
+  if (unique_id < 0 || unique_id >= static_cast<int>(nodes_.size()) ||
+      !in_graph_[unique_id])
+  {
+    return NULL;
+  }
+  return &nodes_[unique_id];
 }
 
 } // end namespace
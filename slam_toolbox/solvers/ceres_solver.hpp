@@ -9,6 +9,8 @@
 #include <ros/ros.h>
 #include <std_srvs/Empty.h>
 
+#include <atomic>
+#include <deque>
 #include <vector>
 #include <unordered_map>
 #include <utility>
@@ -47,8 +49,9 @@ public:
 
   virtual void ModifyNode(const int& unique_id, Eigen::Vector3d pose); // change a node's pose
   virtual void GetNodeOrientation(const int& unique_id, double& pose); // get a node's current pose yaw
+  virtual kt_int32s GetIterations() const; // iterations of the last solve
 
-private:
+protected:
   // karto
   karto::ScanSolver::IdPoseVector corrections_;
 
@@ -57,13 +60,18 @@ private:
   ceres::Problem::Options options_problem_;
   ceres::LossFunction* loss_function_;
   ceres::Problem* problem_;
-  ceres::LocalParameterization* angle_local_parameterization_;
+  ceres::LocalParameterization* pose_local_parameterization_;
   bool was_constant_set_, debug_logging_;
-
-  // graph
-  std::unordered_map<int, Eigen::Vector3d>* nodes_;
+  std::atomic<int> iterations_;
+
+  // graph, one (x, y, yaw) parameter block per node indexed by unique id
+  Eigen::Vector3d* GetNode(const int& unique_id);
+  std::deque<Eigen::Vector3d> nodes_;
+  std::vector<bool> in_graph_;
+  std::size_t num_nodes_;
+  int first_node_;
+  std::unordered_map<int, Eigen::Vector3d> graph_;
   std::unordered_map<size_t, ceres::ResidualBlockId>* blocks_;
-  std::unordered_map<int, Eigen::Vector3d>::iterator first_node_;
   boost::mutex nodes_mutex_;
 };
 
@@ -51,6 +51,38 @@ class AngleLocalParameterization
 /*****************************************************************************/
 /*****************************************************************************/
 
+// Adds to a pose (x, y, yaw) block, normalizing the heading.
+class PoseLocalParameterization : public ceres::LocalParameterization
+{
+ public:
+  virtual bool Plus(const double* x, const double* delta, double* x_plus_delta) const
+  {
+    x_plus_delta[0] = x[0] + delta[0];
+    x_plus_delta[1] = x[1] + delta[1];
+    x_plus_delta[2] = NormalizeAngle(x[2] + delta[2]);
+    return true;
+  }
+
+  virtual bool ComputeJacobian(const double* /*x*/, double* jacobian) const
+  {
+    Eigen::Map<Eigen::Matrix<double, 3, 3, Eigen::RowMajor> > jacobian_map(jacobian);
+    jacobian_map.setIdentity();
+    return true;
+  }
+
+  virtual int GlobalSize() const { return 3; }
+  virtual int LocalSize() const { return 3; }
+
+  static ceres::LocalParameterization* Create()
+  {
+    return (new PoseLocalParameterization);
+  }
+};
+
+/*****************************************************************************/
+/*****************************************************************************/
+/*****************************************************************************/
+
 template <typename T>
 Eigen::Matrix<T, 2, 2> RotationMatrix2D(T yaw_radians)
 {
@@ -65,7 +97,7 @@ Eigen::Matrix<T, 2, 2> RotationMatrix2D(T yaw_radians)
 /*****************************************************************************/
 /*****************************************************************************/
 
-class PoseGraph2dErrorTerm
+class PoseGraph2dErrorTerm : public ceres::SizedCostFunction<3, 3, 3>
 {
  public:
   PoseGraph2dErrorTerm(double x_ab, double y_ab, double yaw_ab_radians, const Eigen::Matrix3d& sqrt_information)
@@ -73,22 +105,55 @@ class PoseGraph2dErrorTerm
   {
   }
 
-  template <typename T>
-  bool operator()(const T* const x_a, const T* const y_a, const T* const yaw_a, const T* const x_b, const T* const y_b, const T* const yaw_b, T* residuals_ptr) const
+  // parameters are the poses (x, y, yaw) of A and B
+  virtual bool Evaluate(double const* const* parameters, double* residuals_ptr, double** jacobians) const
   {
-    const Eigen::Matrix<T, 2, 1> p_a(*x_a, *y_a);
-    const Eigen::Matrix<T, 2, 1> p_b(*x_b, *y_b);
-    Eigen::Map<Eigen::Matrix<T, 3, 1> > residuals_map(residuals_ptr);
-    residuals_map.template head<2>() = RotationMatrix2D(*yaw_a).transpose() * (p_b - p_a) - p_ab_.cast<T>();
-    residuals_map(2) = NormalizeAngle((*yaw_b - *yaw_a) - static_cast<T>(yaw_ab_radians_));
+    const double* pose_a = parameters[0];
+    const double* pose_b = parameters[1];
+    const double cos_yaw = std::cos(pose_a[2]);
+    const double sin_yaw = std::sin(pose_a[2]);
+    const double dx = pose_b[0] - pose_a[0];
+    const double dy = pose_b[1] - pose_a[1];
+
+    Eigen::Vector3d residuals;
+    residuals(0) = cos_yaw * dx + sin_yaw * dy - p_ab_(0);
+    residuals(1) = -sin_yaw * dx + cos_yaw * dy - p_ab_(1);
+    residuals(2) = NormalizeAngle((pose_b[2] - pose_a[2]) - yaw_ab_radians_);
     // Scale the residuals by the square root information matrix to account for the measurement uncertainty.
-    residuals_map = sqrt_information_.template cast<T>() * residuals_map;
+    Eigen::Map<Eigen::Vector3d> residuals_map(residuals_ptr);
+    residuals_map = sqrt_information_ * residuals;
+
+    if (jacobians == NULL)
+    {
+      return true;
+    }
+
+    if (jacobians[0] != NULL)
+    {
+      Eigen::Matrix3d jacobian_a;
+      jacobian_a << -cos_yaw, -sin_yaw, -sin_yaw * dx + cos_yaw * dy,
+                    sin_yaw, -cos_yaw, -cos_yaw * dx - sin_yaw * dy,
+                    0.0, 0.0, -1.0;
+      Eigen::Map<Eigen::Matrix<double, 3, 3, Eigen::RowMajor> > jacobian_a_map(jacobians[0]);
+      jacobian_a_map = sqrt_information_ * jacobian_a;
+    }
+
+    if (jacobians[1] != NULL)
+    {
+      Eigen::Matrix3d jacobian_b;
+      jacobian_b << cos_yaw, sin_yaw, 0.0,
+                    -sin_yaw, cos_yaw, 0.0,
+                    0.0, 0.0, 1.0;
+      Eigen::Map<Eigen::Matrix<double, 3, 3, Eigen::RowMajor> > jacobian_b_map(jacobians[1]);
+      jacobian_b_map = sqrt_information_ * jacobian_b;
+    }
+
     return true;
   }
 
   static ceres::CostFunction* Create(double x_ab, double y_ab, double yaw_ab_radians, const Eigen::Matrix3d& sqrt_information) 
   {
-    return (new ceres::AutoDiffCostFunction<PoseGraph2dErrorTerm, 3, 1, 1, 1, 1, 1, 1>(new PoseGraph2dErrorTerm(x_ab, y_ab, yaw_ab_radians, sqrt_information)));
+    return (new PoseGraph2dErrorTerm(x_ab, y_ab, yaw_ab_radians, sqrt_information));
   }
 
   EIGEN_MAKE_ALIGNED_OPERATOR_NEW
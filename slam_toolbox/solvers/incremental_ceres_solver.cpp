@@ -0,0 +1,315 @@
+/*
+ * Incremental, time-budgeted variant of the Ceres scan solver
+ */
+
+#include "incremental_ceres_solver.hpp"
+
+#include <algorithm>
+#include <deque>
+
+#include "ros/console.h"
+#include <pluginlib/class_list_macros.h>
+
+PLUGINLIB_EXPORT_CLASS(solver_plugins::IncrementalCeresSolver, karto::ScanSolver)
+
+namespace solver_plugins
+{
+
+/*****************************************************************************/
+IncrementalCeresSolver::IncrementalCeresSolver() :
+  window_size_(200), full_solve_interval_(10), time_budget_(0.0),
+  solves_since_full_(0)
+/*****************************************************************************/
+{
+  if (ros::isInitialized())
+  {
+    ros::NodeHandle nh("~");
+    nh.getParam("ceres_incremental_window_size", window_size_);
+    nh.getParam("ceres_full_solve_interval", full_solve_interval_);
+    nh.getParam("ceres_time_budget", time_budget_);
+  }
+
+  if (time_budget_ > 0.0)
+  {
+    ROS_INFO("IncrementalCeresSolver: Limiting each solve to %0.3f seconds.",
+      time_budget_);
+    options_.max_solver_time_in_seconds = time_budget_;
+  }
+}
+
+/*****************************************************************************/
+IncrementalCeresSolver::~IncrementalCeresSolver()
+/*****************************************************************************/
+{
+}
+
+/*****************************************************************************/
+void IncrementalCeresSolver::Compute()
+/*****************************************************************************/
+{
+  bool full_solve;
+  {
+    boost::mutex::scoped_lock lock(nodes_mutex_);
+    full_solve = window_size_ <= 0 ||
+      ++solves_since_full_ >= full_solve_interval_;
+    if (full_solve)
+    {
+      solves_since_full_ = 0;
+      touched_.clear();
+    }
+  }
+
+  if (full_solve)
+  {
+    CeresSolver::Compute();
+    return;
+  }
+
+  ComputeWindow();
+}
+
+/*****************************************************************************/
+void IncrementalCeresSolver::ComputeWindow()
+/*****************************************************************************/
+{
+  boost::mutex::scoped_lock lock(nodes_mutex_);
+
+  corrections_.clear();
+  if (touched_.empty())
+  {
+    return;
+  }
+
+  std::vector<int> window;
+  std::unordered_set<int> in_window;
+  FindWindow(window, in_window);
+
+  // the window borrows the residuals of the full problem and holds the nodes
+  // just outside of it fixed
+  ceres::Problem::Options window_options;
+  window_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+  window_options.loss_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+  window_options.local_parameterization_ownership =
+    ceres::DO_NOT_TAKE_OWNERSHIP;
+  ceres::Problem window_problem(window_options);
+
+  std::unordered_set<int> in_problem;
+  std::vector<int>::const_iterator node = window.begin();
+  for (node; node != window.end(); ++node)
+  {
+    const std::unordered_set<int>& node_neighbors = neighbors_[*node];
+    std::unordered_set<int>::const_iterator neighbor = node_neighbors.begin();
+    for (neighbor; neighbor != node_neighbors.end(); ++neighbor)
+    {
+      // each constraint between two window nodes is visited from both ends
+      if (in_window.count(*neighbor) && *neighbor < *node)
+      {
+        continue;
+      }
+
+      int source = *node, target = *neighbor;
+      std::unordered_map<std::size_t, ceres::ResidualBlockId>::const_iterator
+        block = blocks_->find(GetHash(source, target));
+      if (block == blocks_->end())
+      {
+        std::swap(source, target);
+        block = blocks_->find(GetHash(source, target));
+      }
+
+      Eigen::Vector3d* source_pose = GetNode(source);
+      Eigen::Vector3d* target_pose = GetNode(target);
+      if (block == blocks_->end() || source_pose == NULL ||
+          target_pose == NULL)
+      {
+        continue;
+      }
+
+      const int ends[2] = {source, target};
+      Eigen::Vector3d* end_poses[2] = {source_pose, target_pose};
+      for (int i = 0; i != 2; i++)
+      {
+        if (!in_problem.insert(ends[i]).second)
+        {
+          continue;
+        }
+
+        window_problem.AddParameterBlock(end_poses[i]->data(), 3,
+          pose_local_parameterization_);
+        if (!in_window.count(ends[i]) || ends[i] == first_node_)
+        {
+          window_problem.SetParameterBlockConstant(end_poses[i]->data());
+        }
+      }
+
+      window_problem.AddResidualBlock(
+        const_cast<ceres::CostFunction*>(
+          problem_->GetCostFunctionForResidualBlock(block->second)),
+        loss_function_, source_pose->data(), target_pose->data());
+    }
+  }
+
+  touched_.clear();
+  if (window_problem.NumResidualBlocks() == 0)
+  {
+    return;
+  }
+
+  ceres::Solver::Summary summary;
+  ceres::Solve(options_, &window_problem, &summary);
+  iterations_ = summary.iterations.size();
+  if (debug_logging_)
+  {
+    std::cout << summary.BriefReport() << '\n';
+  }
+
+  if (!summary.IsSolutionUsable())
+  {
+    ROS_WARN("IncrementalCeresSolver: "
+      "Ceres could not find a usable solution to optimize the window.");
+    return;
+  }
+
+  // only the window moved
+  corrections_.reserve(window.size());
+  karto::Pose2 pose;
+  for (node = window.begin(); node != window.end(); ++node)
+  {
+    const Eigen::Vector3d& node_pose = nodes_[*node];
+    pose.SetX(node_pose(0));
+    pose.SetY(node_pose(1));
+    pose.SetHeading(node_pose(2));
+    corrections_.push_back(std::make_pair(*node, pose));
+  }
+}
+
+/*****************************************************************************/
+void IncrementalCeresSolver::FindWindow(std::vector<int>& window,
+  std::unordered_set<int>& in_window)
+/*****************************************************************************/
+{
+  std::vector<int> seeds(touched_.begin(), touched_.end());
+  std::sort(seeds.begin(), seeds.end());
+
+  std::deque<int> queue;
+  std::vector<int>::const_iterator seed = seeds.begin();
+  for (seed; seed != seeds.end(); ++seed)
+  {
+    if (GetNode(*seed) != NULL && in_window.insert(*seed).second)
+    {
+      window.push_back(*seed);
+      queue.push_back(*seed);
+    }
+  }
+
+  while (!queue.empty() && static_cast<int>(window.size()) < window_size_)
+  {
+    std::unordered_map<int, std::unordered_set<int> >::const_iterator
+      node_neighbors = neighbors_.find(queue.front());
+    queue.pop_front();
+    if (node_neighbors == neighbors_.end())
+    {
+      continue;
+    }
+
+    std::vector<int> next(node_neighbors->second.begin(),
+      node_neighbors->second.end());
+    std::sort(next.begin(), next.end());
+    std::vector<int>::const_iterator neighbor = next.begin();
+    for (neighbor; neighbor != next.end() &&
+      static_cast<int>(window.size()) < window_size_; ++neighbor)
+    {
+      if (in_window.insert(*neighbor).second)
+      {
+        window.push_back(*neighbor);
+        queue.push_back(*neighbor);
+      }
+    }
+  }
+}
+
+/*****************************************************************************/
+void IncrementalCeresSolver::Reset()
+/*****************************************************************************/
+{
+  CeresSolver::Reset();
+
+  boost::mutex::scoped_lock lock(nodes_mutex_);
+  neighbors_.clear();
+  touched_.clear();
+  solves_since_full_ = 0;
+}
+
+/*****************************************************************************/
+void IncrementalCeresSolver::AddConstraint(
+  karto::Edge<karto::LocalizedRangeScan>* pEdge)
+/*****************************************************************************/
+{
+  CeresSolver::AddConstraint(pEdge);
+
+  if (!pEdge)
+  {
+    return;
+  }
+
+  const int node1 = pEdge->GetSource()->GetObject()->GetUniqueId();
+  const int node2 = pEdge->GetTarget()->GetObject()->GetUniqueId();
+
+  boost::mutex::scoped_lock lock(nodes_mutex_);
+  if (blocks_->find(GetHash(node1, node2)) == blocks_->end())
+  {
+    return;
+  }
+
+  neighbors_[node1].insert(node2);
+  neighbors_[node2].insert(node1);
+  touched_.insert(node1);
+  touched_.insert(node2);
+}
+
+/*****************************************************************************/
+void IncrementalCeresSolver::RemoveNode(kt_int32s id)
+/*****************************************************************************/
+{
+  CeresSolver::RemoveNode(id);
+
+  boost::mutex::scoped_lock lock(nodes_mutex_);
+  std::unordered_map<int, std::unordered_set<int> >::iterator it =
+    neighbors_.find(id);
+  if (it != neighbors_.end())
+  {
+    std::unordered_set<int>::const_iterator neighbor = it->second.begin();
+    for (neighbor; neighbor != it->second.end(); ++neighbor)
+    {
+      neighbors_[*neighbor].erase(id);
+    }
+    neighbors_.erase(it);
+  }
+  touched_.erase(id);
+}
+
+/*****************************************************************************/
+void IncrementalCeresSolver::RemoveConstraint(kt_int32s sourceId,
+  kt_int32s targetId)
+/*****************************************************************************/
+{
+  CeresSolver::RemoveConstraint(sourceId, targetId);
+
+  boost::mutex::scoped_lock lock(nodes_mutex_);
+  neighbors_[sourceId].erase(targetId);
+  neighbors_[targetId].erase(sourceId);
+  touched_.insert(sourceId);
+  touched_.insert(targetId);
+}
+
+/*****************************************************************************/
+void IncrementalCeresSolver::ModifyNode(const int& unique_id,
+  Eigen::Vector3d pose)
+/*****************************************************************************/
+{
+  CeresSolver::ModifyNode(unique_id, pose);
+
+  boost::mutex::scoped_lock lock(nodes_mutex_);
+  touched_.insert(unique_id);
+}
+
+} // end namespace
@@ -0,0 +1,56 @@
+/*
+ * Incremental, time-budgeted variant of the Ceres scan solver
+ */
+
+#ifndef KARTO_INCREMENTALCERESSOLVER_H
+#define KARTO_INCREMENTALCERESSOLVER_H
+
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "ceres_solver.hpp"
+
+namespace solver_plugins
+{
+
+/**
+ * Solves only a window of the graph around the nodes touched since the last
+ * solve, holding the rest of the graph fixed, and falls back to a full solve
+ * every few calls. Every solve stops at the time budget with the best
+ * solution found so far.
+ */
+class IncrementalCeresSolver : public CeresSolver
+{
+public:
+  IncrementalCeresSolver();
+  virtual ~IncrementalCeresSolver();
+
+public:
+  virtual void Compute(); //Solve the window, or the full problem periodically
+  virtual void Reset(); //Resets the solver plugin clean
+
+  virtual void AddConstraint(karto::Edge<karto::LocalizedRangeScan>* pEdge); //Adds a constraint to the solver
+  virtual void RemoveNode(kt_int32s id); //Removes a node from the solver correction table
+  virtual void RemoveConstraint(kt_int32s sourceId, kt_int32s targetId); // Removes constraints from the optimization problem
+
+  virtual void ModifyNode(const int& unique_id, Eigen::Vector3d pose); // change a node's pose
+
+private:
+  void ComputeWindow(); // Solve the nodes near the touched ones
+  void FindWindow(std::vector<int>& window,
+    std::unordered_set<int>& in_window); // Breadth first from the touched nodes
+
+  // parameters
+  int window_size_, full_solve_interval_;
+  double time_budget_;
+  int solves_since_full_;
+
+  // constraint adjacency and nodes touched since the last solve
+  std::unordered_map<int, std::unordered_set<int> > neighbors_;
+  std::unordered_set<int> touched_;
+};
+
+}
+
+#endif
@@ -107,7 +107,7 @@ void LifelongSlamToolbox::evaluateNodeDepreciation(
 {
   if (range_scan)
   {
-    boost::mutex::scoped_lock lock(smapper_mutex_);
+    boost::unique_lock<boost::shared_mutex> lock(smapper_mutex_);
 
     const BoundingBox2& bb = range_scan->GetBoundingBox();
     const Size2<double> bb_size = bb.GetSize();
@@ -133,6 +133,7 @@ void LifelongSlamToolbox::evaluateNodeDepreciation(
         updateScoresSlamGraph(it->GetScore(), it->GetVertex());
       }
     }
+    smapper_->publishSnapshot();
   }
 
   return;
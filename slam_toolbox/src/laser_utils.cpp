@@ -165,7 +165,7 @@ bool LaserAssistant::isInverted(double& mountingYaw)
 ScanHolder::ScanHolder(std::map<std::string, laser_utils::LaserMetadata>& lasers)
 : lasers_(lasers)
 {
-  current_scans_ = std::make_unique<std::vector<sensor_msgs::LaserScan> >();
+  current_scans_ = std::make_unique<std::vector<sensor_msgs::LaserScan::ConstPtr> >();
 };
 
 ScanHolder::~ScanHolder()
@@ -175,7 +175,7 @@ ScanHolder::~ScanHolder()
 
 sensor_msgs::LaserScan ScanHolder::getCorrectedScan(const int& id)
 {
-  sensor_msgs::LaserScan scan = current_scans_->at(id);
+  sensor_msgs::LaserScan scan = *current_scans_->at(id);
   const laser_utils::LaserMetadata& laser = lasers_[scan.header.frame_id];
   if (laser.isInverted())
   {
@@ -184,7 +184,7 @@ sensor_msgs::LaserScan ScanHolder::getCorrectedScan(const int& id)
   return scan;
 };
 
-void ScanHolder::addScan(const sensor_msgs::LaserScan scan)
+void ScanHolder::addScan(const sensor_msgs::LaserScan::ConstPtr& scan)
 {
   current_scans_->push_back(scan);
 };
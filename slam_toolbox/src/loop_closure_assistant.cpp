@@ -24,10 +24,12 @@ namespace loop_closure_assistant
 /*****************************************************************************/
 LoopClosureAssistant::LoopClosureAssistant(
   ros::NodeHandle& node,
-  karto::Mapper* mapper,
+  mapper_utils::SMapper* smapper,
+  boost::shared_mutex& smapper_mutex,
   laser_utils::ScanHolder* scan_holder,
   PausedState& state, ProcessType & processor_type)
-: mapper_(mapper), scan_holder_(scan_holder),
+: smapper_(smapper), smapper_mutex_(smapper_mutex),
+  mapper_(smapper->getMapper()), scan_holder_(scan_holder),
   interactive_mode_(false), nh_(node), state_(state),
   processor_type_(processor_type)
 /*****************************************************************************/
@@ -133,14 +135,15 @@ void LoopClosureAssistant::publishGraph()
 /*****************************************************************************/
 {
   interactive_server_->clear();
-  std::unordered_map<int, Eigen::Vector3d>* graph = solver_->getGraph();
+  // drawn from the published snapshot, scans are processed meanwhile
+  mapper_utils::GraphSnapshotPtr graph = smapper_->getSnapshot();
 
-  if (graph->size() == 0)
+  if (graph->nodes.empty())
   {
     return;
   }
 
-  ROS_DEBUG("Graph size: %i",(int)graph->size());
+  ROS_DEBUG("Graph size: %i",(int)graph->nodes.size());
   bool interactive_mode = false;
   {
     boost::mutex::scoped_lock lock(interactive_mutex_);
@@ -151,10 +154,10 @@ void LoopClosureAssistant::publishGraph()
   visualization_msgs::Marker m = vis_utils::toMarker(map_frame_,
     "slam_toolbox", 0.1);
 
-  for (ConstGraphIterator it = graph->begin(); it != graph->end(); ++it)
+  for (const mapper_utils::GraphSnapshot::Node& node : graph->nodes)
   {
     // Get sensor name
-    karto::Name sensor_name = mapper_->GetMapperSensorManager()->GetScan(it->first)->GetSensorName();
+    const karto::Name& sensor_name = node.sensor_name;
     // Determine if sensor name has been seen before
     std::map<karto::Name, std_msgs::ColorRGBA>::iterator color_map_it = SensorColorMap.find(sensor_name);
     if (color_map_it == SensorColorMap.end())
@@ -170,12 +173,12 @@ void LoopClosureAssistant::publishGraph()
     // Assign color
     m.color = SensorColorMap[sensor_name];
     // Assign ID and position
-    m.id = it->first;
-    m.pose.position.x = it->second(0);
-    m.pose.position.y = it->second(1);
+    m.id = node.id;
+    m.pose.position.x = node.pose.GetX();
+    m.pose.position.y = node.pose.GetY();
     // Assign yaw
     tf2::Quaternion quat(0.,0.,0.,1.0);
-    quat.setRPY(0., 0., it->second(2));
+    quat.setRPY(0., 0., node.pose.GetHeading());
     m.pose.orientation = tf2::toMsg(quat);
 
     if (interactive_mode && enable_interactive_mode_)
@@ -193,8 +196,6 @@ void LoopClosureAssistant::publishGraph()
     }
   }
 
-  // Get edges
-  std::vector<karto::Edge<karto::LocalizedRangeScan>*> graph_edges = mapper_->GetGraph()->GetEdges();
   // Create markers for edge
   visualization_msgs::Marker edge_adj_marker  = vis_utils::toMarker(map_frame_, "slam_toolbox/graph_edges", 0.02);
   edge_adj_marker.type = visualization_msgs::Marker::LINE_LIST;
@@ -218,30 +219,27 @@ void LoopClosureAssistant::publishGraph()
   edge_cross_marker.color.b = 0;
   edge_cross_marker.color.a = 0.3;
   // Go through all edges
-  std::vector<karto::Edge<karto::LocalizedRangeScan>*>::iterator edge_iterator;
-  for(edge_iterator = graph_edges.begin(); edge_iterator != graph_edges.end(); ++edge_iterator){
-    // Get scans
-    karto::LocalizedRangeScan *pScan_src = (*edge_iterator)->GetSource()->GetObject();
-    karto::LocalizedRangeScan *pScan_target = (*edge_iterator)->GetTarget()->GetObject();
-    // Get unique ids
-    const int id_src = pScan_src->GetUniqueId();
-    const int id_target = pScan_target->GetUniqueId();
+  for (const mapper_utils::GraphSnapshot::Edge& edge : graph->edges)
+  {
     // Get nodes
-    Eigen::Vector3d pose_src, pose_target;
-    pose_src = graph->at(id_src);
-    pose_target = graph->at(id_target);
+    const mapper_utils::GraphSnapshot::Node* src = graph->find(edge.source);
+    const mapper_utils::GraphSnapshot::Node* target = graph->find(edge.target);
+    if (!src || !target)
+    {
+      continue;
+    }
     // Convert to points
     geometry_msgs::Point pt_src, pt_target;
-    pt_src.x = pose_src(0); pt_src.y = pose_src(1);
-    pt_target.x = pose_target(0); pt_target.y = pose_target(1);
+    pt_src.x = src->pose.GetX(); pt_src.y = src->pose.GetY();
+    pt_target.x = target->pose.GetX(); pt_target.y = target->pose.GetY();
     // Push to points field in appropriate msg
-    if(pScan_src->GetSensorName() != pScan_target->GetSensorName())
+    if(src->sensor_name != target->sensor_name)
     {
       // Nodes across different agents
       edge_cross_marker.points.push_back(pt_src);
       edge_cross_marker.points.push_back(pt_target);
     }
-    else if(abs(pScan_src->GetStateId() - pScan_target->GetStateId()) > 1)
+    else if(abs(src->state_id - target->state_id) > 1)
     {
       // Non-adjacent nodes
       edge_loop_marker.points.push_back(pt_src);
@@ -279,6 +277,8 @@ bool LoopClosureAssistant::manualLoopClosureCallback(
   }
 
   {
+    // the scan processing threads must not see the graph half moved
+    boost::unique_lock<boost::shared_mutex> mapper_lock(smapper_mutex_);
     boost::mutex::scoped_lock lock(moved_nodes_mutex_);
 
     if (moved_nodes_.size() == 0)
@@ -296,10 +296,11 @@ bool LoopClosureAssistant::manualLoopClosureCallback(
       moveNode(it->first,
         Eigen::Vector3d(it->second(0),it->second(1), it->second(2)));
     }
-  }
 
-  // optimize
-  mapper_->CorrectPoses();
+    // optimize
+    mapper_->CorrectPoses();
+    smapper_->publishSnapshot();
+  }
 
   // update visualization and clear out nodes completed
   publishGraph();  
@@ -23,11 +23,41 @@
 namespace mapper_utils
 {
 
+/*****************************************************************************/
+const GraphSnapshot::Node* GraphSnapshot::find(const int& id) const
+/*****************************************************************************/
+{
+  size_t first = 0, last = nodes.size();
+  while (first < last)
+  {
+    const size_t middle = first + (last - first) / 2;
+    if (nodes[middle].id < id)
+    {
+      first = middle + 1;
+    }
+    else
+    {
+      last = middle;
+    }
+  }
+  if (first == nodes.size() || nodes[first].id != id)
+  {
+    return nullptr;
+  }
+  return &nodes[first];
+}
+
 /*****************************************************************************/
 SMapper::SMapper()
+: generation_(0), grid_generation_(0), graph_revision_(0)
 /*****************************************************************************/
 {
   mapper_ = std::make_unique<karto::Mapper>(); 
+  std::shared_ptr<GraphSnapshot> empty = std::make_shared<GraphSnapshot>();
+  empty->version = 0;
+  empty->generation = generation_;
+  empty->raytrace_pose_change_threshold = 0.0;
+  snapshot_ = empty;
 }
 
 /*****************************************************************************/
@@ -49,6 +79,9 @@ void SMapper::setMapper(karto::Mapper* mapper)
 /*****************************************************************************/
 {
   mapper_.reset(mapper);
+  nodes_.clear();
+  edges_.clear();
+  generation_++;
 }
 
 /*****************************************************************************/
@@ -59,12 +92,157 @@ void SMapper::clearLocalizationBuffer()
 }
 
 /*****************************************************************************/
-karto::OccupancyGrid* SMapper::getOccupancyGrid(const double& resolution)
+void SMapper::publishSnapshot()
 /*****************************************************************************/
 {
-  karto::OccupancyGrid* occ_grid = nullptr;
-  return karto::OccupancyGrid::CreateFromScans(mapper_->GetAllProcessedScans(),
-    resolution);
+  std::shared_ptr<GraphSnapshot> snapshot = std::make_shared<GraphSnapshot>();
+  snapshot->version = getSnapshot()->version + 1;
+  snapshot->generation = generation_;
+  snapshot->raytrace_pose_change_threshold =
+    mapper_->getParamRaytracePoseChangeThreshold();
+
+  // the readings of a scan never change, so its copy is taken once and
+  // shared by every snapshot after
+  auto toNode = [](const karto::LocalizedRangeScan& scan,
+    std::shared_ptr<karto::LocalizedRangeScan> copy)
+  {
+    if (!copy)
+    {
+      copy = std::make_shared<karto::LocalizedRangeScan>(
+        scan.GetSensorName(), karto::RangeReadingsVector());
+      copy->ShareRangeReadings(scan);
+      copy->SetUniqueId(scan.GetUniqueId());
+      copy->SetStateId(scan.GetStateId());
+      copy->SetTime(scan.GetTime());
+      copy->SetOdometricPose(scan.GetOdometricPose());
+      copy->SetCorrectedPose(scan.GetCorrectedPose());
+    }
+
+    GraphSnapshot::Node node;
+    node.id = scan.GetUniqueId();
+    node.state_id = scan.GetStateId();
+    node.sensor_name = scan.GetSensorName();
+    node.pose = scan.GetCorrectedPose();
+    node.scan = copy;
+    return node;
+  };
+
+  karto::MapperSensorManager* sensors = mapper_->GetMapperSensorManager();
+  karto::MapperGraph* graph = mapper_->GetGraph();
+  if (!sensors || !graph)
+  {
+    nodes_.clear();
+    edges_.clear();
+  }
+  else
+  {
+    const std::map<int, karto::LocalizedRangeScan*>& scans =
+      sensors->GetScansById();
+    bool removed = false;
+
+    // scans were corrected or removed, take all the poses again. Both lists
+    // ascend in unique id, which a generation never reuses
+    const uint64_t graph_revision = mapper_->GetGraphRevision();
+    if (graph_revision != graph_revision_)
+    {
+      GraphSnapshot::Nodes nodes;
+      size_t previous = 0;
+      for (const auto& entry : scans)
+      {
+        if (!entry.second)
+        {
+          continue;
+        }
+
+        std::shared_ptr<karto::LocalizedRangeScan> copy;
+        while (previous < nodes_.size() && nodes_[previous].id < entry.first)
+        {
+          removed = true;
+          previous++;
+        }
+        if (previous < nodes_.size() && nodes_[previous].id == entry.first)
+        {
+          copy = nodes_[previous++].scan;
+        }
+        nodes.push_back(toNode(*entry.second, copy));
+      }
+      removed = removed || previous < nodes_.size();
+      nodes_ = nodes;
+      graph_revision_ = graph_revision;
+    }
+    else
+    {
+      std::map<int, karto::LocalizedRangeScan*>::const_iterator it =
+        nodes_.empty() ? scans.begin() : scans.upper_bound(nodes_.back().id);
+      for (; it != scans.end(); ++it)
+      {
+        if (it->second)
+        {
+          nodes_.push_back(toNode(*it->second, nullptr));
+        }
+      }
+    }
+
+    // edges are only appended to the graph until a scan is removed
+    const std::vector<karto::Edge<karto::LocalizedRangeScan>*>& edges =
+      graph->GetEdges();
+    if (removed || edges.size() < edges_.size())
+    {
+      edges_.clear();
+    }
+    for (size_t i = edges_.size(); i < edges.size(); i++)
+    {
+      GraphSnapshot::Edge snapshot_edge;
+      snapshot_edge.source = edges[i]->GetSource()->GetObject()->GetUniqueId();
+      snapshot_edge.target = edges[i]->GetTarget()->GetObject()->GetUniqueId();
+      edges_.push_back(snapshot_edge);
+    }
+  }
+
+  snapshot->nodes = nodes_;
+  snapshot->edges = edges_;
+  std::atomic_store(&snapshot_, GraphSnapshotPtr(snapshot));
+}
+
+/*****************************************************************************/
+GraphSnapshotPtr SMapper::getSnapshot() const
+/*****************************************************************************/
+{
+  return std::atomic_load(&snapshot_);
+}
+
+/*****************************************************************************/
+karto::IncrementalOccupancyGrid* SMapper::getOccupancyGrid(
+  const GraphSnapshot& snapshot, const double& resolution)
+/*****************************************************************************/
+{
+  if (snapshot.nodes.empty())
+  {
+    return nullptr;
+  }
+
+  // a grid holds on to the scans it raytraced by address, which a new
+  // mapper's scans may take over
+  if (!grid_ || grid_generation_ != snapshot.generation ||
+    !karto::math::DoubleEqual(grid_->GetResolution(), resolution))
+  {
+    grid_ = std::make_unique<karto::IncrementalOccupancyGrid>(resolution);
+    grid_generation_ = snapshot.generation;
+  }
+  grid_->SetPoseChangeThreshold(snapshot.raytrace_pose_change_threshold);
+
+  karto::LocalizedRangeScanVector scans;
+  std::vector<karto::Pose2> poses;
+  scans.reserve(snapshot.nodes.size());
+  poses.reserve(snapshot.nodes.size());
+  for (const GraphSnapshot::Node& node : snapshot.nodes)
+  {
+    scans.push_back(node.scan.get());
+    poses.push_back(node.pose);
+  }
+
+  grid_->Synchronize(scans, poses);
+  return grid_.get();
 }
 
 /*****************************************************************************/
@@ -309,6 +487,48 @@ void SMapper::configure(const ros::NodeHandle& nh)
   {
     mapper_->setParamMinimumScanMatchResponse(minimum_scan_match_response);
   }
+
+  bool use_branch_and_bound_matching;
+  if(nh.getParam("use_branch_and_bound_matching", use_branch_and_bound_matching))
+  {
+    mapper_->setParamUseBranchAndBoundMatching(use_branch_and_bound_matching);
+  }
+
+  bool use_sequential_grid_cache;
+  if(nh.getParam("use_sequential_grid_cache", use_sequential_grid_cache))
+  {
+    mapper_->setParamUseSequentialGridCache(use_sequential_grid_cache);
+  }
+
+  bool use_batched_loop_closure;
+  if(nh.getParam("use_batched_loop_closure", use_batched_loop_closure))
+  {
+    mapper_->setParamUseBatchedLoopClosure(use_batched_loop_closure);
+  }
+
+  bool use_background_optimization;
+  if(nh.getParam("use_background_optimization", use_background_optimization))
+  {
+    mapper_->setParamUseBackgroundOptimization(use_background_optimization);
+  }
+
+  bool use_compact_scans;
+  if(nh.getParam("use_compact_scans", use_compact_scans))
+  {
+    mapper_->setParamUseCompactScans(use_compact_scans);
+  }
+
+  int maximum_materialized_scans;
+  if(nh.getParam("maximum_materialized_scans", maximum_materialized_scans))
+  {
+    mapper_->setParamMaximumMaterializedScans(maximum_materialized_scans);
+  }
+
+  double raytrace_pose_change_threshold;
+  if(nh.getParam("raytrace_pose_change_threshold", raytrace_pose_change_threshold))
+  {
+    mapper_->setParamRaytracePoseChangeThreshold(raytrace_pose_change_threshold);
+  }
   return;
 }
 
@@ -317,6 +537,9 @@ void SMapper::Reset()
 /*****************************************************************************/
 {
   mapper_->Reset();
+  nodes_.clear();
+  edges_.clear();
+  generation_++;
   return;
 }
 
@@ -30,11 +30,34 @@ SlamToolbox::SlamToolbox(ros::NodeHandle& nh)
   processor_type_(PROCESS),
   first_measurement_(true),
   nh_(nh),
-  process_near_pose_(nullptr)
+  process_near_pose_(nullptr),
+  queue_depth_(0),
+  publish_full_map_(true),
+  published_map_generation_(0)
 /*****************************************************************************/
 {
   smapper_ = std::make_unique<mapper_utils::SMapper>();
   dataset_ = std::make_unique<karto::Dataset>();
+  stage_statistics_ = std::make_unique<stage_statistics::StageStatistics>();
+  smapper_->getMapper()->AddListener(stage_statistics_.get());
+
+  bool enable_tracing;
+  int trace_buffer_size;
+  const int default_trace_buffer_size = 65536;
+  nh_.param("enable_tracing", enable_tracing, false);
+  nh_.param("trace_buffer_size", trace_buffer_size, default_trace_buffer_size);
+  if (trace_buffer_size <= 0)
+  {
+    ROS_WARN("trace_buffer_size must be positive, got %i. Using %i instead.",
+      trace_buffer_size, default_trace_buffer_size);
+    trace_buffer_size = default_trace_buffer_size;
+  }
+  if (enable_tracing)
+  {
+    trace_recorder_ =
+      std::make_unique<trace_recorder::TraceRecorder>(trace_buffer_size);
+    smapper_->getMapper()->AddListener(trace_recorder_.get());
+  }
 
   status_client_ = nh_.serviceClient<mtg_messages::agent_status>("/mtg_agent_bringup_node/agent_status");
   // fleet_info_ = getFleetStatusInfo();
@@ -58,18 +81,24 @@ SlamToolbox::SlamToolbox(ros::NodeHandle& nh)
   map_saver_ = std::make_unique<map_saver::MapSaver>(nh_, map_name_);
   closure_assistant_ =
     std::make_unique<loop_closure_assistant::LoopClosureAssistant>(
-    nh_, smapper_->getMapper(), scan_holder_.get(), state_, processor_type_);
+    nh_, smapper_.get(), smapper_mutex_, scan_holder_.get(), state_,
+    processor_type_);
 
   reprocessing_transform_.setIdentity();
 
-  double transform_publish_period, tag_publish_period;
+  double transform_publish_period, tag_publish_period,
+    diagnostics_publish_period;
   nh_.param("transform_publish_period", transform_publish_period, 0.05);
   nh_.param("tag_publish_period", tag_publish_period, 0.5);
+  nh_.param("diagnostics_publish_period", diagnostics_publish_period, 1.0);
   threads_.push_back(std::make_unique<boost::thread>(
     boost::bind(&SlamToolbox::publishTransformLoop,
     this, transform_publish_period, tag_publish_period)));
   threads_.push_back(std::make_unique<boost::thread>(
     boost::bind(&SlamToolbox::publishVisualizations, this)));
+  threads_.push_back(std::make_unique<boost::thread>(
+    boost::bind(&SlamToolbox::publishDiagnostics,
+    this, diagnostics_publish_period)));
 }
 
 /*****************************************************************************/
@@ -83,6 +112,8 @@ SlamToolbox::~SlamToolbox()
 
   smapper_.reset();
   dataset_.reset();
+  stage_statistics_.reset();
+  trace_recorder_.reset();
   closure_assistant_.reset();
   map_saver_.reset();
   for(size_t idx = 0; idx < pose_helpers_.size(); idx++)
@@ -198,13 +229,18 @@ void SlamToolbox::setROSInterfaces(ros::NodeHandle& node)
   tf_ = std::make_unique<tf2_ros::Buffer>(ros::Duration(tf_buffer_dur_));
   tfL_ = std::make_unique<tf2_ros::TransformListener>(*tf_);
   tfB_ = std::make_unique<tf2_ros::TransformBroadcaster>();
-  sst_ = node.advertise<nav_msgs::OccupancyGrid>(map_name_, 1, true);
+  sst_ = node.advertise<nav_msgs::OccupancyGrid>(map_name_, 1,
+    boost::bind(&SlamToolbox::mapSubscriberCallback, this, _1),
+    ros::SubscriberStatusCallback(), ros::VoidConstPtr(), true);
   sstm_ = node.advertise<nav_msgs::MapMetaData>(map_name_ + "_metadata", 1, true);
+  sstu_ = node.advertise<map_msgs::OccupancyGridUpdate>(map_name_ + "_updates", 10);
   tag_pub_ = node.advertise<visualization_msgs::Marker>("victim_markers", 100, true);
+  diagnostics_pub_ = node.advertise<diagnostic_msgs::DiagnosticArray>("/diagnostics", 1);
   ssMap_ = node.advertiseService("dynamic_map", &SlamToolbox::mapCallback, this);
   ssPauseMeasurements_ = node.advertiseService("pause_new_measurements", &SlamToolbox::pauseNewMeasurementsCallback, this);
   ssSerialize_ = node.advertiseService("serialize_map", &SlamToolbox::serializePoseGraphCallback, this);
   ssDesserialize_ = node.advertiseService("deserialize_map", &SlamToolbox::deserializePoseGraphCallback, this);
+  ssDumpTrace_ = node.advertiseService("dump_trace", &SlamToolbox::dumpTraceCallback, this);
   for(size_t idx = 0; idx < laser_topics_.size(); idx++)
   {
     ROS_INFO("Subscribing to scan: %s", laser_topics_[idx].c_str());
@@ -288,13 +324,66 @@ void SlamToolbox::publishVisualizations()
     updateMap();
     if(!isPaused(VISUALIZING_GRAPH))
     {
-      boost::mutex::scoped_lock lock(smapper_mutex_);
+      trace_recorder::ScopedTrace trace(trace_recorder_.get(),
+        trace_recorder::TraceRecorder::PUBLISH_GRAPH_EVENT);
       closure_assistant_->publishGraph();
     }
     r.sleep();
   }
 }
 
+/*****************************************************************************/
+void SlamToolbox::publishDiagnostics(const double& diagnostics_publish_period)
+/*****************************************************************************/
+{
+  if(diagnostics_publish_period == 0)
+  {
+    return;
+  }
+
+  ros::Rate r(1.0 / diagnostics_publish_period);
+  while(ros::ok())
+  {
+    r.sleep();
+
+    diagnostic_msgs::DiagnosticArray msg;
+    msg.header.stamp = ros::Time::now();
+    stage_statistics_->toDiagnostics(stage_statistics_->summarize(), msg);
+
+    mapper_utils::GraphSnapshotPtr graph = smapper_->getSnapshot();
+    const size_t vertices = graph->nodes.size();
+    const size_t edges = graph->edges.size();
+    const int solver_iterations = solver_ ? solver_->GetIterations() : 0;
+
+    const size_t queue_depth = queue_depth_;
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = "slam_toolbox: mapper";
+    status.hardware_id = "slam_toolbox";
+    status.level = queue_depth > 10 ?
+      diagnostic_msgs::DiagnosticStatus::WARN :
+      diagnostic_msgs::DiagnosticStatus::OK;
+    status.message = queue_depth > 10 ?
+      "scans are queueing up faster than they are processed" : "ok";
+
+    diagnostic_msgs::KeyValue kv;
+    kv.key = "queue_depth";
+    kv.value = std::to_string(queue_depth);
+    status.values.push_back(kv);
+    kv.key = "vertices";
+    kv.value = std::to_string(vertices);
+    status.values.push_back(kv);
+    kv.key = "edges";
+    kv.value = std::to_string(edges);
+    status.values.push_back(kv);
+    kv.key = "solver_iterations";
+    kv.value = std::to_string(solver_iterations);
+    status.values.push_back(kv);
+    msg.status.push_back(status);
+
+    diagnostics_pub_.publish(msg);
+  }
+}
+
 /*****************************************************************************/
 void SlamToolbox::loadPoseGraphByParams(ros::NodeHandle& nh)
 /*****************************************************************************/
@@ -367,12 +456,16 @@ karto::LaserRangeFinder* SlamToolbox::getLaser(const
 /*****************************************************************************/
 {
   const std::string& frame = scan->header.frame_id;
-  if(lasers_.find(frame) == lasers_.end())
+  boost::mutex::scoped_lock lock(lasers_mutex_);
+  std::map<std::string, laser_utils::LaserMetadata>::iterator it =
+    lasers_.find(frame);
+  if(it == lasers_.end())
   {
     try
     {
-      lasers_[frame] = laser_assistants_[frame]->toLaserMetadata(*scan);
-      dataset_->Add(lasers_[frame].getLaser(), true);
+      it = lasers_.insert(std::make_pair(frame,
+        laser_assistants_[frame]->toLaserMetadata(*scan))).first;
+      dataset_->Add(it->second.getLaser(), true);
     }
     catch (tf2::TransformException& e)
     {
@@ -382,36 +475,102 @@ karto::LaserRangeFinder* SlamToolbox::getLaser(const
     }
   }
 
-  return lasers_[frame].getLaser();
+  return it->second.getLaser();
 }
 
 /*****************************************************************************/
 bool SlamToolbox::updateMap()
 /*****************************************************************************/
 {
-  if (sst_.getNumSubscribers() == 0)
+  if (sst_.getNumSubscribers() == 0 && sstu_.getNumSubscribers() == 0)
   {
     return true;
   }
-  boost::mutex::scoped_lock lock(smapper_mutex_);
-  karto::OccupancyGrid* occ_grid = smapper_->getOccupancyGrid(resolution_);
+
+  // built from a snapshot, so scans keep being processed meanwhile
+  mapper_utils::GraphSnapshotPtr snapshot = smapper_->getSnapshot();
+  boost::mutex::scoped_lock lock(map_mutex_);
+  trace_recorder::ScopedTrace trace(trace_recorder_.get(),
+    trace_recorder::TraceRecorder::UPDATE_MAP_EVENT);
+  const auto grid_start = std::chrono::steady_clock::now();
+  karto::IncrementalOccupancyGrid* occ_grid =
+    smapper_->getOccupancyGrid(*snapshot, resolution_);
   if(!occ_grid)
   {
     return false;
   }
+  const auto grid_end = std::chrono::steady_clock::now();
+  stage_statistics_->record(karto::MapperStage_OccupancyGrid,
+    grid_end - grid_start);
+  if (trace_recorder_)
+  {
+    trace_recorder_->record(karto::MapperStage_OccupancyGrid,
+      grid_start, grid_end);
+  }
 
-  vis_utils::toNavMap(occ_grid, map_.map);
+  // the whole map only goes out when the grid moved or grew, or a map
+  // subscriber joined, otherwise just the tiles changed since the last update
+  const auto nav_map_start = std::chrono::steady_clock::now();
+  const bool full_map = publish_full_map_.exchange(false) ||
+    occ_grid->GetBoundsGeneration() > published_map_generation_ ||
+    map_.map.info.width != (unsigned int) occ_grid->GetWidth() ||
+    map_.map.info.height != (unsigned int) occ_grid->GetHeight();
+  std::vector<map_msgs::OccupancyGridUpdate> updates;
+  map_.map.header.stamp = ros::Time::now();
+  if (full_map)
+  {
+    vis_utils::toNavMap(occ_grid, map_.map);
+  }
+  else
+  {
+    const kt_int32s tile_size = occ_grid->GetTileSize();
+    for (kt_int32s ty = 0; ty < occ_grid->GetNumberOfTilesY(); ty++)
+    {
+      for (kt_int32s tx = 0; tx < occ_grid->GetNumberOfTilesX(); tx++)
+      {
+        if (occ_grid->GetTileGeneration(tx, ty) <= published_map_generation_)
+        {
+          continue;
+        }
+
+        const kt_int32s min_x = tx * tile_size, min_y = ty * tile_size;
+        const kt_int32s max_x = std::min(min_x + tile_size, occ_grid->GetWidth());
+        const kt_int32s max_y = std::min(min_y + tile_size, occ_grid->GetHeight());
+        vis_utils::toNavMapRegion(occ_grid, map_.map, min_x, min_y, max_x, max_y);
+        updates.emplace_back();
+        vis_utils::toNavMapUpdate(map_.map, min_x, min_y, max_x, max_y,
+          updates.back());
+      }
+    }
+  }
+  published_map_generation_ = occ_grid->GetGeneration();
+  stage_statistics_->record(stage_statistics::StageStatistics::NAV_MAP_STAGE,
+    std::chrono::steady_clock::now() - nav_map_start);
 
   // publish map as current
-  map_.map.header.stamp = ros::Time::now();
-  sst_.publish(map_.map);
-  sstm_.publish(map_.map.info);
-  
-  delete occ_grid;
-  occ_grid = nullptr;
+  if (full_map)
+  {
+    sst_.publish(map_.map);
+    sstm_.publish(map_.map.info);
+    return true;
+  }
+
+  for (const map_msgs::OccupancyGridUpdate& update : updates)
+  {
+    sstu_.publish(update);
+  }
   return true;
 }
 
+/*****************************************************************************/
+void SlamToolbox::mapSubscriberCallback(
+  const ros::SingleSubscriberPublisher& pub)
+/*****************************************************************************/
+{
+  // the latched map may be older than the updates that followed it
+  publish_full_map_ = true;
+}
+
 /*****************************************************************************/
 tf2::Stamped<tf2::Transform> SlamToolbox::setTransformFromPoses(
   const karto::Pose2& corrected_pose,
@@ -474,7 +633,13 @@ tf2::Stamped<tf2::Transform> SlamToolbox::publishTagTransform(int tag_id, const
 /*****************************************************************************/
   boost::mutex::scoped_lock lock(map_to_tags_mutex_);
   geometry_msgs::PoseWithCovarianceStamped scan_to_tag = m_apriltag_to_scan_[tag_id].first;
-  karto::Pose2 corrected_pose = m_apriltag_to_scan_[tag_id].second->GetCorrectedPose();
+  // the scan's pose may be being corrected, read it from the last snapshot
+  const karto::LocalizedRangeScan* tag_scan = m_apriltag_to_scan_[tag_id].second;
+  const mapper_utils::GraphSnapshotPtr snapshot = smapper_->getSnapshot();
+  const mapper_utils::GraphSnapshot::Node* node =
+    snapshot->find(tag_scan->GetUniqueId());
+  karto::Pose2 corrected_pose =
+    node ? node->pose : tag_scan->GetCorrectedPose();
   
   // Get this agent's name
   std::string agent_name = sensor_name.GetScope();
@@ -536,18 +701,21 @@ karto::LocalizedRangeScan* SlamToolbox::getLocalizedRangeScan(
   karto::Pose2& karto_pose)
 /*****************************************************************************/
 {
-  // Create a vector of doubles for karto
-  std::vector<kt_double> readings = laser_utils::scanToReadings(
-    *scan, lasers_[scan->header.frame_id].isInverted());
-
   // transform by the reprocessing transform
   tf2::Transform pose_original = smapper_->toTfPose(karto_pose);
   tf2::Transform tf_pose_transformed = reprocessing_transform_ * pose_original;
   karto::Pose2 transformed_pose = smapper_->toKartoPose(tf_pose_transformed);
 
-  // create localized range scan
-  karto::LocalizedRangeScan* range_scan = new karto::LocalizedRangeScan(
-    laser->GetName(), readings);
+  // the front ends of other lasers call this while a new laser may be added
+  bool inverted;
+  {
+    boost::mutex::scoped_lock lock(lasers_mutex_);
+    inverted = lasers_.find(scan->header.frame_id)->second.isInverted();
+  }
+
+  // create localized range scan, reading the ranges of the message in place
+  karto::LocalizedRangeScan* range_scan =
+    laser_utils::scanToLocalizedRangeScan(laser->GetName(), scan, inverted);
   range_scan->SetOdometricPose(transformed_pose);
   range_scan->SetCorrectedPose(transformed_pose);
   return range_scan;
@@ -663,7 +831,7 @@ karto::LocalizedRangeScan* SlamToolbox::addScan(
     laser, scan, karto_pose);
 
   // Add the localized range scan to the smapper
-  boost::mutex::scoped_lock lock(smapper_mutex_);
+  boost::unique_lock<boost::shared_mutex> lock(smapper_mutex_);
   bool processed = false, update_reprocessing_transform = false;
 
   if (processor_type_ == PROCESS)
@@ -702,30 +870,102 @@ karto::LocalizedRangeScan* SlamToolbox::addScan(
   // and add our scan to storage
   if(processed)
   {
-    if (enable_interactive_mode_)
+    addProcessedScan(range_scan, scan, karto_pose,
+      update_reprocessing_transform);
+  }
+  else
+  {
+    delete range_scan;
+    range_scan = nullptr;
+  }
+
+  return range_scan;
+}
+
+/*****************************************************************************/
+bool SlamToolbox::matchScan(MatchedScan& matched)
+/*****************************************************************************/
+{
+  // front end of addScan in PROCESS mode. It only reads the mapper and the
+  // running scans of this scan's sensor, so the scans of several sensors are
+  // matched at once under the shared lock
+  matched.range_scan = nullptr;
+  {
+    boost::shared_lock<boost::shared_mutex> lock(smapper_mutex_);
+    if (processor_type_ != PROCESS)
     {
-      scan_holder_->addScan(*scan);
+      return false;
+    }
+
+    karto::Mapper* mapper = smapper_->getMapper();
+    if (mapper->HasFrontEnd(matched.laser->GetName()))
+    {
+      karto::LocalizedRangeScan* range_scan = getLocalizedRangeScan(
+        matched.laser, matched.scan_w_pose.scan, matched.scan_w_pose.pose);
+      if (mapper->MatchScan(range_scan, matched.covariance))
+      {
+        matched.range_scan = range_scan;
+      }
+      else
+      {
+        delete range_scan;
+      }
+      return true;
     }
+  }
 
-    setTransformFromPoses(range_scan->GetCorrectedPose(), karto_pose,
-      scan->header, update_reprocessing_transform);
-    dataset_->Add(range_scan);
+  // first scan of this sensor since the mapper was created or loaded
+  {
+    boost::unique_lock<boost::shared_mutex> lock(smapper_mutex_);
+    smapper_->getMapper()->RegisterFrontEnd(matched.laser);
   }
-  else
+  return matchScan(matched);
+}
+
+/*****************************************************************************/
+karto::LocalizedRangeScan* SlamToolbox::insertScan(MatchedScan& matched)
+/*****************************************************************************/
+{
+  // back end of addScan in PROCESS mode, adds a scan matched by matchScan
+  boost::unique_lock<boost::shared_mutex> lock(smapper_mutex_);
+  karto::LocalizedRangeScan* range_scan = matched.range_scan;
+  matched.range_scan = nullptr;
+  if (!smapper_->getMapper()->InsertScan(range_scan, matched.covariance))
   {
+    // matched against a mapper since replaced or a last scan since removed
     delete range_scan;
-    range_scan = nullptr;
+    return nullptr;
   }
 
+  addProcessedScan(range_scan, matched.scan_w_pose.scan,
+    matched.scan_w_pose.pose, false);
   return range_scan;
 }
 
+/*****************************************************************************/
+void SlamToolbox::addProcessedScan(
+  karto::LocalizedRangeScan* range_scan,
+  const sensor_msgs::LaserScan::ConstPtr& scan,
+  karto::Pose2& karto_pose,
+  const bool& update_reprocessing_transform)
+/*****************************************************************************/
+{
+  if (enable_interactive_mode_)
+  {
+    scan_holder_->addScan(scan);
+  }
+
+  setTransformFromPoses(range_scan->GetCorrectedPose(), karto_pose,
+    scan->header, update_reprocessing_transform);
+  dataset_->Add(range_scan);
+  smapper_->publishSnapshot();
+}
+
 /*****************************************************************************/
 void SlamToolbox::addTag(apriltag_ros::AprilTagDetectionArray::ConstPtr& apriltag, karto::LocalizedRangeScan* scan) {
 /*****************************************************************************/
   if (apriltag == nullptr) return;
   boost::mutex::scoped_lock lock_a(apriltag_mutex_);
-  boost::mutex::scoped_lock lock_s(smapper_mutex_);
   if (scan == nullptr) ROS_ERROR("\r\n\r\n\r\n\r\n\r\n**** SCAN POINTER IS NULL ****\r\n\r\n\r\n\r\n\r\n");
   for (apriltag_ros::AprilTagDetection tag : apriltag->detections) {
     // Only consider apriltag ids you have not seen before
@@ -742,9 +982,9 @@ bool SlamToolbox::mapCallback(
   nav_msgs::GetMap::Response &res)
 /*****************************************************************************/
 {
+  boost::mutex::scoped_lock lock(map_mutex_);
   if(map_.map.info.width && map_.map.info.height)
   {
-    boost::mutex::scoped_lock lock(smapper_mutex_);
     res = map_;
     return true;
   }
@@ -792,18 +1032,47 @@ bool SlamToolbox::serializePoseGraphCallback(
     filename = snap_utils::getSnapPath() + std::string("/") + filename;
   }
 
-  boost::mutex::scoped_lock lock(smapper_mutex_);
+  boost::unique_lock<boost::shared_mutex> lock(smapper_mutex_);
   serialization::write(filename, *smapper_->getMapper(), *dataset_);
   return true;
 }
 
+/*****************************************************************************/
+bool SlamToolbox::dumpTraceCallback(
+  slam_toolbox_msgs::DumpTrace::Request& req,
+  slam_toolbox_msgs::DumpTrace::Response& resp)
+/*****************************************************************************/
+{
+  if (!trace_recorder_)
+  {
+    ROS_WARN("dumpTraceCallback: Tracing is disabled, "
+      "set enable_tracing to record a trace.");
+    resp.success = false;
+    return true;
+  }
+
+  std::string filename = req.filename;
+  if (snap_utils::isInSnap())
+  {
+    filename = snap_utils::getSnapPath() + std::string("/") + filename;
+  }
+
+  // the recorder is lock free, no need to stop the mapper
+  resp.success = trace_recorder_->dump(filename);
+  if (!resp.success)
+  {
+    ROS_ERROR("dumpTraceCallback: Failed to write %s.", filename.c_str());
+  }
+  return true;
+}
+
 /*****************************************************************************/
 void SlamToolbox::loadSerializedPoseGraph(
   std::unique_ptr<karto::Mapper>& mapper,
   std::unique_ptr<karto::Dataset>& dataset)
 /*****************************************************************************/
 {
-  boost::mutex::scoped_lock lock(smapper_mutex_);
+  boost::unique_lock<boost::shared_mutex> lock(smapper_mutex_);
 
   solver_->Reset();
 
@@ -837,6 +1106,12 @@ void SlamToolbox::loadSerializedPoseGraph(
   // move the memory to our working dataset
   smapper_->setMapper(mapper.release());
   smapper_->configure(nh_);
+  smapper_->getMapper()->AddListener(stage_statistics_.get());
+  if (trace_recorder_)
+  {
+    smapper_->getMapper()->AddListener(trace_recorder_.get());
+  }
+  smapper_->publishSnapshot();
   dataset_.reset(dataset.release());
 
   closure_assistant_->setMapper(smapper_->getMapper()); // ys
@@ -875,6 +1150,7 @@ void SlamToolbox::loadSerializedPoseGraph(
         ROS_INFO("Got scan!");
         try
         {
+          boost::mutex::scoped_lock lock(lasers_mutex_);
           lasers_[scan->header.frame_id] =
             laser_assistants_[scan->header.frame_id]->toLaserMetadata(*scan);
           break;
@@ -67,9 +67,10 @@ bool LocalizationSlamToolbox::clearLocalizationBuffer(
   std_srvs::Empty::Response& resp)
 /*****************************************************************************/
 {
-  boost::mutex::scoped_lock lock(smapper_mutex_);
+  boost::unique_lock<boost::shared_mutex> lock(smapper_mutex_);
   ROS_INFO("LocalizationSlamToolbox: Clearing localization buffer.");
   smapper_->clearLocalizationBuffer();
+  smapper_->publishSnapshot();
   return true;
 }
 
@@ -152,7 +153,7 @@ LocalizedRangeScan* LocalizationSlamToolbox::addScan(
     laser, scan, karto_pose);
 
   // Add the localized range scan to the smapper
-  boost::mutex::scoped_lock lock(smapper_mutex_);
+  boost::unique_lock<boost::shared_mutex> lock(smapper_mutex_);
   bool processed = false, update_reprocessing_transform = false;
   if (processor_type_ == PROCESS_NEAR_REGION)
   {
@@ -194,6 +195,7 @@ LocalizedRangeScan* LocalizationSlamToolbox::addScan(
     // compute our new transform
     setTransformFromPoses(range_scan->GetCorrectedPose(), karto_pose,
       scan->header, update_reprocessing_transform);
+    smapper_->publishSnapshot();
   }
 
   return range_scan;
@@ -225,8 +227,9 @@ void LocalizationSlamToolbox::localizePoseCallback(const
 
   first_measurement_ = true;
 
-  boost::mutex::scoped_lock lock(smapper_mutex_);
+  boost::unique_lock<boost::shared_mutex> lock(smapper_mutex_);
   smapper_->clearLocalizationBuffer();
+  smapper_->publishSnapshot();
 
   ROS_INFO("LocalizePoseCallback: Localizing to: (%0.2f %0.2f), theta=%0.2f",
     msg->pose.pose.position.x, msg->pose.pose.position.y,
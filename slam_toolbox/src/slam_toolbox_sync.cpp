@@ -40,52 +40,99 @@ SynchronousSlamToolbox::SynchronousSlamToolbox(ros::NodeHandle& nh)
 void SynchronousSlamToolbox::run()
 /*****************************************************************************/
 {
-  ros::Rate r(100);
+  // back end, inserts the scans matched by the front ends one at a time in
+  // the order they were matched
   while(ros::ok())
   {
-    if (!isPaused(PROCESSING))
+    MatchedScan matched(PosedScan(nullptr, karto::Pose2()), nullptr); // dummy, updated in critical section
     {
-      PosedScan scan_w_pose(nullptr, karto::Pose2()); // dummy, updated in critical section
-      bool queue_empty = true;
+      boost::mutex::scoped_lock lock(matched_q_mutex_);
+      if (matched_q_.empty())
       {
-        boost::mutex::scoped_lock lock(q_mutex_);
-        queue_empty = q_.empty();
-        if(!queue_empty)
-        {
-          scan_w_pose = q_.front();
-          q_.pop();
-
-          if (q_.size() > 10)
-          {
-            ROS_WARN_THROTTLE(10., "Queue size has grown to: %i. "
-              "Recommend stopping until message is gone if online mapping.",
-              (int)q_.size());
-          }
-        }
+        matched_q_condition_.timed_wait(lock,
+          boost::posix_time::milliseconds(10));
+        continue;
       }
-      if(!queue_empty){
-        // Process scan with pose
-        karto::LocalizedRangeScan* karto_scan = addScan(getLaser(scan_w_pose.scan), scan_w_pose);
-        // Tie this agent's pose with this agent's apriltag array detections
-        if (karto_scan)
-        {
-          // Get this agent's name
-          std::stringstream ss(scan_w_pose.scan->header.frame_id);
-          std::string frame_id;
-          std::getline(ss, frame_id, '/');
-          boost::mutex::scoped_lock lock(apriltag_q_mutex_);
-          // Get this agent's queue
-          std::queue<apriltag_ros::AprilTagDetectionArray::ConstPtr>& cur_queue = agent_apriltags_q_m_[frame_id];
-          // Go through entire queue
-          while(!cur_queue.empty()){
-            addTag(cur_queue.front(), karto_scan);
-            cur_queue.pop();
-          }
-        }
+      matched = matched_q_.front();
+      matched_q_.pop();
+    }
+
+    // Process scan with pose, scans the front end could not match go
+    // through addScan
+    karto::LocalizedRangeScan* karto_scan = matched.range_scan ?
+      insertScan(matched) : addScan(matched.laser, matched.scan_w_pose);
+    // Tie this agent's pose with this agent's apriltag array detections
+    if (karto_scan)
+    {
+      // Get this agent's name
+      std::stringstream ss(matched.scan_w_pose.scan->header.frame_id);
+      std::string frame_id;
+      std::getline(ss, frame_id, '/');
+      boost::mutex::scoped_lock lock(apriltag_q_mutex_);
+      // Get this agent's queue
+      std::queue<apriltag_ros::AprilTagDetectionArray::ConstPtr>& cur_queue = agent_apriltags_q_m_[frame_id];
+      // Go through entire queue
+      while(!cur_queue.empty()){
+        addTag(cur_queue.front(), karto_scan);
+        cur_queue.pop();
+      }
+    }
+
+    // the front end of this laser can match its next scan against this one
+    boost::mutex::scoped_lock lock(matched_q_mutex_);
+    matching_.erase(matched.scan_w_pose.scan->header.frame_id);
+    matched_q_condition_.notify_all();
+  }
+}
+
+/*****************************************************************************/
+void SynchronousSlamToolbox::runFrontEnd(const std::string& frame_id,
+  karto::LaserRangeFinder* laser)
+/*****************************************************************************/
+{
+  // front end of one laser, matches its scans against its own running scans
+  // concurrently with the front ends of the other lasers
+  while(ros::ok())
+  {
+    PosedScan scan_w_pose(nullptr, karto::Pose2()); // dummy, updated in critical section
+    {
+      boost::mutex::scoped_lock lock(q_mutex_);
+      std::queue<PosedScan>& q = agent_qs_[frame_id];
+      if (q.empty() || isPaused(PROCESSING))
+      {
+        q_condition_.timed_wait(lock, boost::posix_time::milliseconds(10));
+        continue;
       }
+      scan_w_pose = q.front();
+      q.pop();
+      queue_depth_--;
+
+      if (q.size() > 10)
+      {
+        ROS_WARN_THROTTLE(10., "Queue size of %s has grown to: %i. "
+          "Recommend stopping until message is gone if online mapping.",
+          frame_id.c_str(), (int)q.size());
+      }
+    }
+
+    MatchedScan matched(scan_w_pose, laser);
+    if (matchScan(matched) && !matched.range_scan)
+    {
+      // rejected, e.g. not moved enough since the last scan
+      continue;
     }
 
-    r.sleep();
+    // wait until the back end inserted the scan, the next one is matched
+    // against it
+    boost::mutex::scoped_lock lock(matched_q_mutex_);
+    matched_q_.push(matched);
+    matching_.insert(frame_id);
+    matched_q_condition_.notify_all();
+    while(ros::ok() && matching_.count(frame_id))
+    {
+      matched_q_condition_.timed_wait(lock,
+        boost::posix_time::milliseconds(10));
+    }
   }
 }
 
@@ -116,11 +163,21 @@ void SynchronousSlamToolbox::laserCallback(
     return;
   }
 
-  // if sync and valid, add to queue
+  // if sync and valid, add to the queue of its laser
   if (shouldProcessScan(scan, pose))
   {
     boost::mutex::scoped_lock lock(q_mutex_);
-    q_.push(PosedScan(scan, pose));
+    const std::string& frame_id = scan->header.frame_id;
+    if (agent_qs_.find(frame_id) == agent_qs_.end())
+    {
+      agent_qs_[frame_id] = std::queue<PosedScan>();
+      threads_.push_back(std::make_unique<boost::thread>(
+        boost::bind(&SynchronousSlamToolbox::runFrontEnd, this, frame_id,
+        laser)));
+    }
+    agent_qs_[frame_id].push(PosedScan(scan, pose));
+    queue_depth_++;
+    q_condition_.notify_all();
   }
 
   return;
@@ -151,10 +208,16 @@ bool SynchronousSlamToolbox::clearQueueCallback(
 /*****************************************************************************/
 {
   ROS_INFO("SynchronousSlamToolbox: Clearing all queued scans to add to map.");
-  while(!q_.empty())
+  boost::mutex::scoped_lock lock(q_mutex_);
+  std::map<std::string, std::queue<PosedScan> >::iterator it;
+  for (it = agent_qs_.begin(); it != agent_qs_.end(); ++it)
   {
-    q_.pop();
+    while(!it->second.empty())
+    {
+      it->second.pop();
+    }
   }
+  queue_depth_ = 0;
   resp.status = true;
   return true;
 }
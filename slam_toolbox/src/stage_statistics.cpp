@@ -0,0 +1,223 @@
+/*
+ * stage_statistics
+ * Latency histograms of the mapping pipeline stages
+ */
+
+#include "slam_toolbox/stage_statistics.hpp"
+
+#include <algorithm>
+#include <cstdio>
+
+namespace stage_statistics
+{
+
+/*****************************************************************************/
+LatencyHistogram::LatencyHistogram()
+: max_(0)
+/*****************************************************************************/
+{
+  for (auto& count : counts_)
+  {
+    count.store(0, std::memory_order_relaxed);
+  }
+}
+
+/*****************************************************************************/
+int LatencyHistogram::bucketIndex(uint64_t micros)
+/*****************************************************************************/
+{
+  if (micros < SUB_BUCKETS)
+  {
+    return static_cast<int>(micros);
+  }
+
+  // position of the highest set bit, at least SUB_BUCKET_BITS here
+  int exponent = 63 - __builtin_clzll(micros);
+  if (exponent > MAX_EXPONENT)
+  {
+    return BUCKETS - 1;
+  }
+
+  const int shift = exponent - SUB_BUCKET_BITS;
+  return SUB_BUCKETS + shift * SUB_BUCKETS +
+    static_cast<int>((micros >> shift) & (SUB_BUCKETS - 1));
+}
+
+/*****************************************************************************/
+double LatencyHistogram::bucketValue(int index)
+/*****************************************************************************/
+{
+  if (index < SUB_BUCKETS)
+  {
+    return index;
+  }
+
+  const int shift = (index - SUB_BUCKETS) / SUB_BUCKETS;
+  const int sub = (index - SUB_BUCKETS) % SUB_BUCKETS;
+  const double width = static_cast<double>(1ull << shift);
+  return (SUB_BUCKETS + sub) * width + 0.5 * width;
+}
+
+/*****************************************************************************/
+void LatencyHistogram::record(uint64_t micros)
+/*****************************************************************************/
+{
+  counts_[bucketIndex(micros)].fetch_add(1, std::memory_order_relaxed);
+
+  uint64_t max = max_.load(std::memory_order_relaxed);
+  while (micros > max &&
+    !max_.compare_exchange_weak(max, micros, std::memory_order_relaxed))
+  {
+  }
+}
+
+/*****************************************************************************/
+uint64_t LatencyHistogram::collect(std::vector<uint64_t>& counts)
+/*****************************************************************************/
+{
+  for (int i = 0; i != BUCKETS; i++)
+  {
+    counts[i] += counts_[i].load(std::memory_order_relaxed);
+  }
+  return max_.exchange(0, std::memory_order_relaxed);
+}
+
+/*****************************************************************************/
+StageStatistics::StageStatistics()
+: shards_(SHARDS),
+  last_counts_(STAGE_COUNT,
+    std::vector<uint64_t>(LatencyHistogram::BUCKETS, 0))
+/*****************************************************************************/
+{
+}
+
+/*****************************************************************************/
+void StageStatistics::StageTimed(karto::MapperStage stage,
+  const std::chrono::steady_clock::time_point& start,
+  const std::chrono::steady_clock::time_point& end)
+/*****************************************************************************/
+{
+  record(stage, end - start);
+}
+
+/*****************************************************************************/
+void StageStatistics::record(int stage,
+  const std::chrono::steady_clock::duration& duration)
+/*****************************************************************************/
+{
+  // threads spread over the shards so they rarely share a cache line
+  static std::atomic<int> next_shard(0);
+  thread_local const int shard =
+    next_shard.fetch_add(1, std::memory_order_relaxed) % SHARDS;
+
+  const auto micros =
+    std::chrono::duration_cast<std::chrono::microseconds>(duration).count();
+  shards_[shard][stage].record(micros > 0 ? static_cast<uint64_t>(micros) : 0);
+}
+
+/*****************************************************************************/
+std::vector<StageSummary> StageStatistics::summarize()
+/*****************************************************************************/
+{
+  std::vector<StageSummary> summaries(STAGE_COUNT);
+  std::vector<uint64_t> totals(LatencyHistogram::BUCKETS);
+
+  for (int stage = 0; stage != STAGE_COUNT; stage++)
+  {
+    std::fill(totals.begin(), totals.end(), 0);
+    uint64_t max = 0;
+    for (auto& shard : shards_)
+    {
+      max = std::max(max, shard[stage].collect(totals));
+    }
+
+    // the histograms only grow, the window is the difference to last time
+    std::vector<uint64_t>& last = last_counts_[stage];
+    uint64_t count = 0;
+    for (int i = 0; i != LatencyHistogram::BUCKETS; i++)
+    {
+      const uint64_t total = totals[i];
+      totals[i] = total - last[i];
+      last[i] = total;
+      count += totals[i];
+    }
+
+    StageSummary& summary = summaries[stage];
+    summary.count = count;
+    summary.p50 = summary.p95 = summary.p99 = 0.0;
+    summary.max = max / 1000.0;
+    if (count == 0)
+    {
+      continue;
+    }
+
+    const double quantiles[3] = {0.50, 0.95, 0.99};
+    double* values[3] = {&summary.p50, &summary.p95, &summary.p99};
+    int q = 0;
+    uint64_t seen = 0;
+    for (int i = 0; i != LatencyHistogram::BUCKETS && q != 3; i++)
+    {
+      seen += totals[i];
+      while (q != 3 && seen >= quantiles[q] * count)
+      {
+        *values[q] = std::min(LatencyHistogram::bucketValue(i) / 1000.0,
+          summary.max);
+        q++;
+      }
+    }
+  }
+
+  return summaries;
+}
+
+/*****************************************************************************/
+void StageStatistics::toDiagnostics(const std::vector<StageSummary>& summaries,
+  diagnostic_msgs::DiagnosticArray& msg) const
+/*****************************************************************************/
+{
+  char buffer[32];
+  for (int stage = 0; stage != STAGE_COUNT; stage++)
+  {
+    const StageSummary& summary = summaries[stage];
+    diagnostic_msgs::DiagnosticStatus status;
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+    status.name = std::string("slam_toolbox: ") + stageName(stage);
+    status.hardware_id = "slam_toolbox";
+    status.message = summary.count > 0 ? "ok" : "idle";
+
+    const std::pair<const char*, double> values[] = {
+      {"p50_ms", summary.p50}, {"p95_ms", summary.p95},
+      {"p99_ms", summary.p99}, {"max_ms", summary.max}};
+
+    diagnostic_msgs::KeyValue kv;
+    kv.key = "count";
+    kv.value = std::to_string(summary.count);
+    status.values.push_back(kv);
+    for (const auto& value : values)
+    {
+      std::snprintf(buffer, sizeof(buffer), "%.3f", value.second);
+      kv.key = value.first;
+      kv.value = buffer;
+      status.values.push_back(kv);
+    }
+
+    msg.status.push_back(status);
+  }
+}
+
+/*****************************************************************************/
+const char* StageStatistics::stageName(int stage)
+/*****************************************************************************/
+{
+  if (stage < static_cast<int>(karto::MapperStage_Count))
+  {
+    return karto::GetMapperStageName(static_cast<karto::MapperStage>(stage));
+  }
+  if (stage == NAV_MAP_STAGE)
+  {
+    return "nav_map";
+  }
+  return "unknown";
+}
+
+} // end namespace
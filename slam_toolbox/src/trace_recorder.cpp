@@ -0,0 +1,187 @@
+/*
+ * trace_recorder
+ * Chrome trace events of the mapping pipeline stages
+ */
+
+#include "slam_toolbox/trace_recorder.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+namespace trace_recorder
+{
+
+namespace
+{
+
+/*****************************************************************************/
+uint32_t threadIndex()
+/*****************************************************************************/
+{
+  // small stable ids read better in the trace viewer than native handles
+  static std::atomic<uint32_t> next_thread(1);
+  thread_local const uint32_t thread =
+    next_thread.fetch_add(1, std::memory_order_relaxed);
+  return thread;
+}
+
+/*****************************************************************************/
+void copySensorName(const karto::Name& name, char* out, size_t size)
+/*****************************************************************************/
+{
+  // scope and name copied by hand to keep string allocations off the
+  // processing threads
+  const std::string& scope = name.GetScope();
+  const std::string& base = name.GetName();
+  size_t length = 0;
+  if (!scope.empty())
+  {
+    length = std::min(scope.size(), size - 2);
+    std::memcpy(out, scope.data(), length);
+    out[length++] = '/';
+  }
+  const size_t count = std::min(base.size(), size - 1 - length);
+  std::memcpy(out + length, base.data(), count);
+  out[length + count] = '\0';
+}
+
+} // end namespace
+
+/*****************************************************************************/
+TraceRecorder::TraceRecorder(size_t capacity)
+: events_(std::max<size_t>(capacity, 1)), head_(0)
+/*****************************************************************************/
+{
+  for (auto& event : events_)
+  {
+    event.sequence.store(0, std::memory_order_relaxed);
+  }
+}
+
+/*****************************************************************************/
+void TraceRecorder::StageTraced(karto::MapperStage stage,
+  const std::chrono::steady_clock::time_point& start,
+  const std::chrono::steady_clock::time_point& end,
+  const karto::LocalizedRangeScan* scan)
+/*****************************************************************************/
+{
+  record(stage, start, end, scan);
+}
+
+/*****************************************************************************/
+void TraceRecorder::record(int event,
+  const std::chrono::steady_clock::time_point& start,
+  const std::chrono::steady_clock::time_point& end,
+  const karto::LocalizedRangeScan* scan)
+/*****************************************************************************/
+{
+  const uint64_t position = head_.fetch_add(1, std::memory_order_relaxed);
+  Event& slot = events_[position % events_.size()];
+
+  // seqlock, a dump skips the slot until the write is complete
+  slot.sequence.store(2 * position + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+
+  slot.event = event;
+  slot.thread = threadIndex();
+  slot.start_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    start.time_since_epoch()).count();
+  slot.duration_ns =
+    std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+  if (scan)
+  {
+    slot.scan_id = scan->GetUniqueId();
+    copySensorName(scan->GetSensorName(), slot.sensor, sizeof(slot.sensor));
+  }
+  else
+  {
+    slot.scan_id = -1;
+    slot.sensor[0] = '\0';
+  }
+
+  slot.sequence.store(2 * position + 2, std::memory_order_release);
+}
+
+/*****************************************************************************/
+bool TraceRecorder::read(uint64_t position, Event& event) const
+/*****************************************************************************/
+{
+  const Event& slot = events_[position % events_.size()];
+  const uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+  if (sequence != 2 * position + 2)
+  {
+    return false;
+  }
+
+  event.event = slot.event;
+  event.scan_id = slot.scan_id;
+  event.thread = slot.thread;
+  event.start_ns = slot.start_ns;
+  event.duration_ns = slot.duration_ns;
+  std::memcpy(event.sensor, slot.sensor, sizeof(event.sensor));
+  event.sensor[sizeof(event.sensor) - 1] = '\0';
+
+  // overwritten while copying
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot.sequence.load(std::memory_order_relaxed) == sequence;
+}
+
+/*****************************************************************************/
+bool TraceRecorder::dump(const std::string& filename) const
+/*****************************************************************************/
+{
+  FILE* file = std::fopen(filename.c_str(), "w");
+  if (!file)
+  {
+    return false;
+  }
+
+  const uint64_t head = head_.load(std::memory_order_acquire);
+  const uint64_t first = head > events_.size() ? head - events_.size() : 0;
+
+  std::fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", file);
+  bool first_event = true;
+  Event event;
+  for (uint64_t position = first; position != head; position++)
+  {
+    if (!read(position, event))
+    {
+      continue;
+    }
+
+    // sensor names are frame ids and need no escaping
+    std::fprintf(file,
+      "%s\n{\"name\":\"%s\",\"cat\":\"slam_toolbox\",\"ph\":\"X\","
+      "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,"
+      "\"args\":{\"sensor\":\"%s\",\"scan_id\":%d}}",
+      first_event ? "" : ",", eventName(event.event),
+      event.start_ns / 1000.0, event.duration_ns / 1000.0, event.thread,
+      event.sensor, event.scan_id);
+    first_event = false;
+  }
+  std::fputs("\n]}\n", file);
+
+  return std::fclose(file) == 0;
+}
+
+/*****************************************************************************/
+const char* TraceRecorder::eventName(int event)
+/*****************************************************************************/
+{
+  if (event < static_cast<int>(karto::MapperStage_Count))
+  {
+    return karto::GetMapperStageName(static_cast<karto::MapperStage>(event));
+  }
+  if (event == UPDATE_MAP_EVENT)
+  {
+    return "update_map";
+  }
+  if (event == PUBLISH_GRAPH_EVENT)
+  {
+    return "publish_graph";
+  }
+  return "unknown";
+}
+
+} // end namespace
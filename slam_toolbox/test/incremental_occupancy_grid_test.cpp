@@ -0,0 +1,117 @@
+/*
+ * slam_toolbox
+ * Copyright (c) 2019, Steve Macenski
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#include <cmath>
+#include <gtest/gtest.h>
+#include <tbb/task_arena.h>
+#include "karto_sdk/Karto.h"
+
+using namespace karto;
+
+namespace
+{
+
+// binary fraction, so that cells of grids placed a whole number of cells
+// apart line up exactly
+const kt_double resolution = 0.0625;
+
+// occupancy grid created from scans at a given placement rather than around
+// their bounds
+class PlacedOccupancyGrid : public OccupancyGrid
+{
+public:
+  PlacedOccupancyGrid(kt_int32s size, const Vector2<kt_double>& rOffset)
+  : OccupancyGrid(size, size, rOffset, resolution)
+  {
+  }
+
+  using OccupancyGrid::CreateFromScans;
+};
+
+TEST(IncrementalOccupancyGridTests, TestMovedScans)
+{
+  LaserRangeFinder* laser = LaserRangeFinder::CreateLaserRangeFinder(
+    LaserRangeFinder_Custom, Name("moved_scans_laser"));
+  laser->SetMinimumRange(0.1);
+  laser->SetMaximumRange(30.0);
+  laser->SetRangeThreshold(12.0);
+  laser->SetAngularResolution(math::DegreesToRadians(1.0));
+  laser->SetMinimumAngle(-KT_PI);
+  laser->SetMaximumAngle(KT_PI - math::DegreesToRadians(1.0));
+  laser->SetIs360Laser(true);
+  SensorManager::GetInstance()->RegisterSensor(laser);
+
+  // enough copies of the same scan to raytrace them in parallel, moved a few
+  // cells so that old beams pass where new ones end
+  const Pose2 from(0.0, 0.0, 0.0);
+  const Pose2 to(0.3, 0.1, 0.05);
+  LocalizedRangeScanVector scans;
+  for (kt_int32s i = 0; i != 128; i++)
+  {
+    RangeReadingsVector readings(laser->GetNumberOfRangeReadings(), 3.0);
+    LocalizedRangeScan* scan = new LocalizedRangeScan(laser->GetName(), readings);
+    scan->SetUniqueId(i);
+    scan->SetOdometricPose(to);
+    scan->SetCorrectedPose(to);
+    scans.push_back(scan);
+  }
+
+  // one cell tiles, so that every cell whose occupancy changed needs its own
+  // tile marked
+  IncrementalOccupancyGrid grid(resolution, 0);
+  tbb::task_arena arena(2);
+  arena.execute([&]()
+  {
+    grid.Synchronize(scans, std::vector<Pose2>(scans.size(), from));
+    grid.Synchronize(scans, std::vector<Pose2>(scans.size(), to));
+  });
+
+  // the incremental grid is anchored at the first sensor position
+  const kt_int32s size = 160;
+  const Vector2<kt_double> offset(-0.5 * size * resolution, -0.5 * size * resolution);
+  PlacedOccupancyGrid expected(size, offset);
+  expected.CreateFromScans(scans);
+
+  const Vector2<kt_double>& gridOffset = grid.GetCoordinateConverter()->GetOffset();
+  kt_int32s occupied = 0;
+  for (kt_int32s y = 0; y != size; y++)
+  {
+    for (kt_int32s x = 0; x != size; x++)
+    {
+      Vector2<kt_int32s> cell(
+        static_cast<kt_int32s>(std::lround(x + (offset.GetX() - gridOffset.GetX()) / resolution)),
+        static_cast<kt_int32s>(std::lround(y + (offset.GetY() - gridOffset.GetY()) / resolution)));
+      kt_int8u value = grid.IsValidGridIndex(cell) ? grid.GetValue(cell) :
+        static_cast<kt_int8u>(GridStates_Unknown);
+      EXPECT_EQ(value, expected.GetValue(Vector2<kt_int32s>(x, y))) << x << ", " << y;
+      occupied += value == GridStates_Occupied;
+    }
+  }
+  EXPECT_GT(occupied, 0);
+
+  for (LocalizedRangeScan* scan : scans)
+  {
+    delete scan;
+  }
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}
@@ -0,0 +1,132 @@
+/*
+ * slam_toolbox
+ * Copyright (c) 2019, Steve Macenski
+ *
+ * THE WORK (AS DEFINED BELOW) IS PROVIDED UNDER THE TERMS OF THIS CREATIVE
+ * COMMONS PUBLIC LICENSE ("CCPL" OR "LICENSE"). THE WORK IS PROTECTED BY
+ * COPYRIGHT AND/OR OTHER APPLICABLE LAW. ANY USE OF THE WORK OTHER THAN AS
+ * AUTHORIZED UNDER THIS LICENSE OR COPYRIGHT LAW IS PROHIBITED.
+ *
+ * BY EXERCISING ANY RIGHTS TO THE WORK PROVIDED HERE, YOU ACCEPT AND AGREE TO
+ * BE BOUND BY THE TERMS OF THIS LICENSE. THE LICENSOR GRANTS YOU THE RIGHTS
+ * CONTAINED HERE IN CONSIDERATION OF YOUR ACCEPTANCE OF SUCH TERMS AND
+ * CONDITIONS.
+ *
+ */
+
+#include <gtest/gtest.h>
+#include "karto_sdk/Mapper.h"
+
+using namespace karto;
+
+namespace
+{
+
+// removing nodes only needs a solver to drop them from
+class NullSolver : public ScanSolver
+{
+public:
+  virtual void Compute() {}
+  virtual const IdPoseVector& GetCorrections() const {return corrections_;}
+
+private:
+  IdPoseVector corrections_;
+};
+
+LaserRangeFinder* createLaser(const std::string& name)
+{
+  LaserRangeFinder* laser = LaserRangeFinder::CreateLaserRangeFinder(
+    LaserRangeFinder_Custom, Name(name));
+  laser->SetMinimumRange(0.1);
+  laser->SetMaximumRange(30.0);
+  laser->SetRangeThreshold(12.0);
+  laser->SetAngularResolution(math::DegreesToRadians(1.0));
+  laser->SetMinimumAngle(-KT_PI);
+  laser->SetMaximumAngle(KT_PI - math::DegreesToRadians(1.0));
+  laser->SetIs360Laser(true);
+  SensorManager::GetInstance()->RegisterSensor(laser);
+  return laser;
+}
+
+// scan in a round room, taken the given distance down a straight hallway
+LocalizedRangeScan* createScan(LaserRangeFinder* laser, const double& x)
+{
+  RangeReadingsVector readings(laser->GetNumberOfRangeReadings(), 5.0);
+  LocalizedRangeScan* scan = new LocalizedRangeScan(laser->GetName(), readings);
+  scan->SetOdometricPose(Pose2(x, 0.0, 0.0));
+  scan->SetCorrectedPose(scan->GetOdometricPose());
+  return scan;
+}
+
+// maps the given number of scans, all of which end up in the loop closure index
+void createMap(Mapper& mapper, LaserRangeFinder* laser, const int& scans)
+{
+  mapper.SetScanSolver(new NullSolver());
+  for (int i = 0; i != scans; i++)
+  {
+    LocalizedRangeScan* scan = createScan(laser, 0.6 * i);
+    if (!mapper.Process(scan))
+    {
+      delete scan;
+    }
+  }
+}
+
+TEST(LoopClosureIndexTests, TestRemoveNodes)
+{
+  LaserRangeFinder* laser = createLaser("remove_nodes_laser");
+  Mapper mapper;
+  createMap(mapper, laser, 20);
+
+  const Name& name = laser->GetName();
+  ASSERT_EQ(mapper.GetAllProcessedScans().size(), 20u);
+  EXPECT_EQ(mapper.GetGraph()->GetLoopClosureIndexSize(name), 20u);
+
+  for (int id = 5; id != 10; id++)
+  {
+    LocalizedRangeScan* scan = mapper.GetMapperSensorManager()->GetScan(id);
+    Vertex<LocalizedRangeScan>* vertex =
+      mapper.GetGraph()->GetVertices().at(name).at(scan->GetStateId());
+    EXPECT_TRUE(mapper.RemoveNodeFromGraph(vertex));
+    vertex->RemoveObject();
+    mapper.GetMapperSensorManager()->RemoveScan(scan);
+    delete scan;
+  }
+
+  EXPECT_EQ(mapper.GetAllProcessedScans().size(), 15u);
+  EXPECT_EQ(mapper.GetGraph()->GetLoopClosureIndexSize(name), 15u);
+}
+
+TEST(LoopClosureIndexTests, TestLocalizationBuffer)
+{
+  LaserRangeFinder* laser = createLaser("localization_buffer_laser");
+  Mapper mapper;
+  createMap(mapper, laser, 20);
+  mapper.setParamScanBufferSize(3);
+
+  const Name& name = laser->GetName();
+  ASSERT_EQ(mapper.GetGraph()->GetLoopClosureIndexSize(name), 20u);
+
+  // scans falling out of the buffer leave the index with it
+  for (int i = 0; i != 10; i++)
+  {
+    LocalizedRangeScan* scan = createScan(laser, 0.6 * (19 - i));
+    if (!mapper.ProcessLocalization(scan))
+    {
+      delete scan;
+    }
+  }
+  EXPECT_EQ(mapper.GetGraph()->GetLoopClosureIndexSize(name), 23u);
+
+  mapper.ClearLocalizationBuffer();
+  EXPECT_EQ(mapper.GetAllProcessedScans().size(), 20u);
+  EXPECT_EQ(mapper.GetGraph()->GetLoopClosureIndexSize(name), 20u);
+}
+
+}
+
+int main(int argc, char** argv)
+{
+  testing::InitGoogleTest(&argc, argv);
+  return RUN_ALL_TESTS();
+}